@@ -19,6 +19,9 @@
 */
 
 #include "LEDOutput.h"
+#ifdef WiLP_TRACE
+#include <WiLPTrace.h>
+#endif
 
 
 LEDOutput::LEDOutput(uint8_t inLEDPin){
@@ -83,6 +86,9 @@ void LEDOutput::process(){
 	// Check if the output needs updating
 	if (__state_pwm != __state_pwm_last){
 		analogWrite(led_pin,__state_pwm);
+		#ifdef WiLP_TRACE
+			WiLPTrace::output();
+		#endif
 		__state_pwm_last =__state_pwm;
 		// If we are not fading, then call the status update callback
 		if (!__state_fade_inprogress){
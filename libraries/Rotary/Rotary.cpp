@@ -20,6 +20,9 @@
 
 #include "Arduino.h"
 #include "Rotary.h"
+#ifdef WiLP_TRACE
+#include <WiLPTrace.h>
+#endif
 
 /*
  * The below state table has, for each state (row), the new state
@@ -102,5 +105,11 @@ unsigned char Rotary::process() {
   // Determine new state from the pins and state table.
   state = ttable[state & 0xf][pinstate];
   // Return emit bits, ie the generated event.
-  return state & 0x30;
+  unsigned char result = state & 0x30;
+#ifdef WiLP_TRACE
+  if (result) {
+    WiLPTrace::input();
+  }
+#endif
+  return result;
 }
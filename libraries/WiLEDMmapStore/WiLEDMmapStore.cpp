@@ -0,0 +1,173 @@
+/*
+* WiLEDMmapStore class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* A file-backed storage area for running WiLEDProto in a Linux coordinator,
+* using a shared memory mapping and msync() for commits.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "WiLEDMmapStore.h"
+
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <WiLEDProto.h>
+
+WiLEDMmapStore* WiLEDMmapStore::__attached = 0;
+
+/************ Public methods *****************************/
+
+WiLEDMmapStore::WiLEDMmapStore(){
+}
+
+
+WiLEDMmapStore::~WiLEDMmapStore(){
+  end();
+}
+
+
+bool WiLEDMmapStore::begin(const char* inPath, uint32_t inSize){
+  end();
+  __fd = open(inPath, O_RDWR | O_CREAT, 0644);
+  if(__fd < 0){
+    return false;
+  }
+  // Grow the file if needed, new bytes read as zero like a blank EEPROM
+  struct stat file_stat;
+  if(fstat(__fd, &file_stat) != 0){
+    end();
+    return false;
+  }
+  if((uint32_t)file_stat.st_size < inSize && ftruncate(__fd, inSize) != 0){
+    end();
+    return false;
+  }
+  void* mapping = mmap(0, inSize, PROT_READ | PROT_WRITE, MAP_SHARED, __fd, 0);
+  if(mapping == MAP_FAILED){
+    end();
+    return false;
+  }
+  __data = (uint8_t*)mapping;
+  __size = inSize;
+  __dirty_start = __size;
+  __dirty_end = 0;
+  return true;
+}
+
+
+void WiLEDMmapStore::end(){
+  if(__data != 0){
+    commit();
+    munmap(__data, __size);
+    __data = 0;
+    __size = 0;
+  }
+  if(__fd >= 0){
+    close(__fd);
+    __fd = -1;
+  }
+  if(__attached == this){
+    __attached = 0;
+  }
+}
+
+
+uint8_t* WiLEDMmapStore::getData(){
+  return __data;
+}
+
+
+uint32_t WiLEDMmapStore::getSize(){
+  return __size;
+}
+
+
+void WiLEDMmapStore::markDirty(uint32_t inOffset, uint32_t inLength){
+  if(inOffset < __dirty_start){
+    __dirty_start = inOffset;
+  }
+  if(inOffset + inLength > __dirty_end){
+    __dirty_end = inOffset + inLength;
+  }
+}
+
+
+void WiLEDMmapStore::read(uint32_t inOffset, uint8_t* outData, uint32_t inLength){
+  // Out of range reads give zeros, the same as a blank store
+  if(__data == 0 || inOffset + inLength > __size){
+    memset(outData, 0, inLength);
+    return;
+  }
+  memcpy(outData, __data + inOffset, inLength);
+}
+
+
+void WiLEDMmapStore::write(uint32_t inOffset, const uint8_t* inData, uint32_t inLength){
+  if(__data == 0 || inOffset + inLength > __size){
+    return;
+  }
+  memcpy(__data + inOffset, inData, inLength);
+  markDirty(inOffset, inLength);
+}
+
+
+bool WiLEDMmapStore::commit(){
+  if(__data == 0 || __dirty_end <= __dirty_start){
+    return true;
+  }
+  // msync() needs a page aligned start address
+  uint32_t page_size = sysconf(_SC_PAGESIZE);
+  uint32_t start = __dirty_start - (__dirty_start % page_size);
+  bool result = (msync(__data + start, __dirty_end - start, MS_SYNC) == 0);
+  __dirty_start = __size;
+  __dirty_end = 0;
+  return result;
+}
+
+
+void WiLEDMmapStore::attach(WiLEDProtoBase* inHandler){
+  __attached = this;
+  inHandler->setStorageBlockCallbacks(&__blockRead, &__blockWrite, &__commit);
+}
+
+/************ Private methods ***************************/
+
+void WiLEDMmapStore::__blockRead(uint16_t inOffset, uint8_t* outData, uint16_t inLength){
+  if(__attached != 0){
+    __attached->read(inOffset, outData, inLength);
+  }
+}
+
+
+void WiLEDMmapStore::__blockWrite(uint16_t inOffset, const uint8_t* inData, uint16_t inLength){
+  if(__attached != 0){
+    __attached->write(inOffset, inData, inLength);
+  }
+}
+
+
+void WiLEDMmapStore::__commit(){
+  if(__attached != 0){
+    __attached->commit();
+  }
+}
+
+#endif
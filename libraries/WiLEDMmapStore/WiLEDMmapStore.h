@@ -0,0 +1,75 @@
+/*
+* WiLEDMmapStore class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* A file-backed storage area for running WiLEDProto in a Linux coordinator,
+* using a shared memory mapping and msync() for commits.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef WILEDMMAPSTORE_H
+#define WILEDMMAPSTORE_H
+
+// Only meaningful on Linux, this is empty for the microcontroller builds
+#if defined(__linux__)
+
+#include <stdint.h>
+
+class WiLEDProtoBase;
+
+class WiLEDMmapStore {
+  public:
+    WiLEDMmapStore();
+    ~WiLEDMmapStore();
+
+    // Map the file, creating it (filled with zeros) or growing it to at
+    // least inSize bytes. Returns false if the file can't be mapped.
+    bool begin(const char* inPath, uint32_t inSize);
+    void end();
+
+    // Direct access to the mapped bytes, writes through this pointer must
+    // be followed by markDirty() so that commit() syncs them
+    uint8_t* getData();
+    uint32_t getSize();
+    void markDirty(uint32_t inOffset, uint32_t inLength);
+
+    void read(uint32_t inOffset, uint8_t* outData, uint32_t inLength);
+    void write(uint32_t inOffset, const uint8_t* inData, uint32_t inLength);
+    // Flush the written pages to the file, returns false if msync() failed
+    bool commit();
+
+    // Connect a WiLEDProto instance's block storage callbacks to this
+    // store. The callbacks have no context argument, so only one store
+    // can be attached at a time.
+    void attach(WiLEDProtoBase* inHandler);
+
+  protected:
+    int __fd = -1;
+    uint8_t* __data = 0;
+    uint32_t __size = 0;
+    // Byte range written since the last commit
+    uint32_t __dirty_start = 0;
+    uint32_t __dirty_end = 0;
+
+    static WiLEDMmapStore* __attached;
+    static void __blockRead(uint16_t inOffset, uint8_t* outData, uint16_t inLength);
+    static void __blockWrite(uint16_t inOffset, const uint8_t* inData, uint16_t inLength);
+    static void __commit();
+};
+
+#endif
+
+#endif
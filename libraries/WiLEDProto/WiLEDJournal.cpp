@@ -0,0 +1,290 @@
+/*
+* WiLEDJournal class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* An append-only, wear-levelled record journal in raw flash, used by
+* WiLEDProto to keep the known address and Reset Counter state.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "WiLEDJournal.h"
+
+/************ Public methods *****************************/
+
+WiLEDJournal::WiLEDJournal(
+  void (*inFlashReadCB)(uint32_t, uint8_t*, uint16_t),
+  void (*inFlashWriteCB)(uint32_t, const uint8_t*, uint16_t),
+  void (*inFlashEraseCB)(uint16_t),
+  uint16_t inSectorSize,
+  uint16_t inSectorCount
+){
+  __flash_read_callback = inFlashReadCB;
+  __flash_write_callback = inFlashWriteCB;
+  __flash_erase_callback = inFlashEraseCB;
+  __sector_size = inSectorSize;
+  __sector_count = inSectorCount;
+}
+
+
+uint8_t WiLEDJournal::beginReplay(){
+  __replaying = false;
+  if(__flash_read_callback == 0 || __flash_write_callback == 0 || __flash_erase_callback == 0
+    || __sector_count < 2 || __sector_size < (WiLP_JOURNAL_HEADER_LENGTH + WiLP_JOURNAL_RECORD_LENGTH)){
+    return WiLP_JOURNAL_NOT_INIT;
+  }
+
+  // Find the sector with the highest sequence number, that is the head
+  bool found = false;
+  uint32_t sequence;
+  for(uint16_t sector = 0; sector < __sector_count; sector++){
+    if(__readHeader(sector, &sequence) && (!found || sequence > __head_sequence)){
+      __head_sector = sector;
+      __head_sequence = sequence;
+      found = true;
+    }
+  }
+  if(!found){
+    // Blank (or foreign) flash, start a new journal with nothing to replay
+    __live_sequence = 1;
+    return __startSector(0, 1);
+  }
+
+  // Walk backwards to the oldest sector of the unbroken sequence
+  uint16_t chain = 1;
+  while(chain < __sector_count){
+    uint16_t sector = (__head_sector + __sector_count - chain) % __sector_count;
+    if(!__readHeader(sector, &sequence) || sequence != __head_sequence - chain){
+      break;
+    }
+    chain++;
+  }
+  uint16_t oldest_sector = (__head_sector + __sector_count - (chain - 1)) % __sector_count;
+  __live_sequence = __head_sequence - (chain - 1);
+  __replay_sector = oldest_sector;
+  __replay_offset = WiLP_JOURNAL_HEADER_LENGTH;
+  __replay_sequence = __live_sequence;
+
+  // Look for the newest complete snapshot, replay can start from there
+  uint8_t record[WiLP_JOURNAL_RECORD_LENGTH];
+  bool snapshot_open = false;
+  uint16_t begin_sector = 0;
+  uint16_t begin_offset = 0;
+  uint32_t begin_sequence = 0;
+  for(uint16_t idx = 0; idx < chain; idx++){
+    uint16_t sector = (oldest_sector + idx) % __sector_count;
+    uint16_t offset = WiLP_JOURNAL_HEADER_LENGTH;
+    while(offset + WiLP_JOURNAL_RECORD_LENGTH <= __sector_size && __readRecord(sector, offset, record)){
+      if(record[0] == WiLP_JOURNAL_SNAPSHOT_BEGIN){
+        snapshot_open = true;
+        begin_sector = sector;
+        begin_offset = offset;
+        begin_sequence = __live_sequence + idx;
+      } else if(record[0] == WiLP_JOURNAL_SNAPSHOT_END && snapshot_open){
+        snapshot_open = false;
+        __replay_sector = begin_sector;
+        __replay_offset = begin_offset;
+        __replay_sequence = begin_sequence;
+      }
+      offset += WiLP_JOURNAL_RECORD_LENGTH;
+    }
+    if(sector == __head_sector){
+      __head_offset = offset;
+      // A torn write leaves bits that can't be set again, so don't append
+      // after it, move on to a fresh sector instead
+      if(offset + WiLP_JOURNAL_RECORD_LENGTH <= __sector_size && record[0] != WiLP_JOURNAL_ERASED){
+        __head_offset = __sector_size;
+      }
+    }
+  }
+  __live_sequence = __replay_sequence;
+  __records_since_snapshot = 0;
+  __replaying = true;
+  return WiLP_JOURNAL_SUCCESS;
+}
+
+
+bool WiLEDJournal::nextRecord(uint8_t* outType, uint16_t* outAddress, uint16_t* outResetCounter){
+  uint8_t record[WiLP_JOURNAL_RECORD_LENGTH];
+  while(__replaying){
+    if(__replay_offset + WiLP_JOURNAL_RECORD_LENGTH > __sector_size
+      || !__readRecord(__replay_sector, __replay_offset, record)){
+      // End of this sector, stop at the head or carry on with the next one
+      if(__replay_sequence == __head_sequence){
+        __replaying = false;
+        break;
+      }
+      __replay_sector = (__replay_sector + 1) % __sector_count;
+      __replay_offset = WiLP_JOURNAL_HEADER_LENGTH;
+      __replay_sequence++;
+      continue;
+    }
+    __replay_offset += WiLP_JOURNAL_RECORD_LENGTH;
+    // Snapshot markers only matter to beginReplay()
+    if(record[0] == WiLP_JOURNAL_PEER || record[0] == WiLP_JOURNAL_SELF_RESET
+      || record[0] == WiLP_JOURNAL_PEER_REMOVED || record[0] == WiLP_JOURNAL_GROUPS){
+      *outType = record[0];
+      *outAddress = (record[1] << 8) + record[2];
+      *outResetCounter = (record[3] << 8) + record[4];
+      return true;
+    }
+  }
+  return false;
+}
+
+
+uint8_t WiLEDJournal::append(uint8_t inType, uint16_t inAddress, uint16_t inResetCounter){
+  if(__flash_write_callback == 0 || __head_sequence == 0){
+    return WiLP_JOURNAL_NOT_INIT;
+  }
+  if(__head_offset + WiLP_JOURNAL_RECORD_LENGTH > __sector_size){
+    uint8_t result = __advanceSector();
+    if(result != WiLP_JOURNAL_SUCCESS){
+      return result;
+    }
+  }
+  uint8_t record[WiLP_JOURNAL_RECORD_LENGTH];
+  record[0] = inType;
+  record[1] = (inAddress >> 8);
+  record[2] = (inAddress);
+  record[3] = (inResetCounter >> 8);
+  record[4] = (inResetCounter);
+  record[5] = 0xFF;
+  uint16_t check = 0;
+  for(uint8_t idx = 0; idx < 6; idx++){
+    check += record[idx];
+  }
+  check = ~check;
+  record[6] = (check >> 8);
+  record[7] = (check);
+  __flash_write_callback((uint32_t)__head_sector * __sector_size + __head_offset, record, WiLP_JOURNAL_RECORD_LENGTH);
+  __head_offset += WiLP_JOURNAL_RECORD_LENGTH;
+  __records_since_snapshot++;
+  return WiLP_JOURNAL_SUCCESS;
+}
+
+
+bool WiLEDJournal::needsCompaction(uint16_t inLiveRecords){
+  // Nothing to gain if nothing has been written since the last snapshot
+  if(__records_since_snapshot == 0 || __head_sequence == 0){
+    return false;
+  }
+  // The snapshot has a begin and end record as well as the live ones. Once
+  // there is no room left for it, nothing can be erased again.
+  return __freeRecords() < (uint32_t)inLiveRecords + 3;
+}
+
+
+bool WiLEDJournal::canHold(uint16_t inLiveRecords){
+  // The last complete snapshot can start anywhere in a sector, and after it
+  // there must be room for the next one plus a record
+  return __sector_count >= 2 * __sectorsNeeded(inLiveRecords + 3) + 1;
+}
+
+
+uint8_t WiLEDJournal::beginSnapshot(){
+  uint8_t result = append(WiLP_JOURNAL_SNAPSHOT_BEGIN, 0, 0);
+  if(result == WiLP_JOURNAL_SUCCESS){
+    // The begin record may have started a new sector, so check afterwards
+    __snapshot_sequence = __head_sequence;
+    __snapshot_open = true;
+  }
+  return result;
+}
+
+
+uint8_t WiLEDJournal::endSnapshot(){
+  if(!__snapshot_open){
+    return WiLP_JOURNAL_NOT_INIT;
+  }
+  uint8_t result = append(WiLP_JOURNAL_SNAPSHOT_END, 0, 0);
+  if(result == WiLP_JOURNAL_SUCCESS){
+    // Everything before the snapshot can now be erased
+    __live_sequence = __snapshot_sequence;
+    __records_since_snapshot = 0;
+  }
+  __snapshot_open = false;
+  return result;
+}
+
+
+uint32_t WiLEDJournal::getEraseCount(){
+  return __erase_count;
+}
+
+/************ Private methods ***************************/
+
+// Read a sector header, return true if it is valid
+bool WiLEDJournal::__readHeader(uint16_t inSector, uint32_t* outSequence){
+  uint8_t header[WiLP_JOURNAL_HEADER_LENGTH];
+  __flash_read_callback((uint32_t)inSector * __sector_size, header, WiLP_JOURNAL_HEADER_LENGTH);
+  if(header[0] != 'W' || header[1] != 'J' || header[2] != 0x01){
+    return false;
+  }
+  *outSequence = ((uint32_t)header[4] << 24) + ((uint32_t)header[5] << 16) + (header[6] << 8) + header[7];
+  // Sequence number 0 is never written, all 0xFF is an erased header
+  return (*outSequence != 0) && (*outSequence != 0xFFFFFFFF);
+}
+
+
+// Read a record, return true if it has been completely written
+bool WiLEDJournal::__readRecord(uint16_t inSector, uint16_t inOffset, uint8_t* outRecord){
+  __flash_read_callback((uint32_t)inSector * __sector_size + inOffset, outRecord, WiLP_JOURNAL_RECORD_LENGTH);
+  uint16_t check = 0;
+  for(uint8_t idx = 0; idx < 6; idx++){
+    check += outRecord[idx];
+  }
+  check = ~check;
+  return (outRecord[6] == (uint8_t)(check >> 8)) && (outRecord[7] == (uint8_t)check);
+}
+
+
+// Erase a sector and write its header, making it the head
+uint8_t WiLEDJournal::__startSector(uint16_t inSector, uint32_t inSequence){
+  __flash_erase_callback(inSector);
+  __erase_count++;
+  uint8_t header[WiLP_JOURNAL_HEADER_LENGTH] = {'W', 'J', 0x01, 0xFF,
+    (uint8_t)(inSequence >> 24), (uint8_t)(inSequence >> 16), (uint8_t)(inSequence >> 8), (uint8_t)(inSequence)};
+  __flash_write_callback((uint32_t)inSector * __sector_size, header, WiLP_JOURNAL_HEADER_LENGTH);
+  __head_sector = inSector;
+  __head_sequence = inSequence;
+  __head_offset = WiLP_JOURNAL_HEADER_LENGTH;
+  return WiLP_JOURNAL_SUCCESS;
+}
+
+
+// Move the head on to the next sector of the ring
+uint8_t WiLEDJournal::__advanceSector(){
+  // The next sector must not hold anything that is still needed
+  if((__head_sequence + 1) - __live_sequence >= __sector_count){
+    return WiLP_JOURNAL_FULL;
+  }
+  return __startSector((__head_sector + 1) % __sector_count, __head_sequence + 1);
+}
+
+
+// How many whole sectors a run of records can spill over into
+uint16_t WiLEDJournal::__sectorsNeeded(uint16_t inRecords){
+  uint16_t per_sector = (__sector_size - WiLP_JOURNAL_HEADER_LENGTH) / WiLP_JOURNAL_RECORD_LENGTH;
+  return (inRecords + per_sector - 1) / per_sector;
+}
+
+
+// How many more records fit before the ring runs into the oldest live sector
+uint32_t WiLEDJournal::__freeRecords(){
+  uint16_t per_sector = (__sector_size - WiLP_JOURNAL_HEADER_LENGTH) / WiLP_JOURNAL_RECORD_LENGTH;
+  uint32_t live_sectors = __head_sequence - __live_sequence + 1;
+  uint32_t free_sectors = __sector_count - live_sectors;
+  return (__sector_size - __head_offset) / WiLP_JOURNAL_RECORD_LENGTH + free_sectors * per_sector;
+}
@@ -0,0 +1,116 @@
+/*
+* WiLEDJournal class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* An append-only, wear-levelled record journal in raw flash, used by
+* WiLEDProto to keep the known address and Reset Counter state.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef WILEDJOURNAL_H
+#define WILEDJOURNAL_H
+
+#include <Arduino.h>
+
+// Every sector starts with a header, and holds a run of fixed size records.
+// Both are 8 bytes, which keeps flash writes aligned to 4-byte words.
+#define WiLP_JOURNAL_HEADER_LENGTH 8
+#define WiLP_JOURNAL_RECORD_LENGTH 8
+
+// Record types. An erased record reads as 0xFF, which ends a sector.
+#define WiLP_JOURNAL_PEER 0x01
+#define WiLP_JOURNAL_SELF_RESET 0x02
+#define WiLP_JOURNAL_PEER_REMOVED 0x03
+// The attached groups, packed two to a field
+#define WiLP_JOURNAL_GROUPS 0x04
+#define WiLP_JOURNAL_SNAPSHOT_BEGIN 0x10
+#define WiLP_JOURNAL_SNAPSHOT_END 0x11
+#define WiLP_JOURNAL_ERASED 0xFF
+
+#define WiLP_JOURNAL_SUCCESS 0
+#define WiLP_JOURNAL_FULL 1
+#define WiLP_JOURNAL_NOT_INIT 3
+
+class WiLEDJournal {
+  public:
+    // The callbacks address the journal's own region, from 0 up to
+    // inSectorSize * inSectorCount. Writes only ever clear bits of erased
+    // flash, and an erase sets a whole sector back to 0xFF.
+    WiLEDJournal(
+      void (*inFlashReadCB)(uint32_t, uint8_t*, uint16_t),
+      void (*inFlashWriteCB)(uint32_t, const uint8_t*, uint16_t),
+      void (*inFlashEraseCB)(uint16_t),
+      uint16_t inSectorSize,
+      uint16_t inSectorCount);
+
+    // Find the newest state in flash, and start replaying it. Call
+    // nextRecord() until it returns false before appending anything.
+    uint8_t beginReplay();
+    bool nextRecord(uint8_t* outType, uint16_t* outAddress, uint16_t* outResetCounter);
+
+    // Add a record to the end of the journal
+    uint8_t append(uint8_t inType, uint16_t inAddress, uint16_t inResetCounter);
+
+    // True when a snapshot of inLiveRecords records should be written now,
+    // while there is still room for it and one more record
+    bool needsCompaction(uint16_t inLiveRecords);
+    // True if the ring is big enough for snapshots of inLiveRecords records.
+    // It has to hold a complete snapshot while the next one is written.
+    bool canHold(uint16_t inLiveRecords);
+    // A snapshot is written as beginSnapshot(), one append() per live
+    // record, then endSnapshot(). Once it is complete, everything written
+    // before it can be erased.
+    uint8_t beginSnapshot();
+    uint8_t endSnapshot();
+
+    uint32_t getEraseCount();
+
+  protected:
+    void (*__flash_read_callback)(uint32_t, uint8_t*, uint16_t) = 0;
+    void (*__flash_write_callback)(uint32_t, const uint8_t*, uint16_t) = 0;
+    void (*__flash_erase_callback)(uint16_t) = 0;
+    uint16_t __sector_size = 0;
+    uint16_t __sector_count = 0;
+
+    // Where the next record will be written
+    uint16_t __head_sector = 0;
+    uint16_t __head_offset = 0;
+    uint32_t __head_sequence = 0;
+    // Sequence number of the oldest sector that is still needed
+    uint32_t __live_sequence = 0;
+    // Where the snapshot being written started
+    uint32_t __snapshot_sequence = 0;
+    bool __snapshot_open = false;
+    uint32_t __records_since_snapshot = 0;
+
+    // Replay cursor
+    uint16_t __replay_sector = 0;
+    uint16_t __replay_offset = 0;
+    uint32_t __replay_sequence = 0;
+    bool __replaying = false;
+
+    uint32_t __erase_count = 0;
+
+    bool __readHeader(uint16_t inSector, uint32_t* outSequence);
+    bool __readRecord(uint16_t inSector, uint16_t inOffset, uint8_t* outRecord);
+    uint8_t __startSector(uint16_t inSector, uint32_t inSequence);
+    uint8_t __advanceSector();
+    uint16_t __sectorsNeeded(uint16_t inRecords);
+    uint32_t __freeRecords();
+};
+
+
+#endif
@@ -20,16 +20,109 @@
 */
 
 #include "WiLEDProto.h"
+#ifdef WiLP_TRACE
+#include "WiLPTrace.h"
+#endif
+
+// Describe a message type, as listed in docs/WiLEDProto.md
+static constexpr WiLPTypeInfo wilpTypeInfo(uint8_t inType){
+  return
+    (inType == WiLP_Beacon) ? WiLPTypeInfo{4, WiLP_TYPE_DEFINED | WiLP_TYPE_BROADCAST, 1} :
+    (inType == WiLP_Device_Status) ? WiLPTypeInfo{5, WiLP_TYPE_DEFINED | WiLP_TYPE_BROADCAST, 2} :
+    (inType == WiLP_Set_Individual) ? WiLPTypeInfo{3, WiLP_TYPE_DEFINED | WiLP_TYPE_BROADCAST | WiLP_TYPE_TO_ADDRESSES, 3} :
+    (inType == WiLP_Set_Individuals_Two) ? WiLPTypeInfo{5, WiLP_TYPE_DEFINED | WiLP_TYPE_BROADCAST | WiLP_TYPE_TO_ADDRESSES, 4} :
+    (inType == WiLP_Set_Individuals_Three) ? WiLPTypeInfo{7, WiLP_TYPE_DEFINED | WiLP_TYPE_BROADCAST | WiLP_TYPE_TO_ADDRESSES, 5} :
+    (inType == WiLP_Set_Groups) ? WiLPTypeInfo{4, WiLP_TYPE_DEFINED | WiLP_TYPE_BROADCAST | WiLP_TYPE_TO_GROUPS, 6} :
+    (inType == WiLP_Attach_Groups) ? WiLPTypeInfo{4, WiLP_TYPE_DEFINED | WiLP_TYPE_ADDRESSED, 7} :
+    (inType == WiLP_Set_Fade_Timeout) ? WiLPTypeInfo{3, WiLP_TYPE_DEFINED | WiLP_TYPE_ADDRESSED, 8} :
+    (inType == WiLP_Fade_Timeout_Status) ? WiLPTypeInfo{3, WiLP_TYPE_DEFINED | WiLP_TYPE_BROADCAST, 9} :
+    (inType == WiLP_Not_Understood) ? WiLPTypeInfo{4, WiLP_TYPE_DEFINED | WiLP_TYPE_BROADCAST, 10} :
+    (inType >= WiLP_Extension_First) ? WiLPTypeInfo{WiLP_PAYLOAD_UNKNOWN, WiLP_TYPE_EXTENSION,
+      (uint8_t)(WiLP_HANDLER_SLOT_EXTENSION + inType - WiLP_Extension_First)} :
+    WiLPTypeInfo{WiLP_PAYLOAD_UNKNOWN, 0, 0};
+}
+
+// Expand to one table entry per type code
+#define WiLP_TYPE_ROW4(n) wilpTypeInfo(n), wilpTypeInfo(n + 1), wilpTypeInfo(n + 2), wilpTypeInfo(n + 3)
+#define WiLP_TYPE_ROW16(n) WiLP_TYPE_ROW4(n), WiLP_TYPE_ROW4(n + 4), WiLP_TYPE_ROW4(n + 8), WiLP_TYPE_ROW4(n + 12)
+#define WiLP_TYPE_ROW64(n) WiLP_TYPE_ROW16(n), WiLP_TYPE_ROW16(n + 16), WiLP_TYPE_ROW16(n + 32), WiLP_TYPE_ROW16(n + 48)
+
+static constexpr WiLPTypeInfo WiLP_TYPE_TABLE[256] = {
+  WiLP_TYPE_ROW64(0), WiLP_TYPE_ROW64(64), WiLP_TYPE_ROW64(128), WiLP_TYPE_ROW64(192)
+};
+
+// Check the table against the payload lengths in the protocol definition
+static_assert(WiLP_TYPE_TABLE[WiLP_Beacon].payload_length == 4, "Beacon payload is 4 bytes");
+static_assert(WiLP_TYPE_TABLE[WiLP_Device_Status].payload_length == 5, "Device Status payload is 5 bytes");
+static_assert(WiLP_TYPE_TABLE[WiLP_Set_Individual].payload_length == 3, "Set Individual payload is 3 bytes");
+static_assert(WiLP_TYPE_TABLE[WiLP_Set_Individuals_Two].payload_length == 5, "Set Individuals (two) payload is 5 bytes");
+static_assert(WiLP_TYPE_TABLE[WiLP_Set_Individuals_Three].payload_length == 7, "Set Individuals (three) payload is 7 bytes");
+static_assert(WiLP_TYPE_TABLE[WiLP_Set_Groups].payload_length == 4, "Set Groups payload is 4 bytes");
+static_assert(WiLP_TYPE_TABLE[WiLP_Attach_Groups].payload_length == 4, "Attach Groups payload is 4 bytes");
+static_assert(WiLP_TYPE_TABLE[WiLP_Set_Fade_Timeout].payload_length == 3, "Set Fade Timeout payload is 3 bytes");
+static_assert(WiLP_TYPE_TABLE[WiLP_Fade_Timeout_Status].payload_length == 3, "Fade Timeout Status payload is 3 bytes");
+static_assert(WiLP_TYPE_TABLE[WiLP_Not_Understood].payload_length == 4, "Not Understood payload is 4 bytes");
+static_assert(WiLP_TYPE_TABLE[0x00].flags == 0 && WiLP_TYPE_TABLE[0xEF].flags == 0, "Undefined types must not be flagged");
+static_assert(WiLP_TYPE_TABLE[WiLP_Extension_First].handler_slot == WiLP_HANDLER_SLOT_EXTENSION
+  && WiLP_TYPE_TABLE[WiLP_Extension_Last].handler_slot == WiLP_HANDLER_SLOTS - 1, "Extension types use the last handler slots");
+
+// Check every defined payload fits, recursing through the table
+static constexpr bool wilpPayloadsFit(uint16_t inType){
+  return (inType > 0xFF) ? true :
+    ((WiLP_TYPE_TABLE[inType].payload_length <= MAXIMUM_PAYLOAD_LENGTH
+      || WiLP_TYPE_TABLE[inType].payload_length == WiLP_PAYLOAD_UNKNOWN) && wilpPayloadsFit(inType + 1));
+}
+static_assert(wilpPayloadsFit(0), "A payload is longer than MAXIMUM_PAYLOAD_LENGTH");
+
+// Lengths of the extension types, shared by all instances
+uint8_t WiLEDProtoBase::__extension_payload_lengths[16] = {
+  WiLP_PAYLOAD_UNKNOWN, WiLP_PAYLOAD_UNKNOWN, WiLP_PAYLOAD_UNKNOWN, WiLP_PAYLOAD_UNKNOWN,
+  WiLP_PAYLOAD_UNKNOWN, WiLP_PAYLOAD_UNKNOWN, WiLP_PAYLOAD_UNKNOWN, WiLP_PAYLOAD_UNKNOWN,
+  WiLP_PAYLOAD_UNKNOWN, WiLP_PAYLOAD_UNKNOWN, WiLP_PAYLOAD_UNKNOWN, WiLP_PAYLOAD_UNKNOWN,
+  WiLP_PAYLOAD_UNKNOWN, WiLP_PAYLOAD_UNKNOWN, WiLP_PAYLOAD_UNKNOWN, WiLP_PAYLOAD_UNKNOWN
+};
 
 /************ Public methods *****************************/
 
-// Initialise the WiLEDProto class with its address
-WiLEDProto::WiLEDProto(
+// Initialise the WiLEDProto class with its address, and the arrays given by
+// WiLEDProtoCapacity
+WiLEDProtoBase::WiLEDProtoBase(
   uint16_t inAddress,
   uint8_t (*inStorageReadCB)(uint16_t),
   void (*inStorageWriteCB)(uint16_t, uint8_t),
-  void (*inStorageCommitCB)(void)
-){
+  void (*inStorageCommitCB)(void),
+  uint16_t inCapacity,
+  uint8_t inPeerIndexBits,
+  const WiLPStorageLayout& inStorageLayout,
+  uint16_t* inPeerWords,
+  uint64_t* inMessageWindows,
+  uint32_t* inLastHeard,
+  uint8_t* inDirtySlots,
+  WiLPQueuedMessage* inQueue,
+  uint8_t inQueueLength
+) : __capacity(inCapacity),
+  __peer_index_bits(inPeerIndexBits),
+  __peer_index_mask((uint16_t)((1UL << inPeerIndexBits) - 1)),
+  __storage_layout(inStorageLayout),
+  __queue(inQueue),
+  __queue_length(inQueueLength){
+  // Addresses first, so that they are contiguous, then the other per-slot
+  // arrays, then the index
+  __address_array = inPeerWords;
+  __reset_counter_array = __address_array + inCapacity;
+  __message_counter_array = __reset_counter_array + inCapacity;
+  if(inPeerIndexBits == 0){
+    __lru_previous = 0;
+    __lru_next = 0;
+    __peer_index = 0;
+  } else {
+    __lru_previous = __message_counter_array + inCapacity;
+    __lru_next = __lru_previous + inCapacity;
+    __peer_index = __lru_next + inCapacity;
+  }
+  __message_window_array = inMessageWindows;
+  __last_heard_array = inLastHeard;
+  __storage_dirty_slots = inDirtySlots;
   // Store callbacks
   __storage_read_callback = inStorageReadCB;
   __storage_write_callback = inStorageWriteCB;
@@ -40,7 +133,8 @@ WiLEDProto::WiLEDProto(
   } else {
     __address = 0;
   }
-  // Set magic number
+  // Start with no outgoing message, then set magic number
+  memset(__outgoing_message_buffer, 0, MAXIMUM_MESSAGE_LENGTH);
   __outgoing_message_buffer[0] = 0xAA;
   // Set source address (as big-endian 2-byte number)
   __outgoing_message_buffer[1] = (__address >> 8);
@@ -48,86 +142,419 @@ WiLEDProto::WiLEDProto(
 }
 
 
-void WiLEDProto::initStorage(){
-  // Read the addresses and reset counter arrays from storage
-  if(__storage_commit_callback > 0 && __storage_write_callback > 0){
+void WiLEDProtoBase::initStorage(){
+  // A ring that can't hold two snapshots would fill up for good, so don't
+  // start using it at all
+  if(__journal != 0 && !__journal->canHold(__capacity + 2)){
+    Serial.print("Journal too small for ");
+    Serial.print(__capacity);
+    Serial.println(" addresses, not using it");
+    __journal = 0;
+  }
+  // Replay the journal, the byte callbacks are not used at all. Flash that
+  // can't be read (or has no callbacks set) is no better than no journal.
+  if(__journal != 0 && !__restoreFromJournal()){
+    Serial.println("Journal can't be read, not using it");
+    __journal = 0;
+  }
+  if(__journal == 0 && __storage_commit_callback != 0 && (__storage_write_callback != 0 || __storage_block_write_callback != 0)){
+    // Read the addresses and reset counter arrays from storage
     // TODO: Check the return value of these
-    __restoreFromStorage_uint16t(__address_array, STORAGE_ADDRESSES_LOCATION, sizeof(__address_array));
-    __restoreFromStorage_uint16t(__reset_counter_array, STORAGE_RESET_LOCATION, sizeof(__reset_counter_array));
-    __restoreFromStorage_uint16t(&__count_addresses, STORAGE_COUNT_LOCATION, sizeof(__count_addresses));
-    __restoreFromStorage_uint16t(&__self_reset_counter, STORAGE_SELF_RESET_LOCATION, sizeof(__self_reset_counter));
-    __self_reset_counter++;
-    __addToStorage_uint16t(&__self_reset_counter, STORAGE_SELF_RESET_LOCATION, sizeof(__self_reset_counter));
-    __storage_commit_callback();
+    __restoreFromStorage_uint16t(__address_array, __storage_layout.addresses, __capacity * sizeof(uint16_t));
+    __restoreFromStorage_uint16t(__reset_counter_array, __storage_layout.reset_counters, __capacity * sizeof(uint16_t));
+    __restoreFromStorage_uint16t(&__count_addresses, __storage_layout.count, sizeof(__count_addresses));
+    __restoreFromStorage_uint16t(&__self_reset_reserved, __storage_layout.self_reset, sizeof(__self_reset_reserved));
+    __restoreGroups();
+    // Blank storage may hold any count, don't trust more than the image has
+    // slots for. An image with more slots than this table, written before
+    // the table was made smaller, keeps its first __capacity addresses.
+    if(__count_addresses > __storage_layout.reset_counters / sizeof(uint16_t)){
+      __count_addresses = 0;
+    } else if(__count_addresses > __capacity){
+      __count_addresses = __capacity;
+      __count_addresses_dirty = true;
+    }
+    __rebuildPeerIndex();
+    __startResetEpoch();
+  } else if(__journal == 0){
+    // Nothing is kept across a restart, but still don't send with Reset
+    // Counter 0
+    __startResetEpoch();
+    return;
+  }
+  __resetPeerAges();
+
+  // Arduino-specific debug
+  Serial.print("Loaded addresses: ");
+  Serial.println(__count_addresses);
+  Serial.print("Addresses: ");
+  for(uint16_t idx=0; idx < __count_addresses; idx++){
+    Serial.print(__address_array[idx], HEX);
+    Serial.print(", ");
+  }
+  Serial.println();
+  Serial.print("This device's reset counter: ");
+  Serial.println(__self_reset_counter);
+  Serial.println();
+}
+
 
-    // Arduino-specific debug
-    Serial.print("Loaded addresses: ");
-    Serial.println(__count_addresses);
-    Serial.print("Addresses: ");
-    for(uint16_t idx=0; idx < __count_addresses; idx++){
-      Serial.print(__address_array[idx], HEX);
-      Serial.print(", ");
+void WiLEDProtoBase::setRetainedCallbacks(
+  bool (*inRetainedReadCB)(uint8_t*, uint16_t),
+  void (*inRetainedWriteCB)(const uint8_t*, uint16_t)
+){
+  __retained_read_callback = inRetainedReadCB;
+  __retained_write_callback = inRetainedWriteCB;
+}
+
+
+void WiLEDProtoBase::setStorageBlockCallbacks(
+  void (*inStorageBlockReadCB)(uint16_t, uint8_t*, uint16_t),
+  void (*inStorageBlockWriteCB)(uint16_t, const uint8_t*, uint16_t),
+  void (*inStorageCommitCB)(void)
+){
+  /// Read and write whole blocks of storage in one call, instead of one
+  /// call per byte. Must be called before initStorage().
+  __storage_block_read_callback = inStorageBlockReadCB;
+  __storage_block_write_callback = inStorageBlockWriteCB;
+  __storage_commit_callback = inStorageCommitCB;
+}
+
+
+void WiLEDProtoBase::setJournal(WiLEDJournal* inJournal){
+  /// Must be called before initStorage()
+  __journal = inJournal;
+}
+
+
+// Commit pending storage changes, if any are due. This keeps the flash
+// writes out of processMessage(), which only marks what has changed.
+void WiLEDProtoBase::process(){
+  if(__storage_pending == 0 && !__status_pending){
+    return;
+  }
+  uint32_t millis_now = millis();
+  if(__status_pending){
+    __processDeviceStatus(millis_now);
+  }
+  if(__storage_pending == 0){
+    return;
+  }
+  if((__storage_pending >= __storage_max_pending)
+    || (millis_now - __storage_first_pending_millis >= __storage_commit_deadline_millis)
+    || (millis_now - __last_received_millis >= __storage_commit_idle_millis)){
+    flushStorage();
+  }
+}
+
+
+void WiLEDProtoBase::flushStorage(){
+  if(__storage_pending == 0){
+    return;
+  }
+  if(__journal != 0){
+    __flushRemovedPeers();
+    if(__storage_pending == 0){
+      return;
     }
-    Serial.println();
-    Serial.print("This device's reset counter: ");
-    Serial.println(__self_reset_counter);
-    Serial.println();
+  }
+  // Only write the slots that have changed, rather than the whole arrays.
+  // Neighbouring dirty slots are written as one block.
+  uint16_t run_start = 0;
+  // Changes the journal couldn't take stay dirty for the next flush, rather
+  // than a stale counter coming back after a restart
+  uint16_t still_pending = 0;
+  uint16_t run_length = 0;
+  if(__groups_dirty){
+    if(__storeGroups() == WiLP_JOURNAL_SUCCESS){
+      __groups_dirty = false;
+    } else {
+      still_pending++;
+    }
+  }
+  for(uint16_t slot = 0; slot <= __count_addresses; slot++){
+    bool dirty = (slot < __count_addresses) && (__storage_dirty_slots[slot / 8] & (1 << (slot % 8)));
+    if(dirty){
+      if(__journal != 0){
+        if(__appendJournal(WiLP_JOURNAL_PEER, __address_array[slot], __reset_counter_array[slot]) == WiLP_JOURNAL_SUCCESS){
+          __storage_dirty_slots[slot / 8] &= ~(1 << (slot % 8));
+        } else {
+          still_pending++;
+        }
+        continue;
+      }
+      if(run_length == 0){
+        run_start = slot;
+      }
+      run_length++;
+      continue;
+    }
+    if(run_length > 0){
+      __addToStorage_uint16t(&__address_array[run_start], __storage_layout.addresses + (run_start * sizeof(uint16_t)), run_length * sizeof(uint16_t));
+      __addToStorage_uint16t(&__reset_counter_array[run_start], __storage_layout.reset_counters + (run_start * sizeof(uint16_t)), run_length * sizeof(uint16_t));
+      run_length = 0;
+    }
+  }
+  if(__journal != 0){
+    // The journal records are already in flash, there is no commit
+    __compactJournal();
+  } else {
+    memset(__storage_dirty_slots, 0, (__capacity + 7) / 8);
+    if(__count_addresses_dirty){
+      __addToStorage_uint16t(&__count_addresses, __storage_layout.count, sizeof(__count_addresses));
+    }
+    // One commit covers all of the changes
+    if(__storage_commit_callback != 0){
+      __storage_commit_callback();
+    }
+  }
+  __count_addresses_dirty = false;
+  // A snapshot that is still due keeps the flush coming back
+  if(__snapshot_due){
+    still_pending++;
+  }
+  __storage_pending = still_pending;
+  if(still_pending != 0){
+    __storage_first_pending_millis = millis();
   }
 }
 
 
+void WiLEDProtoBase::setStorageCommitTiming(uint32_t inDeadlineMillis, uint32_t inIdleMillis, uint16_t inMaxPending){
+  __storage_commit_deadline_millis = inDeadlineMillis;
+  __storage_commit_idle_millis = inIdleMillis;
+  // Zero would mean never committing from process()
+  if(inMaxPending > 0){
+    __storage_max_pending = inMaxPending;
+  } else {
+    __storage_max_pending = 1;
+  }
+}
+
+
+uint16_t WiLEDProtoBase::getStoragePending(){
+  return __storage_pending;
+}
+
+
 // Process a received message
-uint8_t WiLEDProto::processMessage(uint8_t* inBuffer){
-  // Check if first byte is magic number
-  if(inBuffer[0] != 0xAA){
+uint8_t WiLEDProtoBase::processMessage(const uint8_t* inBuffer, uint8_t inLength){
+  return processMessage(parseMessage(inBuffer, inLength));
+}
+
+
+uint8_t WiLEDProtoBase::processMessage(uint8_t* inBuffer){
+  return processMessage(parseMessage(inBuffer, MAXIMUM_MESSAGE_LENGTH));
+}
+
+
+uint8_t WiLEDProtoBase::processMessage(const WiLPMessageView& inMessage){
+  // Check the buffer held an intact message at all
+  if(!inMessage.hasHeader()){
     __last_received_destination = 0;
     __last_received_source = 0;
     __last_received_type = 0;
     __last_received_reset_counter = 0;
     __last_received_message_counter = 0;
-    return WiLP_RETURN_INVALID_BUFFER;
-  }
-  // Store the received message destination (left shift)
-  __last_received_destination = (inBuffer[3] << 8);
-  __last_received_destination += inBuffer[4];
-  // Store the received message source (left shift)
-  __last_received_source = (inBuffer[1] << 8);
-  __last_received_source += inBuffer[2];
-  // Store the received message type byte
-  __last_received_type = inBuffer[9];
-  // Store the received reset counter (left shift)
-  __last_received_reset_counter = (inBuffer[5] << 8);
-  __last_received_reset_counter += inBuffer[6];
-  // Store the received message counter
-  __last_received_message_counter = (inBuffer[7] << 8);
-  __last_received_message_counter += inBuffer[8];
-  // Check if we are the destination
-  if((__last_received_destination != __address) and (__last_received_destination != 0xFFFF)){
-    return WiLP_RETURN_NOT_THIS_DEST;
+    return inMessage.getStatus();
+  }
+  // Store the received header fields
+  __last_received_destination = inMessage.getDestination();
+  __last_received_source = inMessage.getSource();
+  __last_received_type = inMessage.getType();
+  __last_received_reset_counter = inMessage.getResetCounter();
+  __last_received_message_counter = inMessage.getMessageCounter();
+  __last_received_millis = millis();
+  // The payload stays in the caller's buffer, read it through the view
+  __last_received_payload_length = inMessage.getPayloadLength();
+  // The checksum of an unknown type can't be checked, so it must not touch
+  // the counters or storage
+  if(!inMessage.isValid()){
+    __last_received_message_counter_validation = inMessage.getStatus();
+    return inMessage.getStatus();
   }
+  uint8_t status = __acceptMessage(inMessage, &__last_received_message_counter_validation);
+  if(status == WiLP_RETURN_SUCCESS){
+    __dispatchMessage(inMessage, __last_received_message_counter_validation);
+  }
+  return status;
+}
 
-  __last_received_message_counter_validation = __checkAndUpdateMessageCounter(__last_received_source, __last_received_reset_counter, __last_received_message_counter);
 
-  // Determine the payload length
-  switch(__last_received_type){
-    case WiLP_Beacon:
-      __last_received_payload_length = 4;
+uint16_t WiLEDProtoBase::processMessages(const uint8_t* const* inFrames, const uint8_t* inLengths, uint16_t inCount, WiLPBatchResult* outResults){
+  uint16_t count_success = 0;
+  // One timestamp covers the whole burst, and the last received state is
+  // only updated for the final frame
+  __last_received_millis = millis();
+  for(uint16_t idx = 0; idx < inCount; idx++){
+    WiLPMessageView message = parseMessage(inFrames[idx], inLengths[idx]);
+    WiLPBatchResult* result = &outResults[idx];
+    if(!message.hasHeader()){
+      result->status = message.getStatus();
+      result->type = 0;
+      result->source = 0;
+      result->validation = message.getStatus();
+      continue;
+    }
+    result->type = message.getType();
+    result->source = message.getSource();
+    if(!message.isValid()){
+      result->status = message.getStatus();
+      result->validation = message.getStatus();
+      continue;
+    }
+    result->status = __acceptMessage(message, &result->validation);
+    if(result->status == WiLP_RETURN_SUCCESS){
+      __dispatchMessage(message, result->validation);
+      count_success++;
+    }
+  }
+  if(inCount > 0){
+    WiLPMessageView last = parseMessage(inFrames[inCount - 1], inLengths[inCount - 1]);
+    if(last.hasHeader()){
+      __last_received_destination = last.getDestination();
+      __last_received_source = last.getSource();
+      __last_received_type = last.getType();
+      __last_received_reset_counter = last.getResetCounter();
+      __last_received_message_counter = last.getMessageCounter();
+      __last_received_message_counter_validation = outResults[inCount - 1].validation;
+      __last_received_payload_length = last.getPayloadLength();
+    }
+  }
+  return count_success;
+}
+
+
+uint8_t WiLEDProtoBase::processFrame(const uint8_t* inFrame, uint8_t inLength, WiLPBatchResult* outResults, uint8_t inMaxResults){
+  // Split the frame up by the length of each message's type, then process
+  // the messages as a burst. Each one still has its own checksum checked.
+  const uint8_t* messages[WiLP_MAXIMUM_AGGREGATE_MESSAGES];
+  uint8_t lengths[WiLP_MAXIMUM_AGGREGATE_MESSAGES];
+  uint8_t count_messages = 0;
+  uint8_t offset = 0;
+  if(inMaxResults > WiLP_MAXIMUM_AGGREGATE_MESSAGES){
+    inMaxResults = WiLP_MAXIMUM_AGGREGATE_MESSAGES;
+  }
+  // Anything that doesn't start with the magic number is padding
+  while(count_messages < inMaxResults && offset < inLength
+    && inFrame[offset] == WiLPMessageView::MAGIC){
+    messages[count_messages] = &inFrame[offset];
+    lengths[count_messages] = inLength - offset;
+    count_messages++;
+    // Without the type, the start of the next message can't be found, so
+    // leave the rest for processMessages() to reject
+    if(inLength - offset < WiLPMessageView::HEADER_LENGTH){
+      break;
+    }
+    // A message cut short by the end of the frame keeps only the bytes that
+    // are there, so parseMessage() rejects it without reading past them
+    uint8_t frame_length = getFrameLength(inFrame[offset + WiLPMessageView::OFFSET_TYPE]);
+    if(frame_length == 0 || frame_length > inLength - offset){
       break;
-    default:
-      __last_received_payload_length = 0;
-      return WiLP_RETURN_UNKNOWN_TYPE;
+    }
+    lengths[count_messages - 1] = frame_length;
+    offset += frame_length;
+  }
+  processMessages(messages, lengths, count_messages, outResults);
+  return count_messages;
+}
+
+
+uint8_t WiLEDProtoBase::appendToFrame(uint8_t* ioFrame, uint8_t inFrameLength, uint8_t inFrameCapacity){
+  uint8_t frame_length = getFrameLength(__outgoing_message_buffer[WiLPMessageView::OFFSET_TYPE]);
+  // Leave the message staged if it doesn't fit, so it can start the next frame
+  if(frame_length == 0 || inFrameLength + frame_length > inFrameCapacity){
+    return inFrameLength;
+  }
+  return inFrameLength + copyToBuffer(&ioFrame[inFrameLength]);
+}
+
+
+WiLPMessageView WiLEDProtoBase::parseMessage(const uint8_t* inBuffer, uint8_t inLength){
+  // Check the header fits, and the first byte is the magic number
+  if(inBuffer == 0 || inLength < WiLPMessageView::HEADER_LENGTH
+    || inBuffer[WiLPMessageView::OFFSET_MAGIC] != WiLPMessageView::MAGIC){
+    return WiLPMessageView(inBuffer, inLength, 0, WiLP_RETURN_INVALID_BUFFER);
+  }
+  // Determine the payload length
+  uint8_t payload_length = getPayloadLength(inBuffer[WiLPMessageView::OFFSET_TYPE]);
+  if(payload_length == WiLP_PAYLOAD_UNKNOWN){
+    return WiLPMessageView(inBuffer, inLength, 0, WiLP_RETURN_UNKNOWN_TYPE);
   }
-  // Store the payload bytes in an array
-  if(__last_received_payload_length > 0){
-    memcpy(__last_received_payload, &inBuffer[10], __last_received_payload_length);
+  uint8_t checked_length = WiLPMessageView::HEADER_LENGTH + payload_length;
+  if(inLength < checked_length + WiLP_CHECKSUM_LENGTH){
+    return WiLPMessageView(inBuffer, inLength, 0, WiLP_RETURN_INVALID_BUFFER);
   }
+  // Reject corrupt frames here, before anything looks at their counters
+  uint16_t checksum = (inBuffer[checked_length] << 8) + inBuffer[checked_length + 1];
+  if(WiLPChecksum::crc16(inBuffer, checked_length) != checksum){
+    return WiLPMessageView(inBuffer, inLength, 0, WiLP_RETURN_INVALID_CHECKSUM);
+  }
+  return WiLPMessageView(inBuffer, inLength, payload_length, WiLP_RETURN_SUCCESS);
+}
+
+
+uint8_t WiLEDProtoBase::getPayloadLength(uint8_t inType){
+  if(WiLP_TYPE_TABLE[inType].flags & WiLP_TYPE_EXTENSION){
+    return __extension_payload_lengths[inType - WiLP_Extension_First];
+  }
+  return WiLP_TYPE_TABLE[inType].payload_length;
+}
+
+
+uint8_t WiLEDProtoBase::getFrameLength(uint8_t inType){
+  uint8_t payload_length = getPayloadLength(inType);
+  if(payload_length == WiLP_PAYLOAD_UNKNOWN){
+    return 0;
+  }
+  return WiLPMessageView::HEADER_LENGTH + payload_length + WiLP_CHECKSUM_LENGTH;
+}
+
+
+WiLPTypeInfo WiLEDProtoBase::getTypeInfo(uint8_t inType){
+  return WiLP_TYPE_TABLE[inType];
+}
 
+
+uint8_t WiLEDProtoBase::setMessageHandler(uint8_t inType, void (*inHandler)(const WiLPMessageView&)){
+  uint8_t slot = WiLP_TYPE_TABLE[inType].handler_slot;
+  if(slot == 0){
+    return WiLP_RETURN_UNKNOWN_TYPE;
+  }
+  __type_handlers[slot] = inHandler;
+  return WiLP_RETURN_SUCCESS;
+}
+
+
+uint8_t WiLEDProtoBase::registerExtensionType(uint8_t inType, uint8_t inPayloadLength, void (*inHandler)(const WiLPMessageView&)){
+  if(!(WiLP_TYPE_TABLE[inType].flags & WiLP_TYPE_EXTENSION)){
+    return WiLP_RETURN_UNKNOWN_TYPE;
+  }
+  if(inPayloadLength > MAXIMUM_PAYLOAD_LENGTH){
+    return WiLP_RETURN_OTHER_ERROR;
+  }
+  __extension_payload_lengths[inType - WiLP_Extension_First] = inPayloadLength;
+  __type_handlers[WiLP_TYPE_TABLE[inType].handler_slot] = inHandler;
+  return WiLP_RETURN_SUCCESS;
+}
+
+
+uint8_t WiLEDProtoBase::sendMessage(uint16_t inDestination, uint8_t inType, const uint8_t* inPayload){
+  uint8_t payload_length = getPayloadLength(inType);
+  if(payload_length == WiLP_PAYLOAD_UNKNOWN){
+    return WiLP_RETURN_UNKNOWN_TYPE;
+  }
+  __setTypeByte(inType);
+  __setDestinationByte(inDestination);
+  for(uint8_t idx = 0; idx < payload_length; idx++){
+    __setPayloadByte(idx, inPayload[idx]);
+  }
   return WiLP_RETURN_SUCCESS;
 }
 
 
 // Send a "Beacon" message
-uint8_t WiLEDProto::sendMessageBeacon(uint32_t inUptime){
+uint8_t WiLEDProtoBase::sendMessageBeacon(uint32_t inUptime){
   __setTypeByte(WiLP_Beacon);
   __setDestinationByte(0xFFFF);
 
@@ -141,63 +568,315 @@ uint8_t WiLEDProto::sendMessageBeacon(uint32_t inUptime){
 }
 
 
-void WiLEDProto::copyToBuffer(uint8_t * inBuffer){
+uint8_t WiLEDProtoBase::sendMessageDeviceStatus(uint8_t inOutput, uint8_t inGroup1, uint8_t inGroup2, uint8_t inGroup3, uint8_t inGroup4){
+  __setTypeByte(WiLP_Device_Status);
+  __setDestinationByte(0xFFFF);
+
+  __setPayloadByte(0, inOutput);
+  __setPayloadByte(1, inGroup1);
+  __setPayloadByte(2, inGroup2);
+  __setPayloadByte(3, inGroup3);
+  __setPayloadByte(4, inGroup4);
+
+  return WiLP_RETURN_SUCCESS;
+}
+
+
+void WiLEDProtoBase::updateDeviceStatus(uint8_t inOutput){
+  __status_output = inOutput;
+  __markStatusChanged();
+}
+
+
+void WiLEDProtoBase::setDeviceStatusTiming(uint32_t inCoalesceMillis, uint32_t inMinIntervalMillis){
+  __status_coalesce_millis = inCoalesceMillis;
+  __status_min_interval_millis = inMinIntervalMillis;
+}
+
+
+uint32_t WiLEDProtoBase::getDeviceStatusSentCount(){
+  return __status_sent_count;
+}
+
+
+uint32_t WiLEDProtoBase::getDeviceStatusSuppressedCount(){
+  return __status_suppressed_count;
+}
+
+
+uint8_t WiLEDProtoBase::sendMessageSetIndividual(uint8_t inOutput, uint16_t inAddress){
+  __setTypeByte(WiLP_Set_Individual);
+  __setDestinationByte(0xFFFF);
+
+  __setPayloadByte(0, inOutput);
+  __setPayloadByte(1, (inAddress >> 8));
+  __setPayloadByte(2, (inAddress));
+
+  return WiLP_RETURN_SUCCESS;
+}
+
+
+uint8_t WiLEDProtoBase::sendMessageSetIndividuals(uint8_t inOutput, uint16_t inAddress1, uint16_t inAddress2){
+  __setTypeByte(WiLP_Set_Individuals_Two);
+  __setDestinationByte(0xFFFF);
+
+  __setPayloadByte(0, inOutput);
+  __setPayloadByte(1, (inAddress1 >> 8));
+  __setPayloadByte(2, (inAddress1));
+  __setPayloadByte(3, (inAddress2 >> 8));
+  __setPayloadByte(4, (inAddress2));
+
+  return WiLP_RETURN_SUCCESS;
+}
+
+
+uint8_t WiLEDProtoBase::sendMessageSetIndividuals(uint8_t inOutput, uint16_t inAddress1, uint16_t inAddress2, uint16_t inAddress3){
+  __setTypeByte(WiLP_Set_Individuals_Three);
+  __setDestinationByte(0xFFFF);
+
+  __setPayloadByte(0, inOutput);
+  __setPayloadByte(1, (inAddress1 >> 8));
+  __setPayloadByte(2, (inAddress1));
+  __setPayloadByte(3, (inAddress2 >> 8));
+  __setPayloadByte(4, (inAddress2));
+  __setPayloadByte(5, (inAddress3 >> 8));
+  __setPayloadByte(6, (inAddress3));
+
+  return WiLP_RETURN_SUCCESS;
+}
+
+
+uint8_t WiLEDProtoBase::sendMessageSetGroups(uint8_t inOutput, uint8_t inGroup1, uint8_t inGroup2, uint8_t inGroup3){
+  __setTypeByte(WiLP_Set_Groups);
+  __setDestinationByte(0xFFFF);
+
+  __setPayloadByte(0, inOutput);
+  __setPayloadByte(1, inGroup1);
+  __setPayloadByte(2, inGroup2);
+  __setPayloadByte(3, inGroup3);
+
+  return WiLP_RETURN_SUCCESS;
+}
+
+
+uint8_t WiLEDProtoBase::sendMessageAttachGroups(uint16_t inDestination, uint8_t inGroup1, uint8_t inGroup2, uint8_t inGroup3, uint8_t inGroup4){
+  __setTypeByte(WiLP_Attach_Groups);
+  __setDestinationByte(inDestination);
+
+  __setPayloadByte(0, inGroup1);
+  __setPayloadByte(1, inGroup2);
+  __setPayloadByte(2, inGroup3);
+  __setPayloadByte(3, inGroup4);
+
+  return WiLP_RETURN_SUCCESS;
+}
+
+
+uint8_t WiLEDProtoBase::copyToBuffer(uint8_t * inBuffer){
   /// copyToBuffer can only be called once. After calling, the
   /// message contents must be set again.
-  // Set reset counter bytes
-  __outgoing_message_buffer[5] = (__self_reset_counter >> 8);
-  __outgoing_message_buffer[6] = (__self_reset_counter);
-
-  // Increment and set message counter bytes (big endian)
-  // TODO: Handle overflow of message counter
-  __self_message_counter++;
-  __outgoing_message_buffer[7] = (__self_message_counter >> 8);
-  __outgoing_message_buffer[8] = (__self_message_counter);
+  // Only whole messages of a known type can be sent
+  uint8_t frame_length = getFrameLength(__outgoing_message_buffer[WiLPMessageView::OFFSET_TYPE]);
+  if(frame_length == 0){
+    return 0;
+  }
 
-  // Copy internal buffer to provided address
-  memcpy(inBuffer, __outgoing_message_buffer, MAXIMUM_MESSAGE_LENGTH);
+  // Copy the frame to provided address, and give it counters and a checksum
+  memcpy(inBuffer, __outgoing_message_buffer, frame_length);
+  __sealMessage(inBuffer, frame_length);
 
   // Wipe message buffer (keep magic number and source address)
+  for(uint8_t idx = 3; idx<frame_length; idx++){
+    __outgoing_message_buffer[idx] = 0x00;
+  }
+  return frame_length;
+}
+
+
+uint8_t WiLEDProtoBase::queueMessage(uint8_t inPriority){
+  uint8_t type = __outgoing_message_buffer[WiLPMessageView::OFFSET_TYPE];
+  if(getFrameLength(type) == 0){
+    return WiLP_RETURN_UNKNOWN_TYPE;
+  }
+  uint8_t result = __enqueue((__outgoing_message_buffer[3] << 8) + __outgoing_message_buffer[4], type,
+    &__outgoing_message_buffer[WiLPMessageView::OFFSET_PAYLOAD], inPriority);
+  if(result != WiLP_RETURN_SUCCESS){
+    return result;
+  }
+
+  // The message is out of the way, so a new one can be staged
   for(uint8_t idx = 3; idx<MAXIMUM_MESSAGE_LENGTH; idx++){
     __outgoing_message_buffer[idx] = 0x00;
   }
+  return WiLP_RETURN_SUCCESS;
+}
+
+
+uint8_t WiLEDProtoBase::getQueuedCount(){
+  uint8_t count = 0;
+  for(uint8_t priority = 0; priority < WiLP_PRIORITY_LEVELS; priority++){
+    count += __queue_count[priority];
+  }
+  return count;
+}
+
+
+uint8_t WiLEDProtoBase::copyQueuedToBuffer(uint8_t* outBuffer){
+  WiLPQueuedMessage* message = __peekQueue();
+  if(message == 0){
+    return 0;
+  }
+  uint8_t frame_length = getFrameLength(message->type);
+  // Header from the staging buffer, then the queued fields
+  memcpy(outBuffer, __outgoing_message_buffer, 3);
+  outBuffer[3] = (message->destination >> 8);
+  outBuffer[4] = (message->destination);
+  outBuffer[WiLPMessageView::OFFSET_TYPE] = message->type;
+  memcpy(&outBuffer[WiLPMessageView::OFFSET_PAYLOAD], message->payload, frame_length - WiLPMessageView::HEADER_LENGTH - WiLP_CHECKSUM_LENGTH);
+  __sealMessage(outBuffer, frame_length);
+  __popQueue();
+  return frame_length;
+}
+
+
+uint8_t WiLEDProtoBase::appendQueuedToFrame(uint8_t* ioFrame, uint8_t inFrameLength, uint8_t inFrameCapacity){
+  WiLPQueuedMessage* message = __peekQueue();
+  // Stop at the first message that doesn't fit, to keep them in order
+  while(message != 0 && inFrameLength + getFrameLength(message->type) <= inFrameCapacity){
+    inFrameLength += copyQueuedToBuffer(&ioFrame[inFrameLength]);
+    message = __peekQueue();
+  }
+  return inFrameLength;
 }
 
 
-uint8_t WiLEDProto::getLastReceivedType(){
+uint8_t WiLEDProtoBase::getLastReceivedType(){
   return __last_received_type;
 }
 
-uint16_t WiLEDProto::getLastReceivedSource(){
+uint16_t WiLEDProtoBase::getLastReceivedSource(){
   return __last_received_source;
 }
 
-uint16_t WiLEDProto::getLastReceivedDestination(){
+uint16_t WiLEDProtoBase::getLastReceivedDestination(){
   return __last_received_destination;
 }
 
-uint16_t WiLEDProto::getLastReceivedResetCounter(){
+uint16_t WiLEDProtoBase::getLastReceivedResetCounter(){
   return __last_received_reset_counter;
 }
 
-uint16_t WiLEDProto::getLastReceivedMessageCounter(){
+uint16_t WiLEDProtoBase::getLastReceivedMessageCounter(){
   return __last_received_message_counter;
 }
 
-uint8_t WiLEDProto::getLastReceivedMessageCounterValidation(){
+uint8_t WiLEDProtoBase::getLastReceivedMessageCounterValidation(){
   return __last_received_message_counter_validation;
 }
 
+void WiLEDProtoBase::setPeerEvictionAge(uint32_t inMillis){
+  __peer_eviction_age = inMillis;
+}
+
+uint32_t WiLEDProtoBase::getPeerEvictionCount(){
+  return __peer_evictions;
+}
+
+uint16_t WiLEDProtoBase::getCapacity(){
+  return __capacity;
+}
+
+void WiLEDProtoBase::attachGroups(uint8_t inGroup1, uint8_t inGroup2, uint8_t inGroup3, uint8_t inGroup4){
+  uint8_t groups[WiLP_GROUP_SLOTS] = {inGroup1, inGroup2, inGroup3, inGroup4};
+  if(memcmp(groups, __groups, WiLP_GROUP_SLOTS) == 0){
+    return;
+  }
+  __setGroups(groups);
+  // Written by flushStorage(), so a received Attach Groups costs no more
+  // than any other message
+  __groups_dirty = true;
+  __markStorageChanged();
+  // The groups are part of the Device Status
+  __markStatusChanged();
+}
+
+uint8_t WiLEDProtoBase::getGroup(uint8_t inSlot){
+  if(inSlot >= WiLP_GROUP_SLOTS){
+    return WiLP_GROUP_NONE;
+  }
+  return __groups[inSlot];
+}
+
+bool WiLEDProtoBase::isInGroup(uint8_t inGroup){
+  return (__group_bits[inGroup >> 5] >> (inGroup & 31)) & 1;
+}
+
+WiLPCounterStats WiLEDProtoBase::getCounterStats(){
+  return __counter_stats;
+}
+
+void WiLEDProtoBase::clearCounterStats(){
+  __counter_stats = {0, 0, 0, 0, 0};
+}
+
 /************ Private methods ***************************/
 
+// The oldest message of the highest priority level that has one, or 0
+WiLPQueuedMessage* WiLEDProtoBase::__peekQueue(){
+  for(uint8_t priority = 0; priority < WiLP_PRIORITY_LEVELS; priority++){
+    if(__queue_count[priority] > 0){
+      return &__queue[priority * __queue_length + __queue_head[priority]];
+    }
+  }
+  return 0;
+}
+
+
+// Remove the message returned by __peekQueue()
+void WiLEDProtoBase::__popQueue(){
+  for(uint8_t priority = 0; priority < WiLP_PRIORITY_LEVELS; priority++){
+    if(__queue_count[priority] > 0){
+      __queue_head[priority] = (__queue_head[priority] + 1) % __queue_length;
+      __queue_count[priority]--;
+      return;
+    }
+  }
+}
+
+
+// Give a frame the next message counter and its checksum, in place. This is
+// only done as the frame is about to be sent, so counters go out in order.
+void WiLEDProtoBase::__sealMessage(uint8_t* ioBuffer, uint8_t inFrameLength){
+  // Increment and set message counter bytes (big endian), moving on to the
+  // next Reset Counter when the Message Counter would overflow
+  if(__self_message_counter == 0xFFFF){
+    __nextResetEpoch();
+  }
+  __self_message_counter++;
+  ioBuffer[5] = (__self_reset_counter >> 8);
+  ioBuffer[6] = (__self_reset_counter);
+  ioBuffer[7] = (__self_message_counter >> 8);
+  ioBuffer[8] = (__self_message_counter);
+  #ifdef WiLP_TRACE
+  WiLPTrace::message(WiLP_TRACE_ENCODE, ioBuffer[WiLPMessageView::OFFSET_TYPE], __address, __self_message_counter);
+  #endif
+
+  // Set the checksum bytes (big endian) after the payload
+  uint8_t checked_length = inFrameLength - WiLP_CHECKSUM_LENGTH;
+  uint16_t checksum = WiLPChecksum::crc16(ioBuffer, checked_length);
+  ioBuffer[checked_length] = (checksum >> 8);
+  ioBuffer[checked_length + 1] = (checksum);
+}
+
+
 // Set the "type" byte in the output buffer
-void WiLEDProto::__setTypeByte(uint8_t inType){
+void WiLEDProtoBase::__setTypeByte(uint8_t inType){
   __outgoing_message_buffer[9] = inType;
 }
 
 
 // Set the "destination" bytes in the output buffer
-void WiLEDProto::__setDestinationByte(uint16_t inDestination){
+void WiLEDProtoBase::__setDestinationByte(uint16_t inDestination){
   // Set destination address (as big-endian 2-byte number)
   __outgoing_message_buffer[3] = (inDestination >> 8);
   __outgoing_message_buffer[4] = (inDestination);
@@ -205,20 +884,25 @@ void WiLEDProto::__setDestinationByte(uint16_t inDestination){
 
 
 // Set the specified "payload" byte in the output buffer
-void WiLEDProto::__setPayloadByte(uint8_t inPayloadOffset, uint8_t inPayloadValue){
+void WiLEDProtoBase::__setPayloadByte(uint8_t inPayloadOffset, uint8_t inPayloadValue){
   __outgoing_message_buffer[10+inPayloadOffset] = inPayloadValue;
 }
 
 
-uint8_t WiLEDProto::__restoreFromStorage_uint16t(uint16_t* outArray, uint16_t inStorageOffset, uint16_t inLength){
+uint8_t WiLEDProtoBase::__restoreFromStorage_uint16t(uint16_t* outArray, uint16_t inStorageOffset, uint16_t inLength){
   /*Serial.println("Reading to storage: ");
   Serial.println((int)(void*)outArray, HEX);
   Serial.println(inStorageOffset);
   Serial.println(inLength);*/
   // Make a 1-byte pointer to the array of 2-byte values
   uint8_t* p = (uint8_t*)(void*)outArray;
+  // Prefer a single block read where possible
+  if(__storage_block_read_callback != 0){
+    (*__storage_block_read_callback)(inStorageOffset, p, inLength);
+    return WiLP_RETURN_SUCCESS;
+  }
   // First, check callback has been set
-  if(__storage_read_callback > 0){
+  if(__storage_read_callback != 0){
     for (uint16_t idx = 0; idx < inLength; idx++){
       // Read from the storage location into the array
       p[idx] = (*__storage_read_callback)(idx + inStorageOffset);
@@ -231,7 +915,7 @@ uint8_t WiLEDProto::__restoreFromStorage_uint16t(uint16_t* outArray, uint16_t in
 }
 
 
-uint8_t WiLEDProto::__addToStorage_uint16t(uint16_t* inArray, uint16_t inStorageOffset, uint16_t inLength){
+uint8_t WiLEDProtoBase::__addToStorage_uint16t(uint16_t* inArray, uint16_t inStorageOffset, uint16_t inLength){
   /*Serial.println("Adding to storage: ");
   Serial.println((int)(void*)inArray, HEX);
   Serial.println(*inArray);
@@ -239,8 +923,13 @@ uint8_t WiLEDProto::__addToStorage_uint16t(uint16_t* inArray, uint16_t inStorage
   Serial.println(inLength);*/
   // Make a 1-byte pointer to the array of 2-byte values
   uint8_t* p = (uint8_t*)(void*)inArray;
+  // Prefer a single block write where possible
+  if(__storage_block_write_callback != 0){
+    (*__storage_block_write_callback)(inStorageOffset, p, inLength);
+    return WiLP_RETURN_SUCCESS;
+  }
   // First, check callback has been set
-  if(__storage_write_callback > 0){
+  if(__storage_write_callback != 0){
     for (uint16_t idx = 0; idx < inLength; idx++){
       // Write from the array into the storage location
       (*__storage_write_callback)(idx + inStorageOffset, p[idx]);
@@ -254,53 +943,711 @@ uint8_t WiLEDProto::__addToStorage_uint16t(uint16_t* inArray, uint16_t inStorage
 }
 
 
-uint8_t WiLEDProto::__checkAndUpdateMessageCounter(uint16_t inAddress, uint16_t inResetCounter, uint16_t inMessageCounter){
-  // Loop over all the known stored addresses
-  for(uint16_t idx = 0; idx < __count_addresses; idx++){
-    // Look for the requested address
-    if(__address_array[idx] == inAddress){
-      // Stored reset counter must be less than or equal to the current counter
-      if(__reset_counter_array[idx] < inResetCounter){
-        // If less than current value, save new value and reset message counter
-        __reset_counter_array[idx] = inResetCounter;
-        __addToStorage_uint16t(__address_array, STORAGE_ADDRESSES_LOCATION, sizeof(__address_array));
-        __storage_commit_callback();
-        __message_counter_array[idx] = inMessageCounter;
-        // Message is fully valid so return success
-        return WiLP_RETURN_SUCCESS;
-      } else if (__reset_counter_array[idx] != inResetCounter){
-        // Valid but no update needed, still check message counter
-        return WiLP_RETURN_INVALID_RST_CTR;
-      }
-      // Stored message counter must be less than the current counter
-      if(__message_counter_array[idx] < inMessageCounter){
-        // If valid, update the stored message counter
-        __message_counter_array[idx] = inMessageCounter;
-        return WiLP_RETURN_SUCCESS;
-      }
-      else {
-        // Message is invalid, ignore it
-        return WiLP_RETURN_INVALID_MSG_CTR;
-      }
+uint8_t WiLEDProtoBase::__checkAndUpdateMessageCounter(uint16_t inAddress, uint16_t inResetCounter, uint16_t inMessageCounter){
+  // Look for the requested address in the peer index
+  uint16_t idx = __findPeer(inAddress);
+  if(idx != WiLP_PEER_INDEX_EMPTY){
+    uint8_t result;
+    // Stored reset counter must be less than or equal to the current counter
+    if(__reset_counter_array[idx] < inResetCounter){
+      // If less than current value, save new value and reset message counter
+      __reset_counter_array[idx] = inResetCounter;
+      __markSlotDirty(idx);
+      __message_counter_array[idx] = inMessageCounter;
+      __message_window_array[idx] = __firstMessageWindow(inMessageCounter);
+      __counter_stats.accepted++;
+      // Message is fully valid
+      result = WiLP_RETURN_SUCCESS;
+    } else if (__reset_counter_array[idx] != inResetCounter){
+      // Valid but no update needed, still check message counter
+      return WiLP_RETURN_INVALID_RST_CTR;
+    } else {
+      // Message counter must not have been seen before
+      result = __checkMessageWindow(idx, inMessageCounter);
+    }
+    if(result == WiLP_RETURN_SUCCESS){
+      __touchPeer(idx);
     }
+    return result;
   }
   // If we reach this point, we did not previously know the address
   // Add the address to our known addresses
-  if(__count_addresses < MAXIMUM_STORED_ADDRESSES){
-    __address_array[__count_addresses] = inAddress;
-    __message_counter_array[__count_addresses] = inMessageCounter;
+  if(__count_addresses < __capacity){
+    __addPeer(__count_addresses, inAddress, inResetCounter, inMessageCounter);
+    // Save __count_addresses to storage later
+    __count_addresses_dirty = true;
     // Increment the counter
     __count_addresses++;
-    // Save the new __address_array and __count_addresses to storage
-    // TODO: Check return value of these
-    __addToStorage_uint16t(__address_array, STORAGE_ADDRESSES_LOCATION, sizeof(__address_array));
-    __addToStorage_uint16t(&__count_addresses, STORAGE_COUNT_LOCATION, sizeof(__count_addresses));
-    __storage_commit_callback();
     return WiLP_RETURN_ADDED_ADDRESS;
+  }
+  // At maximum known addresses, take over the slot of one that has gone quiet
+  idx = __evictPeer();
+  if(idx != WiLP_PEER_INDEX_EMPTY){
+    __addPeer(idx, inAddress, inResetCounter, inMessageCounter);
+    return WiLP_RETURN_ADDED_ADDRESS;
+  }
+  return WiLP_RETURN_AT_MAX_ADDRESSES;
+}
+
+
+// Fill in a free slot for a new address, and save it to storage later
+void WiLEDProtoBase::__addPeer(uint16_t inSlot, uint16_t inAddress, uint16_t inResetCounter, uint16_t inMessageCounter){
+  __address_array[inSlot] = inAddress;
+  __reset_counter_array[inSlot] = inResetCounter;
+  __message_counter_array[inSlot] = inMessageCounter;
+  __message_window_array[inSlot] = __firstMessageWindow(inMessageCounter);
+  __counter_stats.accepted++;
+  __insertPeerIndex(inSlot);
+  __last_heard_array[inSlot] = __last_received_millis;
+  __linkPeer(inSlot);
+  __markSlotDirty(inSlot);
+}
+
+
+// Free the slot of the least recently heard address, if it is old enough.
+// Returns the slot, or WiLP_PEER_INDEX_EMPTY.
+uint16_t WiLEDProtoBase::__evictPeer(){
+  uint16_t slot = __lru_tail;
+  if(__peer_index_bits == 0){
+    // No list to take the tail of, so find the oldest by its last heard time
+    uint32_t oldest_age = 0;
+    for(uint16_t idx = 0; idx < __count_addresses; idx++){
+      uint32_t age = __last_received_millis - __last_heard_array[idx];
+      if(slot == WiLP_PEER_INDEX_EMPTY || age > oldest_age){
+        slot = idx;
+        oldest_age = age;
+      }
+    }
+  }
+  if(slot == WiLP_PEER_INDEX_EMPTY || (__last_received_millis - __last_heard_array[slot]) < __peer_eviction_age){
+    return WiLP_PEER_INDEX_EMPTY;
+  }
+  // The slot will be written over in storage, but the journal is keyed by
+  // address so it needs to be told the old one has gone. That is left to
+  // flushStorage(), like every other write.
+  if(__journal != 0){
+    if(__removed_count < WiLP_REMOVED_QUEUE_LENGTH){
+      __removed_addresses[__removed_count] = __address_array[slot];
+      __removed_count++;
+    } else {
+      __snapshot_due = true;
+    }
+  }
+  __removePeerIndex(slot);
+  __unlinkPeer(slot);
+  __peer_evictions++;
+  return slot;
+}
+
+
+// Forget an address altogether, moving the last slot into its place. Only
+// used while replaying the journal, since it moves slots around.
+void WiLEDProtoBase::__removePeer(uint16_t inAddress){
+  uint16_t slot = __findPeer(inAddress);
+  if(slot == WiLP_PEER_INDEX_EMPTY){
+    return;
+  }
+  __removePeerIndex(slot);
+  uint16_t last = __count_addresses - 1;
+  if(slot != last){
+    __removePeerIndex(last);
+    __address_array[slot] = __address_array[last];
+    __reset_counter_array[slot] = __reset_counter_array[last];
+    __message_counter_array[slot] = __message_counter_array[last];
+    __message_window_array[slot] = __message_window_array[last];
+    __insertPeerIndex(slot);
+  }
+  __count_addresses--;
+}
+
+
+// Put a slot at the head of the least recently heard list
+void WiLEDProtoBase::__linkPeer(uint16_t inSlot){
+  if(__peer_index_bits == 0){
+    return;
+  }
+  __lru_previous[inSlot] = WiLP_PEER_INDEX_EMPTY;
+  __lru_next[inSlot] = __lru_head;
+  if(__lru_head != WiLP_PEER_INDEX_EMPTY){
+    __lru_previous[__lru_head] = inSlot;
+  } else {
+    __lru_tail = inSlot;
+  }
+  __lru_head = inSlot;
+}
+
+
+// Take a slot out of the least recently heard list
+void WiLEDProtoBase::__unlinkPeer(uint16_t inSlot){
+  if(__peer_index_bits == 0){
+    return;
+  }
+  uint16_t previous = __lru_previous[inSlot];
+  uint16_t next = __lru_next[inSlot];
+  if(previous != WiLP_PEER_INDEX_EMPTY){
+    __lru_next[previous] = next;
+  } else {
+    __lru_head = next;
+  }
+  if(next != WiLP_PEER_INDEX_EMPTY){
+    __lru_previous[next] = previous;
   } else {
-    // At maximum known addresses!
-    return WiLP_RETURN_AT_MAX_ADDRESSES;
+    __lru_tail = previous;
+  }
+}
+
+
+// Note that a valid message has just been heard from a slot's address
+void WiLEDProtoBase::__touchPeer(uint16_t inSlot){
+  __last_heard_array[inSlot] = __last_received_millis;
+  if(__lru_head != inSlot){
+    __unlinkPeer(inSlot);
+    __linkPeer(inSlot);
+  }
+}
+
+
+// Start the least recently heard list again after a restart, when nothing
+// has been heard yet. Every address gets the full age before it can go.
+void WiLEDProtoBase::__resetPeerAges(){
+  uint32_t now = millis();
+  __lru_head = WiLP_PEER_INDEX_EMPTY;
+  __lru_tail = WiLP_PEER_INDEX_EMPTY;
+  for(uint16_t slot = 0; slot < __count_addresses; slot++){
+    __last_heard_array[slot] = now;
+    __linkPeer(slot);
+  }
+}
+
+
+// Check a message counter against the window of recent counters from a known
+// address, with a matching reset counter. Only a few shifts and masks, however
+// far the counter has moved on.
+uint8_t WiLEDProtoBase::__checkMessageWindow(uint16_t inSlot, uint16_t inMessageCounter){
+  uint16_t highest = __message_counter_array[inSlot];
+  uint64_t window = __message_window_array[inSlot];
+  if(inMessageCounter > highest){
+    uint16_t distance = inMessageCounter - highest;
+    if(window == 0){
+      // Nothing known since a restart, so nothing can be counted as lost
+      window = ~(uint64_t)0;
+    } else if(distance >= WiLP_REPLAY_WINDOW){
+      // The whole window leaves, along with everything skipped past it
+      __counter_stats.lost += (distance - WiLP_REPLAY_WINDOW) + (WiLP_REPLAY_WINDOW - __builtin_popcountll(window));
+      window = 1;
+    } else {
+      // The top bits leave the window, any not set were never seen
+      uint64_t leaving = window >> (WiLP_REPLAY_WINDOW - distance);
+      __counter_stats.lost += distance - __builtin_popcountll(leaving);
+      window = (window << distance) | 1;
+    }
+    __message_counter_array[inSlot] = inMessageCounter;
+    __message_window_array[inSlot] = window;
+    __counter_stats.accepted++;
+    return WiLP_RETURN_SUCCESS;
+  }
+  uint16_t distance = highest - inMessageCounter;
+  if(distance >= WiLP_REPLAY_WINDOW || window == 0){
+    __counter_stats.too_old++;
+    return WiLP_RETURN_INVALID_MSG_CTR;
+  }
+  uint64_t bit = (uint64_t)1 << distance;
+  if(window & bit){
+    __counter_stats.duplicates++;
+    return WiLP_RETURN_INVALID_MSG_CTR;
+  }
+  // Late, but not seen before
+  __message_window_array[inSlot] = window | bit;
+  __counter_stats.late++;
+  return WiLP_RETURN_SUCCESS;
+}
+
+
+// The window for the first message heard with a Reset Counter. The counters
+// before it were sent but not heard, so they can still arrive late. There
+// are none below 1.
+uint64_t WiLEDProtoBase::__firstMessageWindow(uint16_t inMessageCounter){
+  if(inMessageCounter >= WiLP_REPLAY_WINDOW){
+    return 1;
+  }
+  return (~(uint64_t)0 << inMessageCounter) | 1;
+}
+
+
+// Rebuild the known addresses from the journal, then record this boot.
+// Returns false, having started nothing, if the journal can't be read.
+bool WiLEDProtoBase::__restoreFromJournal(){
+  __count_addresses = 0;
+  __self_reset_reserved = 0;
+  __rebuildPeerIndex();
+  uint8_t groups[WiLP_GROUP_SLOTS] = {0};
+  __setGroups(groups);
+  if(__journal->beginReplay() != WiLP_JOURNAL_SUCCESS){
+    return false;
+  }
+  uint8_t type;
+  uint16_t address;
+  uint16_t reset_counter;
+  // Later records replace earlier ones for the same address
+  while(__journal->nextRecord(&type, &address, &reset_counter)){
+    if(type == WiLP_JOURNAL_SELF_RESET){
+      __self_reset_reserved = reset_counter;
+      continue;
+    }
+    if(type == WiLP_JOURNAL_PEER_REMOVED){
+      __removePeer(address);
+      continue;
+    }
+    if(type == WiLP_JOURNAL_GROUPS){
+      groups[0] = (address >> 8);
+      groups[1] = (address);
+      groups[2] = (reset_counter >> 8);
+      groups[3] = (reset_counter);
+      __setGroups(groups);
+      continue;
+    }
+    uint16_t slot = __findPeer(address);
+    if(slot == WiLP_PEER_INDEX_EMPTY){
+      if(__count_addresses >= __capacity){
+        continue;
+      }
+      slot = __count_addresses;
+      __address_array[slot] = address;
+      __message_counter_array[slot] = 0;
+      __message_window_array[slot] = 0;
+      __insertPeerIndex(slot);
+      __count_addresses++;
+    }
+    __reset_counter_array[slot] = reset_counter;
+  }
+  __startResetEpoch();
+  __compactJournal();
+  return true;
+}
+
+
+// Pick this device's Reset Counter after a restart, once the last reserved
+// value has been read from storage
+void WiLEDProtoBase::__startResetEpoch(){
+  // If retained RAM still holds the Reset Counter from before the restart,
+  // and it belongs to the block in storage, carry on from it
+  uint8_t retained[WiLP_RETAINED_LENGTH];
+  if(__retained_read_callback != 0 && __retained_read_callback(retained, WiLP_RETAINED_LENGTH)){
+    uint16_t check = 0;
+    for(uint8_t idx = 0; idx < 6; idx++){
+      check += retained[idx];
+    }
+    check = ~check;
+    uint16_t epoch = (retained[2] << 8) + retained[3];
+    uint16_t reserved = (retained[4] << 8) + retained[5];
+    if(retained[0] == 'W' && retained[1] == 'R' && retained[6] == (uint8_t)(check >> 8) && retained[7] == (uint8_t)check
+      && reserved == __self_reset_reserved && epoch <= reserved){
+      __self_reset_counter = epoch;
+      __self_message_counter = 0;
+      __nextResetEpoch();
+      return;
+    }
+  }
+  // Otherwise any value up to the stored one may have been used already
+  __self_reset_counter = __self_reset_reserved;
+  __self_message_counter = 0;
+  __nextResetEpoch();
+}
+
+
+// Move on to the next Reset Counter, reserving another block in storage
+// only if this one has been used up
+void WiLEDProtoBase::__nextResetEpoch(){
+  __self_reset_counter++;
+  __self_message_counter = 0;
+  if(__self_reset_counter > __self_reset_reserved || __self_reset_counter == 0){
+    // Without retained RAM every restart needs a write anyway, and reserving
+    // a whole block each time would only use up Reset Counters faster
+    uint16_t block = (__retained_write_callback != 0) ? WiLP_RESET_EPOCH_BLOCK : 1;
+    __self_reset_reserved = __self_reset_counter + block - 1;
+    __storeResetReserved();
+  }
+  __writeRetained();
+}
+
+
+// Save the last reserved Reset Counter, straight away since it must be in
+// storage before any of the block is used
+void WiLEDProtoBase::__storeResetReserved(){
+  if(__journal != 0){
+    __appendJournal(WiLP_JOURNAL_SELF_RESET, __address, __self_reset_reserved);
+  } else if(__storage_commit_callback != 0 && (__storage_write_callback != 0 || __storage_block_write_callback != 0)){
+    __addToStorage_uint16t(&__self_reset_reserved, __storage_layout.self_reset, sizeof(__self_reset_reserved));
+    __storage_commit_callback();
+  }
+}
+
+
+// Add a message to the end of the ring for its priority level
+uint8_t WiLEDProtoBase::__enqueue(uint16_t inDestination, uint8_t inType, const uint8_t* inPayload, uint8_t inPriority){
+  if(inPriority >= WiLP_PRIORITY_LEVELS){
+    return WiLP_RETURN_OTHER_ERROR;
+  }
+  if(__queue_count[inPriority] == __queue_length){
+    return WiLP_RETURN_QUEUE_FULL;
+  }
+  uint8_t slot = (__queue_head[inPriority] + __queue_count[inPriority]) % __queue_length;
+  WiLPQueuedMessage* message = &__queue[inPriority * __queue_length + slot];
+  message->destination = inDestination;
+  message->type = inType;
+  memcpy(message->payload, inPayload, MAXIMUM_PAYLOAD_LENGTH);
+  __queue_count[inPriority]++;
+  return WiLP_RETURN_SUCCESS;
+}
+
+
+// Note that the output level or groups have changed. A change made while one
+// is already waiting is merged into it.
+void WiLEDProtoBase::__markStatusChanged(){
+  if(__status_pending){
+    __status_suppressed_count++;
+    return;
+  }
+  __status_pending = true;
+  __status_first_change_millis = millis();
+}
+
+
+// Queue a Device Status message once the changes have settled, and the last
+// one is old enough. It goes straight into the queue, so that a message the
+// sketch has staged is left alone.
+void WiLEDProtoBase::__processDeviceStatus(uint32_t inMillis){
+  if(inMillis - __status_first_change_millis < __status_coalesce_millis){
+    return;
+  }
+  if(__status_sent && (inMillis - __status_sent_millis < __status_min_interval_millis)){
+    return;
+  }
+  uint8_t payload[MAXIMUM_PAYLOAD_LENGTH] = {__status_output, __groups[0], __groups[1], __groups[2], __groups[3]};
+  // A dial that was turned and then put back needs no message at all
+  if(__status_sent && memcmp(payload, __status_sent_payload, sizeof(__status_sent_payload)) == 0){
+    __status_pending = false;
+    __status_suppressed_count++;
+    return;
+  }
+  // Try again on the next pass if the queue is full
+  if(__enqueue(0xFFFF, WiLP_Device_Status, payload, WiLP_PRIORITY_NORMAL) != WiLP_RETURN_SUCCESS){
+    return;
+  }
+  memcpy(__status_sent_payload, payload, sizeof(__status_sent_payload));
+  __status_sent = true;
+  __status_sent_millis = inMillis;
+  __status_pending = false;
+  __status_sent_count++;
+}
+
+
+// Keep the attached groups, and set their bits for isInGroup()
+void WiLEDProtoBase::__setGroups(const uint8_t* inGroups){
+  memcpy(__groups, inGroups, WiLP_GROUP_SLOTS);
+  memset(__group_bits, 0, sizeof(__group_bits));
+  for(uint8_t idx = 0; idx < WiLP_GROUP_SLOTS; idx++){
+    __group_bits[__groups[idx] >> 5] |= (1UL << (__groups[idx] & 31));
+  }
+  // Group 0 is "no group", never a member of it
+  __group_bits[0] &= ~1UL;
+}
+
+
+// Write the attached groups to the journal or the storage image, for
+// flushStorage(). The storage image is committed along with everything else.
+uint8_t WiLEDProtoBase::__storeGroups(){
+  if(__journal != 0){
+    return __appendJournal(WiLP_JOURNAL_GROUPS, (__groups[0] << 8) + __groups[1], (__groups[2] << 8) + __groups[3]);
+  }
+  uint16_t words[WiLP_STORAGE_GROUP_WORDS];
+  words[0] = (__groups[0] << 8) + __groups[1];
+  words[1] = (__groups[2] << 8) + __groups[3];
+  words[2] = ~(uint16_t)(words[0] + words[1]);
+  __addToStorage_uint16t(words, __storage_layout.groups, sizeof(words));
+  return WiLP_JOURNAL_SUCCESS;
+}
+
+
+// Read the attached groups from the storage image. Blank storage fails the
+// check, and leaves the device in no groups.
+void WiLEDProtoBase::__restoreGroups(){
+  uint16_t words[WiLP_STORAGE_GROUP_WORDS] = {0};
+  uint8_t groups[WiLP_GROUP_SLOTS] = {0};
+  __restoreFromStorage_uint16t(words, __storage_layout.groups, sizeof(words));
+  if(words[2] == (uint16_t)~(uint16_t)(words[0] + words[1])){
+    groups[0] = (words[0] >> 8);
+    groups[1] = (words[0]);
+    groups[2] = (words[1] >> 8);
+    groups[3] = (words[1]);
+  }
+  __setGroups(groups);
+}
+
+
+// Save the Reset Counter in use to retained RAM, if there is any
+void WiLEDProtoBase::__writeRetained(){
+  if(__retained_write_callback == 0){
+    return;
+  }
+  uint8_t retained[WiLP_RETAINED_LENGTH] = {'W', 'R',
+    (uint8_t)(__self_reset_counter >> 8), (uint8_t)(__self_reset_counter),
+    (uint8_t)(__self_reset_reserved >> 8), (uint8_t)(__self_reset_reserved), 0, 0};
+  uint16_t check = 0;
+  for(uint8_t idx = 0; idx < 6; idx++){
+    check += retained[idx];
+  }
+  check = ~check;
+  retained[6] = (check >> 8);
+  retained[7] = (check);
+  __retained_write_callback(retained, WiLP_RETAINED_LENGTH);
+}
+
+
+// Write a snapshot of the whole state, if the journal is running out of room
+uint8_t WiLEDProtoBase::__compactJournal(){
+  // One record per known address, plus this device's reset counter and
+  // groups. Room is kept for a full table, since several new addresses can
+  // arrive between two flushes.
+  if(!__journal->needsCompaction(__capacity + 2)){
+    return WiLP_JOURNAL_SUCCESS;
+  }
+  return __writeSnapshot();
+}
+
+
+// Write a snapshot of the whole state. A snapshot that can't be finished is
+// never marked complete, so replay still uses the one before it.
+uint8_t WiLEDProtoBase::__writeSnapshot(){
+  uint8_t result = __journal->beginSnapshot();
+  if(result == WiLP_JOURNAL_SUCCESS){
+    result = __journal->append(WiLP_JOURNAL_SELF_RESET, __address, __self_reset_reserved);
+  }
+  if(result == WiLP_JOURNAL_SUCCESS){
+    result = __journal->append(WiLP_JOURNAL_GROUPS, (__groups[0] << 8) + __groups[1], (__groups[2] << 8) + __groups[3]);
+  }
+  for(uint16_t slot = 0; slot < __count_addresses && result == WiLP_JOURNAL_SUCCESS; slot++){
+    result = __journal->append(WiLP_JOURNAL_PEER, __address_array[slot], __reset_counter_array[slot]);
+  }
+  if(result != WiLP_JOURNAL_SUCCESS){
+    return result;
+  }
+  return __journal->endSnapshot();
+}
+
+
+// Add a record to the journal, writing a snapshot first if the record would
+// leave too little room for one
+uint8_t WiLEDProtoBase::__appendJournal(uint8_t inType, uint16_t inAddress, uint16_t inResetCounter){
+  __compactJournal();
+  return __journal->append(inType, inAddress, inResetCounter);
+}
+
+
+// Tell the journal about the addresses whose slots were recycled, before
+// the records for the new ones. If too many were to fit in the queue, a
+// snapshot of the table as it is now replaces all of the pending changes.
+void WiLEDProtoBase::__flushRemovedPeers(){
+  if(__snapshot_due){
+    if(__writeSnapshot() != WiLP_JOURNAL_SUCCESS){
+      return;
+    }
+    __snapshot_due = false;
+    __removed_count = 0;
+    memset(__storage_dirty_slots, 0, (__capacity + 7) / 8);
+    __count_addresses_dirty = false;
+    __groups_dirty = false;
+    __storage_pending = 0;
+    return;
+  }
+  for(uint8_t idx = 0; idx < __removed_count; idx++){
+    if(__appendJournal(WiLP_JOURNAL_PEER_REMOVED, __removed_addresses[idx], 0) != WiLP_JOURNAL_SUCCESS){
+      // A snapshot puts it right next time, whatever order the rest of the
+      // records end up in
+      __snapshot_due = true;
+      return;
+    }
+  }
+  __removed_count = 0;
+}
+
+
+// Check the destination and counters of a message that has a valid header
+uint8_t WiLEDProtoBase::__acceptMessage(const WiLPMessageView& inMessage, uint8_t* outValidation){
+  // Check if we are the destination, before spending any time on counters
+  if(!__isForThisDevice(inMessage)){
+    *outValidation = WiLP_RETURN_NOT_THIS_DEST;
+    return WiLP_RETURN_NOT_THIS_DEST;
+  }
+  *outValidation = __checkAndUpdateMessageCounter(inMessage.getSource(), inMessage.getResetCounter(), inMessage.getMessageCounter());
+  return inMessage.getStatus();
+}
+
+
+// Decide whether a message applies to this device. Addressed messages, such
+// as Attach Groups, must carry this device's own address, broadcast commands
+// that list addresses or groups only apply if this device is one of them.
+// The type table says which kind a message is, so anything else costs one
+// test.
+bool WiLEDProtoBase::__isForThisDevice(const WiLPMessageView& inMessage){
+  uint16_t destination = inMessage.getDestination();
+  uint8_t flags = WiLP_TYPE_TABLE[inMessage.getType()].flags;
+  if((destination != __address) and ((destination != 0xFFFF) or (flags & WiLP_TYPE_ADDRESSED))){
+    return false;
+  }
+  if((flags & (WiLP_TYPE_TO_ADDRESSES | WiLP_TYPE_TO_GROUPS)) == 0){
+    return true;
+  }
+  if(flags & WiLP_TYPE_TO_GROUPS){
+    // Group 0 is never set, so unused group fields never match
+    return isInGroup(inMessage.getPayloadByte(1)) | isInGroup(inMessage.getPayloadByte(2))
+      | isInGroup(inMessage.getPayloadByte(3));
+  }
+  // One to three addresses follow the output level
+  bool match = false;
+  for(uint8_t offset = 1; offset < inMessage.getPayloadLength(); offset += 2){
+    match |= (inMessage.getPayloadWord(offset) == __address);
+  }
+  return match;
+}
+
+
+// Call the handler for a message's type, if the counters were valid
+void WiLEDProtoBase::__dispatchMessage(const WiLPMessageView& inMessage, uint8_t inValidation){
+  if(inValidation != WiLP_RETURN_SUCCESS && inValidation != WiLP_RETURN_ADDED_ADDRESS){
+    return;
+  }
+  #ifdef WiLP_TRACE
+  WiLPTrace::message(WiLP_TRACE_PROCESS, inMessage.getType(), inMessage.getSource(), inMessage.getMessageCounter());
+  #endif
+  // Attach Groups is acted on here, the handler is only told about it
+  if(inMessage.getType() == WiLP_Attach_Groups){
+    attachGroups(inMessage.getPayloadByte(0), inMessage.getPayloadByte(1),
+      inMessage.getPayloadByte(2), inMessage.getPayloadByte(3));
+  }
+  void (*handler)(const WiLPMessageView&) = __type_handlers[WiLP_TYPE_TABLE[inMessage.getType()].handler_slot];
+  if(handler != 0){
+    handler(inMessage);
+  }
+}
+
+
+// Flag a slot of the stored arrays as needing to be written to storage
+void WiLEDProtoBase::__markSlotDirty(uint16_t inSlot){
+  __storage_dirty_slots[inSlot / 8] |= (1 << (inSlot % 8));
+  __markStorageChanged();
+}
+
+
+// Count a change waiting for flushStorage(), and start the commit deadline
+// if it is the first
+void WiLEDProtoBase::__markStorageChanged(){
+  if(__storage_pending == 0){
+    __storage_first_pending_millis = millis();
+  }
+  if(__storage_pending < 0xFFFF){
+    __storage_pending++;
+  }
+}
+
+
+// Hash an address into a starting position in the peer index
+uint16_t WiLEDProtoBase::__hashAddress(uint16_t inAddress){
+  // Fibonacci hashing, take the top bits of the 16-bit product so that
+  // sequential addresses are spread across the whole index
+  uint16_t product = (uint16_t)(inAddress * 40503U);
+  return (product >> (16 - __peer_index_bits)) & __peer_index_mask;
+}
+
+
+// Find the position of an address in __address_array, or WiLP_PEER_INDEX_EMPTY
+uint16_t WiLEDProtoBase::__findPeer(uint16_t inAddress){
+  if(__peer_index_bits == 0){
+    for(uint16_t idx = 0; idx < __count_addresses; idx++){
+      if(__address_array[idx] == inAddress){
+        return idx;
+      }
+    }
+    return WiLP_PEER_INDEX_EMPTY;
+  }
+  uint16_t pos = __hashAddress(inAddress);
+  // Linear probing, the index is never full so this always terminates
+  while(__peer_index[pos] != WiLP_PEER_INDEX_EMPTY){
+    if(__address_array[__peer_index[pos]] == inAddress){
+      return __peer_index[pos];
+    }
+    pos = (pos + 1) & __peer_index_mask;
+  }
+  return WiLP_PEER_INDEX_EMPTY;
+}
+
+
+// Add the address stored at the given slot of __address_array to the index
+void WiLEDProtoBase::__insertPeerIndex(uint16_t inSlot){
+  if(__peer_index_bits == 0){
+    return;
+  }
+  uint16_t pos = __hashAddress(__address_array[inSlot]);
+  while(__peer_index[pos] != WiLP_PEER_INDEX_EMPTY){
+    pos = (pos + 1) & __peer_index_mask;
+  }
+  __peer_index[pos] = inSlot;
+}
+
+
+// Take a slot out of the peer index. Later entries of the same probe run are
+// shifted back, so that no lookup is cut short by the gap.
+void WiLEDProtoBase::__removePeerIndex(uint16_t inSlot){
+  if(__peer_index_bits == 0){
+    return;
+  }
+  uint16_t pos = __hashAddress(__address_array[inSlot]);
+  while(__peer_index[pos] != inSlot){
+    if(__peer_index[pos] == WiLP_PEER_INDEX_EMPTY){
+      return;
+    }
+    pos = (pos + 1) & __peer_index_mask;
+  }
+  uint16_t next = (pos + 1) & __peer_index_mask;
+  while(__peer_index[next] != WiLP_PEER_INDEX_EMPTY){
+    uint16_t home = __hashAddress(__address_array[__peer_index[next]]);
+    // The entry can fill the gap unless its home is after the gap
+    if(((next - home) & __peer_index_mask) >= ((next - pos) & __peer_index_mask)){
+      __peer_index[pos] = __peer_index[next];
+      pos = next;
+    }
+    next = (next + 1) & __peer_index_mask;
+  }
+  __peer_index[pos] = WiLP_PEER_INDEX_EMPTY;
+}
+
+
+// Forget all known addresses, and start with an empty peer index
+void WiLEDProtoBase::__clearPeers(){
+  __count_addresses = 0;
+  memset(__address_array, 0, wilpPeerWords(__capacity, __peer_index_bits) * sizeof(uint16_t));
+  memset(__message_window_array, 0, __capacity * sizeof(uint64_t));
+  memset(__last_heard_array, 0, __capacity * sizeof(uint32_t));
+  memset(__storage_dirty_slots, 0, (__capacity + 7) / 8);
+  __lru_head = WiLP_PEER_INDEX_EMPTY;
+  __lru_tail = WiLP_PEER_INDEX_EMPTY;
+  __rebuildPeerIndex();
+}
+
+
+// Clear the index and add all of the known addresses again
+void WiLEDProtoBase::__rebuildPeerIndex(){
+  if(__peer_index_bits == 0){
+    return;
+  }
+  // The index is written through a pointer, so copy the size out first or it
+  // is read again on every pass
+  uint32_t size = (uint32_t)__peer_index_mask + 1;
+  uint16_t* index = __peer_index;
+  for(uint32_t idx = 0; idx < size; idx++){
+    index[idx] = WiLP_PEER_INDEX_EMPTY;
+  }
+  for(uint16_t idx = 0; idx < __count_addresses; idx++){
+    __insertPeerIndex(idx);
   }
-  // We should never get here, but just in case
-  return WiLP_RETURN_OTHER_ERROR;
 }
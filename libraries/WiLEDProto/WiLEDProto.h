@@ -24,52 +24,396 @@
 #define WILEDPROTO_H
 
 #include <Arduino.h>
+#include "WiLEDJournal.h"
+#include "WiLPChecksum.h"
 
+#ifndef MAXIMUM_STORED_ADDRESSES
 #define MAXIMUM_STORED_ADDRESSES 100
+#endif
 #define MAXIMUM_MESSAGE_LENGTH 25
 #define MAXIMUM_PAYLOAD_LENGTH 8
+// The CRC16 trailer follows straight after the payload
+#define WiLP_CHECKSUM_LENGTH 2
+// Several messages can be packed into one radio frame, up to the RFM69's
+// 60 byte limit. At least 15 bytes each means at most four per frame.
+#define WiLP_MAXIMUM_AGGREGATE_LENGTH 60
+#define WiLP_MAXIMUM_AGGREGATE_MESSAGES 4
+
+// The known addresses are indexed by an open-addressed hash table, so that
+// looking up a source address does not need a scan of __address_array. The
+// index must have at least twice as many entries as there are slots to keep
+// the probe sequences short, and can be at most 2^16 entries. By default it
+// is the smallest power of two that is big enough, WiLP_PEER_INDEX_BITS
+// overrides that for the WiLEDProto typedef.
+#define WiLP_PEER_INDEX_EMPTY 0xFFFF
+// Tables of up to this many addresses have no index (0 index bits) and are
+// scanned instead, which is just as quick when there are only a few. They
+// don't keep the least recently heard list either, eviction scans the last
+// heard times.
+#ifndef WiLP_PEER_SCAN_LIMIT
+#define WiLP_PEER_SCAN_LIMIT 32
+#endif
 
 #define WiLP_Beacon 0x01
 #define WiLP_Device_Status 0x02
+#define WiLP_Set_Individual 0x10
+#define WiLP_Set_Individuals_Two 0x11
+#define WiLP_Set_Individuals_Three 0x12
+#define WiLP_Set_Groups 0x20
+#define WiLP_Attach_Groups 0x30
+#define WiLP_Set_Fade_Timeout 0x40
+#define WiLP_Fade_Timeout_Status 0x41
+#define WiLP_Not_Understood 0xEE
+#define WiLP_Extension_First 0xF0
+#define WiLP_Extension_Last 0xFF
+
+#define WiLP_PAYLOAD_UNKNOWN 0xFF
+
+// Flags in WiLPTypeInfo
+#define WiLP_TYPE_DEFINED 0x01
+#define WiLP_TYPE_BROADCAST 0x02
+#define WiLP_TYPE_ADDRESSED 0x04
+#define WiLP_TYPE_EXTENSION 0x08
+// Broadcast commands that list the addresses, or the groups, they are for
+#define WiLP_TYPE_TO_ADDRESSES 0x10
+#define WiLP_TYPE_TO_GROUPS 0x20
+
+// Each message type has a handler slot, 0 means no handler. The extension
+// types take the last 16 slots.
+#define WiLP_HANDLER_SLOT_EXTENSION 11
+#define WiLP_HANDLER_SLOTS (WiLP_HANDLER_SLOT_EXTENSION + 16)
+
+// What is known about a message type, looked up from a constant table
+// covering all 256 type codes
+struct WiLPTypeInfo {
+  // Fixed payload length, or WiLP_PAYLOAD_UNKNOWN (always for extensions)
+  uint8_t payload_length;
+  uint8_t flags;
+  uint8_t handler_slot;
+};
 
 #define WiLP_RETURN_SUCCESS 0
 #define WiLP_RETURN_INVALID_MSG_CTR 200
 #define WiLP_RETURN_INVALID_RST_CTR 201
 #define WiLP_RETURN_ADDED_ADDRESS 202
 #define WiLP_RETURN_AT_MAX_ADDRESSES 203
+#define WiLP_RETURN_INVALID_CHECKSUM 253
 #define WiLP_RETURN_INVALID_BUFFER 254
 #define WiLP_RETURN_OTHER_ERROR 255
 #define WiLP_RETURN_NOT_THIS_DEST 1
 #define WiLP_RETURN_UNKNOWN_TYPE 2
 #define WiLP_RETURN_NOT_INIT 3
+#define WiLP_RETURN_QUEUE_FULL 4
+
+// Changes to the stored arrays are written behind, see WiLEDProto::process().
+// A commit happens once the oldest change is this old...
+#define WiLP_STORAGE_COMMIT_DEADLINE_MILLIS 10000
+// ...or once no message has been received for this long...
+#define WiLP_STORAGE_COMMIT_IDLE_MILLIS 500
+// ...or once this many changes are waiting, which bounds what a power cut loses
+#define WiLP_STORAGE_MAX_PENDING 16
+
+// Once all slots are in use, a new address takes
+// over the slot of the least recently heard one, if that hasn't been heard
+// for at least this long (7 days by default)
+#ifndef WiLP_PEER_EVICTION_AGE_MILLIS
+#define WiLP_PEER_EVICTION_AGE_MILLIS 604800000UL
+#endif
+// With a flash journal, this many recycled addresses are remembered until
+// the next flush. If more are recycled, a snapshot is written instead.
+#define WiLP_REMOVED_QUEUE_LENGTH 4
+
+// Each known address keeps a window of the most recent message counters it
+// has sent, so messages that arrive late (but not twice) are still accepted
+#define WiLP_REPLAY_WINDOW 64
+
+// When there is retained RAM (see setRetainedCallbacks()), Reset Counter
+// values are reserved in blocks, with one storage write per block. Restarts
+// and Message Counter overflows then move through the block without writing
+// to storage.
+#ifndef WiLP_RESET_EPOCH_BLOCK
+#define WiLP_RESET_EPOCH_BLOCK 16
+#endif
+// Length of the state kept in retained RAM
+#define WiLP_RETAINED_LENGTH 8
+
+// Each device can be attached to this many groups, numbered 1 to 255. Group
+// 0 means the slot is not in use.
+#define WiLP_GROUP_SLOTS 4
+#define WiLP_GROUP_NONE 0
+
+// Device Status changes reported with updateDeviceStatus() are merged for
+// this long before one is queued...
+#define WiLP_STATUS_COALESCE_MILLIS 200
+// ...and at least this long is left between them
+#define WiLP_STATUS_MIN_INTERVAL_MILLIS 1000
+
+// Staged messages can be queued to be sent later. Each priority level has its
+// own ring of this many messages, and higher priorities are always sent first.
+#ifndef WiLP_OUTGOING_QUEUE_LENGTH
+#define WiLP_OUTGOING_QUEUE_LENGTH 8
+#endif
+#define WiLP_PRIORITY_HIGH 0
+#define WiLP_PRIORITY_NORMAL 1
+#define WiLP_PRIORITY_LEVELS 2
+
+// Where each part of the state is kept in the storage image, which depends
+// only on the number of slots
+struct WiLPStorageLayout {
+  // __address_array is stored at location 0
+  uint16_t addresses;
+  // __reset_counter_array is stored immediately following __address_array
+  uint16_t reset_counters;
+  // __count_addresses is then stored after __reset_counter_array
+  uint16_t count;
+  // __self_reset_reserved is then stored after __count_addresses
+  uint16_t self_reset;
+  // The attached groups are then stored after __self_reset_reserved
+  uint16_t groups;
+  // Total bytes used
+  uint16_t length;
+};
+
+// The attached groups are kept as two bytes per word, plus a check word
+#define WiLP_STORAGE_GROUP_WORDS 3
+
+// Bytes used by the storage image, as a 32 bit number so that it can be
+// checked against the 16 bit storage offsets
+constexpr uint32_t wilpStorageLength(uint16_t inCapacity){
+  return (2UL * inCapacity + 2 + WiLP_STORAGE_GROUP_WORDS) * sizeof(uint16_t);
+}
+
+constexpr WiLPStorageLayout wilpStorageLayout(uint16_t inCapacity){
+  return WiLPStorageLayout{
+    0,
+    (uint16_t)(inCapacity * sizeof(uint16_t)),
+    (uint16_t)(2 * inCapacity * sizeof(uint16_t)),
+    (uint16_t)(2 * inCapacity * sizeof(uint16_t) + sizeof(uint16_t)),
+    (uint16_t)(2 * inCapacity * sizeof(uint16_t) + 2 * sizeof(uint16_t)),
+    (uint16_t)wilpStorageLength(inCapacity)};
+}
 
-// Arrange the storage locations of the arrays.
-// __address_array is stored at location 0
-#define STORAGE_ADDRESSES_LOCATION (0)
-// __reset_counter_array is stored immediately following __address_array
-#define STORAGE_RESET_LOCATION (STORAGE_ADDRESSES_LOCATION + sizeof(__address_array))
-// __count_addresses is then stored after __reset_counter_array
-#define STORAGE_COUNT_LOCATION (STORAGE_RESET_LOCATION + sizeof(__reset_counter_array))
-// __self_reset_counter is then stored after __count_addresses
-#define STORAGE_SELF_RESET_LOCATION (STORAGE_COUNT_LOCATION + sizeof(__count_addresses))
-
-class WiLEDProto {
+// The smallest peer index that has at least twice as many entries as
+// inCapacity, or 0 for a table that is small enough to scan
+constexpr uint8_t wilpPeerIndexBits(uint16_t inCapacity, uint8_t inBits = 1){
+  return (inCapacity <= WiLP_PEER_SCAN_LIMIT) ? 0 :
+    ((1UL << inBits) >= 2UL * inCapacity) ? inBits : wilpPeerIndexBits(inCapacity, inBits + 1);
+}
+
+// How many uint16_t the per-slot arrays and the peer index take up together,
+// see WiLEDProtoBase::__address_array. Without an index there are no least
+// recently heard links either.
+constexpr uint32_t wilpPeerWords(uint16_t inCapacity, uint8_t inIndexBits){
+  return (inIndexBits == 0) ? 3UL * inCapacity : 5UL * inCapacity + (1UL << inIndexBits);
+}
+
+// A WiLPMessageView does not copy anything, it reads the fields straight out
+// of the buffer it was made from. The buffer must stay unchanged for as long
+// as the view is used. Views are made by WiLEDProto::parseMessage().
+class WiLPMessageView {
   public:
-    // Initialise with a single argument
-    WiLEDProto(
-      uint16_t inAddress,
-      uint8_t (*inStorageReadCB)(uint16_t),
-      void (*inStorageWriteCB)(uint16_t, uint8_t),
+    // Byte offsets of the header fields, multi-byte fields are big-endian
+    static constexpr uint8_t OFFSET_MAGIC = 0;
+    static constexpr uint8_t OFFSET_SOURCE = 1;
+    static constexpr uint8_t OFFSET_DESTINATION = 3;
+    static constexpr uint8_t OFFSET_RESET_COUNTER = 5;
+    static constexpr uint8_t OFFSET_MESSAGE_COUNTER = 7;
+    static constexpr uint8_t OFFSET_TYPE = 9;
+    static constexpr uint8_t OFFSET_PAYLOAD = 10;
+    static constexpr uint8_t HEADER_LENGTH = 10;
+    static constexpr uint8_t MAGIC = 0xAA;
+
+    WiLPMessageView() {}
+    WiLPMessageView(const uint8_t* inBuffer, uint8_t inLength, uint8_t inPayloadLength, uint8_t inStatus)
+      : __buffer(inBuffer), __length(inLength), __payload_length(inPayloadLength), __status(inStatus) {}
+
+    // WiLP_RETURN_SUCCESS, WiLP_RETURN_UNKNOWN_TYPE (the header can still be
+    // read, but not the payload, and the checksum could not be checked),
+    // WiLP_RETURN_INVALID_CHECKSUM or WiLP_RETURN_INVALID_BUFFER (nothing can)
+    uint8_t getStatus() const { return __status; }
+    bool isValid() const { return __status == WiLP_RETURN_SUCCESS; }
+    bool hasHeader() const { return __status == WiLP_RETURN_SUCCESS || __status == WiLP_RETURN_UNKNOWN_TYPE; }
+
+    uint16_t getSource() const { return __read16(OFFSET_SOURCE); }
+    uint16_t getDestination() const { return __read16(OFFSET_DESTINATION); }
+    uint16_t getResetCounter() const { return __read16(OFFSET_RESET_COUNTER); }
+    uint16_t getMessageCounter() const { return __read16(OFFSET_MESSAGE_COUNTER); }
+    uint8_t getType() const { return __buffer[OFFSET_TYPE]; }
+
+    uint8_t getPayloadLength() const { return __payload_length; }
+    // Header, payload and checksum, any bytes after this are not part of it
+    uint8_t getFrameLength() const {
+      return isValid() ? HEADER_LENGTH + __payload_length + WiLP_CHECKSUM_LENGTH : 0;
+    }
+    const uint8_t* getPayload() const { return &__buffer[OFFSET_PAYLOAD]; }
+    uint8_t getPayloadByte(uint8_t inOffset) const { return __buffer[OFFSET_PAYLOAD + inOffset]; }
+    uint16_t getPayloadWord(uint8_t inOffset) const { return __read16(OFFSET_PAYLOAD + inOffset); }
+    uint32_t getPayloadLong(uint8_t inOffset) const {
+      return ((uint32_t)__read16(OFFSET_PAYLOAD + inOffset) << 16) + __read16(OFFSET_PAYLOAD + inOffset + 2);
+    }
+
+    const uint8_t* getBuffer() const { return __buffer; }
+    uint8_t getLength() const { return __length; }
+
+  protected:
+    const uint8_t* __buffer = 0;
+    uint8_t __length = 0;
+    uint8_t __payload_length = 0;
+    uint8_t __status = WiLP_RETURN_INVALID_BUFFER;
+
+    uint16_t __read16(uint8_t inOffset) const {
+      return (__buffer[inOffset] << 8) + __buffer[inOffset + 1];
+    }
+};
+
+
+// Totals kept by the message counter checks, see WiLEDProto::getCounterStats()
+struct WiLPCounterStats {
+  // Messages accepted in order, and accepted late (out of order)
+  uint32_t accepted;
+  uint32_t late;
+  // Messages rejected because their counter had already been seen, or was
+  // too far behind to be checked
+  uint32_t duplicates;
+  uint32_t too_old;
+  // Counters that left the window without ever being seen
+  uint32_t lost;
+};
+
+// A message waiting in the outgoing queue. The counters and checksum are only
+// added when it is taken out of the queue to be sent.
+struct WiLPQueuedMessage {
+  uint16_t destination;
+  uint8_t type;
+  uint8_t payload[MAXIMUM_PAYLOAD_LENGTH];
+};
+
+// The outcome of one message given to WiLEDProto::processMessages() or
+// WiLEDProto::processFrame()
+struct WiLPBatchResult {
+  // The same codes as returned by processMessage()
+  uint8_t status;
+  uint8_t type;
+  uint16_t source;
+  // Message counter validation, or a copy of status if the counters were
+  // not checked (e.g. the message was for another device)
+  uint8_t validation;
+};
+
+// Everything except the arrays that are sized by the number of known
+// addresses, which are provided by WiLEDProtoCapacity. Use WiLEDProto (or
+// WiLEDProtoCapacity) to make an instance, and WiLEDProtoBase* to refer to
+// one of any capacity.
+class WiLEDProtoBase {
+  public:
+
+    // Use block storage callbacks, with offset, data and length arguments
+    void setStorageBlockCallbacks(
+      void (*inStorageBlockReadCB)(uint16_t, uint8_t*, uint16_t),
+      void (*inStorageBlockWriteCB)(uint16_t, const uint8_t*, uint16_t),
       void (*inStorageCommitCB)(void));
 
+    // Keep this device's Reset Counter in memory that survives a restart
+    // (but not a power cut), e.g. the ESP8266 RTC user memory. The read
+    // callback returns false if it can't read anything. Must be called
+    // before initStorage().
+    void setRetainedCallbacks(
+      bool (*inRetainedReadCB)(uint8_t*, uint16_t),
+      void (*inRetainedWriteCB)(const uint8_t*, uint16_t));
+
     void initStorage();
+    // Keep the stored state in a flash journal instead of the byte callbacks
+    void setJournal(WiLEDJournal* inJournal);
 
+    // Run in each cycle of the main loop, commits storage changes and queues
+    // Device Status messages when due
+    void process();
+    // Write all pending storage changes and commit them now
+    void flushStorage();
+    // Change when pending storage changes are committed
+    void setStorageCommitTiming(uint32_t inDeadlineMillis, uint32_t inIdleMillis, uint16_t inMaxPending);
+    uint16_t getStoragePending();
+
+    // Process a received frame of inLength bytes
+    uint8_t processMessage(const uint8_t* inBuffer, uint8_t inLength);
+    // Process a received frame held in a MAXIMUM_MESSAGE_LENGTH buffer
     uint8_t processMessage(uint8_t* inBuffer);
+    // Validate an already parsed message, and update the last received state
+    uint8_t processMessage(const WiLPMessageView& inMessage);
+
+    // Process a burst of received frames, filling in one result per frame.
+    // Returns the number of frames that were processed successfully.
+    uint16_t processMessages(const uint8_t* const* inFrames, const uint8_t* inLengths, uint16_t inCount, WiLPBatchResult* outResults);
+
+    // Unpack a radio frame holding one or more messages, and process each of
+    // them in turn. Returns the number of results filled in, which stops at
+    // the first message that can't be read, or at inMaxResults.
+    uint8_t processFrame(const uint8_t* inFrame, uint8_t inLength, WiLPBatchResult* outResults, uint8_t inMaxResults);
 
+    // Check a received buffer and return a view of it, without copying it or
+    // changing any state. Many views can be held at once.
+    static WiLPMessageView parseMessage(const uint8_t* inBuffer, uint8_t inLength);
+    // The payload length of a message type, or WiLP_PAYLOAD_UNKNOWN
+    static uint8_t getPayloadLength(uint8_t inType);
+    // The length of a whole frame of a message type, or 0 if it is unknown
+    static uint8_t getFrameLength(uint8_t inType);
+    static WiLPTypeInfo getTypeInfo(uint8_t inType);
+
+    // Set a function to be called with each valid message of a type
+    uint8_t setMessageHandler(uint8_t inType, void (*inHandler)(const WiLPMessageView&));
+    // Define an extension type (0xF0 - 0xFF), its payload length applies to
+    // all WiLEDProto instances since parseMessage() needs to know it
+    uint8_t registerExtensionType(uint8_t inType, uint8_t inPayloadLength, void (*inHandler)(const WiLPMessageView&));
+
+    // Stage a message of any defined type, e.g. one passed on from a host.
+    // inPayload must hold getPayloadLength(inType) bytes. Returns
+    // WiLP_RETURN_UNKNOWN_TYPE if the type has no known payload length.
+    uint8_t sendMessage(uint16_t inDestination, uint8_t inType, const uint8_t* inPayload);
     uint8_t sendMessageBeacon(uint32_t inUptime);
     uint8_t sendMessageDeviceStatus(uint8_t inOutput, uint8_t inGroup1, uint8_t inGroup2, uint8_t inGroup3, uint8_t inGroup4);
+    // Set the output level of one, two or three devices
+    uint8_t sendMessageSetIndividual(uint8_t inOutput, uint16_t inAddress);
+    uint8_t sendMessageSetIndividuals(uint8_t inOutput, uint16_t inAddress1, uint16_t inAddress2);
+    uint8_t sendMessageSetIndividuals(uint8_t inOutput, uint16_t inAddress1, uint16_t inAddress2, uint16_t inAddress3);
+    // Set the output level of every device in up to three groups, unused
+    // groups are WiLP_GROUP_NONE
+    uint8_t sendMessageSetGroups(uint8_t inOutput, uint8_t inGroup1, uint8_t inGroup2, uint8_t inGroup3);
+    // Tell a device which groups it is attached to
+    uint8_t sendMessageAttachGroups(uint16_t inDestination, uint8_t inGroup1, uint8_t inGroup2, uint8_t inGroup3, uint8_t inGroup4);
+
+    // Report a change of output level, e.g. from the LEDOutput status
+    // callback. process() queues a Device Status message (with the attached
+    // groups) once the changes have settled, skipping it if nothing differs
+    // from the last one sent.
+    void updateDeviceStatus(uint8_t inOutput);
+    // Change how long changes are merged for, and the least time between two
+    // Device Status messages
+    void setDeviceStatusTiming(uint32_t inCoalesceMillis, uint32_t inMinIntervalMillis);
+    // How many Device Status messages have been queued, and how many changes
+    // were merged into them or dropped as unchanged
+    uint32_t getDeviceStatusSentCount();
+    uint32_t getDeviceStatusSuppressedCount();
 
-    void copyToBuffer(uint8_t * inBuffer);
+    // Finish the outgoing message and copy it into inBuffer, which must
+    // hold MAXIMUM_MESSAGE_LENGTH bytes. Returns the length of the frame,
+    // which is all that needs to be sent, or 0 if no message was set.
+    uint8_t copyToBuffer(uint8_t * inBuffer);
+    // Add the outgoing message to the end of a radio frame that already
+    // holds inFrameLength bytes. Returns the new length of the frame. If the
+    // message doesn't fit, the length is unchanged and the message is kept.
+    uint8_t appendToFrame(uint8_t* ioFrame, uint8_t inFrameLength, uint8_t inFrameCapacity);
+
+    // Move the outgoing message into the queue at a priority level, so that
+    // another can be staged straight away
+    uint8_t queueMessage(uint8_t inPriority);
+    uint8_t getQueuedCount();
+    // Take the next queued message, give it counters and a checksum, and copy
+    // it into outBuffer. Returns the length of the frame, or 0 if the queue
+    // is empty.
+    uint8_t copyQueuedToBuffer(uint8_t* outBuffer);
+    // Add as many queued messages as will fit to the end of a radio frame.
+    // Returns the new length of the frame.
+    uint8_t appendQueuedToFrame(uint8_t* ioFrame, uint8_t inFrameLength, uint8_t inFrameCapacity);
 
     uint8_t getLastReceivedType();
     uint16_t getLastReceivedSource();
@@ -78,10 +422,64 @@ class WiLEDProto {
     uint16_t getLastReceivedMessageCounter();
     uint8_t getLastReceivedMessageCounterValidation();
 
+    WiLPCounterStats getCounterStats();
+    void clearCounterStats();
+
+    // Change how long a known address must have been quiet before its slot
+    // can be given to a new one, 0 always recycles the least recently heard
+    void setPeerEvictionAge(uint32_t inMillis);
+    uint32_t getPeerEvictionCount();
+
+    // How many addresses can be known at once
+    uint16_t getCapacity();
+
+    // Attach this device to up to WiLP_GROUP_SLOTS groups, replacing the
+    // previous ones, and save them to storage with the next flush. A
+    // received Attach Groups message does the same.
+    void attachGroups(uint8_t inGroup1, uint8_t inGroup2, uint8_t inGroup3, uint8_t inGroup4);
+    uint8_t getGroup(uint8_t inSlot);
+    bool isInGroup(uint8_t inGroup);
+
   protected:
+    // inPeerWords holds wilpPeerWords(inCapacity, inPeerIndexBits) entries,
+    // inQueue WiLP_PRIORITY_LEVELS * inQueueLength, the other arrays one
+    // entry (or bit, for inDirtySlots) per slot. None of them are touched
+    // until __clearPeers() is called.
+    WiLEDProtoBase(
+      uint16_t inAddress,
+      uint8_t (*inStorageReadCB)(uint16_t),
+      void (*inStorageWriteCB)(uint16_t, uint8_t),
+      void (*inStorageCommitCB)(void),
+      uint16_t inCapacity,
+      uint8_t inPeerIndexBits,
+      const WiLPStorageLayout& inStorageLayout,
+      uint16_t* inPeerWords,
+      uint64_t* inMessageWindows,
+      uint32_t* inLastHeard,
+      uint8_t* inDirtySlots,
+      WiLPQueuedMessage* inQueue,
+      uint8_t inQueueLength);
+    WiLEDProtoBase(const WiLEDProtoBase&) = delete;
+    WiLEDProtoBase& operator=(const WiLEDProtoBase&) = delete;
+    void __clearPeers();
+
+    const uint16_t __capacity;
+    const uint8_t __peer_index_bits;
+    const uint16_t __peer_index_mask;
+    const WiLPStorageLayout __storage_layout;
+
     uint16_t __address = 0;
     uint16_t __self_reset_counter = 0;
     uint16_t __self_message_counter = 0;
+    // The last Reset Counter reserved in storage, __self_reset_counter can
+    // go up to this without writing to storage
+    uint16_t __self_reset_reserved = 0;
+    bool (*__retained_read_callback)(uint8_t*, uint16_t) = 0;
+    void (*__retained_write_callback)(const uint8_t*, uint16_t) = 0;
+    void __startResetEpoch();
+    void __nextResetEpoch();
+    void __storeResetReserved();
+    void __writeRetained();
 
     uint8_t __last_received_type = 0x00;
     uint16_t __last_received_source = 0;
@@ -90,32 +488,202 @@ class WiLEDProto {
     uint16_t __last_received_message_counter = 0;
     uint8_t __last_received_message_counter_validation = 0;
     uint8_t __last_received_payload_length = 0;
-    uint8_t __last_received_payload[MAXIMUM_PAYLOAD_LENGTH];
 
     uint8_t __outgoing_message_buffer[MAXIMUM_MESSAGE_LENGTH];
 
+    // Outgoing queue, one ring of __queue_length per priority level
+    WiLPQueuedMessage* __queue;
+    const uint8_t __queue_length;
+    uint8_t __queue_head[WiLP_PRIORITY_LEVELS] = {0};
+    uint8_t __queue_count[WiLP_PRIORITY_LEVELS] = {0};
+    WiLPQueuedMessage* __peekQueue();
+    void __popQueue();
+    uint8_t __enqueue(uint16_t inDestination, uint8_t inType, const uint8_t* inPayload, uint8_t inPriority);
+
+    // Device Status coalescing, see updateDeviceStatus()
+    bool __status_pending = false;
+    bool __status_sent = false;
+    uint8_t __status_output = 0;
+    uint8_t __status_sent_payload[5] = {0};
+    uint32_t __status_first_change_millis = 0;
+    uint32_t __status_sent_millis = 0;
+    uint32_t __status_coalesce_millis = WiLP_STATUS_COALESCE_MILLIS;
+    uint32_t __status_min_interval_millis = WiLP_STATUS_MIN_INTERVAL_MILLIS;
+    uint32_t __status_sent_count = 0;
+    uint32_t __status_suppressed_count = 0;
+    void __markStatusChanged();
+    void __processDeviceStatus(uint32_t inMillis);
+
+    void __sealMessage(uint8_t* ioBuffer, uint8_t inFrameLength);
     void __setTypeByte(uint8_t inType);
     void __setDestinationByte(uint16_t inDestination);
     void __setPayloadByte(uint8_t inPayloadOffset, uint8_t inPayloadValue);
 
+    uint8_t __acceptMessage(const WiLPMessageView& inMessage, uint8_t* outValidation);
+    bool __isForThisDevice(const WiLPMessageView& inMessage);
+    void __dispatchMessage(const WiLPMessageView& inMessage, uint8_t inValidation);
+
+    // Handlers, indexed by WiLPTypeInfo::handler_slot
+    void (*__type_handlers[WiLP_HANDLER_SLOTS])(const WiLPMessageView&) = {0};
+    static uint8_t __extension_payload_lengths[16];
     uint8_t __checkAndUpdateMessageCounter(uint16_t inAddress, uint16_t inResetCounter, uint16_t inMessageCounter);
 
+    // Peer index, maps a hashed address to a position in __address_array
+    uint16_t* __peer_index;
+    uint16_t __hashAddress(uint16_t inAddress);
+    uint16_t __findPeer(uint16_t inAddress);
+    void __insertPeerIndex(uint16_t inSlot);
+    void __removePeerIndex(uint16_t inSlot);
+    void __rebuildPeerIndex();
+
+    // Known addresses in the order they were last heard, as a doubly linked
+    // list through the slots, most recent at the head. Not kept without an
+    // index.
+    uint16_t* __lru_previous;
+    uint16_t* __lru_next;
+    uint16_t __lru_head = WiLP_PEER_INDEX_EMPTY;
+    uint16_t __lru_tail = WiLP_PEER_INDEX_EMPTY;
+    uint32_t* __last_heard_array;
+    uint32_t __peer_eviction_age = WiLP_PEER_EVICTION_AGE_MILLIS;
+    uint32_t __peer_evictions = 0;
+    void __linkPeer(uint16_t inSlot);
+    void __unlinkPeer(uint16_t inSlot);
+    void __touchPeer(uint16_t inSlot);
+    void __resetPeerAges();
+    uint16_t __evictPeer();
+    void __addPeer(uint16_t inSlot, uint16_t inAddress, uint16_t inResetCounter, uint16_t inMessageCounter);
+    void __removePeer(uint16_t inAddress);
+
     // Store callback functions for storage read and write (usually EEPROM)
     void (*__storage_write_callback)(uint16_t, uint8_t) = 0;
     uint8_t (*__storage_read_callback)(uint16_t) = 0;
     void (*__storage_commit_callback)(void) = 0;
+    void (*__storage_block_read_callback)(uint16_t, uint8_t*, uint16_t) = 0;
+    void (*__storage_block_write_callback)(uint16_t, const uint8_t*, uint16_t) = 0;
 
     // Store a count of how many unique addresses we have seen
     uint16_t __count_addresses = 0;
 
+    // Attached groups, and the same as one bit per group number
+    uint8_t __groups[WiLP_GROUP_SLOTS] = {0};
+    uint32_t __group_bits[8] = {0};
+    // Set when the attached groups need to be written
+    bool __groups_dirty = false;
+    void __setGroups(const uint8_t* inGroups);
+    uint8_t __storeGroups();
+    void __restoreGroups();
+
     uint8_t __restoreFromStorage_uint16t(uint16_t* outArray, uint16_t inStorageOffset, uint16_t inLength);
     uint8_t __addToStorage_uint16t(uint16_t* inArray, uint16_t inStorageOffset, uint16_t inLength);
 
-    // Store (linked) arrays to track the other nodes' states, initialise to zero
-    uint16_t __address_array[MAXIMUM_STORED_ADDRESSES] = {0};
-    uint16_t __reset_counter_array[MAXIMUM_STORED_ADDRESSES] = {0};
-    uint16_t __message_counter_array[MAXIMUM_STORED_ADDRESSES] = {0};
+    // Write-behind state, one dirty bit per slot of the stored arrays
+    uint8_t* __storage_dirty_slots;
+    // Set when __count_addresses needs to be written
+    bool __count_addresses_dirty = false;
+    uint16_t __storage_pending = 0;
+    uint32_t __storage_first_pending_millis = 0;
+    uint32_t __last_received_millis = 0;
+    uint32_t __storage_commit_deadline_millis = WiLP_STORAGE_COMMIT_DEADLINE_MILLIS;
+    uint32_t __storage_commit_idle_millis = WiLP_STORAGE_COMMIT_IDLE_MILLIS;
+    uint16_t __storage_max_pending = WiLP_STORAGE_MAX_PENDING;
+    void __markSlotDirty(uint16_t inSlot);
+    void __markStorageChanged();
+
+    // Optional flash journal, replaces the fixed storage image when set
+    WiLEDJournal* __journal = 0;
+    bool __restoreFromJournal();
+    uint8_t __compactJournal();
+    uint8_t __writeSnapshot();
+    uint8_t __appendJournal(uint8_t inType, uint16_t inAddress, uint16_t inResetCounter);
+    // Addresses whose slots were recycled since the last flush, which the
+    // journal must be told about
+    uint16_t __removed_addresses[WiLP_REMOVED_QUEUE_LENGTH];
+    uint8_t __removed_count = 0;
+    bool __snapshot_due = false;
+    void __flushRemovedPeers();
+
+    // Store (linked) arrays to track the other nodes' states. They are laid
+    // out one after the other in the peer words, starting with the
+    // addresses, so a scan of the addresses reads one contiguous run.
+    uint16_t* __address_array;
+    uint16_t* __reset_counter_array;
+    uint16_t* __message_counter_array;
+    // Bit n is set once the counter n below __message_counter_array has been
+    // seen. All zeros means nothing is known yet, e.g. after a restart.
+    uint64_t* __message_window_array;
+    WiLPCounterStats __counter_stats = {0, 0, 0, 0, 0};
+    uint8_t __checkMessageWindow(uint16_t inSlot, uint16_t inMessageCounter);
+    uint64_t __firstMessageWindow(uint16_t inMessageCounter);
+};
+
+
+// A WiLEDProto that can know up to Capacity other addresses, and queue
+// QueueLength messages of each priority. The storage image is laid out for
+// StorageSlots addresses, so a device that used to keep more can move to a
+// smaller table and still find its Reset Counter. Only the first Capacity
+// slots are used. The Reset and Message Counters stay 16 bits wide whatever
+// the capacity, since that is what goes over the air.
+template <uint16_t Capacity, uint8_t PeerIndexBits = wilpPeerIndexBits(Capacity),
+  uint8_t QueueLength = WiLP_OUTGOING_QUEUE_LENGTH, uint16_t StorageSlots = Capacity>
+class WiLEDProtoCapacity : public WiLEDProtoBase {
+  static_assert(Capacity > 0 && Capacity < WiLP_PEER_INDEX_EMPTY, "Capacity must be between 1 and 65534");
+  static_assert(PeerIndexBits <= 16, "The peer index can have at most 2^16 entries");
+  static_assert(PeerIndexBits == 0 || (1UL << PeerIndexBits) >= 2UL * Capacity,
+    "The peer index must have at least twice Capacity entries");
+  static_assert(QueueLength > 0, "The outgoing queue must hold at least one message");
+  static_assert(StorageSlots >= Capacity, "The storage image must have a slot for every address");
+  static_assert(wilpStorageLength(StorageSlots) <= 0xFFFF, "The storage image must fit in 64k");
+
+  public:
+    static constexpr uint16_t CAPACITY = Capacity;
+    // Bytes of storage used by the storage image (not the journal)
+    static constexpr uint16_t STORAGE_LENGTH = wilpStorageLayout(StorageSlots).length;
+
+    WiLEDProtoCapacity(
+      uint16_t inAddress,
+      uint8_t (*inStorageReadCB)(uint16_t),
+      void (*inStorageWriteCB)(uint16_t, uint8_t),
+      void (*inStorageCommitCB)(void))
+      : WiLEDProtoBase(inAddress, inStorageReadCB, inStorageWriteCB, inStorageCommitCB,
+        Capacity, PeerIndexBits, wilpStorageLayout(StorageSlots),
+        __peer_words, __peer_windows, __peer_last_heard, __peer_dirty_slots,
+        __queued_messages, QueueLength){
+      __clearPeers();
+    }
+
+  protected:
+    uint16_t __peer_words[wilpPeerWords(Capacity, PeerIndexBits)];
+    uint64_t __peer_windows[Capacity];
+    uint32_t __peer_last_heard[Capacity];
+    uint8_t __peer_dirty_slots[(Capacity + 7) / 8];
+    WiLPQueuedMessage __queued_messages[WiLP_PRIORITY_LEVELS * QueueLength];
 };
 
+template <uint16_t Capacity, uint8_t PeerIndexBits, uint8_t QueueLength, uint16_t StorageSlots>
+constexpr uint16_t WiLEDProtoCapacity<Capacity, PeerIndexBits, QueueLength, StorageSlots>::CAPACITY;
+template <uint16_t Capacity, uint8_t PeerIndexBits, uint8_t QueueLength, uint16_t StorageSlots>
+constexpr uint16_t WiLEDProtoCapacity<Capacity, PeerIndexBits, QueueLength, StorageSlots>::STORAGE_LENGTH;
+
+// The capacity used by the sketches, set with build flags
+#ifdef WiLP_PEER_INDEX_BITS
+typedef WiLEDProtoCapacity<MAXIMUM_STORED_ADDRESSES, WiLP_PEER_INDEX_BITS> WiLEDProto;
+#else
+typedef WiLEDProtoCapacity<MAXIMUM_STORED_ADDRESSES> WiLEDProto;
+#endif
+
+// The capacity used by the lamp sketch. A lamp only hears the coordinator,
+// its remotes and a few neighbours, and sends most messages straight away.
+// Lamps used to keep 100 addresses, so their EEPROM keeps that layout and
+// the Reset Counter reserved before an upgrade is still found.
+#ifndef WiLP_LAMP_STORED_ADDRESSES
+#define WiLP_LAMP_STORED_ADDRESSES 16
+#endif
+#ifndef WiLP_LAMP_QUEUE_LENGTH
+#define WiLP_LAMP_QUEUE_LENGTH 2
+#endif
+#define WiLP_LAMP_STORAGE_SLOTS 100
+typedef WiLEDProtoCapacity<WiLP_LAMP_STORED_ADDRESSES, wilpPeerIndexBits(WiLP_LAMP_STORED_ADDRESSES),
+  WiLP_LAMP_QUEUE_LENGTH, WiLP_LAMP_STORAGE_SLOTS> WiLEDProtoLamp;
+
 
 #endif
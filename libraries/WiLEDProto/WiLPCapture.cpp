@@ -0,0 +1,102 @@
+/*
+* WiLPCapture class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* A binary capture format for received radio frames, so that field
+* traffic can be recorded and replayed later.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "WiLPCapture.h"
+
+/************ WiLPCapture ********************************/
+
+uint8_t WiLPCapture::writeHeader(uint8_t* outBuffer){
+  outBuffer[0] = 'W';
+  outBuffer[1] = 'L';
+  outBuffer[2] = 'P';
+  outBuffer[3] = 'C';
+  outBuffer[4] = WiLP_CAPTURE_VERSION;
+  outBuffer[5] = 0;
+  outBuffer[6] = 0;
+  outBuffer[7] = 0;
+  return WiLP_CAPTURE_HEADER_LENGTH;
+}
+
+
+uint8_t WiLPCapture::writeRecord(uint8_t* outBuffer, uint32_t inMicros, int8_t inRSSI, const uint8_t* inFrame, uint8_t inLength){
+  if(inLength > WiLP_CAPTURE_MAXIMUM_FRAME){
+    return 0;
+  }
+  outBuffer[0] = (inMicros >> 24);
+  outBuffer[1] = (inMicros >> 16);
+  outBuffer[2] = (inMicros >> 8);
+  outBuffer[3] = (inMicros);
+  outBuffer[4] = (uint8_t)inRSSI;
+  outBuffer[5] = inLength;
+  memcpy(&outBuffer[WiLP_CAPTURE_RECORD_HEADER_LENGTH], inFrame, inLength);
+  return WiLP_CAPTURE_RECORD_HEADER_LENGTH + inLength;
+}
+
+/************ WiLPCaptureReader **************************/
+
+WiLPCaptureReader::WiLPCaptureReader(const uint8_t* inData, uint32_t inLength){
+  __data = inData;
+  __length = inLength;
+  __valid = (inData != 0) && (inLength >= WiLP_CAPTURE_HEADER_LENGTH)
+    && (inData[0] == 'W') && (inData[1] == 'L') && (inData[2] == 'P') && (inData[3] == 'C')
+    && (inData[4] == WiLP_CAPTURE_VERSION);
+  __offset = WiLP_CAPTURE_HEADER_LENGTH;
+}
+
+
+bool WiLPCaptureReader::isValid(){
+  return __valid;
+}
+
+
+bool WiLPCaptureReader::next(WiLPCaptureRecord* outRecord){
+  if(!__valid || __offset >= __length){
+    return false;
+  }
+  if(__length - __offset < WiLP_CAPTURE_RECORD_HEADER_LENGTH){
+    __truncated = true;
+    return false;
+  }
+  const uint8_t* record = &__data[__offset];
+  uint8_t length = record[5];
+  if(__length - __offset - WiLP_CAPTURE_RECORD_HEADER_LENGTH < length){
+    __truncated = true;
+    return false;
+  }
+  uint32_t stamp = ((uint32_t)record[0] << 24) + ((uint32_t)record[1] << 16) + ((uint32_t)record[2] << 8) + record[3];
+  // The records are in the order they were received, so a smaller stamp
+  // means the counter has wrapped
+  if(stamp < __last_stamp){
+    __wraps++;
+  }
+  __last_stamp = stamp;
+  outRecord->micros = (__wraps << 32) + stamp;
+  outRecord->rssi = (int8_t)record[4];
+  outRecord->length = length;
+  outRecord->frame = &record[WiLP_CAPTURE_RECORD_HEADER_LENGTH];
+  __offset += WiLP_CAPTURE_RECORD_HEADER_LENGTH + length;
+  return true;
+}
+
+
+bool WiLPCaptureReader::isTruncated(){
+  return __truncated;
+}
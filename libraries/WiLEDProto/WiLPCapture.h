@@ -0,0 +1,87 @@
+/*
+* WiLPCapture class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* A binary capture format for received radio frames, so that field
+* traffic can be recorded and replayed later.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef WILPCAPTURE_H
+#define WILPCAPTURE_H
+
+#include <Arduino.h>
+
+// A capture starts with an 8 byte header: "WLPC", the format version, then
+// three reserved bytes. It is followed by one record per received frame.
+#define WiLP_CAPTURE_HEADER_LENGTH 8
+#define WiLP_CAPTURE_VERSION 1
+// Each record is a 32 bit microsecond timestamp, the RSSI in dBm (signed),
+// the frame length, then the frame itself. Multi-byte fields are big-endian,
+// as in the protocol.
+#define WiLP_CAPTURE_RECORD_HEADER_LENGTH 6
+// The longest frame the RFM69 can receive
+#define WiLP_CAPTURE_MAXIMUM_FRAME 64
+#define WiLP_CAPTURE_MAXIMUM_RECORD (WiLP_CAPTURE_RECORD_HEADER_LENGTH + WiLP_CAPTURE_MAXIMUM_FRAME)
+
+// One record, as read back by WiLPCaptureReader. The frame points into the
+// reader's buffer.
+struct WiLPCaptureRecord {
+  // Microseconds since the capture started. The stored timestamp wraps
+  // every 71 minutes, the reader unwraps it.
+  uint64_t micros;
+  int8_t rssi;
+  uint8_t length;
+  const uint8_t* frame;
+};
+
+class WiLPCapture {
+  public:
+    // Write the capture header into outBuffer, which must hold
+    // WiLP_CAPTURE_HEADER_LENGTH bytes. Returns the number of bytes.
+    static uint8_t writeHeader(uint8_t* outBuffer);
+    // Write one record into outBuffer, which must hold
+    // WiLP_CAPTURE_RECORD_HEADER_LENGTH + inLength bytes. Returns the
+    // number of bytes, or 0 if the frame is too long.
+    static uint8_t writeRecord(uint8_t* outBuffer, uint32_t inMicros, int8_t inRSSI, const uint8_t* inFrame, uint8_t inLength);
+};
+
+// Reads the records of a capture held in memory, without copying them
+class WiLPCaptureReader {
+  public:
+    WiLPCaptureReader(const uint8_t* inData, uint32_t inLength);
+
+    // False if the data doesn't start with a capture header of a version
+    // this reader understands
+    bool isValid();
+    // Fill in the next record, returns false at the end of the capture, or
+    // if the last record was cut short
+    bool next(WiLPCaptureRecord* outRecord);
+    // True if the capture ended part way through a record
+    bool isTruncated();
+
+  protected:
+    const uint8_t* __data = 0;
+    uint32_t __length = 0;
+    uint32_t __offset = 0;
+    bool __valid = false;
+    bool __truncated = false;
+    uint32_t __last_stamp = 0;
+    uint64_t __wraps = 0;
+};
+
+
+#endif
@@ -0,0 +1,119 @@
+/*
+* WiLPChecksum class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* CRC16 checksum kernels for WiLP messages.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "WiLPChecksum.h"
+
+// Shift a CRC through inBits zero bits
+static constexpr uint16_t crcShift(uint16_t inCRC, uint8_t inBits){
+  return (inBits == 0) ? inCRC :
+    crcShift((inCRC & 0x8000) ? (uint16_t)((inCRC << 1) ^ WiLP_CRC16_POLYNOMIAL) : (uint16_t)(inCRC << 1), inBits - 1);
+}
+
+// Entry of table inSlice: the CRC of byte inByte followed by inSlice zero bytes
+static constexpr uint16_t crcEntry(uint8_t inSlice, uint16_t inByte){
+  return (inSlice == 0) ? crcShift(inByte << 8, 8) :
+    (uint16_t)((crcEntry(inSlice - 1, inByte) << 8) ^ crcShift((crcEntry(inSlice - 1, inByte) >> 8) << 8, 8));
+}
+
+#define WiLP_CRC_ROW4(s, n) crcEntry(s, n), crcEntry(s, n + 1), crcEntry(s, n + 2), crcEntry(s, n + 3)
+#define WiLP_CRC_ROW16(s, n) WiLP_CRC_ROW4(s, n), WiLP_CRC_ROW4(s, n + 4), WiLP_CRC_ROW4(s, n + 8), WiLP_CRC_ROW4(s, n + 12)
+#define WiLP_CRC_ROW64(s, n) WiLP_CRC_ROW16(s, n), WiLP_CRC_ROW16(s, n + 16), WiLP_CRC_ROW16(s, n + 32), WiLP_CRC_ROW16(s, n + 48)
+#define WiLP_CRC_TABLE(s) { WiLP_CRC_ROW64(s, 0), WiLP_CRC_ROW64(s, 64), WiLP_CRC_ROW64(s, 128), WiLP_CRC_ROW64(s, 192) }
+
+// The ESP8266 copies constant arrays into its small DRAM unless they are
+// kept in flash, which is then read a word at a time
+#ifdef ESP8266
+#define WiLP_CRC_STORAGE PROGMEM
+#define WiLP_CRC_READ(entry) pgm_read_word(&(entry))
+#else
+#define WiLP_CRC_STORAGE
+#define WiLP_CRC_READ(entry) (entry)
+#endif
+
+static constexpr uint16_t CRC_TABLE[256] WiLP_CRC_STORAGE = WiLP_CRC_TABLE(0);
+
+static_assert(CRC_TABLE[1] == WiLP_CRC16_POLYNOMIAL, "CRC table is wrong");
+
+#ifdef WiLP_CRC16_SLICED
+static constexpr uint16_t CRC_SLICES[8][256] = {
+  WiLP_CRC_TABLE(0), WiLP_CRC_TABLE(1), WiLP_CRC_TABLE(2), WiLP_CRC_TABLE(3),
+  WiLP_CRC_TABLE(4), WiLP_CRC_TABLE(5), WiLP_CRC_TABLE(6), WiLP_CRC_TABLE(7)
+};
+#endif
+
+
+uint16_t WiLPChecksum::crc16(const uint8_t* inData, uint16_t inLength){
+  #ifdef WiLP_CRC16_SLICED
+  return crc16Sliced(inData, inLength);
+  #else
+  return crc16Table(inData, inLength);
+  #endif
+}
+
+
+uint16_t WiLPChecksum::crc16Bitwise(const uint8_t* inData, uint16_t inLength){
+  uint16_t crc = WiLP_CRC16_INITIAL;
+  for(uint16_t idx = 0; idx < inLength; idx++){
+    crc ^= (inData[idx] << 8);
+    for(uint8_t bit = 0; bit < 8; bit++){
+      if(crc & 0x8000){
+        crc = (crc << 1) ^ WiLP_CRC16_POLYNOMIAL;
+      } else {
+        crc = (crc << 1);
+      }
+    }
+  }
+  return crc;
+}
+
+
+uint16_t WiLPChecksum::crc16Table(const uint8_t* inData, uint16_t inLength){
+  uint16_t crc = WiLP_CRC16_INITIAL;
+  for(uint16_t idx = 0; idx < inLength; idx++){
+    crc = (crc << 8) ^ WiLP_CRC_READ(CRC_TABLE[(crc >> 8) ^ inData[idx]]);
+  }
+  return crc;
+}
+
+
+#ifdef WiLP_CRC16_SLICED
+uint16_t WiLPChecksum::crc16Sliced(const uint8_t* inData, uint16_t inLength){
+  uint16_t crc = WiLP_CRC16_INITIAL;
+  // The CRC lines up with the first two bytes of each block, the other six
+  // bytes only need their own contribution, shifted by their distance to
+  // the end of the block
+  while(inLength >= 8){
+    uint16_t top = crc ^ ((inData[0] << 8) | inData[1]);
+    crc = CRC_SLICES[7][top >> 8] ^ CRC_SLICES[6][top & 0xFF]
+      ^ CRC_SLICES[5][inData[2]] ^ CRC_SLICES[4][inData[3]]
+      ^ CRC_SLICES[3][inData[4]] ^ CRC_SLICES[2][inData[5]]
+      ^ CRC_SLICES[1][inData[6]] ^ CRC_SLICES[0][inData[7]];
+    inData += 8;
+    inLength -= 8;
+  }
+  // Finish off the last few bytes one at a time
+  while(inLength > 0){
+    crc = (crc << 8) ^ CRC_SLICES[0][(crc >> 8) ^ *inData];
+    inData++;
+    inLength--;
+  }
+  return crc;
+}
+#endif
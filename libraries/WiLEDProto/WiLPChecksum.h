@@ -0,0 +1,54 @@
+/*
+* WiLPChecksum class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* CRC16 checksum kernels for WiLP messages.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef WILPCHECKSUM_H
+#define WILPCHECKSUM_H
+
+#include <Arduino.h>
+
+// CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF, no bit
+// reflection. The check value of the ASCII string "123456789" is 0x29B1.
+#define WiLP_CRC16_POLYNOMIAL 0x1021
+#define WiLP_CRC16_INITIAL 0xFFFF
+
+// The sliced kernel needs 4 KB of tables, so it is only built for the
+// x86 coordinator and host builds
+#if defined(__x86_64__) || defined(__i386__)
+#define WiLP_CRC16_SLICED 1
+#endif
+
+class WiLPChecksum {
+  public:
+    // The fastest kernel available on this target
+    static uint16_t crc16(const uint8_t* inData, uint16_t inLength);
+
+    // One bit at a time, no tables. Used as the reference.
+    static uint16_t crc16Bitwise(const uint8_t* inData, uint16_t inLength);
+    // One byte at a time, with a 512 byte table. Used on the MCUs.
+    static uint16_t crc16Table(const uint8_t* inData, uint16_t inLength);
+    #ifdef WiLP_CRC16_SLICED
+    // Eight bytes at a time, with eight tables (slicing-by-8)
+    static uint16_t crc16Sliced(const uint8_t* inData, uint16_t inLength);
+    #endif
+};
+
+
+#endif
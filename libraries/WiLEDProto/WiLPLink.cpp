@@ -0,0 +1,176 @@
+/*
+* WiLPLink class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* A batched binary link between a coordinator and its host computer, for
+* received radio frames one way and messages to send the other.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "WiLPLink.h"
+
+/************ WiLPLinkBatch ******************************/
+
+WiLPLinkBatch::WiLPLinkBatch(){
+  __packet[0] = WiLP_LINK_FRAMES;
+  __packet[1] = 0;
+}
+
+
+bool WiLPLinkBatch::add(uint32_t inMicros, int8_t inRSSI, const uint8_t* inValidations, uint8_t inCount, const uint8_t* inFrame, uint8_t inLength){
+  if(__length + WiLP_LINK_FRAME_HEADER_LENGTH + inCount + inLength > WiLP_LINK_MAXIMUM_PACKET || __packet[1] == 0xFF){
+    return false;
+  }
+  if(__packet[1] == 0){
+    __start_millis = millis();
+  }
+  uint8_t* entry = &__packet[__length];
+  entry[0] = (inMicros >> 24);
+  entry[1] = (inMicros >> 16);
+  entry[2] = (inMicros >> 8);
+  entry[3] = (inMicros);
+  entry[4] = (uint8_t)inRSSI;
+  entry[5] = inCount;
+  entry[6] = inLength;
+  memcpy(&entry[WiLP_LINK_FRAME_HEADER_LENGTH], inValidations, inCount);
+  memcpy(&entry[WiLP_LINK_FRAME_HEADER_LENGTH + inCount], inFrame, inLength);
+  __length += WiLP_LINK_FRAME_HEADER_LENGTH + inCount + inLength;
+  __packet[1]++;
+  return true;
+}
+
+
+uint8_t WiLPLinkBatch::getFrameCount(){
+  return __packet[1];
+}
+
+
+uint32_t WiLPLinkBatch::getStartMillis(){
+  return __start_millis;
+}
+
+
+uint8_t WiLPLinkBatch::encode(uint8_t* outBuffer){
+  uint8_t length = WiLPSerialFrame::encode(__packet, __length, outBuffer);
+  __packet[1] = 0;
+  __length = WiLP_LINK_BATCH_HEADER_LENGTH;
+  return length;
+}
+
+/************ WiLPLink ***********************************/
+
+bool WiLPLink::nextFrame(const uint8_t* inPacket, uint8_t inLength, uint8_t* ioOffset, WiLPSerialRecord* outRecord){
+  if(inLength < WiLP_LINK_BATCH_HEADER_LENGTH || inPacket[0] != WiLP_LINK_FRAMES){
+    return false;
+  }
+  uint8_t offset = *ioOffset;
+  if(offset < WiLP_LINK_BATCH_HEADER_LENGTH){
+    offset = WiLP_LINK_BATCH_HEADER_LENGTH;
+  }
+  if(inLength - offset < WiLP_LINK_FRAME_HEADER_LENGTH){
+    return false;
+  }
+  const uint8_t* entry = &inPacket[offset];
+  uint8_t count = entry[5];
+  uint8_t length = entry[6];
+  if(inLength - offset - WiLP_LINK_FRAME_HEADER_LENGTH < count + length){
+    return false;
+  }
+  outRecord->type = WiLP_SERIAL_RECORD_FRAME;
+  outRecord->micros = ((uint32_t)entry[0] << 24) + ((uint32_t)entry[1] << 16) + ((uint32_t)entry[2] << 8) + entry[3];
+  outRecord->rssi = (int8_t)entry[4];
+  outRecord->count = count;
+  outRecord->validations = &entry[WiLP_LINK_FRAME_HEADER_LENGTH];
+  outRecord->length = length;
+  outRecord->frame = &entry[WiLP_LINK_FRAME_HEADER_LENGTH + count];
+  outRecord->dropped = 0;
+  *ioOffset = offset + WiLP_LINK_FRAME_HEADER_LENGTH + count + length;
+  return true;
+}
+
+
+uint8_t WiLPLink::writeMessage(uint8_t* outPacket, uint8_t inSequence, uint16_t inDestination, uint8_t inType,
+  const uint8_t* inPayload, uint8_t inPayloadLength){
+  if(inPayloadLength > WiLP_LINK_MAXIMUM_PACKET - WiLP_LINK_MESSAGE_HEADER_LENGTH){
+    return 0;
+  }
+  outPacket[0] = WiLP_LINK_MESSAGE;
+  outPacket[1] = inSequence;
+  outPacket[2] = (inDestination >> 8);
+  outPacket[3] = (inDestination);
+  outPacket[4] = inType;
+  memcpy(&outPacket[WiLP_LINK_MESSAGE_HEADER_LENGTH], inPayload, inPayloadLength);
+  return WiLP_LINK_MESSAGE_HEADER_LENGTH + inPayloadLength;
+}
+
+
+uint8_t WiLPLink::writeResult(uint8_t* outPacket, uint8_t inSequence, uint8_t inResult){
+  outPacket[0] = WiLP_LINK_RESULT;
+  outPacket[1] = inSequence;
+  outPacket[2] = inResult;
+  return 3;
+}
+
+
+uint8_t WiLPLink::writeStats(uint8_t* outPacket, const WiLPLinkStats& inStats){
+  const uint32_t values[3] = {inStats.received, inStats.dropped, inStats.sent};
+  outPacket[0] = WiLP_LINK_STATS;
+  for(uint8_t idx = 0; idx < 3; idx++){
+    outPacket[1 + idx * 4] = (values[idx] >> 24);
+    outPacket[2 + idx * 4] = (values[idx] >> 16);
+    outPacket[3 + idx * 4] = (values[idx] >> 8);
+    outPacket[4 + idx * 4] = (values[idx]);
+  }
+  return 13;
+}
+
+
+bool WiLPLink::readMessage(const uint8_t* inPacket, uint8_t inLength, WiLPLinkMessage* outMessage){
+  if(inLength < WiLP_LINK_MESSAGE_HEADER_LENGTH || inPacket[0] != WiLP_LINK_MESSAGE){
+    return false;
+  }
+  outMessage->sequence = inPacket[1];
+  outMessage->destination = (inPacket[2] << 8) + inPacket[3];
+  outMessage->type = inPacket[4];
+  outMessage->payload_length = inLength - WiLP_LINK_MESSAGE_HEADER_LENGTH;
+  outMessage->payload = &inPacket[WiLP_LINK_MESSAGE_HEADER_LENGTH];
+  return true;
+}
+
+
+bool WiLPLink::readResult(const uint8_t* inPacket, uint8_t inLength, uint8_t* outSequence, uint8_t* outResult){
+  if(inLength != 3 || inPacket[0] != WiLP_LINK_RESULT){
+    return false;
+  }
+  *outSequence = inPacket[1];
+  *outResult = inPacket[2];
+  return true;
+}
+
+
+bool WiLPLink::readStats(const uint8_t* inPacket, uint8_t inLength, WiLPLinkStats* outStats){
+  if(inLength != 13 || inPacket[0] != WiLP_LINK_STATS){
+    return false;
+  }
+  uint32_t values[3];
+  for(uint8_t idx = 0; idx < 3; idx++){
+    values[idx] = ((uint32_t)inPacket[1 + idx * 4] << 24) + ((uint32_t)inPacket[2 + idx * 4] << 16)
+      + ((uint32_t)inPacket[3 + idx * 4] << 8) + inPacket[4 + idx * 4];
+  }
+  outStats->received = values[0];
+  outStats->dropped = values[1];
+  outStats->sent = values[2];
+  return true;
+}
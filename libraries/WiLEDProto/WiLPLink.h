@@ -0,0 +1,118 @@
+/*
+* WiLPLink class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* A batched binary link between a coordinator and its host computer, for
+* received radio frames one way and messages to send the other.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef WILPLINK_H
+#define WILPLINK_H
+
+#include <Arduino.h>
+#include "WiLPSerialFrame.h"
+
+// Every packet is framed by WiLPSerialFrame::encode() and read back with a
+// WiLPSerialDecoder. The first byte is the packet type.
+
+// Coordinator to host: a batch of received radio frames. After the type
+// and the number of frames, each frame is a 32 bit microsecond timestamp,
+// the RSSI in dBm (signed), the number of messages found in it, its length,
+// one counter validation code per message, then the frame itself.
+#define WiLP_LINK_FRAMES 0x10
+// Coordinator to host: the outcome of a WiLP_LINK_MESSAGE, as the sequence
+// number it was sent with and a WiLP_RETURN_* code
+#define WiLP_LINK_RESULT 0x11
+// Coordinator to host: running totals, see WiLPLinkStats
+#define WiLP_LINK_STATS 0x12
+// Host to coordinator: a message for the coordinator to send, as a
+// sequence number, the destination address, the type, and the payload
+#define WiLP_LINK_MESSAGE 0x20
+
+#define WiLP_LINK_MAXIMUM_PACKET WiLP_SERIAL_LONGEST_PACKET
+#define WiLP_LINK_MAXIMUM_ENCODED WiLP_SERIAL_LONGEST_ENCODED
+#define WiLP_LINK_BATCH_HEADER_LENGTH 2
+#define WiLP_LINK_FRAME_HEADER_LENGTH 7
+#define WiLP_LINK_MESSAGE_HEADER_LENGTH 5
+// A batch is sent once it is full, or once its first frame has waited this
+// long
+#define WiLP_LINK_BATCH_MILLIS 5
+
+struct WiLPLinkStats {
+  // Radio frames received, and those the link had no room to pass on
+  uint32_t received;
+  uint32_t dropped;
+  // Radio frames sent
+  uint32_t sent;
+};
+
+// A message for the coordinator to send, as read by WiLPLink::readMessage().
+// The payload points into the packet.
+struct WiLPLinkMessage {
+  uint8_t sequence;
+  uint16_t destination;
+  uint8_t type;
+  uint8_t payload_length;
+  const uint8_t* payload;
+};
+
+// Collects received radio frames into one WiLP_LINK_FRAMES packet, which
+// saves the framing and the checksum of each one
+class WiLPLinkBatch {
+  public:
+    WiLPLinkBatch();
+
+    // Add a frame, returns false if it doesn't fit (encode() the batch and
+    // then try again)
+    bool add(uint32_t inMicros, int8_t inRSSI, const uint8_t* inValidations, uint8_t inCount, const uint8_t* inFrame, uint8_t inLength);
+    uint8_t getFrameCount();
+    // When the first frame of this batch was added
+    uint32_t getStartMillis();
+    // Frame the batch into outBuffer, which must hold
+    // WiLP_LINK_MAXIMUM_ENCODED bytes, and start a new one. Returns the
+    // number of bytes to send.
+    uint8_t encode(uint8_t* outBuffer);
+
+  protected:
+    uint8_t __packet[WiLP_LINK_MAXIMUM_PACKET];
+    uint8_t __length = WiLP_LINK_BATCH_HEADER_LENGTH;
+    uint32_t __start_millis = 0;
+};
+
+class WiLPLink {
+  public:
+    // Walk the frames of a WiLP_LINK_FRAMES packet. Start with *ioOffset at
+    // 0, returns false after the last frame or if the packet is malformed.
+    static bool nextFrame(const uint8_t* inPacket, uint8_t inLength, uint8_t* ioOffset, WiLPSerialRecord* outRecord);
+
+    // Fill in packets, outPacket must hold WiLP_LINK_MAXIMUM_PACKET bytes.
+    // Each returns the length of the packet, to be given to
+    // WiLPSerialFrame::encode().
+    static uint8_t writeMessage(uint8_t* outPacket, uint8_t inSequence, uint16_t inDestination, uint8_t inType,
+      const uint8_t* inPayload, uint8_t inPayloadLength);
+    static uint8_t writeResult(uint8_t* outPacket, uint8_t inSequence, uint8_t inResult);
+    static uint8_t writeStats(uint8_t* outPacket, const WiLPLinkStats& inStats);
+
+    // Read packets back, each returns false if the packet isn't of that type
+    // or is the wrong length
+    static bool readMessage(const uint8_t* inPacket, uint8_t inLength, WiLPLinkMessage* outMessage);
+    static bool readResult(const uint8_t* inPacket, uint8_t inLength, uint8_t* outSequence, uint8_t* outResult);
+    static bool readStats(const uint8_t* inPacket, uint8_t inLength, WiLPLinkStats* outStats);
+};
+
+
+#endif
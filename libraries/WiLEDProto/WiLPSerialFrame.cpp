@@ -0,0 +1,241 @@
+/*
+* WiLPSerialFrame class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* Binary records of received radio frames, framed with COBS for a serial
+* link, so a sniffer can keep up with a busy channel.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "WiLPSerialFrame.h"
+
+/************ WiLPSerialFrame ****************************/
+
+uint8_t WiLPSerialFrame::writeFrameRecord(uint8_t* outPacket, uint32_t inMicros, int8_t inRSSI,
+  const uint8_t* inValidations, uint8_t inCount, const uint8_t* inFrame, uint8_t inLength){
+  if(inLength > WiLP_SERIAL_MAXIMUM_FRAME || inCount > WiLP_SERIAL_MAXIMUM_MESSAGES){
+    return 0;
+  }
+  outPacket[0] = WiLP_SERIAL_RECORD_FRAME;
+  outPacket[1] = (inMicros >> 24);
+  outPacket[2] = (inMicros >> 16);
+  outPacket[3] = (inMicros >> 8);
+  outPacket[4] = (inMicros);
+  outPacket[5] = (uint8_t)inRSSI;
+  outPacket[6] = inCount;
+  memcpy(&outPacket[WiLP_SERIAL_FRAME_HEADER_LENGTH], inValidations, inCount);
+  memcpy(&outPacket[WiLP_SERIAL_FRAME_HEADER_LENGTH + inCount], inFrame, inLength);
+  return WiLP_SERIAL_FRAME_HEADER_LENGTH + inCount + inLength;
+}
+
+
+uint8_t WiLPSerialFrame::writeDroppedRecord(uint8_t* outPacket, uint32_t inMicros, uint32_t inDropped){
+  outPacket[0] = WiLP_SERIAL_RECORD_DROPPED;
+  outPacket[1] = (inMicros >> 24);
+  outPacket[2] = (inMicros >> 16);
+  outPacket[3] = (inMicros >> 8);
+  outPacket[4] = (inMicros);
+  outPacket[5] = (inDropped >> 24);
+  outPacket[6] = (inDropped >> 16);
+  outPacket[7] = (inDropped >> 8);
+  outPacket[8] = (inDropped);
+  return 9;
+}
+
+
+bool WiLPSerialFrame::readRecord(const uint8_t* inPacket, uint8_t inLength, WiLPSerialRecord* outRecord){
+  if(inLength < 5){
+    return false;
+  }
+  outRecord->type = inPacket[0];
+  outRecord->micros = ((uint32_t)inPacket[1] << 24) + ((uint32_t)inPacket[2] << 16) + ((uint32_t)inPacket[3] << 8) + inPacket[4];
+  if(outRecord->type == WiLP_SERIAL_RECORD_FRAME){
+    if(inLength < WiLP_SERIAL_FRAME_HEADER_LENGTH || inPacket[6] > WiLP_SERIAL_MAXIMUM_MESSAGES
+      || inLength - WiLP_SERIAL_FRAME_HEADER_LENGTH < inPacket[6]){
+      return false;
+    }
+    outRecord->rssi = (int8_t)inPacket[5];
+    outRecord->count = inPacket[6];
+    outRecord->validations = &inPacket[WiLP_SERIAL_FRAME_HEADER_LENGTH];
+    outRecord->length = inLength - WiLP_SERIAL_FRAME_HEADER_LENGTH - outRecord->count;
+    outRecord->frame = &inPacket[WiLP_SERIAL_FRAME_HEADER_LENGTH + outRecord->count];
+    return outRecord->length <= WiLP_SERIAL_MAXIMUM_FRAME;
+  }
+  if(outRecord->type == WiLP_SERIAL_RECORD_DROPPED && inLength == 9){
+    outRecord->dropped = ((uint32_t)inPacket[5] << 24) + ((uint32_t)inPacket[6] << 16) + ((uint32_t)inPacket[7] << 8) + inPacket[8];
+    return true;
+  }
+  return false;
+}
+
+
+uint8_t WiLPSerialFrame::encode(const uint8_t* inPacket, uint8_t inLength, uint8_t* outBuffer){
+  // Each zero is replaced by the distance to the next one, starting with a
+  // code byte in front of the packet. The checksum is encoded the same way.
+  uint16_t checksum = WiLPChecksum::crc16(inPacket, inLength);
+  uint8_t code_position = 0;
+  uint8_t out = 1;
+  for(uint8_t idx = 0; idx < inLength + 2; idx++){
+    uint8_t value;
+    if(idx < inLength){
+      value = inPacket[idx];
+    } else if(idx == inLength){
+      value = (checksum >> 8);
+    } else {
+      value = (checksum);
+    }
+    if(value == 0){
+      outBuffer[code_position] = out - code_position;
+      code_position = out;
+      out++;
+    } else {
+      outBuffer[out] = value;
+      out++;
+    }
+  }
+  outBuffer[code_position] = out - code_position;
+  outBuffer[out] = WiLP_SERIAL_DELIMITER;
+  return out + 1;
+}
+
+/************ WiLPSerialDecoder **************************/
+
+bool WiLPSerialDecoder::push(uint8_t inByte){
+  if(inByte != WiLP_SERIAL_DELIMITER){
+    if(__buffer_length < sizeof(__buffer)){
+      __buffer[__buffer_length] = inByte;
+      __buffer_length++;
+    } else {
+      __overflow = true;
+    }
+    return false;
+  }
+
+  // End of a packet. Two delimiters in a row are just idle.
+  uint8_t length = __buffer_length;
+  bool overflow = __overflow;
+  __buffer_length = 0;
+  __overflow = false;
+  if(length == 0){
+    return false;
+  }
+  if(overflow){
+    __errors++;
+    return false;
+  }
+  // Undo the encoding, each code byte says how far it is to the next zero
+  uint8_t in = 0;
+  uint8_t out = 0;
+  while(in < length){
+    uint8_t code = __buffer[in];
+    if(code == 0 || in + code > length){
+      __errors++;
+      return false;
+    }
+    in++;
+    for(uint8_t idx = 1; idx < code; idx++){
+      __packet[out] = __buffer[in];
+      out++;
+      in++;
+    }
+    // The last code byte doesn't stand for a zero
+    if(in < length && code != 0xFF){
+      __packet[out] = 0;
+      out++;
+    }
+  }
+  if(out < 3){
+    __errors++;
+    return false;
+  }
+  uint16_t checksum = WiLPChecksum::crc16(__packet, out - 2);
+  if(__packet[out - 2] != (uint8_t)(checksum >> 8) || __packet[out - 1] != (uint8_t)checksum){
+    __errors++;
+    return false;
+  }
+  __packet_length = out - 2;
+  return true;
+}
+
+
+const uint8_t* WiLPSerialDecoder::getPacket(){
+  return __packet;
+}
+
+
+uint8_t WiLPSerialDecoder::getLength(){
+  return __packet_length;
+}
+
+
+uint32_t WiLPSerialDecoder::getErrorCount(){
+  return __errors;
+}
+
+/************ WiLPSerialRing *****************************/
+
+WiLPSerialRing::WiLPSerialRing(uint8_t* inBuffer, uint16_t inSize){
+  __buffer = inBuffer;
+  __size = inSize;
+}
+
+
+bool WiLPSerialRing::write(const uint8_t* inData, uint16_t inLength){
+  if(inLength > __size - __used){
+    return false;
+  }
+  uint16_t tail = __head + __used;
+  if(tail >= __size){
+    tail -= __size;
+  }
+  // Copy up to the end of the buffer, then any rest from the start
+  uint16_t first = __size - tail;
+  if(first > inLength){
+    first = inLength;
+  }
+  memcpy(&__buffer[tail], inData, first);
+  memcpy(__buffer, &inData[first], inLength - first);
+  __used += inLength;
+  return true;
+}
+
+
+uint16_t WiLPSerialRing::peek(const uint8_t** outData){
+  *outData = &__buffer[__head];
+  uint16_t run = __size - __head;
+  return (run < __used) ? run : __used;
+}
+
+
+void WiLPSerialRing::consume(uint16_t inLength){
+  if(inLength > __used){
+    inLength = __used;
+  }
+  __head += inLength;
+  if(__head >= __size){
+    __head -= __size;
+  }
+  __used -= inLength;
+}
+
+
+uint16_t WiLPSerialRing::getUsed(){
+  return __used;
+}
+
+
+uint16_t WiLPSerialRing::getFree(){
+  return __size - __used;
+}
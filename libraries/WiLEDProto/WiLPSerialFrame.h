@@ -0,0 +1,135 @@
+/*
+* WiLPSerialFrame class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* Binary records of received radio frames, framed with COBS for a serial
+* link, so a sniffer can keep up with a busy channel.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef WILPSERIALFRAME_H
+#define WILPSERIALFRAME_H
+
+#include <Arduino.h>
+#include "WiLPChecksum.h"
+
+// Each packet is followed by a CRC-16 (big-endian), then COBS encoded so
+// that it holds no zero bytes, and ended with a zero byte. A receiver that
+// starts part way through a packet, or loses a byte, picks up again at the
+// next zero.
+#define WiLP_SERIAL_DELIMITER 0x00
+
+// Record types, the first byte of each packet
+// A received radio frame: 32 bit microsecond timestamp, RSSI in dBm
+// (signed), the number of messages found in the frame, one counter
+// validation code per message, then the frame itself
+#define WiLP_SERIAL_RECORD_FRAME 0x01
+// Records were dropped because the serial port couldn't keep up:
+// 32 bit microsecond timestamp, then the number dropped (32 bit)
+#define WiLP_SERIAL_RECORD_DROPPED 0x02
+
+#define WiLP_SERIAL_FRAME_HEADER_LENGTH 7
+// The longest frame the RFM69 can receive
+#define WiLP_SERIAL_MAXIMUM_FRAME 64
+#define WiLP_SERIAL_MAXIMUM_MESSAGES 4
+#define WiLP_SERIAL_MAXIMUM_PACKET (WiLP_SERIAL_FRAME_HEADER_LENGTH + WiLP_SERIAL_MAXIMUM_MESSAGES + WiLP_SERIAL_MAXIMUM_FRAME)
+// With the checksum, one COBS code byte (packets are under 254 bytes) and
+// the delimiter
+#define WiLP_SERIAL_MAXIMUM_ENCODED (WiLP_SERIAL_MAXIMUM_PACKET + 4)
+// The longest packet encode() takes, and the most a decoder has to hold,
+// so that the same framing can carry longer packets such as WiLPLink's
+#define WiLP_SERIAL_LONGEST_PACKET 251
+#define WiLP_SERIAL_LONGEST_ENCODED (WiLP_SERIAL_LONGEST_PACKET + 4)
+
+// One record, as read back by WiLPSerialFrame::readRecord(). The pointers
+// point into the packet.
+struct WiLPSerialRecord {
+  uint8_t type;
+  uint32_t micros;
+  // Only for WiLP_SERIAL_RECORD_FRAME
+  int8_t rssi;
+  uint8_t count;
+  const uint8_t* validations;
+  uint8_t length;
+  const uint8_t* frame;
+  // Only for WiLP_SERIAL_RECORD_DROPPED
+  uint32_t dropped;
+};
+
+class WiLPSerialFrame {
+  public:
+    // Fill in a record in outPacket, which must hold
+    // WiLP_SERIAL_MAXIMUM_PACKET bytes. Returns its length, or 0 if the
+    // frame is too long or has too many messages.
+    static uint8_t writeFrameRecord(uint8_t* outPacket, uint32_t inMicros, int8_t inRSSI,
+      const uint8_t* inValidations, uint8_t inCount, const uint8_t* inFrame, uint8_t inLength);
+    static uint8_t writeDroppedRecord(uint8_t* outPacket, uint32_t inMicros, uint32_t inDropped);
+    // Split up a decoded packet, returns false if it isn't a known record
+    static bool readRecord(const uint8_t* inPacket, uint8_t inLength, WiLPSerialRecord* outRecord);
+
+    // Add the checksum, COBS encode the packet and add the delimiter.
+    // outBuffer must hold inLength + 4 bytes, and inLength must be at most
+    // WiLP_SERIAL_LONGEST_PACKET.
+    // Returns the number of bytes to send.
+    static uint8_t encode(const uint8_t* inPacket, uint8_t inLength, uint8_t* outBuffer);
+};
+
+// Takes the received bytes one at a time, and gives back each packet whose
+// checksum matches
+class WiLPSerialDecoder {
+  public:
+    // Returns true once a whole packet has been received, which can then be
+    // read with getPacket() until the next call
+    bool push(uint8_t inByte);
+    const uint8_t* getPacket();
+    uint8_t getLength();
+    // Packets that were cut short, too long or failed the checksum
+    uint32_t getErrorCount();
+
+  protected:
+    uint8_t __buffer[WiLP_SERIAL_LONGEST_ENCODED];
+    uint8_t __packet[WiLP_SERIAL_LONGEST_ENCODED];
+    uint8_t __buffer_length = 0;
+    uint8_t __packet_length = 0;
+    bool __overflow = false;
+    uint32_t __errors = 0;
+};
+
+// A byte ring for outgoing packets, so that the radio loop never waits on
+// the serial port. Whole packets are added or refused, never split.
+class WiLPSerialRing {
+  public:
+    // inBuffer is owned by the caller, and holds inSize bytes
+    WiLPSerialRing(uint8_t* inBuffer, uint16_t inSize);
+
+    // Add inLength bytes, returns false (adding nothing) if they don't fit
+    bool write(const uint8_t* inData, uint16_t inLength);
+    // The longest run of waiting bytes that can be read in one go, without
+    // wrapping around. Pass the number actually sent to consume().
+    uint16_t peek(const uint8_t** outData);
+    void consume(uint16_t inLength);
+    uint16_t getUsed();
+    uint16_t getFree();
+
+  protected:
+    uint8_t* __buffer = 0;
+    uint16_t __size = 0;
+    uint16_t __head = 0;
+    uint16_t __used = 0;
+};
+
+
+#endif
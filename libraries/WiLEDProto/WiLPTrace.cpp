@@ -0,0 +1,276 @@
+/*
+* WiLPTrace class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* Timestamps a command at each step from a dial detent to the PWM change it
+* causes, and keeps the time between steps in fixed size histograms.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "WiLPTrace.h"
+
+// Always built, but the histograms are only kept with WiLP_TRACE, so that
+// they cost no RAM otherwise
+#ifdef WiLP_TRACE
+
+#include "WiLEDProto.h"
+
+
+void WiLPHistogram::record(uint32_t inValue){
+  __buckets[getBucket(inValue)]++;
+  __count++;
+  __sum += inValue;
+  if(inValue < __minimum){
+    __minimum = inValue;
+  }
+  if(inValue > __maximum){
+    __maximum = inValue;
+  }
+}
+
+
+void WiLPHistogram::clear(){
+  memset(__buckets, 0, sizeof(__buckets));
+  __count = 0;
+  __minimum = 0xFFFFFFFF;
+  __maximum = 0;
+  __sum = 0;
+}
+
+
+uint32_t WiLPHistogram::getPercentile(float inFraction) const {
+  if(__count == 0){
+    return 0;
+  }
+  // The rank of the value wanted, counting from 1
+  uint32_t rank = (uint32_t)(inFraction * __count + 0.999f);
+  if(rank < 1){
+    rank = 1;
+  }
+  uint32_t seen = 0;
+  for(uint8_t bucket = 0; bucket < WiLP_HISTOGRAM_BUCKETS; bucket++){
+    seen += __buckets[bucket];
+    if(seen >= rank){
+      uint32_t upper = (bucket + 1 < WiLP_HISTOGRAM_BUCKETS) ? getBucketLower(bucket + 1) - 1 : 0xFFFFFFFF;
+      return (upper < __maximum) ? upper : __maximum;
+    }
+  }
+  return __maximum;
+}
+
+
+uint8_t WiLPHistogram::getBucket(uint32_t inValue){
+  if(inValue < WiLP_HISTOGRAM_SUB_BUCKETS){
+    return inValue;
+  }
+  // The top bit picks the power of two, the bits below it the sub-bucket
+  uint8_t shift = (31 - __builtin_clz(inValue)) - WiLP_HISTOGRAM_SUB_BITS;
+  return (shift + 1) * WiLP_HISTOGRAM_SUB_BUCKETS + ((inValue >> shift) & (WiLP_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+
+uint32_t WiLPHistogram::getBucketLower(uint8_t inBucket){
+  if(inBucket < WiLP_HISTOGRAM_SUB_BUCKETS){
+    return inBucket;
+  }
+  uint8_t shift = inBucket / WiLP_HISTOGRAM_SUB_BUCKETS - 1;
+  return (uint32_t)(WiLP_HISTOGRAM_SUB_BUCKETS + inBucket % WiLP_HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+
+WiLPTrace::InFlight WiLPTrace::__in_flight[WiLP_TRACE_IN_FLIGHT];
+WiLPHistogram WiLPTrace::__stages[WiLP_TRACE_POINTS];
+bool WiLPTrace::__input_pending = false;
+uint32_t WiLPTrace::__input_micros = 0;
+int8_t WiLPTrace::__output_pending = -1;
+uint32_t WiLPTrace::__traced = 0;
+uint32_t WiLPTrace::__unfinished = 0;
+uint32_t WiLPTrace::__untraced_outputs = 0;
+
+
+void WiLPTrace::input(){
+  __input_pending = true;
+  __input_micros = micros();
+}
+
+
+void WiLPTrace::message(uint8_t inPoint, uint8_t inType, uint16_t inSource, uint16_t inCounter){
+  if(inType != WiLP_Set_Individual && inType != WiLP_Set_Individuals_Two
+    && inType != WiLP_Set_Individuals_Three && inType != WiLP_Set_Groups){
+    return;
+  }
+  uint32_t now = micros();
+  InFlight* oldest = &__in_flight[0];
+  for(uint8_t idx = 0; idx < WiLP_TRACE_IN_FLIGHT; idx++){
+    InFlight* slot = &__in_flight[idx];
+    if(slot->used && slot->source == inSource && slot->counter == inCounter){
+      // Points are only ever passed forwards. A broadcast reaches PROCESS
+      // once for each device it names, only the first counts.
+      if(inPoint > slot->point){
+        __advance(slot, inPoint, now);
+        if(inPoint == WiLP_TRACE_PROCESS){
+          __output_pending = idx;
+        }
+      }
+      return;
+    }
+    if(!slot->used){
+      oldest = slot;
+    } else if(oldest->used && (int32_t)(slot->last_micros - oldest->last_micros) < 0){
+      oldest = slot;
+    }
+  }
+  if(oldest->used && oldest->point != WiLP_TRACE_OUTPUT){
+    __unfinished++;
+    if(__output_pending == oldest - __in_flight){
+      __output_pending = -1;
+    }
+  }
+  __traced++;
+  oldest->used = true;
+  oldest->source = inSource;
+  oldest->counter = inCounter;
+  oldest->point = inPoint;
+  oldest->first_micros = now;
+  oldest->last_micros = now;
+  // A message encoded after a dial step starts from the step
+  if(inPoint == WiLP_TRACE_ENCODE && __input_pending){
+    __input_pending = false;
+    oldest->point = WiLP_TRACE_INPUT;
+    oldest->first_micros = __input_micros;
+    oldest->last_micros = __input_micros;
+    __advance(oldest, inPoint, now);
+  }
+  if(inPoint == WiLP_TRACE_PROCESS){
+    __output_pending = oldest - __in_flight;
+  }
+}
+
+
+void WiLPTrace::frame(uint8_t inPoint, const uint8_t* inFrame, uint8_t inLength){
+  uint8_t offset = 0;
+  // The same walk as WiLEDProtoBase::processFrame(), without the checks
+  // that processing does later
+  while(offset + WiLPMessageView::HEADER_LENGTH <= inLength
+    && inFrame[offset] == WiLPMessageView::MAGIC){
+    const uint8_t* header = &inFrame[offset];
+    uint8_t frame_length = WiLEDProtoBase::getFrameLength(header[WiLPMessageView::OFFSET_TYPE]);
+    if(frame_length == 0){
+      return;
+    }
+    message(inPoint, header[WiLPMessageView::OFFSET_TYPE],
+      (header[WiLPMessageView::OFFSET_SOURCE] << 8) + header[WiLPMessageView::OFFSET_SOURCE + 1],
+      (header[WiLPMessageView::OFFSET_MESSAGE_COUNTER] << 8) + header[WiLPMessageView::OFFSET_MESSAGE_COUNTER + 1]);
+    offset += frame_length;
+  }
+}
+
+
+void WiLPTrace::output(){
+  if(__output_pending < 0){
+    __untraced_outputs++;
+    return;
+  }
+  InFlight* slot = &__in_flight[__output_pending];
+  __output_pending = -1;
+  __advance(slot, WiLP_TRACE_OUTPUT, micros());
+  __stages[WiLP_TRACE_INPUT].record(slot->last_micros - slot->first_micros);
+  // The slot is kept until it is needed, so that the same message turning
+  // up again (at another receiver, or resent) isn't traced twice
+}
+
+
+const WiLPHistogram& WiLPTrace::getStage(uint8_t inPoint){
+  return __stages[inPoint];
+}
+
+uint32_t WiLPTrace::getTraced(){
+  return __traced;
+}
+
+uint32_t WiLPTrace::getUnfinished(){
+  return __unfinished;
+}
+
+uint32_t WiLPTrace::getUntracedOutputs(){
+  return __untraced_outputs;
+}
+
+
+void WiLPTrace::dump(){
+  const char* names[WiLP_TRACE_POINTS] = {
+    "total", "input-encode", "encode-send", "send-receive", "receive-process", "process-output"
+  };
+  Serial.print("WiLPTrace traced ");
+  Serial.print((long)__traced);
+  Serial.print(" unfinished ");
+  Serial.print((long)__unfinished);
+  Serial.print(" untraced outputs ");
+  Serial.println((long)__untraced_outputs);
+  for(uint8_t point = 0; point < WiLP_TRACE_POINTS; point++){
+    const WiLPHistogram& stage = __stages[point];
+    Serial.print(names[point]);
+    Serial.print(" n=");
+    Serial.print((long)stage.getCount());
+    Serial.print(" min=");
+    Serial.print((long)stage.getMinimum());
+    Serial.print(" p50=");
+    Serial.print((long)stage.getPercentile(0.5f));
+    Serial.print(" p90=");
+    Serial.print((long)stage.getPercentile(0.9f));
+    Serial.print(" p99=");
+    Serial.print((long)stage.getPercentile(0.99f));
+    Serial.print(" max=");
+    Serial.print((long)stage.getMaximum());
+    Serial.println(" us");
+    if(stage.getCount() == 0){
+      continue;
+    }
+    // Each bucket as lower bound:count, for plotting or merging devices
+    Serial.print(" ");
+    for(uint8_t bucket = 0; bucket < WiLP_HISTOGRAM_BUCKETS; bucket++){
+      if(stage.getBucketCount(bucket) != 0){
+        Serial.print(" ");
+        Serial.print((long)WiLPHistogram::getBucketLower(bucket));
+        Serial.print(":");
+        Serial.print((long)stage.getBucketCount(bucket));
+      }
+    }
+    Serial.println();
+  }
+}
+
+
+void WiLPTrace::clear(){
+  for(uint8_t point = 0; point < WiLP_TRACE_POINTS; point++){
+    __stages[point].clear();
+  }
+  memset(__in_flight, 0, sizeof(__in_flight));
+  __input_pending = false;
+  __output_pending = -1;
+  __traced = 0;
+  __unfinished = 0;
+  __untraced_outputs = 0;
+}
+
+
+void WiLPTrace::__advance(InFlight* ioMessage, uint8_t inPoint, uint32_t inMicros){
+  __stages[inPoint].record(inMicros - ioMessage->last_micros);
+  ioMessage->point = inPoint;
+  ioMessage->last_micros = inMicros;
+}
+
+
+#endif
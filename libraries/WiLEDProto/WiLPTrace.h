@@ -0,0 +1,137 @@
+/*
+* WiLPTrace class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* Timestamps a command at each step from a dial detent to the PWM change it
+* causes, and keeps the time between steps in fixed size histograms. Only
+* built with -DWiLP_TRACE, the hooks in the libraries compile to nothing
+* without it.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef WILPTRACE_H
+#define WILPTRACE_H
+
+#include <Arduino.h>
+
+// Trace points, in the order a command passes them. INPUT is a Rotary
+// step, ENCODE is the message being given its counters in a frame, SEND and
+// RECEIVE are the radio, PROCESS is the message being accepted and handed
+// to its handler, and OUTPUT is the next analogWrite() after that.
+#define WiLP_TRACE_INPUT 0
+#define WiLP_TRACE_ENCODE 1
+#define WiLP_TRACE_SEND 2
+#define WiLP_TRACE_RECEIVE 3
+#define WiLP_TRACE_PROCESS 4
+#define WiLP_TRACE_OUTPUT 5
+#define WiLP_TRACE_POINTS 6
+
+// Messages followed at once, matched by source and Message Counter. When
+// all are in use, the one that moved least recently is given up on, or
+// forgotten if it had already reached OUTPUT.
+#ifndef WiLP_TRACE_IN_FLIGHT
+#define WiLP_TRACE_IN_FLIGHT 8
+#endif
+
+// Values below WiLP_HISTOGRAM_SUB_BUCKETS get a bucket each, then each
+// power of two is split into WiLP_HISTOGRAM_SUB_BUCKETS. With 4 that is
+// within 25% across the whole 32 bit range, in 124 buckets.
+#define WiLP_HISTOGRAM_SUB_BITS 2
+#define WiLP_HISTOGRAM_SUB_BUCKETS (1 << WiLP_HISTOGRAM_SUB_BITS)
+#define WiLP_HISTOGRAM_BUCKETS ((32 - WiLP_HISTOGRAM_SUB_BITS + 1) * WiLP_HISTOGRAM_SUB_BUCKETS)
+
+class WiLPHistogram {
+  public:
+    void record(uint32_t inValue);
+    void clear();
+
+    uint32_t getCount() const { return __count; }
+    uint32_t getMinimum() const { return __count ? __minimum : 0; }
+    uint32_t getMaximum() const { return __maximum; }
+    uint32_t getMean() const { return __count ? __sum / __count : 0; }
+    // The top of the bucket holding the value at inFraction (0 to 1) of the
+    // way through, so never less than the real percentile
+    uint32_t getPercentile(float inFraction) const;
+    uint32_t getBucketCount(uint8_t inBucket) const { return __buckets[inBucket]; }
+
+    static uint8_t getBucket(uint32_t inValue);
+    // The smallest value that goes in a bucket
+    static uint32_t getBucketLower(uint8_t inBucket);
+
+  protected:
+    uint32_t __buckets[WiLP_HISTOGRAM_BUCKETS] = {};
+    uint32_t __count = 0;
+    uint32_t __minimum = 0xFFFFFFFF;
+    uint32_t __maximum = 0;
+    uint64_t __sum = 0;
+};
+
+// One set of histograms for the whole device, so that Rotary, WiLEDProto,
+// LEDOutput and the sketch can all add to it without being wired together.
+// Times are micros(). A device only sees its own part of the path, so
+// the sender fills in the stages up to SEND and the receiver the rest. On a
+// host build with every node in one process, one trace sees all of it.
+class WiLPTrace {
+  public:
+    // A Rotary step. The next traced message encoded here starts from it.
+    static void input();
+    // A message passing a point. Only the types that change outputs (the
+    // Set commands) are followed, others are ignored.
+    static void message(uint8_t inPoint, uint8_t inType, uint16_t inSource, uint16_t inCounter);
+    // Every message in a radio frame passing a point
+    static void frame(uint8_t inPoint, const uint8_t* inFrame, uint8_t inLength);
+    // An analogWrite(). It finishes the last message that reached PROCESS.
+    static void output();
+
+    // The time from the point before to inPoint, for each message that
+    // passed both. Stage 0 (INPUT) is from the first point to OUTPUT, for
+    // each message that got that far.
+    static const WiLPHistogram& getStage(uint8_t inPoint);
+    // Messages seen, those given up on before reaching OUTPUT (all of them
+    // on a sender), and outputs that weren't from a traced message
+    static uint32_t getTraced();
+    static uint32_t getUnfinished();
+    static uint32_t getUntracedOutputs();
+
+    // Print the percentiles of each stage, then its nonzero buckets
+    static void dump();
+    static void clear();
+
+  protected:
+    struct InFlight {
+      bool used;
+      uint8_t point;
+      uint16_t source;
+      uint16_t counter;
+      uint32_t first_micros;
+      uint32_t last_micros;
+    };
+
+    static InFlight __in_flight[WiLP_TRACE_IN_FLIGHT];
+    static WiLPHistogram __stages[WiLP_TRACE_POINTS];
+    static bool __input_pending;
+    static uint32_t __input_micros;
+    // The message that reached PROCESS last, or -1
+    static int8_t __output_pending;
+    static uint32_t __traced;
+    static uint32_t __unfinished;
+    static uint32_t __untraced_outputs;
+
+    static void __advance(InFlight* ioMessage, uint8_t inPoint, uint32_t inMicros);
+};
+
+
+#endif
@@ -35,7 +35,17 @@
 #include <RH_RF69.h>
 
 #include <WiLEDProto.h>
-
+#include <WiLPSerialFrame.h>
+
+// By default every received frame is sent as a binary record (see
+// WiLPSerialFrame.h), decoded on a PC by WiLED_native-sniffer. Build with
+// -DEAVESDROPPER_TEXT for the old readable output, which is too slow to keep
+// up with a busy channel.
+#ifdef EAVESDROPPER_TEXT
+#define SERIAL_BAUD 115200
+#else
+#define SERIAL_BAUD 921600
+#endif
 
 #define RFM69_CS      16
 #define RFM69_IRQ     15
@@ -66,12 +76,72 @@ void EEPROMcommitter(){
 }
 
 
+// The eavesdropper hears every device on the channel, so it needs the full
+// table, not a lamp's. With too few slots every message after the table
+// filled up would only be reported as TABLE FULL.
 WiLEDProto handler(0x1000, &EEPROMreader, &EEPROMwriter, &EEPROMcommitter);
 
 
+#ifndef EAVESDROPPER_TEXT
+// Encoded records wait here until the serial port can take them, so the
+// radio is never left waiting on a print
+#define SERIAL_RING_SIZE 2048
+uint8_t serial_ring_buffer[SERIAL_RING_SIZE];
+WiLPSerialRing serial_ring(serial_ring_buffer, SERIAL_RING_SIZE);
+// Records that didn't fit in the ring since the last one that did
+uint32_t dropped_records = 0;
+
+// Hand the serial port as much of the ring as it has room for, without
+// blocking
+void drainSerial(){
+  const uint8_t* data;
+  uint16_t length = serial_ring.peek(&data);
+  int room = Serial.availableForWrite();
+  if(room <= 0 || length == 0){
+    return;
+  }
+  if(length > room){
+    length = room;
+  }
+  serial_ring.consume(Serial.write(data, length));
+}
+
+// Queue a record of a received frame, with the counter validation of each
+// message in it
+void reportFrame(const uint8_t* inFrame, uint8_t inLength, uint32_t inMicros){
+  WiLPBatchResult results[WiLP_MAXIMUM_AGGREGATE_MESSAGES];
+  uint8_t count = handler.processFrame(inFrame, inLength, results, WiLP_MAXIMUM_AGGREGATE_MESSAGES);
+  uint8_t validations[WiLP_MAXIMUM_AGGREGATE_MESSAGES];
+  for(uint8_t idx = 0; idx < count; idx++){
+    validations[idx] = results[idx].validation;
+  }
+
+  uint8_t packet[WiLP_SERIAL_MAXIMUM_PACKET];
+  uint8_t encoded[WiLP_SERIAL_MAXIMUM_ENCODED];
+  // Say how many were lost first, so the gap shows up in the right place
+  if(dropped_records != 0){
+    uint8_t length = WiLPSerialFrame::encode(packet, WiLPSerialFrame::writeDroppedRecord(packet, inMicros, dropped_records), encoded);
+    if(!serial_ring.write(encoded, length)){
+      dropped_records++;
+      return;
+    }
+    dropped_records = 0;
+  }
+  uint8_t packet_length = WiLPSerialFrame::writeFrameRecord(packet, inMicros, rf69.lastRssi(), validations, count, inFrame, inLength);
+  if(packet_length == 0){
+    return;
+  }
+  uint8_t length = WiLPSerialFrame::encode(packet, packet_length, encoded);
+  if(!serial_ring.write(encoded, length)){
+    dropped_records++;
+  }
+}
+#endif
+
+
 void setup()
 {
-  Serial.begin(115200);
+  Serial.begin(SERIAL_BAUD);
 
   WiFi.mode(WIFI_STA);
   WiFi.begin(ssid, password);
@@ -140,6 +210,11 @@ void setup()
 */
 
   handler.initStorage();
+
+#ifndef EAVESDROPPER_TEXT
+  // End the text above, so the decoder starts cleanly at the first record
+  Serial.write((uint8_t)WiLP_SERIAL_DELIMITER);
+#endif
 }
 
 uint32_t last_message = 0;
@@ -148,6 +223,21 @@ uint32_t this_message = 0;
 void loop()
 {
   ArduinoOTA.handle();
+  handler.process();
+
+#ifndef EAVESDROPPER_TEXT
+  drainSerial();
+  // Don't wait for a packet, the ring needs draining in the meantime
+  if (rf69.available())
+  {
+    uint8_t buf[RH_RF69_MAX_MESSAGE_LEN];
+    uint8_t len = sizeof(buf);
+    if (rf69.recv(buf, &len))
+    {
+      reportFrame(buf, len, micros());
+    }
+  }
+#else
 
   // Listen and report if there is a packet available, otherwise keep looping
   if (rf69.waitAvailableTimeout(10))
@@ -162,42 +252,52 @@ void loop()
       //Serial.println((char*)buf);
 
       Serial.print("HEX: ");
-      for(int idx=0; idx<20; idx++){
+      for(int idx=0; idx<len; idx++){
         Serial.print(buf[idx], HEX);
         Serial.print(" ");
       }
       Serial.println(". ");
 
-      uint8_t status_code = handler.processMessage(buf);
-      int16_t msg_check_code = -1;
-
-      if(status_code == WiLP_RETURN_SUCCESS){
-        msg_check_code = handler.getLastReceivedMessageCounterValidation();
-      }
-
-      Serial.print("Message analysis. Return code: ");
-      Serial.println(status_code, DEC);
-      Serial.print("  Source device: ");
-      Serial.println(handler.getLastReceivedSource(), HEX);
-      Serial.print("  Destination device: ");
-      Serial.println(handler.getLastReceivedDestination(), HEX);
-      Serial.print("  Message type: ");
-      Serial.println(handler.getLastReceivedType(), HEX);
-      Serial.print("  Reset counter: ");
-      Serial.println(handler.getLastReceivedResetCounter(), DEC);
-      Serial.print("  Message counter: ");
-      Serial.print(handler.getLastReceivedMessageCounter(), DEC);
-      if(msg_check_code == WiLP_RETURN_SUCCESS){
-        Serial.println(" (VALID)");
-      } else if(msg_check_code == WiLP_RETURN_ADDED_ADDRESS){
-        Serial.println(" (ADDED NEW)");
-      } else if(msg_check_code == WiLP_RETURN_INVALID_RST_CTR){
-        Serial.println(" (INVALID RST)");
-      } else if(msg_check_code == WiLP_RETURN_INVALID_MSG_CTR){
-        Serial.println(" (INVALID MSG)");
-      } else {
-        Serial.println(" (OTHER ERROR)");
-      }
+      // A frame can hold several messages, report each of them in turn
+      uint8_t offset = 0;
+      do {
+        WiLPMessageView message = WiLEDProto::parseMessage(&buf[offset], len - offset);
+        uint8_t status_code = handler.processMessage(message);
+        int16_t msg_check_code = -1;
+
+        if(status_code == WiLP_RETURN_SUCCESS){
+          msg_check_code = handler.getLastReceivedMessageCounterValidation();
+        }
+
+        Serial.print("Message analysis. Return code: ");
+        Serial.println(status_code, DEC);
+        Serial.print("  Source device: ");
+        Serial.println(handler.getLastReceivedSource(), HEX);
+        Serial.print("  Destination device: ");
+        Serial.println(handler.getLastReceivedDestination(), HEX);
+        Serial.print("  Message type: ");
+        Serial.println(handler.getLastReceivedType(), HEX);
+        Serial.print("  Reset counter: ");
+        Serial.println(handler.getLastReceivedResetCounter(), DEC);
+        Serial.print("  Message counter: ");
+        Serial.print(handler.getLastReceivedMessageCounter(), DEC);
+        if(msg_check_code == WiLP_RETURN_SUCCESS){
+          Serial.println(" (VALID)");
+        } else if(msg_check_code == WiLP_RETURN_ADDED_ADDRESS){
+          Serial.println(" (ADDED NEW)");
+        } else if(msg_check_code == WiLP_RETURN_INVALID_RST_CTR){
+          Serial.println(" (INVALID RST)");
+        } else if(msg_check_code == WiLP_RETURN_INVALID_MSG_CTR){
+          Serial.println(" (INVALID MSG)");
+        } else {
+          Serial.println(" (OTHER ERROR)");
+        }
+        // Without a valid message, the start of the next one can't be found
+        if(!message.isValid()){
+          break;
+        }
+        offset += message.getFrameLength();
+      } while(offset < len && buf[offset] == WiLPMessageView::MAGIC);
 
       //Serial.print("RSSI: ");
       //Serial.println(rf69.lastRssi(), DEC);
@@ -211,4 +311,5 @@ void loop()
       Serial.println("recv failed");
     }
   }
+#endif
 }
@@ -74,8 +74,24 @@ void EEPROMcommitter(){
   EEPROM.commit();
 }
 
+// Create functions to pass to WiLP class for the RTC user memory, which
+// survives a restart so the reset counter can be kept without an EEPROM write
+bool RTCreader(uint8_t* outData, uint16_t inLength){
+  uint32_t words[WiLP_RETAINED_LENGTH / 4];
+  if(!ESP.rtcUserMemoryRead(0, words, sizeof(words))){
+    return false;
+  }
+  memcpy(outData, words, inLength);
+  return true;
+}
+void RTCwriter(const uint8_t* inData, uint16_t inLength){
+  uint32_t words[WiLP_RETAINED_LENGTH / 4];
+  memcpy(words, inData, inLength);
+  ESP.rtcUserMemoryWrite(0, words, sizeof(words));
+}
+
 
-WiLEDProto handler(CLIENT_ADDRESS, &EEPROMreader, &EEPROMwriter, &EEPROMcommitter);
+WiLEDProtoLamp handler(CLIENT_ADDRESS, &EEPROMreader, &EEPROMwriter, &EEPROMcommitter);
 
 
 uint8_t msg_status = 0;
@@ -87,19 +103,20 @@ void sendMessage()
   uint8_t len = sizeof(data);
 
   msg_status = handler.sendMessageBeacon(millis());
-  handler.copyToBuffer(data);
+  // Only send the bytes of the frame, not the whole buffer
+  uint8_t data_len = handler.copyToBuffer(data);
 
   // Send a message to rf69_server
 
   // Send a message to manager_server
   rf69.waitCAD();
-  rf69.send(data, MAXIMUM_MESSAGE_LENGTH);
+  rf69.send(data, data_len);
   rf69.waitPacketSent();
 
   #ifdef RETRANSMIT_TEST
   delay(15);
   rf69.waitCAD();
-  rf69.send(data, MAXIMUM_MESSAGE_LENGTH);
+  rf69.send(data, data_len);
   rf69.waitPacketSent();
   #endif
 
@@ -205,6 +222,7 @@ void setup()
   Serial.println("EEPROM has been erased!");
 */
 
+  handler.setRetainedCallbacks(&RTCreader, &RTCwriter);
   handler.initStorage();
 
   next_fire = millis() + 5000;
@@ -214,6 +232,7 @@ void setup()
 void loop()
 {
   ArduinoOTA.handle();
+  handler.process();
 
   if(millis() > next_fire)
   {
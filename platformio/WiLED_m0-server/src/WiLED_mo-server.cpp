@@ -23,8 +23,14 @@
 
 #include <SPI.h>
 #include <RH_RF69.h>
+#include <FlashStorage.h>
 
 #include <WiLEDProto.h>
+#include <WiLEDJournal.h>
+#include <WiLPLink.h>
+#ifdef WiLP_TRACE
+#include <WiLPTrace.h>
+#endif
 
 // Hard-wired pins for Feather M0
 #define RFM69_CS      8
@@ -32,23 +38,315 @@
 #define RFM69_RST     4
 #define LED           13
 
+// Serial1, the hardware UART on the TX and RX pins, carries the binary
+// WiLPLink protocol to the host computer through a USB serial adapter, see
+// WiLED_native-linkd for the other end. The USB port is left for debug.
+#define LINK_BAUD     921600
+#define LINK_STATS_MILLIS 1000
+// Built with -DWiLP_TRACE, the trace histograms are printed on the USB port
+// whenever a byte is sent to it, and cleared if that byte is 'c'
+#define TRACE_BAUD    115200
+
 // Singleton instance of the radio driver
 RH_RF69 rf69(RFM69_CS, RFM69_IRQ);
 
+// The M0 has no EEPROM, so the reserved Reset Counter and the known
+// addresses are kept in a journal in its own flash. Each journal sector is
+// one 256 byte NVM row, the smallest part that can be erased, and writes are
+// whole 4-byte words. A WiLEDProto of 100 addresses needs at least 9.
+#define JOURNAL_SECTOR_SIZE   256
+#define JOURNAL_SECTOR_COUNT  32
+
+// Uploading a sketch writes this region back to zeros, which the journal
+// reads as blank
+__attribute__((__aligned__(JOURNAL_SECTOR_SIZE)))
+const uint8_t journal_region[JOURNAL_SECTOR_SIZE * JOURNAL_SECTOR_COUNT] = {};
+FlashClass journal_flash(journal_region, sizeof(journal_region));
+
+// Create functions to pass to the journal, addressing the region from 0.
+// Reads go through FlashClass too, so they are never taken from the zeros
+// the compiler knows the array was built with.
+void flashReader(uint32_t inAddress, uint8_t* outData, uint16_t inLength){
+  journal_flash.read(&journal_region[inAddress], outData, inLength);
+}
+void flashWriter(uint32_t inAddress, const uint8_t* inData, uint16_t inLength){
+  journal_flash.write(&journal_region[inAddress], inData, inLength);
+}
+void flashEraser(uint16_t inSector){
+  journal_flash.erase(&journal_region[(uint32_t)inSector * JOURNAL_SECTOR_SIZE], JOURNAL_SECTOR_SIZE);
+}
+
+WiLEDJournal journal(&flashReader, &flashWriter, &flashEraser, JOURNAL_SECTOR_SIZE, JOURNAL_SECTOR_COUNT);
+WiLEDProto handler(0x0001, 0, 0, 0);
+
+
+// Nothing in loop() waits on the radio or the serial link. The radio's
+// interrupt fills the driver's receive buffer, which is emptied into the RX
+// ring straight away so the radio can listen again. Frames are then
+// processed from the ring, and replies wait in the TX ring until the radio
+// is free to send them. Both rings are fixed arrays, there is no heap use.
+struct RadioFrame {
+  uint32_t micros;
+  int16_t rssi;
+  uint8_t length;
+  uint8_t data[RH_RF69_MAX_MESSAGE_LEN];
+};
+
+#define FRAME_RING_SLOTS 8
+
+struct FrameRing {
+  RadioFrame slots[FRAME_RING_SLOTS];
+  uint8_t head = 0;
+  uint8_t count = 0;
+
+  // The slot to fill in next, or 0 if the ring is full
+  RadioFrame* back(){
+    return (count == FRAME_RING_SLOTS) ? 0 : &slots[(head + count) % FRAME_RING_SLOTS];
+  }
+  // Add the slot returned by back()
+  void push(){
+    count++;
+  }
+  RadioFrame* front(){
+    return (count == 0) ? 0 : &slots[head];
+  }
+  void pop(){
+    head = (head + 1) % FRAME_RING_SLOTS;
+    count--;
+  }
+};
+
+FrameRing rx_ring;
+FrameRing tx_ring;
+
+// Sent back for each frame with a message that passed the counter checks,
+// the ping test client prints it as text
+const uint8_t ACK_FRAME[] = "Received";
+
+// Acks that didn't fit in the TX ring
+uint32_t acks_dropped = 0;
+
+
+// Encoded link packets wait here until Serial1 can take them
+#define LINK_RING_SIZE 2048
+uint8_t link_ring_buffer[LINK_RING_SIZE];
+WiLPSerialRing link_ring(link_ring_buffer, LINK_RING_SIZE);
+WiLPSerialDecoder link_decoder;
+WiLPLinkBatch link_batch;
+WiLPLinkStats link_stats = {0, 0, 0};
+uint32_t last_stats = 0;
+
+// Hand Serial1 as much of the ring as it has room for, without blocking
+void drainLink(){
+  const uint8_t* data;
+  uint16_t length = link_ring.peek(&data);
+  int room = Serial1.availableForWrite();
+  if(room <= 0 || length == 0){
+    return;
+  }
+  if(length > room){
+    length = room;
+  }
+  link_ring.consume(Serial1.write(data, length));
+}
+
+// Move the batch of received frames into the ring
+void flushBatch(){
+  uint8_t frames = link_batch.getFrameCount();
+  if(frames == 0){
+    return;
+  }
+  uint8_t encoded[WiLP_LINK_MAXIMUM_ENCODED];
+  uint8_t length = link_batch.encode(encoded);
+  if(!link_ring.write(encoded, length)){
+    link_stats.dropped += frames;
+  }
+}
+
+// Queue a short packet, such as a result or the totals
+void sendLinkPacket(const uint8_t* inPacket, uint8_t inLength){
+  uint8_t encoded[WiLP_LINK_MAXIMUM_ENCODED];
+  link_ring.write(encoded, WiLPSerialFrame::encode(inPacket, inLength, encoded));
+}
+
+// Stage and queue each message the host asks for, and tell it the outcome.
+// Each message is longer than its result, so bytes are only read while there
+// is room to answer, the rest wait in the UART buffer.
+void readLink(){
+  while(Serial1.available() > 0 && link_ring.getFree() >= WiLP_LINK_MAXIMUM_ENCODED){
+    if(!link_decoder.push(Serial1.read())){
+      continue;
+    }
+    WiLPLinkMessage message;
+    if(!WiLPLink::readMessage(link_decoder.getPacket(), link_decoder.getLength(), &message)){
+      continue;
+    }
+    uint8_t result = WiLP_RETURN_INVALID_BUFFER;
+    if(message.payload_length == WiLEDProto::getPayloadLength(message.type)){
+      result = handler.sendMessage(message.destination, message.type, message.payload);
+    } else if(WiLEDProto::getPayloadLength(message.type) == WiLP_PAYLOAD_UNKNOWN){
+      result = WiLP_RETURN_UNKNOWN_TYPE;
+    }
+    if(result == WiLP_RETURN_SUCCESS){
+      result = handler.queueMessage(WiLP_PRIORITY_NORMAL);
+    }
+    uint8_t packet[WiLP_LINK_MAXIMUM_PACKET];
+    sendLinkPacket(packet, WiLPLink::writeResult(packet, message.sequence, result));
+  }
+}
+
+// Batches are sent once full or old enough, or straight away if the link
+// is idle, so they only grow while Serial1 is busy
+void serviceLink(){
+  readLink();
+  if(link_batch.getFrameCount() != 0
+    && (link_ring.getUsed() == 0 || millis() - link_batch.getStartMillis() >= WiLP_LINK_BATCH_MILLIS)){
+    flushBatch();
+  }
+  if(millis() - last_stats >= LINK_STATS_MILLIS){
+    last_stats = millis();
+    uint8_t packet[WiLP_LINK_MAXIMUM_PACKET];
+    sendLinkPacket(packet, WiLPLink::writeStats(packet, link_stats));
+  }
+  drainLink();
+}
+
+
+// Move a frame from the driver into the RX ring, if one has arrived
+void receiveFrames(){
+  if(!rf69.available()){
+    return;
+  }
+  RadioFrame* frame = rx_ring.back();
+  if(frame == 0){
+    // Leave it in the driver, the radio stays off until there is room
+    return;
+  }
+  frame->length = sizeof(frame->data);
+  if(rf69.recv(frame->data, &frame->length)){
+    frame->micros = micros();
+    #ifdef WiLP_TRACE
+    WiLPTrace::frame(WiLP_TRACE_RECEIVE, frame->data, frame->length);
+    #endif
+    frame->rssi = rf69.lastRssi();
+    rx_ring.push();
+    link_stats.received++;
+  }
+}
+
+
+// Run one received frame through the protocol, pass it on to the host, and
+// queue an ack if any of its messages were accepted
+void processFrame(const RadioFrame& inFrame){
+  WiLPBatchResult results[WiLP_MAXIMUM_AGGREGATE_MESSAGES];
+  uint8_t count = handler.processFrame(inFrame.data, inFrame.length, results, WiLP_MAXIMUM_AGGREGATE_MESSAGES);
+  bool accepted = false;
+  uint8_t validations[WiLP_MAXIMUM_AGGREGATE_MESSAGES];
+  for(uint8_t idx = 0; idx < count; idx++){
+    validations[idx] = results[idx].validation;
+    if(results[idx].validation == WiLP_RETURN_SUCCESS || results[idx].validation == WiLP_RETURN_ADDED_ADDRESS){
+      accepted = true;
+    }
+  }
+  if(!link_batch.add(inFrame.micros, inFrame.rssi, validations, count, inFrame.data, inFrame.length)){
+    flushBatch();
+    link_batch.add(inFrame.micros, inFrame.rssi, validations, count, inFrame.data, inFrame.length);
+  }
+  if(!accepted){
+    // Invalid messages get no acknowledgement
+    return;
+  }
+  RadioFrame* ack = tx_ring.back();
+  if(ack == 0){
+    acks_dropped++;
+    return;
+  }
+  memcpy(ack->data, ACK_FRAME, sizeof(ACK_FRAME));
+  ack->length = sizeof(ACK_FRAME);
+  tx_ring.push();
+}
+
+
+// Sending is a small state machine, advanced a step each time round loop()
+enum TxState {
+  TX_IDLE,
+  // The channel was busy, wait a little before trying again
+  TX_BACKOFF,
+  // The radio is sending a frame
+  TX_SENDING
+};
+TxState tx_state = TX_IDLE;
+uint32_t tx_backoff_until = 0;
+
+void serviceTx(){
+  if(tx_state == TX_SENDING){
+    if(rf69.mode() == RHGenericDriver::RHModeTx){
+      return;
+    }
+    link_stats.sent++;
+    tx_state = TX_IDLE;
+  }
+  if(tx_state == TX_BACKOFF){
+    if((int32_t)(millis() - tx_backoff_until) < 0){
+      return;
+    }
+    tx_state = TX_IDLE;
+  }
+
+  // Acks go first, then anything the protocol has queued, packed together
+  RadioFrame* frame = tx_ring.front();
+  if(frame == 0 && handler.getQueuedCount() != 0){
+    frame = tx_ring.back();
+    frame->length = handler.appendQueuedToFrame(frame->data, 0, WiLP_MAXIMUM_AGGREGATE_LENGTH);
+    tx_ring.push();
+  }
+  if(frame == 0){
+    return;
+  }
+  // The same check as waitCAD(), without waiting
+  if(rf69.isChannelActive()){
+    tx_backoff_until = millis() + random(1, 10);
+    tx_state = TX_BACKOFF;
+    return;
+  }
+  // The previous frame has finished, so send() starts this one and returns
+  #ifdef WiLP_TRACE
+  WiLPTrace::frame(WiLP_TRACE_SEND, frame->data, frame->length);
+  #endif
+  rf69.send(frame->data, frame->length);
+  tx_ring.pop();
+  tx_state = TX_SENDING;
+}
+
+
+#ifdef WiLP_TRACE
+void serviceTrace(){
+  if(Serial.available() > 0){
+    char command = Serial.read();
+    WiLPTrace::dump();
+    if(command == 'c'){
+      WiLPTrace::clear();
+    }
+  }
+}
+#endif
+
+
 void setup()
 {
   pinMode(LED, OUTPUT);
-  Serial1.begin(115200);
-
-  Serial1.println(F("Feather M0 RFM69 RX Test!"));
-  Serial1.println();
+  Serial1.begin(LINK_BAUD);
+  #ifdef WiLP_TRACE
+  Serial.begin(TRACE_BAUD);
+  #endif
 
+  // The link is binary, so problems show up on the LED instead
   if (!rf69.init())
-    Serial1.println("init failed");
+    digitalWrite(LED, HIGH);
   // Defaults after init are 434.0MHz, modulation GFSK_Rb250Fd250, +13dbM (for low power module)
   // No encryption
   if (!rf69.setFrequency(915.0))
-    Serial1.println("setFrequency failed");
+    digitalWrite(LED, HIGH);
 
   // If you are using a high power RF69 eg RFM69HW, you *must* set a Tx power with the
   // ishighpowermodule flag set like this:
@@ -60,48 +358,33 @@ void setup()
                     0x1F, 0x44, 0xE1, 0x66, 0x65, 0x55, 0xF0, 0xB6
                   };
   rf69.setEncryptionKey(key);
-  rf69.setCADTimeout(2);
-}
+  // No CAD timeout, so send() never waits for the channel. serviceTx()
+  // checks it first instead.
+  rf69.setCADTimeout(0);
 
-String message = "";
+  // Without this the coordinator would start at Reset Counter 1 after every
+  // restart, and the lamps would refuse what it sends
+  handler.setJournal(&journal);
+  handler.initStorage();
+}
 
 void loop()
 {
-  if (rf69.available())
+  receiveFrames();
+
+  RadioFrame* frame = rx_ring.front();
+  if (frame != 0)
   {
     digitalWrite(LED, HIGH);
-    // Should be a message for us now
-    uint8_t buf[RH_RF69_MAX_MESSAGE_LEN];
-    uint8_t len = sizeof(buf);
-    if (rf69.recv(buf, &len))
-    {
-      Serial1.print("HEX: ");
-      for(int idx=0; idx<20; idx++){
-        Serial1.print(buf[idx], HEX);
-        Serial1.print(" ");
-      }
-      Serial1.println(". ");
-
-      Serial1.print("RSSI: ");
-      Serial1.println(rf69.lastRssi(), DEC);
-
-      message = "Received";
-
-      uint8_t buf2[RH_RF69_MAX_MESSAGE_LEN];
-
-      message.toCharArray((char *)buf2, message.length());
-
-      // Send a reply
-      rf69.waitCAD();
-      rf69.send(buf2, message.length());
-      rf69.waitPacketSent();
-      Serial1.println("Sent a reply");
-      Serial1.println();
-    }
-    else
-    {
-      Serial1.println("recv failed");
-    }
+    processFrame(*frame);
+    rx_ring.pop();
     digitalWrite(LED, LOW);
   }
+
+  handler.process();
+  serviceTx();
+  serviceLink();
+  #ifdef WiLP_TRACE
+  serviceTrace();
+  #endif
 }
@@ -0,0 +1,163 @@
+/* Arduino.h
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* A minimal stand-in for the Arduino core, so that the WiLED libraries can
+* be built and measured on a workstation.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ARDUINO_NATIVE_SHIM_H
+#define ARDUINO_NATIVE_SHIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define DEC 10
+#define HEX 16
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+// The clock normally follows real time, but code that depends on time can
+// be stepped through by hand with nativeSetMillis() and nativeAdvanceMillis(),
+// or nativeSetMicros() for finer steps
+struct NativeClock {
+  bool manual = false;
+  uint64_t now_micros = 0;
+};
+
+inline NativeClock& nativeClockInstance(){
+  static NativeClock instance;
+  return instance;
+}
+
+// Milliseconds since the first call, the coarse clock is plenty for this
+inline uint32_t millis(){
+  if(nativeClockInstance().manual){
+    return (uint32_t)(nativeClockInstance().now_micros / 1000);
+  }
+  static struct timespec start = {0, 0};
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  if(start.tv_sec == 0 && start.tv_nsec == 0){
+    start = now;
+  }
+  return (uint32_t)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+}
+
+// Microseconds since the first call, wrapping like the Arduino one
+inline uint32_t micros(){
+  if(nativeClockInstance().manual){
+    return (uint32_t)nativeClockInstance().now_micros;
+  }
+  static struct timespec start = {0, 0};
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if(start.tv_sec == 0 && start.tv_nsec == 0){
+    start = now;
+  }
+  return (uint32_t)((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000);
+}
+
+inline void nativeSetMillis(uint32_t inMillis){
+  nativeClockInstance().manual = true;
+  nativeClockInstance().now_micros = (uint64_t)inMillis * 1000;
+}
+inline void nativeAdvanceMillis(uint32_t inMillis){
+  nativeClockInstance().manual = true;
+  nativeClockInstance().now_micros += (uint64_t)inMillis * 1000;
+}
+inline void nativeSetMicros(uint64_t inMicros){
+  nativeClockInstance().manual = true;
+  nativeClockInstance().now_micros = inMicros;
+}
+// Go back to following real time
+inline void nativeRealMillis(){
+  nativeClockInstance().manual = false;
+}
+
+// Pins are just memory. Inputs are set by the host code with nativeSetPin(),
+// outputs can be read back with nativeGetPin().
+#define NATIVE_PIN_COUNT 64
+
+struct NativePins {
+  uint8_t mode[NATIVE_PIN_COUNT] = {0};
+  uint16_t level[NATIVE_PIN_COUNT] = {0};
+  uint32_t analog_writes = 0;
+};
+
+inline NativePins& nativePinsInstance(){
+  static NativePins instance;
+  return instance;
+}
+
+inline void pinMode(uint8_t inPin, uint8_t inMode){
+  nativePinsInstance().mode[inPin % NATIVE_PIN_COUNT] = inMode;
+}
+inline void digitalWrite(uint8_t inPin, uint8_t inValue){
+  nativePinsInstance().level[inPin % NATIVE_PIN_COUNT] = inValue ? HIGH : LOW;
+}
+inline int digitalRead(uint8_t inPin){
+  return nativePinsInstance().level[inPin % NATIVE_PIN_COUNT] ? HIGH : LOW;
+}
+inline void analogWrite(uint8_t inPin, int inValue){
+  nativePinsInstance().level[inPin % NATIVE_PIN_COUNT] = (uint16_t)inValue;
+  nativePinsInstance().analog_writes++;
+}
+
+inline void nativeSetPin(uint8_t inPin, uint16_t inLevel){
+  nativePinsInstance().level[inPin % NATIVE_PIN_COUNT] = inLevel;
+}
+inline uint16_t nativeGetPin(uint8_t inPin){
+  return nativePinsInstance().level[inPin % NATIVE_PIN_COUNT];
+}
+
+// Serial output goes to stdout, unless it has been muted for benchmarking
+class NativeSerial {
+  public:
+    bool muted = false;
+
+    void print(const char* inText){
+      if(!muted) fputs(inText, stdout);
+    }
+    void print(long inValue, int inBase = DEC){
+      if(!muted) printf(inBase == HEX ? "%lX" : "%ld", inValue);
+    }
+    void println(){
+      if(!muted) fputs("\n", stdout);
+    }
+    void println(const char* inText){
+      print(inText);
+      println();
+    }
+    void println(long inValue, int inBase = DEC){
+      print(inValue, inBase);
+      println();
+    }
+};
+
+// One shared instance across all translation units
+inline NativeSerial& nativeSerialInstance(){
+  static NativeSerial instance;
+  return instance;
+}
+#define Serial (nativeSerialInstance())
+
+#endif
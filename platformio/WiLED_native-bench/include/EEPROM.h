@@ -0,0 +1,84 @@
+/* EEPROM.h
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* A stand-in for the ESP8266 EEPROM emulation, kept in memory, so that
+* sketch code using it can be built and measured on a workstation.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EEPROM_NATIVE_SHIM_H
+#define EEPROM_NATIVE_SHIM_H
+
+#include <Arduino.h>
+
+// The ESP8266 core allows up to one flash sector
+#define NATIVE_EEPROM_MAX_SIZE 4096
+
+class NativeEEPROM {
+  public:
+    // Like the real thing, a fresh EEPROM reads as erased flash
+    NativeEEPROM(){
+      memset(__data, 0xFF, sizeof(__data));
+    }
+
+    void begin(size_t inSize){
+      __size = (inSize > NATIVE_EEPROM_MAX_SIZE) ? NATIVE_EEPROM_MAX_SIZE : inSize;
+    }
+    uint8_t read(int inAddress){
+      if(inAddress < 0 || (size_t)inAddress >= __size){
+        return 0;
+      }
+      return __data[inAddress];
+    }
+    void write(int inAddress, uint8_t inValue){
+      if(inAddress < 0 || (size_t)inAddress >= __size){
+        return;
+      }
+      __dirty |= (__data[inAddress] != inValue);
+      __data[inAddress] = inValue;
+    }
+    // The real commit erases and rewrites a flash sector, but only if
+    // something has changed. Count them, since that is what wears the flash.
+    bool commit(){
+      if(__dirty){
+        commits++;
+        __dirty = false;
+      }
+      return true;
+    }
+    void end(){
+      commit();
+      __size = 0;
+    }
+    size_t length(){
+      return __size;
+    }
+
+    uint32_t commits = 0;
+
+  protected:
+    uint8_t __data[NATIVE_EEPROM_MAX_SIZE];
+    size_t __size = 0;
+    bool __dirty = false;
+};
+
+// One shared instance across all translation units
+inline NativeEEPROM& nativeEEPROMInstance(){
+  static NativeEEPROM instance;
+  return instance;
+}
+#define EEPROM (nativeEEPROMInstance())
+
+#endif
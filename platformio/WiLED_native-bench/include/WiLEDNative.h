@@ -0,0 +1,266 @@
+/* WiLEDNative.h
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* Helpers shared by the Linux tools: serial port and epoll setup, names for
+* the validation codes, and the emulated coordinator that the self tests
+* talk to over a pseudo-terminal.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WILED_NATIVE_H
+#define WILED_NATIVE_H
+
+#include <Arduino.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <vector>
+
+#include <WiLEDProto.h>
+#include <WiLPLink.h>
+
+
+// Put a serial port (or pseudo-terminal) into raw mode at the given speed,
+// and optionally make reads and writes return instead of waiting
+inline bool setupPort(int inDescriptor, uint32_t inBaud, bool inNonBlocking){
+  speed_t speed;
+  switch(inBaud){
+    case 115200: speed = B115200; break;
+    case 230400: speed = B230400; break;
+    case 460800: speed = B460800; break;
+    case 921600: speed = B921600; break;
+    default:
+      fprintf(stderr, "unsupported baud rate %u\n", (unsigned)inBaud);
+      return false;
+  }
+  struct termios options;
+  if(tcgetattr(inDescriptor, &options) != 0){
+    perror("tcgetattr");
+    return false;
+  }
+  cfmakeraw(&options);
+  cfsetispeed(&options, speed);
+  cfsetospeed(&options, speed);
+  options.c_cflag |= (CLOCAL | CREAD);
+  // Return from a blocking read() as soon as anything has arrived
+  options.c_cc[VMIN] = 1;
+  options.c_cc[VTIME] = 0;
+  if(tcsetattr(inDescriptor, TCSANOW, &options) != 0){
+    perror("tcsetattr");
+    return false;
+  }
+  if(!inNonBlocking){
+    return true;
+  }
+  return fcntl(inDescriptor, F_SETFL, fcntl(inDescriptor, F_GETFL) | O_NONBLOCK) == 0;
+}
+
+
+// Add a descriptor to an epoll set, or change what it is watched for
+inline void watch(int inEpoll, int inDescriptor, bool inRead, bool inWrite, bool inAdd){
+  struct epoll_event event;
+  event.events = (inRead ? (uint32_t)EPOLLIN : 0) | (inWrite ? (uint32_t)EPOLLOUT : 0);
+  event.data.fd = inDescriptor;
+  epoll_ctl(inEpoll, inAdd ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, inDescriptor, &event);
+}
+
+
+// Short names for the validation of received messages and the results of
+// sending one. inNotThisDest names whoever a message was not meant for.
+inline const char* validationName(uint8_t inCode, const char* inNotThisDest){
+  switch(inCode){
+    case WiLP_RETURN_SUCCESS: return "VALID";
+    case WiLP_RETURN_ADDED_ADDRESS: return "ADDED NEW";
+    case WiLP_RETURN_INVALID_RST_CTR: return "INVALID RST";
+    case WiLP_RETURN_INVALID_MSG_CTR: return "INVALID MSG";
+    case WiLP_RETURN_AT_MAX_ADDRESSES: return "TABLE FULL";
+    case WiLP_RETURN_INVALID_CHECKSUM: return "BAD CHECKSUM";
+    case WiLP_RETURN_NOT_THIS_DEST: return inNotThisDest;
+    case WiLP_RETURN_UNKNOWN_TYPE: return "UNKNOWN TYPE";
+    case WiLP_RETURN_QUEUE_FULL: return "QUEUE FULL";
+    case WiLP_RETURN_INVALID_BUFFER: return "BAD LENGTH";
+  }
+  return "OTHER ERROR";
+}
+
+
+// Simulated senders only need to keep their own Reset Counter, so they all
+// share one small storage image
+typedef WiLEDProtoCapacity<1> WiLPSender;
+
+inline uint8_t* senderStorage(){
+  static uint8_t storage[WiLPSender::STORAGE_LENGTH];
+  return storage;
+}
+
+inline uint8_t senderReader(uint16_t inAddress){
+  return senderStorage()[inAddress];
+}
+inline void senderWriter(uint16_t inAddress, uint8_t inValue){
+  senderStorage()[inAddress] = inValue;
+}
+inline void senderCommitter(){
+}
+
+// The emulated coordinator starts with nothing stored, like WiLED_m0-server
+// after an upload
+inline uint8_t coordinatorReader(uint16_t){
+  return 0;
+}
+inline void coordinatorWriter(uint16_t, uint8_t){
+}
+
+
+// Stands in for WiLED_m0-server at the other end of a pseudo-terminal. It
+// uses the same WiLEDProto and WiLPLink code, with frames from simulated
+// nodes in place of the radio. Each tool adds how its frames are made.
+class NativeCoordinator {
+  public:
+    NativeCoordinator(int inDescriptor, uint16_t inFirstAddress, uint16_t inNodes)
+      : __descriptor(inDescriptor), __ring(__ring_buffer, sizeof(__ring_buffer)),
+        __receiver(0x0001, &coordinatorReader, &coordinatorWriter, &senderCommitter) {
+      __receiver.initStorage();
+      for(uint16_t node = 0; node < inNodes; node++){
+        __senders.push_back(new WiLPSender(inFirstAddress + node, &senderReader, &senderWriter, &senderCommitter));
+        __senders.back()->initStorage();
+      }
+    }
+    virtual ~NativeCoordinator(){
+      for(size_t idx = 0; idx < __senders.size(); idx++){
+        delete __senders[idx];
+      }
+    }
+
+    bool wantsWrite(){
+      return __ring.getUsed() != 0;
+    }
+
+    bool onWritable(){
+      while(__ring.getUsed() != 0){
+        const uint8_t* data;
+        uint16_t length = __ring.peek(&data);
+        ssize_t written = write(__descriptor, data, length);
+        if(written > 0){
+          __ring.consume(written);
+        } else if(written < 0 && errno == EINTR){
+          continue;
+        } else {
+          return (written < 0 && errno == EAGAIN);
+        }
+      }
+      return true;
+    }
+
+    // Stage and queue each message, and send it straight away
+    bool onReadable(){
+      uint8_t chunk[4096];
+      while(true){
+        // Each message is longer than its result, so only read as much as
+        // there is room to answer. The rest waits in the terminal.
+        if(__ring.getFree() < 2 * WiLP_LINK_MAXIMUM_ENCODED){
+          return true;
+        }
+        size_t room = __ring.getFree() - WiLP_LINK_MAXIMUM_ENCODED;
+        ssize_t length = read(__descriptor, chunk, (room < sizeof(chunk)) ? room : sizeof(chunk));
+        if(length < 0 && errno == EINTR){
+          continue;
+        }
+        if(length <= 0){
+          return (length < 0 && errno == EAGAIN);
+        }
+        for(ssize_t idx = 0; idx < length; idx++){
+          if(!__decoder.push(chunk[idx])){
+            continue;
+          }
+          WiLPLinkMessage message;
+          if(!WiLPLink::readMessage(__decoder.getPacket(), __decoder.getLength(), &message)){
+            continue;
+          }
+          __onMessage(message);
+          uint8_t result = WiLP_RETURN_INVALID_BUFFER;
+          if(message.payload_length == WiLEDProto::getPayloadLength(message.type)){
+            result = __receiver.sendMessage(message.destination, message.type, message.payload);
+          }
+          if(result == WiLP_RETURN_SUCCESS){
+            result = __receiver.queueMessage(WiLP_PRIORITY_NORMAL);
+          }
+          uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+          while(__receiver.copyQueuedToBuffer(frame) != 0){
+            __stats.sent++;
+          }
+          uint8_t packet[WiLP_LINK_MAXIMUM_PACKET];
+          __sendPacket(packet, WiLPLink::writeResult(packet, message.sequence, result));
+        }
+      }
+    }
+
+    const WiLPLinkStats& getStats(){
+      return __stats;
+    }
+
+  protected:
+    int __descriptor;
+    uint8_t __ring_buffer[8192];
+    WiLPSerialRing __ring;
+    WiLPSerialDecoder __decoder;
+    WiLPLinkBatch __batch;
+    WiLEDProto __receiver;
+    std::vector<WiLPSender*> __senders;
+    WiLPLinkStats __stats = {0, 0, 0};
+
+    // Called with each message from the host, before it is staged
+    virtual void __onMessage(const WiLPLinkMessage&){
+    }
+
+    // Check a frame from one of the senders and add it to the batch,
+    // sending the batch first if it is full
+    void __receiveFrame(const uint8_t* inFrame, uint8_t inLength, uint32_t inMicros, int8_t inRssi){
+      WiLPBatchResult results[WiLP_MAXIMUM_AGGREGATE_MESSAGES];
+      uint8_t count = __receiver.processFrame(inFrame, inLength, results, WiLP_MAXIMUM_AGGREGATE_MESSAGES);
+      uint8_t validations[WiLP_MAXIMUM_AGGREGATE_MESSAGES];
+      for(uint8_t idx = 0; idx < count; idx++){
+        validations[idx] = results[idx].validation;
+      }
+      if(!__batch.add(inMicros, inRssi, validations, count, inFrame, inLength)){
+        __flush();
+        __batch.add(inMicros, inRssi, validations, count, inFrame, inLength);
+      }
+      __stats.received++;
+    }
+
+    // Send the batch, returns how many frames it held
+    virtual uint8_t __flush(){
+      uint8_t frames = __batch.getFrameCount();
+      if(frames == 0){
+        return 0;
+      }
+      uint8_t encoded[WiLP_LINK_MAXIMUM_ENCODED];
+      if(!__ring.write(encoded, __batch.encode(encoded))){
+        __stats.dropped += frames;
+      }
+      return frames;
+    }
+
+    void __sendPacket(const uint8_t* inPacket, uint8_t inLength){
+      uint8_t encoded[WiLP_LINK_MAXIMUM_ENCODED];
+      __ring.write(encoded, WiLPSerialFrame::encode(inPacket, inLength, encoded));
+    }
+};
+
+#endif
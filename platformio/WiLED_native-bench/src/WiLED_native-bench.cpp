@@ -0,0 +1,1155 @@
+/* WiLED_native-bench.cpp
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* A host-side benchmark for the WiLED libraries, built with the PlatformIO
+* "native" platform.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <Arduino.h>
+
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#include <LEDOutput.h>
+#include <Rotary.h>
+#include <WiLEDProto.h>
+#include <WiLEDMmapStore.h>
+
+
+// Count heap allocations, so that a hot path that starts allocating shows up
+uint64_t allocations = 0;
+
+void* operator new(size_t inSize){
+  allocations++;
+  void* block = malloc(inSize ? inSize : 1);
+  if(block == 0){
+    throw std::bad_alloc();
+  }
+  return block;
+}
+void operator delete(void* inBlock) noexcept {
+  free(inBlock);
+}
+
+
+const uint16_t BENCH_ADDRESS = 0x0001;
+
+// Checks that fail are counted here, and make the exit status non-zero
+uint32_t failures = 0;
+
+// Emulated EEPROM, large enough for the storage image at any capacity
+uint8_t storage[65536];
+
+uint8_t storageReader(uint16_t inAddress){
+  return storage[inAddress];
+}
+void storageWriter(uint16_t inAddress, uint8_t inValue){
+  storage[inAddress] = inValue;
+}
+uint32_t storage_commits = 0;
+void storageCommitter(){
+  storage_commits++;
+}
+void storageBlockReader(uint16_t inAddress, uint8_t* outData, uint16_t inLength){
+  memcpy(outData, &storage[inAddress], inLength);
+}
+void storageBlockWriter(uint16_t inAddress, const uint8_t* inData, uint16_t inLength){
+  memcpy(&storage[inAddress], inData, inLength);
+}
+
+
+// Simulated NOR flash for the journal: writes can only clear bits, and an
+// erase sets a whole sector back to 0xFF. Smaller sectors can be used to
+// make the ring wrap sooner.
+#define FLASH_SECTOR_SIZE 4096
+#define FLASH_SECTOR_COUNT 8
+uint8_t flash[FLASH_SECTOR_SIZE * FLASH_SECTOR_COUNT];
+uint16_t flash_sector_size = FLASH_SECTOR_SIZE;
+uint32_t flash_writes = 0;
+uint32_t flash_erases = 0;
+
+void flashReader(uint32_t inAddress, uint8_t* outData, uint16_t inLength){
+  memcpy(outData, &flash[inAddress], inLength);
+}
+void flashWriter(uint32_t inAddress, const uint8_t* inData, uint16_t inLength){
+  flash_writes++;
+  for(uint16_t idx = 0; idx < inLength; idx++){
+    flash[inAddress + idx] &= inData[idx];
+  }
+}
+void flashEraser(uint16_t inSector){
+  memset(&flash[(uint32_t)inSector * flash_sector_size], 0xFF, flash_sector_size);
+  flash_erases++;
+}
+
+
+// Write the checksum of a frame after its header or counters have changed
+void sealFrame(uint8_t* ioBuffer){
+  uint8_t checked_length = WiLPMessageView::HEADER_LENGTH + WiLEDProto::getPayloadLength(ioBuffer[WiLPMessageView::OFFSET_TYPE]);
+  uint16_t checksum = WiLPChecksum::crc16(ioBuffer, checked_length);
+  ioBuffer[checked_length] = (checksum >> 8);
+  ioBuffer[checked_length + 1] = (checksum);
+}
+
+
+// Fill in a Beacon frame from the given source with the given counters
+void makeFrame(uint8_t* outBuffer, uint16_t inSource, uint16_t inResetCounter, uint16_t inMessageCounter){
+  memset(outBuffer, 0, MAXIMUM_MESSAGE_LENGTH);
+  outBuffer[0] = 0xAA;
+  outBuffer[1] = (inSource >> 8);
+  outBuffer[2] = (inSource);
+  outBuffer[3] = 0xFF;
+  outBuffer[4] = 0xFF;
+  outBuffer[5] = (inResetCounter >> 8);
+  outBuffer[6] = (inResetCounter);
+  outBuffer[7] = (inMessageCounter >> 8);
+  outBuffer[8] = (inMessageCounter);
+  outBuffer[9] = WiLP_Beacon;
+  sealFrame(outBuffer);
+}
+
+
+// Measure the cost of processMessage() with a given number of known peers,
+// in a handler with room for Capacity of them
+template <uint16_t Capacity>
+void benchPeerTable(uint16_t inKnownNodes){
+  memset(storage, 0, sizeof(storage));
+  WiLEDProtoCapacity<Capacity>* handler = new WiLEDProtoCapacity<Capacity>(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+  uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+
+  // Teach the handler about every node first, these frames are not timed
+  for(uint16_t node = 0; node < inKnownNodes; node++){
+    makeFrame(frame, 0x1000 + node, 1, 1);
+    handler->processMessage(frame);
+  }
+
+  // Then cycle through the nodes with increasing message counters, stopping
+  // well before the message counters would overflow
+  uint32_t total_frames = 2000000;
+  if(total_frames > inKnownNodes * 60000UL){
+    total_frames = inKnownNodes * 60000UL;
+  }
+  uint32_t valid = 0;
+  uint16_t counter = 2;
+  uint16_t node = 0;
+  uint64_t allocations_before = allocations;
+  auto start = std::chrono::steady_clock::now();
+  for(uint32_t idx = 0; idx < total_frames; idx++){
+    makeFrame(frame, 0x1000 + node, 1, counter);
+    handler->processMessage(frame);
+    if(handler->getLastReceivedMessageCounterValidation() == WiLP_RETURN_SUCCESS){
+      valid++;
+    }
+    node++;
+    if(node == inKnownNodes){
+      node = 0;
+      counter++;
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  if(valid != total_frames){
+    failures++;
+  }
+
+  printf("peer table  %6u known nodes  %8.1f ns/frame  %4.2f allocs/frame  (%u/%u valid)  capacity %5u  %7u bytes\n",
+    inKnownNodes, ns / total_frames, (double)(allocations - allocations_before) / total_frames,
+    (unsigned)valid, (unsigned)total_frames, Capacity, (unsigned)sizeof(WiLEDProtoCapacity<Capacity>));
+  delete handler;
+}
+
+
+// Deliver frames from many nodes with some swapped, repeated or dropped, as
+// relays and retransmissions would, and check the counter window sorts it out.
+// Nothing falls behind the window, so the totals can be worked out exactly.
+void benchReorder(uint16_t inKnownNodes){
+  WiLEDProto* handler = new WiLEDProto(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+  uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+  const uint32_t total_frames = 2000000;
+  // Pairs of counters from 1, keeping clear of a Message Counter overflow
+  uint32_t sent_counters = total_frames / inKnownNodes;
+  if(sent_counters > 60000){
+    sent_counters = 60000;
+  }
+  sent_counters &= ~1UL;
+  uint32_t random = 12345;
+  uint32_t delivered = 0;
+  WiLPCounterStats expected = {0, 0, 0, 0, 0};
+  auto start = std::chrono::steady_clock::now();
+  for(uint32_t counter = 1; counter < sent_counters; counter += 2){
+    for(uint16_t node = 0; node < inKnownNodes; node++){
+      // Each pair of counters arrives in order, swapped, with a repeat, or
+      // with the first one lost
+      random = random * 1103515245 + 12345;
+      uint8_t pattern = (random >> 16) % 8;
+      uint16_t first = (pattern == 1) ? counter + 1 : counter;
+      uint16_t second = (pattern == 1) ? counter : counter + 1;
+      if(pattern != 2){
+        makeFrame(frame, 0x1000 + node, 1, first);
+        handler->processMessage(frame, WiLEDProto::getFrameLength(WiLP_Beacon));
+        delivered++;
+        expected.accepted++;
+      } else if(counter + WiLP_REPLAY_WINDOW <= sent_counters){
+        // Only counted once it has left the window, which the last few
+        // never do
+        expected.lost++;
+      }
+      makeFrame(frame, 0x1000 + node, 1, second);
+      handler->processMessage(frame, WiLEDProto::getFrameLength(WiLP_Beacon));
+      delivered++;
+      if(pattern == 1){
+        expected.late++;
+      } else {
+        expected.accepted++;
+      }
+      if(pattern == 3){
+        handler->processMessage(frame, WiLEDProto::getFrameLength(WiLP_Beacon));
+        delivered++;
+        expected.duplicates++;
+      }
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  WiLPCounterStats stats = handler->getCounterStats();
+  if(stats.accepted != expected.accepted || stats.late != expected.late || stats.duplicates != expected.duplicates
+    || stats.too_old != expected.too_old || stats.lost != expected.lost){
+    failures++;
+  }
+  printf("reorder     %6u known nodes  %8.1f ns/frame  accepted %u/%u  late %u/%u  duplicates %u/%u  too old %u/%u  lost %u/%u\n",
+    inKnownNodes, ns / delivered, (unsigned)stats.accepted, (unsigned)expected.accepted,
+    (unsigned)stats.late, (unsigned)expected.late, (unsigned)stats.duplicates, (unsigned)expected.duplicates,
+    (unsigned)stats.too_old, (unsigned)expected.too_old, (unsigned)stats.lost, (unsigned)expected.lost);
+  delete handler;
+}
+
+
+// Compare processMessages() on bursts of frames against the same frames
+// given one at a time to processMessage() and its getters
+void benchBatch(uint16_t inKnownNodes, uint16_t inBurst){
+  WiLEDProto* handler = new WiLEDProto(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+  uint8_t frames[inBurst][MAXIMUM_MESSAGE_LENGTH];
+  const uint8_t* frame_pointers[inBurst];
+  uint8_t frame_lengths[inBurst];
+  WiLPBatchResult results[inBurst];
+  for(uint16_t node = 0; node < inKnownNodes; node++){
+    makeFrame(frames[0], 0x1000 + node, 1, 1);
+    handler->processMessage(frames[0]);
+  }
+  for(uint16_t idx = 0; idx < inBurst; idx++){
+    makeFrame(frames[idx], 0, 1, 1);
+    frame_pointers[idx] = frames[idx];
+    frame_lengths[idx] = WiLEDProto::getFrameLength(WiLP_Beacon);
+  }
+
+  const uint32_t total_bursts = 2000000 / inBurst;
+  double ns[2];
+  uint32_t valid[2] = {0, 0};
+  for(uint8_t batched = 0; batched < 2; batched++){
+    // Sources are spread across the table, each round bumps the counters
+    uint16_t counter = 2;
+    uint32_t node = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(uint32_t burst = 0; burst < total_bursts; burst++){
+      for(uint16_t idx = 0; idx < inBurst; idx++){
+        // Only the source and counter change, so skip the rest of makeFrame()
+        uint16_t source = 0x1000 + (node * 7919) % inKnownNodes;
+        frames[idx][1] = (source >> 8);
+        frames[idx][2] = (source);
+        frames[idx][7] = (counter >> 8);
+        frames[idx][8] = (counter);
+        sealFrame(frames[idx]);
+        node++;
+        if(node == inKnownNodes){
+          node = 0;
+          counter++;
+        }
+      }
+      if(batched){
+        valid[1] += handler->processMessages(frame_pointers, frame_lengths, inBurst, results);
+      } else {
+        for(uint16_t idx = 0; idx < inBurst; idx++){
+          results[idx].status = handler->processMessage(frames[idx]);
+          results[idx].source = handler->getLastReceivedSource();
+          results[idx].type = handler->getLastReceivedType();
+          results[idx].validation = handler->getLastReceivedMessageCounterValidation();
+          if(results[idx].status == WiLP_RETURN_SUCCESS){
+            valid[0]++;
+          }
+        }
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    ns[batched] = std::chrono::duration<double, std::nano>(end - start).count() / (total_bursts * inBurst);
+    // Start the second run from fresh counters
+    delete handler;
+    handler = new WiLEDProto(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+    for(uint16_t node = 0; node < inKnownNodes; node++){
+      makeFrame(frames[0], 0x1000 + node, 1, 1);
+      handler->processMessage(frames[0]);
+    }
+  }
+  printf("batch       %6u known nodes  burst %3u  %6.1f ns/frame single  %6.1f ns/frame batched  (%u/%u valid)\n",
+    inKnownNodes, inBurst, ns[0], ns[1], (unsigned)valid[0], (unsigned)valid[1]);
+  delete handler;
+}
+
+
+// Fill the outgoing queue of a lamp sized handler, which only has room for
+// WiLP_LAMP_QUEUE_LENGTH messages of each priority, and check that they come
+// out high priority first and otherwise in order
+void benchLampQueue(){
+  WiLEDProtoLamp* handler = new WiLEDProtoLamp(BENCH_ADDRESS, 0, 0, 0);
+  uint32_t wrong = 0;
+  for(uint8_t priority = 0; priority < WiLP_PRIORITY_LEVELS; priority++){
+    for(uint8_t idx = 0; idx <= WiLP_LAMP_QUEUE_LENGTH; idx++){
+      handler->sendMessageBeacon(priority * 100 + idx);
+      uint8_t result = handler->queueMessage(priority);
+      if(result != (idx < WiLP_LAMP_QUEUE_LENGTH ? WiLP_RETURN_SUCCESS : WiLP_RETURN_QUEUE_FULL)){
+        wrong++;
+      }
+    }
+  }
+  uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+  for(uint8_t priority = 0; priority < WiLP_PRIORITY_LEVELS; priority++){
+    for(uint8_t idx = 0; idx < WiLP_LAMP_QUEUE_LENGTH; idx++){
+      if(handler->copyQueuedToBuffer(frame) == 0 || frame[WiLPMessageView::OFFSET_PAYLOAD + 3] != priority * 100 + idx){
+        wrong++;
+      }
+    }
+  }
+  if(handler->getQueuedCount() != 0){
+    wrong++;
+  }
+  if(wrong != 0){
+    failures++;
+  }
+  printf("lamp queue  %u per priority  (%u wrong)  %u bytes\n",
+    WiLP_LAMP_QUEUE_LENGTH, (unsigned)wrong, (unsigned)sizeof(WiLEDProtoLamp));
+  delete handler;
+}
+
+
+// Fill the EEPROM the way a lamp with 100 addresses left it, then start a
+// WiLEDProtoLamp on it. It must carry on past the old Reset Counter, and
+// still know the addresses in its first slots.
+void benchLampUpgrade(){
+  typedef WiLEDProtoCapacity<WiLP_LAMP_STORAGE_SLOTS> OldLamp;
+  const uint16_t peers = 40;
+  memset(storage, 0, sizeof(storage));
+  uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+  OldLamp* old_lamp = new OldLamp(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+  old_lamp->initStorage();
+  for(uint16_t peer = 0; peer < peers; peer++){
+    makeFrame(frame, 0x1000 + peer, 5, 1);
+    old_lamp->processMessage(frame);
+  }
+  old_lamp->flushStorage();
+  old_lamp->sendMessageBeacon(0);
+  old_lamp->copyToBuffer(frame);
+  uint16_t old_reset_counter = (frame[5] << 8) + frame[6];
+  delete old_lamp;
+
+  WiLEDProtoLamp* lamp = new WiLEDProtoLamp(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+  lamp->initStorage();
+  lamp->sendMessageBeacon(0);
+  lamp->copyToBuffer(frame);
+  uint16_t reset_counter = (frame[5] << 8) + frame[6];
+  uint32_t unknown = 0;
+  for(uint16_t peer = 0; peer < WiLP_LAMP_STORED_ADDRESSES; peer++){
+    // An older Reset Counter is only refused from an address it knows
+    makeFrame(frame, 0x1000 + peer, 4, 1);
+    lamp->processMessage(frame);
+    if(lamp->getLastReceivedMessageCounterValidation() != WiLP_RETURN_INVALID_RST_CTR){
+      unknown++;
+    }
+  }
+  if(reset_counter <= old_reset_counter || unknown != 0){
+    failures++;
+  }
+  printf("lamp upgrade  reset counter %u -> %u  (%u of the first %u addresses unknown)  %u bytes of EEPROM\n",
+    (unsigned)old_reset_counter, (unsigned)reset_counter, (unsigned)unknown, WiLP_LAMP_STORED_ADDRESSES,
+    (unsigned)WiLEDProtoLamp::STORAGE_LENGTH);
+  delete lamp;
+}
+
+
+// Compare sending a run of Beacons from each of many nodes one per radio
+// frame, against packing each node's run into as few frames as possible,
+// for receive cost and time on air
+void benchAggregate(uint8_t inMessages){
+  const uint16_t senders = (MAXIMUM_STORED_ADDRESSES < 1000) ? MAXIMUM_STORED_ADDRESSES : 1000;
+  std::vector<uint8_t> singles((uint32_t)senders * inMessages * MAXIMUM_MESSAGE_LENGTH);
+  std::vector<uint8_t> single_lengths((uint32_t)senders * inMessages);
+  std::vector<uint8_t> packed((uint32_t)senders * inMessages * WiLP_MAXIMUM_AGGREGATE_LENGTH);
+  std::vector<uint8_t> packed_lengths((uint32_t)senders * inMessages);
+  uint32_t packed_count = 0;
+
+  for(uint16_t sender_idx = 0; sender_idx < senders; sender_idx++){
+    // Both ways of sending use the same counters
+    WiLEDProto single_sender(0x1000 + sender_idx, &storageReader, &storageWriter, &storageCommitter);
+    WiLEDProto packed_sender(0x1000 + sender_idx, &storageReader, &storageWriter, &storageCommitter);
+    uint8_t* frame = 0;
+    for(uint8_t idx = 0; idx < inMessages; idx++){
+      uint32_t single = (uint32_t)sender_idx * inMessages + idx;
+      single_sender.sendMessageBeacon(idx);
+      single_lengths[single] = single_sender.copyToBuffer(&singles[single * MAXIMUM_MESSAGE_LENGTH]);
+      packed_sender.sendMessageBeacon(idx);
+      uint8_t length = 0;
+      if(frame != 0){
+        length = packed_sender.appendToFrame(frame, packed_lengths[packed_count - 1], WiLP_MAXIMUM_AGGREGATE_LENGTH);
+      }
+      if(frame != 0 && length > packed_lengths[packed_count - 1]){
+        packed_lengths[packed_count - 1] = length;
+      } else {
+        // Full (or no frame yet), start another one
+        frame = &packed[packed_count * WiLP_MAXIMUM_AGGREGATE_LENGTH];
+        packed_lengths[packed_count] = packed_sender.appendToFrame(frame, 0, WiLP_MAXIMUM_AGGREGATE_LENGTH);
+        packed_count++;
+      }
+    }
+  }
+
+  const uint32_t passes = 50;
+  WiLPBatchResult results[WiLP_MAXIMUM_AGGREGATE_MESSAGES];
+  uint32_t valid[2] = {0, 0};
+  double ns[2] = {0, 0};
+  for(uint8_t aggregated = 0; aggregated < 2; aggregated++){
+    for(uint32_t pass = 0; pass < passes; pass++){
+      // A fresh receiver each pass, so every message is accepted again
+      WiLEDProto* receiver = new WiLEDProto(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+      auto start = std::chrono::steady_clock::now();
+      if(aggregated){
+        for(uint32_t frame = 0; frame < packed_count; frame++){
+          uint8_t count = receiver->processFrame(&packed[frame * WiLP_MAXIMUM_AGGREGATE_LENGTH], packed_lengths[frame],
+            results, WiLP_MAXIMUM_AGGREGATE_MESSAGES);
+          for(uint8_t idx = 0; idx < count; idx++){
+            if(results[idx].status == WiLP_RETURN_SUCCESS){
+              valid[1]++;
+            }
+          }
+        }
+      } else {
+        for(uint32_t single = 0; single < (uint32_t)senders * inMessages; single++){
+          if(receiver->processMessage(&singles[single * MAXIMUM_MESSAGE_LENGTH], single_lengths[single]) == WiLP_RETURN_SUCCESS){
+            valid[0]++;
+          }
+        }
+      }
+      auto end = std::chrono::steady_clock::now();
+      ns[aggregated] += std::chrono::duration<double, std::nano>(end - start).count();
+      delete receiver;
+    }
+    ns[aggregated] /= (double)passes * senders * inMessages;
+  }
+
+  // Each RFM69 packet also carries a 4 byte preamble, 2 byte sync word,
+  // length byte, 4 byte RadioHead header and 2 byte CRC. At 250 kbps a
+  // byte takes 32 us.
+  const uint8_t packet_overhead = 13;
+  uint32_t single_bytes = 0;
+  uint32_t packed_bytes = 0;
+  for(uint8_t idx = 0; idx < inMessages; idx++){
+    single_bytes += packet_overhead + single_lengths[idx];
+  }
+  for(uint32_t frame = 0; frame < packed_count / senders; frame++){
+    packed_bytes += packet_overhead + packed_lengths[frame];
+  }
+  printf("aggregate   %3u beacons/node  %2u packets %5u us on air %6.1f ns/msg  ->  %2u packets %5u us on air %6.1f ns/msg  (%u/%u valid)\n",
+    inMessages, inMessages, (unsigned)(single_bytes * 32), ns[0],
+    (unsigned)(packed_count / senders), (unsigned)(packed_bytes * 32), ns[1], (unsigned)valid[0], (unsigned)valid[1]);
+}
+
+
+// Measure parseMessage() on its own, which only reads the buffer
+void benchParse(){
+  const uint16_t frame_count = 64;
+  uint8_t frames[frame_count][MAXIMUM_MESSAGE_LENGTH];
+  for(uint16_t idx = 0; idx < frame_count; idx++){
+    makeFrame(frames[idx], 0x1000 + idx, 1, idx + 1);
+  }
+  const uint32_t total_frames = 10000000;
+  uint32_t checksum = 0;
+  uint64_t allocations_before = allocations;
+  auto start = std::chrono::steady_clock::now();
+  for(uint32_t idx = 0; idx < total_frames; idx++){
+    WiLPMessageView message = WiLEDProto::parseMessage(frames[idx % frame_count], MAXIMUM_MESSAGE_LENGTH);
+    if(message.isValid()){
+      checksum += message.getSource() + message.getMessageCounter() + message.getPayloadByte(3);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  printf("parse view  %8.1f ns/frame  %4.2f allocs/frame  (checksum %u)\n", ns / total_frames,
+    (double)(allocations - allocations_before) / total_frames, (unsigned)checksum);
+}
+
+
+// Measure each CRC16 kernel over a single Beacon (the checked part of the
+// smallest frame) and over a whole radio packet's worth of data
+void benchChecksum(){
+  uint8_t data[64];
+  for(uint8_t idx = 0; idx < sizeof(data); idx++){
+    data[idx] = idx * 37 + 11;
+  }
+  const uint8_t lengths[] = {WiLPMessageView::HEADER_LENGTH + 4, 60};
+  const char* names[] = {"bitwise", "table", "sliced"};
+  uint16_t (*kernels[])(const uint8_t*, uint16_t) = {
+    &WiLPChecksum::crc16Bitwise,
+    &WiLPChecksum::crc16Table,
+    #ifdef WiLP_CRC16_SLICED
+    &WiLPChecksum::crc16Sliced,
+    #endif
+  };
+  const uint32_t total_runs = 5000000;
+  for(uint8_t kernel = 0; kernel < sizeof(kernels) / sizeof(kernels[0]); kernel++){
+    for(uint8_t size = 0; size < sizeof(lengths); size++){
+      uint16_t result = 0;
+      auto start = std::chrono::steady_clock::now();
+      for(uint32_t run = 0; run < total_runs; run++){
+        // Feed the last result back in, so the calls can't be overlapped
+        data[0] = result;
+        result = kernels[kernel](data, lengths[size]);
+      }
+      auto end = std::chrono::steady_clock::now();
+      double ns = std::chrono::duration<double, std::nano>(end - start).count() / total_runs;
+      printf("crc16       %-8s %3u bytes  %8.1f ns/call  %6.2f ns/byte  (%04X)\n",
+        names[kernel], lengths[size], ns, ns / lengths[size], result);
+    }
+  }
+}
+
+
+// Measure how quickly corrupt frames are turned away, and check that none
+// of them reach the peer table or storage
+void benchCorruptFrames(){
+  memset(storage, 0, sizeof(storage));
+  storage_commits = 0;
+  WiLEDProto* handler = new WiLEDProto(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+  const uint16_t frame_count = 64;
+  uint8_t frames[frame_count][MAXIMUM_MESSAGE_LENGTH];
+  for(uint16_t idx = 0; idx < frame_count; idx++){
+    makeFrame(frames[idx], 0x1000 + idx, 1, 1);
+    // Flip one bit somewhere in the header, payload or checksum
+    frames[idx][1 + idx % 15] ^= (1 << (idx % 8));
+  }
+  const uint32_t total_frames = 2000000;
+  uint32_t rejected = 0;
+  auto start = std::chrono::steady_clock::now();
+  for(uint32_t idx = 0; idx < total_frames; idx++){
+    // A flipped type byte can also make the frame an unknown type
+    if(handler->processMessage(frames[idx % frame_count]) != WiLP_RETURN_SUCCESS){
+      rejected++;
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  handler->flushStorage();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  printf("corrupt     %8.1f ns/frame  (%u/%u rejected, %u commits)\n",
+    ns / total_frames, (unsigned)rejected, (unsigned)total_frames, (unsigned)storage_commits);
+  delete handler;
+}
+
+
+// Cut an aggregated frame short at every length, each copy in a buffer of
+// exactly that size, and check that only the whole messages are accepted
+void benchTruncatedFrames(){
+  WiLEDProto sender(0x1000, &storageReader, &storageWriter, &storageCommitter);
+  uint8_t packed[WiLP_MAXIMUM_AGGREGATE_LENGTH];
+  uint8_t packed_length = 0;
+  for(uint8_t idx = 0; idx < 3; idx++){
+    sender.sendMessageBeacon(idx);
+    packed_length = sender.appendToFrame(packed, packed_length, WiLP_MAXIMUM_AGGREGATE_LENGTH);
+  }
+  const uint8_t message_length = WiLEDProto::getFrameLength(WiLP_Beacon);
+  WiLPBatchResult results[WiLP_MAXIMUM_AGGREGATE_MESSAGES];
+  uint32_t wrong = 0;
+  for(uint8_t length = 1; length <= packed_length; length++){
+    // A fresh receiver each time, so the counters are always new
+    WiLEDProto* receiver = new WiLEDProto(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+    std::vector<uint8_t> frame(packed, packed + length);
+    uint8_t count = receiver->processFrame(&frame[0], length, results, WiLP_MAXIMUM_AGGREGATE_MESSAGES);
+    uint8_t whole = length / message_length;
+    uint8_t accepted = 0;
+    for(uint8_t idx = 0; idx < count; idx++){
+      accepted += (results[idx].status == WiLP_RETURN_SUCCESS);
+    }
+    // Any leftover part of a message is reported as one that can't be read
+    uint8_t expected_count = whole + (length % message_length != 0);
+    if(accepted != whole || count != expected_count
+      || (count > whole && results[count - 1].status != WiLP_RETURN_INVALID_BUFFER)){
+      wrong++;
+    }
+    delete receiver;
+  }
+  if(wrong != 0){
+    failures++;
+  }
+  printf("truncated   %u frame lengths  (%u wrong)\n", (unsigned)packed_length, (unsigned)wrong);
+}
+
+
+// Fill in a Set Groups frame from the coordinator
+void makeSetGroupsFrame(uint8_t* outBuffer, uint16_t inMessageCounter, uint8_t inGroup1, uint8_t inGroup2, uint8_t inGroup3){
+  makeFrame(outBuffer, 0x0001, 1, inMessageCounter);
+  outBuffer[WiLPMessageView::OFFSET_TYPE] = WiLP_Set_Groups;
+  outBuffer[WiLPMessageView::OFFSET_PAYLOAD] = 128;
+  outBuffer[WiLPMessageView::OFFSET_PAYLOAD + 1] = inGroup1;
+  outBuffer[WiLPMessageView::OFFSET_PAYLOAD + 2] = inGroup2;
+  outBuffer[WiLPMessageView::OFFSET_PAYLOAD + 3] = inGroup3;
+  sealFrame(outBuffer);
+}
+
+
+// Measure how quickly a lamp turns away Set Groups broadcasts for groups it
+// isn't in, against the ones it has to act on
+void benchGroups(){
+  memset(storage, 0, sizeof(storage));
+  WiLEDProtoCapacity<16>* handler = new WiLEDProtoCapacity<16>(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+  handler->initStorage();
+  handler->attachGroups(7, 42, 0, 0);
+  uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+  const uint32_t total_frames = 1000000;
+  double ns[2];
+  uint32_t accepted[2] = {0, 0};
+  for(uint8_t mine = 0; mine < 2; mine++){
+    auto start = std::chrono::steady_clock::now();
+    for(uint32_t idx = 0; idx < total_frames; idx++){
+      uint8_t group = mine ? 42 : (uint8_t)(100 + idx % 100);
+      makeSetGroupsFrame(frame, (uint16_t)(idx + 1), group, 0, 0);
+      if(handler->processMessage(frame) == WiLP_RETURN_SUCCESS){
+        accepted[mine]++;
+      }
+    }
+    auto end = std::chrono::steady_clock::now();
+    ns[mine] = std::chrono::duration<double, std::nano>(end - start).count();
+  }
+  printf("set groups  %8.1f ns/frame other groups (%u accepted)  %8.1f ns/frame own group (%u accepted)\n",
+    ns[0] / total_frames, (unsigned)accepted[0], ns[1] / total_frames, (unsigned)accepted[1]);
+  delete handler;
+}
+
+
+// Send Attach Groups messages to a handler: one broadcast, which must be
+// ignored, then one addressed to it. Neither may touch storage until the
+// flush, and the groups must come back after a restart.
+void benchAttachGroups(bool inJournal){
+  memset(storage, 0, sizeof(storage));
+  memset(flash, 0xFF, sizeof(flash));
+  flash_sector_size = FLASH_SECTOR_SIZE;
+  WiLEDJournal journal(&flashReader, &flashWriter, &flashEraser, FLASH_SECTOR_SIZE, FLASH_SECTOR_COUNT);
+  WiLEDProtoCapacity<16>* handler = new WiLEDProtoCapacity<16>(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+  if(inJournal){
+    handler->setJournal(&journal);
+  }
+  handler->initStorage();
+  handler->flushStorage();
+  WiLEDProto sender(0x2000, 0, 0, 0);
+  uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+  uint32_t wrong = 0;
+
+  sender.sendMessageAttachGroups(0xFFFF, 1, 2, 3, 4);
+  sender.copyToBuffer(frame);
+  if(handler->processMessage(frame) != WiLP_RETURN_NOT_THIS_DEST || handler->getGroup(0) != WiLP_GROUP_NONE){
+    wrong++;
+  }
+
+  uint32_t commits_before = storage_commits;
+  uint32_t writes_before = flash_writes;
+  uint8_t storage_before[WiLEDProtoCapacity<16>::STORAGE_LENGTH];
+  memcpy(storage_before, storage, sizeof(storage_before));
+  sender.sendMessageAttachGroups(BENCH_ADDRESS, 5, 6, 7, 8);
+  sender.copyToBuffer(frame);
+  if(handler->processMessage(frame) != WiLP_RETURN_SUCCESS || !handler->isInGroup(7)){
+    wrong++;
+  }
+  uint32_t receive_writes = (storage_commits - commits_before) + (flash_writes - writes_before)
+    + (memcmp(storage_before, storage, sizeof(storage_before)) != 0);
+
+  handler->flushStorage();
+  delete handler;
+  handler = new WiLEDProtoCapacity<16>(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+  if(inJournal){
+    handler->setJournal(&journal);
+  }
+  handler->initStorage();
+  for(uint8_t slot = 0; slot < WiLP_GROUP_SLOTS; slot++){
+    if(handler->getGroup(slot) != 5 + slot){
+      wrong++;
+    }
+  }
+  if(wrong != 0 || receive_writes != 0){
+    failures++;
+  }
+  printf("attach      %s  %u writes while receiving  (%u wrong)\n",
+    inJournal ? "journal" : "image  ", (unsigned)receive_writes, (unsigned)wrong);
+  delete handler;
+}
+
+
+uint32_t status_callbacks = 0;
+void statusCounter(){
+  status_callbacks++;
+}
+
+
+// Measure LEDOutput::process() through back to back fades, with the clock
+// moved on by hand so that every call has some fading to do
+void benchFade(){
+  nativeSetMillis(0);
+  LEDOutput output(5);
+  output.setStatusCallback(&statusCounter);
+  status_callbacks = 0;
+  uint32_t writes_before = nativePinsInstance().analog_writes;
+  const uint32_t total_calls = 10000000;
+  const uint16_t fade_millis = 1000;
+  // A few calls per millisecond, as a busy main loop would make
+  const uint8_t calls_per_milli = 4;
+  uint32_t fades = 0;
+  uint64_t allocations_before = allocations;
+  auto start = std::chrono::steady_clock::now();
+  for(uint32_t idx = 0; idx < total_calls; idx++){
+    // Leave a little time after each fade, so that it ends
+    if(idx % ((fade_millis + 10) * calls_per_milli) == 0){
+      output.setDimFadeStart((fades % 2) ? 0 : MAX_PWM, fade_millis);
+      fades++;
+    }
+    if(idx % calls_per_milli == 0){
+      nativeAdvanceMillis(1);
+    }
+    output.process();
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  printf("fade        %8.1f ns/process  %4.2f allocs/process  (%u fades, %u PWM writes, %u status callbacks)\n",
+    ns / total_calls, (double)(allocations - allocations_before) / total_calls, (unsigned)fades,
+    (unsigned)(nativePinsInstance().analog_writes - writes_before), (unsigned)status_callbacks);
+  nativeRealMillis();
+}
+
+
+// Measure Rotary::process() decoding a knob being turned back and forth,
+// with some contact bounce, and check every step is seen
+void benchRotary(){
+  const uint8_t pin1 = 12;
+  const uint8_t pin2 = 13;
+  Rotary encoder(pin1, pin2);
+  // Pin states (pin2 << 1 | pin1) for one full step each way, from rest at 11
+  const uint8_t clockwise[4] = {0x1, 0x0, 0x2, 0x3};
+  const uint8_t anticlockwise[4] = {0x2, 0x0, 0x1, 0x3};
+  std::vector<uint8_t> states;
+  uint32_t expected_cw = 0;
+  uint32_t expected_ccw = 0;
+  srand(1);
+  while(states.size() < 65536){
+    bool cw = (rand() % 3) != 0;
+    const uint8_t* step = cw ? clockwise : anticlockwise;
+    for(uint8_t idx = 0; idx < 4; idx++){
+      // A bounce goes back to the previous state and forward again
+      if(idx > 0 && rand() % 8 == 0){
+        states.push_back(step[idx]);
+        states.push_back(step[idx - 1]);
+      }
+      states.push_back(step[idx]);
+    }
+    if(cw){
+      expected_cw++;
+    } else {
+      expected_ccw++;
+    }
+  }
+  const uint32_t rounds = 100;
+  uint32_t seen_cw = 0;
+  uint32_t seen_ccw = 0;
+  uint64_t allocations_before = allocations;
+  auto start = std::chrono::steady_clock::now();
+  for(uint32_t round = 0; round < rounds; round++){
+    for(size_t idx = 0; idx < states.size(); idx++){
+      nativeSetPin(pin1, states[idx] & 0x1);
+      nativeSetPin(pin2, states[idx] >> 1);
+      unsigned char result = encoder.process();
+      seen_cw += (result == DIR_CW);
+      seen_ccw += (result == DIR_CCW);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  uint64_t total_calls = (uint64_t)rounds * states.size();
+  printf("rotary      %8.1f ns/process  %4.2f allocs/process  (%u/%u clockwise, %u/%u anticlockwise)\n",
+    ns / total_calls, (double)(allocations - allocations_before) / total_calls,
+    (unsigned)seen_cw, (unsigned)(expected_cw * rounds), (unsigned)seen_ccw, (unsigned)(expected_ccw * rounds));
+}
+
+
+// Compare flash erases between the fixed storage image (where every commit
+// of the ESP8266 EEPROM emulation erases a sector) and the journal. Each
+// event is a peer resetting, committed straight away as the worst case.
+// The device restarts every so often, and the replayed state is checked.
+// A small ring is made to wrap many times, with inBurst changes waiting at
+// each flush, and every change must still make it into the journal.
+template <uint16_t Capacity>
+void benchStorageWear(bool inJournal, uint16_t inPeers, uint32_t inEvents, uint16_t inSectorSize, uint16_t inSectorCount, uint16_t inBurst){
+  memset(storage, 0, sizeof(storage));
+  memset(flash, 0xFF, sizeof(flash));
+  storage_commits = 0;
+  flash_erases = 0;
+  flash_sector_size = inSectorSize;
+  WiLEDJournal journal(&flashReader, &flashWriter, &flashEraser, inSectorSize, inSectorCount);
+  if(inJournal && !journal.canHold(Capacity + 2)){
+    printf("storage     journal  %5u x %4u bytes is too small for %u addresses\n", inSectorCount, inSectorSize, Capacity);
+    failures++;
+    return;
+  }
+  WiLEDProtoCapacity<Capacity>* handler = 0;
+  uint16_t reset_counters[inPeers];
+  memset(reset_counters, 0, sizeof(reset_counters));
+  uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+  uint32_t restarts = 0;
+  uint32_t mismatches = 0;
+  uint32_t unwritten = 0;
+
+  for(uint32_t event = 0; event <= inEvents; event++){
+    if(event % 1000 == 0){
+      // Restart, and check every peer's reset counter survived
+      delete handler;
+      handler = new WiLEDProtoCapacity<Capacity>(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+      if(inJournal){
+        handler->setJournal(&journal);
+      }
+      handler->initStorage();
+      restarts++;
+      for(uint16_t peer = 0; peer < inPeers && event > 0; peer++){
+        makeFrame(frame, 0x1000 + peer, reset_counters[peer] - 1, 1);
+        if(handler->processMessage(frame) != WiLP_RETURN_SUCCESS
+          || handler->getLastReceivedMessageCounterValidation() != WiLP_RETURN_INVALID_RST_CTR){
+          mismatches++;
+        }
+      }
+    }
+    if(event == inEvents){
+      break;
+    }
+    uint16_t peer = event % inPeers;
+    reset_counters[peer]++;
+    makeFrame(frame, 0x1000 + peer, reset_counters[peer], 1);
+    handler->processMessage(frame);
+    if((event + 1) % inBurst != 0){
+      continue;
+    }
+    handler->flushStorage();
+    if(handler->getStoragePending() != 0){
+      unwritten++;
+    }
+  }
+  delete handler;
+  flash_sector_size = FLASH_SECTOR_SIZE;
+  if(mismatches != 0 || unwritten != 0){
+    failures++;
+  }
+
+  uint32_t erases = inJournal ? flash_erases : storage_commits;
+  printf("storage     %-8s %5u peers  %2u x %4u bytes  burst %2u  %6u events  %6u erases  %6.3f erases/event  %u restarts, %u mismatches, %u unwritten\n",
+    inJournal ? "journal" : "image", inPeers, inSectorCount, inSectorSize, inBurst, (unsigned)inEvents, (unsigned)erases,
+    (double)erases / inEvents, (unsigned)restarts, (unsigned)mismatches, (unsigned)unwritten);
+}
+
+
+// Recycle a slot on every frame, from more addresses than the table holds,
+// with inBurst frames between flushes. Nothing may be written to flash while
+// receiving, and after each restart the table must match the one before.
+void benchJournalEviction(uint16_t inBurst){
+  typedef WiLEDProtoCapacity<8> SmallTable;
+  const uint16_t addresses = 20;
+  const uint32_t total_events = 20000;
+  memset(flash, 0xFF, sizeof(flash));
+  flash_sector_size = 256;
+  WiLEDJournal journal(&flashReader, &flashWriter, &flashEraser, 256, 3);
+  SmallTable* handler = 0;
+  uint16_t reset_counters[addresses];
+  memset(reset_counters, 0, sizeof(reset_counters));
+  uint8_t validations[addresses];
+  uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+  uint32_t receive_writes = 0;
+  uint32_t mismatches = 0;
+  uint32_t evictions = 0;
+
+  for(uint32_t event = 0; event <= total_events; event++){
+    if(event % 100 == 0){
+      if(handler != 0){
+        evictions += handler->getPeerEvictionCount();
+      }
+      // Ask the table about every address, without recycling anything
+      for(uint16_t idx = 0; idx < addresses && handler != 0; idx++){
+        handler->setPeerEvictionAge(0xFFFFFFFF);
+        makeFrame(frame, 0x1000 + idx, reset_counters[idx] - 1, 1);
+        handler->processMessage(frame);
+        validations[idx] = handler->getLastReceivedMessageCounterValidation();
+      }
+      delete handler;
+      handler = new SmallTable(BENCH_ADDRESS, 0, 0, 0);
+      handler->setJournal(&journal);
+      handler->initStorage();
+      for(uint16_t idx = 0; idx < addresses && event > 0; idx++){
+        makeFrame(frame, 0x1000 + idx, reset_counters[idx] - 1, 1);
+        handler->processMessage(frame);
+        mismatches += (handler->getLastReceivedMessageCounterValidation() != validations[idx]);
+      }
+      handler->setPeerEvictionAge(0);
+    }
+    if(event == total_events){
+      break;
+    }
+    uint16_t idx = event % addresses;
+    reset_counters[idx]++;
+    makeFrame(frame, 0x1000 + idx, reset_counters[idx], 1);
+    uint32_t writes_before = flash_writes;
+    handler->processMessage(frame);
+    receive_writes += flash_writes - writes_before;
+    if((event + 1) % inBurst == 0){
+      handler->flushStorage();
+    }
+  }
+  delete handler;
+  flash_sector_size = FLASH_SECTOR_SIZE;
+  if(receive_writes != 0 || mismatches != 0){
+    failures++;
+  }
+  printf("eviction    journal      8 slots  burst %2u  %6u events  %6u evictions  %u flash writes while receiving, %u mismatches\n",
+    inBurst, (unsigned)total_events, (unsigned)evictions, (unsigned)receive_writes, (unsigned)mismatches);
+}
+
+
+// A ring too small for two snapshots would fill up for good, so
+// initStorage() must leave it alone
+void benchJournalTooSmall(){
+  memset(flash, 0xFF, sizeof(flash));
+  flash_sector_size = 256;
+  WiLEDJournal journal(&flashReader, &flashWriter, &flashEraser, 256, 4);
+  WiLEDProtoCapacity<60>* handler = new WiLEDProtoCapacity<60>(BENCH_ADDRESS, 0, 0, 0);
+  handler->setJournal(&journal);
+  handler->initStorage();
+  uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+  for(uint16_t peer = 0; peer < 60; peer++){
+    makeFrame(frame, 0x1000 + peer, 1, 1);
+    handler->processMessage(frame);
+  }
+  handler->flushStorage();
+  delete handler;
+  flash_sector_size = FLASH_SECTOR_SIZE;
+  uint32_t written = 0;
+  for(uint32_t idx = 0; idx < 256 * 4; idx++){
+    written += (flash[idx] != 0xFF);
+  }
+  if(journal.canHold(60 + 2) || written != 0){
+    failures++;
+  }
+  printf("storage     journal     60 peers   4 x  256 bytes  %s, %u bytes written\n",
+    journal.canHold(60 + 2) ? "accepted" : "refused", (unsigned)written);
+}
+
+
+// A journal without flash callbacks can't be read, so initStorage() must
+// fall back to the storage image, and still pick a Reset Counter without one
+void benchJournalUnreadable(bool inImage){
+  memset(storage, 0, sizeof(storage));
+  WiLEDJournal journal(0, 0, 0, FLASH_SECTOR_SIZE, FLASH_SECTOR_COUNT);
+  uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+  uint16_t reset_counters[2];
+  for(uint8_t restart = 0; restart < 2; restart++){
+    WiLEDProtoCapacity<16>* handler = inImage
+      ? new WiLEDProtoCapacity<16>(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter)
+      : new WiLEDProtoCapacity<16>(BENCH_ADDRESS, 0, 0, 0);
+    handler->setJournal(&journal);
+    handler->initStorage();
+    handler->sendMessageBeacon(0);
+    handler->copyToBuffer(frame);
+    reset_counters[restart] = WiLEDProto::parseMessage(frame, MAXIMUM_MESSAGE_LENGTH).getResetCounter();
+    delete handler;
+  }
+  // Only the image carries the Reset Counter on to the next restart
+  if(reset_counters[0] == 0 || (inImage && reset_counters[1] <= reset_counters[0])){
+    failures++;
+  }
+  printf("storage     journal     no flash callbacks, %-8s reset counters %u, %u\n",
+    inImage ? "image" : "no image", reset_counters[0], reset_counters[1]);
+}
+
+
+// Emulated retained RAM, which survives a restart but not a power cut
+uint8_t retained[WiLP_RETAINED_LENGTH];
+bool retained_valid = false;
+
+bool retainedReader(uint8_t* outData, uint16_t inLength){
+  if(!retained_valid){
+    return false;
+  }
+  memcpy(outData, retained, inLength);
+  return true;
+}
+void retainedWriter(const uint8_t* inData, uint16_t inLength){
+  memcpy(retained, inData, inLength);
+  retained_valid = true;
+}
+
+
+// Count the storage commits from restarts, with and without retained RAM,
+// and from a node sending enough to overflow its Message Counter
+void benchResetEpochs(bool inRetained, uint16_t inRestarts, uint32_t inMessages){
+  memset(storage, 0, sizeof(storage));
+  storage_commits = 0;
+  retained_valid = false;
+  uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+  WiLEDProto* handler = 0;
+  for(uint16_t restart = 0; restart < inRestarts; restart++){
+    delete handler;
+    handler = new WiLEDProto(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+    if(inRetained){
+      handler->setRetainedCallbacks(&retainedReader, &retainedWriter);
+    }
+    handler->initStorage();
+  }
+  uint32_t restart_commits = storage_commits;
+  WiLEDProto receiver(0x0002, &storageReader, &storageWriter, &storageCommitter);
+  uint32_t rejected = 0;
+  for(uint32_t idx = 0; idx < inMessages; idx++){
+    handler->sendMessageBeacon(idx);
+    uint8_t length = handler->copyToBuffer(frame);
+    receiver.processMessage(frame, length);
+    uint8_t validation = receiver.getLastReceivedMessageCounterValidation();
+    if(validation != WiLP_RETURN_SUCCESS && validation != WiLP_RETURN_ADDED_ADDRESS){
+      rejected++;
+    }
+  }
+  WiLPMessageView last = WiLEDProto::parseMessage(frame, MAXIMUM_MESSAGE_LENGTH);
+  printf("epochs      %-12s %5u restarts %6u commits  %8u messages %3u commits  reset counter %u  (%u rejected)\n",
+    inRetained ? "retained" : "no retained", inRestarts, (unsigned)restart_commits, (unsigned)inMessages,
+    (unsigned)(storage_commits - restart_commits), last.getResetCounter(), (unsigned)rejected);
+  delete handler;
+}
+
+
+// Measure initStorage() and a single committed update, using the per-byte
+// callbacks, the block callbacks, and the memory mapped file store
+void benchStorageCallbacks(uint8_t inMode, const char* inName){
+  const char* store_path = "/tmp/WiLED_native-bench.store";
+  WiLEDMmapStore store;
+  memset(storage, 0, sizeof(storage));
+  if(inMode == 2){
+    unlink(store_path);
+    if(!store.begin(store_path, sizeof(storage))){
+      printf("storage     could not map %s\n", store_path);
+      return;
+    }
+  }
+  const uint32_t rounds = 200;
+  uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+  double restore_ns = 0;
+  double update_ns = 0;
+  for(uint32_t round = 0; round < rounds; round++){
+    WiLEDProto* handler = new WiLEDProto(BENCH_ADDRESS, &storageReader, &storageWriter, &storageCommitter);
+    if(inMode == 1){
+      handler->setStorageBlockCallbacks(&storageBlockReader, &storageBlockWriter, &storageCommitter);
+    } else if(inMode == 2){
+      store.attach(handler);
+    }
+    auto start = std::chrono::steady_clock::now();
+    handler->initStorage();
+    auto middle = std::chrono::steady_clock::now();
+    makeFrame(frame, 0x1000 + round, 1, 1);
+    handler->processMessage(frame);
+    handler->flushStorage();
+    auto end = std::chrono::steady_clock::now();
+    restore_ns += std::chrono::duration<double, std::nano>(middle - start).count();
+    update_ns += std::chrono::duration<double, std::nano>(end - middle).count();
+    delete handler;
+  }
+  printf("storage     %-16s %10.1f us/initStorage  %8.1f us/update\n",
+    inName, restore_ns / rounds / 1000, update_ns / rounds / 1000);
+  if(inMode == 2){
+    store.end();
+    unlink(store_path);
+  }
+}
+
+
+int main(){
+  // initStorage() and friends print debug text, keep the output readable
+  Serial.muted = true;
+
+  benchChecksum();
+  benchParse();
+  benchCorruptFrames();
+  benchTruncatedFrames();
+  benchGroups();
+  benchAttachGroups(false);
+  benchAttachGroups(true);
+
+  // An end node sized table, then the default, then coordinator sizes
+  benchPeerTable<16>(10);
+  benchPeerTable<WiLP_PEER_SCAN_LIMIT>(WiLP_PEER_SCAN_LIMIT);
+  benchPeerTable<WiLP_PEER_SCAN_LIMIT + 1>(WiLP_PEER_SCAN_LIMIT + 1);
+  benchPeerTable<100>(10);
+  benchPeerTable<100>(100);
+  benchPeerTable<1000>(1000);
+  benchPeerTable<10000>(10000);
+
+  benchReorder(100 <= MAXIMUM_STORED_ADDRESSES ? 100 : MAXIMUM_STORED_ADDRESSES);
+
+  benchBatch(100 <= MAXIMUM_STORED_ADDRESSES ? 100 : MAXIMUM_STORED_ADDRESSES, 32);
+  if(MAXIMUM_STORED_ADDRESSES >= 10000){
+    benchBatch(10000, 32);
+  }
+
+  benchLampQueue();
+  benchLampUpgrade();
+  benchAggregate(3);
+  benchAggregate(12);
+
+  benchFade();
+  benchRotary();
+
+  benchStorageCallbacks(0, "byte callbacks");
+  benchStorageCallbacks(1, "block callbacks");
+  benchStorageCallbacks(2, "mmap store");
+
+  benchResetEpochs(false, 1000, 1000000);
+  benchResetEpochs(true, 1000, 1000000);
+
+  benchStorageWear<100>(false, 100, 20000, FLASH_SECTOR_SIZE, FLASH_SECTOR_COUNT, 1);
+  benchStorageWear<100>(true, 100, 20000, FLASH_SECTOR_SIZE, FLASH_SECTOR_COUNT, 1);
+  // The smallest rings that hold these tables, wrapping every few hundred
+  // events, with new addresses and changes arriving between flushes
+  benchStorageWear<12>(true, 12, 20000, 256, 3, 1);
+  benchStorageWear<24>(true, 24, 20000, 256, 3, 8);
+  benchStorageWear<40>(true, 40, 20000, 256, 5, 40);
+  benchJournalTooSmall();
+  benchJournalUnreadable(true);
+  benchJournalUnreadable(false);
+  // Recycled addresses that fit in the queue, and more than that
+  benchJournalEviction(1);
+  benchJournalEviction(WiLP_REMOVED_QUEUE_LENGTH);
+  benchJournalEviction(10);
+
+  if(failures != 0){
+    printf("%u checks failed\n", (unsigned)failures);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,449 @@
+/* WiLED_native-linkd.cpp
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* The Linux end of the WiLPLink serial protocol to WiLED_m0-server. Prints
+* the batches of received radio frames, and passes commands typed on
+* standard input to the coordinator to send. With --selftest it checks the
+* whole path against an emulated coordinator over a pseudo-terminal.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <Arduino.h>
+
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <vector>
+
+#include <WiLEDProto.h>
+#include <WiLPLink.h>
+#include <WiLEDNative.h>
+
+
+volatile sig_atomic_t stopping = 0;
+
+void stopSignal(int){
+  stopping = 1;
+}
+
+
+// Messages that were not meant for the coordinator
+#define NOT_THIS_DEST_NAME "NOT FOR COORDINATOR"
+
+
+// The host end of the link. Reads and writes never block, the caller waits
+// for the descriptor to be ready with epoll.
+class LinkHost {
+  public:
+    LinkHost(int inDescriptor, bool inQuiet) : __descriptor(inDescriptor), __quiet(inQuiet) {}
+
+    // Queue a message for the coordinator to send, its outcome comes back
+    // as a result with the same sequence number
+    void sendMessage(uint16_t inDestination, uint8_t inType, const uint8_t* inPayload, uint8_t inPayloadLength){
+      uint8_t packet[WiLP_LINK_MAXIMUM_PACKET];
+      uint8_t encoded[WiLP_LINK_MAXIMUM_ENCODED];
+      uint8_t length = WiLPLink::writeMessage(packet, __sequence, inDestination, inType, inPayload, inPayloadLength);
+      if(length == 0){
+        return;
+      }
+      __sequence++;
+      length = WiLPSerialFrame::encode(packet, length, encoded);
+      __outgoing.insert(__outgoing.end(), encoded, encoded + length);
+    }
+
+    bool wantsWrite(){
+      return __outgoing_offset < __outgoing.size();
+    }
+
+    // Both return false once the link has gone
+    bool onReadable(){
+      uint8_t chunk[4096];
+      while(true){
+        ssize_t length = read(__descriptor, chunk, sizeof(chunk));
+        if(length > 0){
+          bytes += length;
+          for(ssize_t idx = 0; idx < length; idx++){
+            if(__decoder.push(chunk[idx])){
+              __handlePacket(__decoder.getPacket(), __decoder.getLength());
+            }
+          }
+        } else if(length < 0 && errno == EINTR){
+          continue;
+        } else {
+          return (length < 0 && errno == EAGAIN);
+        }
+      }
+    }
+
+    bool onWritable(){
+      while(wantsWrite()){
+        ssize_t length = write(__descriptor, &__outgoing[__outgoing_offset], __outgoing.size() - __outgoing_offset);
+        if(length > 0){
+          __outgoing_offset += length;
+        } else if(length < 0 && errno == EINTR){
+          continue;
+        } else {
+          return (length < 0 && errno == EAGAIN);
+        }
+      }
+      __outgoing.clear();
+      __outgoing_offset = 0;
+      return true;
+    }
+
+    uint32_t getErrorCount(){
+      return __decoder.getErrorCount();
+    }
+
+    uint64_t bytes = 0;
+    uint32_t batches = 0;
+    uint32_t frames = 0;
+    uint32_t results = 0;
+    uint32_t result_counts[256] = {0};
+    uint32_t validation_counts[256] = {0};
+    uint32_t unknown_packets = 0;
+    // Frames whose timestamp went backwards
+    uint32_t out_of_order = 0;
+    bool have_stats = false;
+    WiLPLinkStats stats = {0, 0, 0};
+
+  protected:
+    int __descriptor;
+    bool __quiet;
+    WiLPSerialDecoder __decoder;
+    std::vector<uint8_t> __outgoing;
+    size_t __outgoing_offset = 0;
+    uint8_t __sequence = 0;
+    bool __started = false;
+    uint32_t __first_micros = 0;
+    uint32_t __last_micros = 0;
+
+    void __handlePacket(const uint8_t* inPacket, uint8_t inLength){
+      uint8_t sequence;
+      uint8_t result;
+      if(inPacket[0] == WiLP_LINK_FRAMES){
+        batches++;
+        uint8_t offset = 0;
+        WiLPSerialRecord record;
+        while(WiLPLink::nextFrame(inPacket, inLength, &offset, &record)){
+          __handleFrame(record);
+        }
+      } else if(WiLPLink::readResult(inPacket, inLength, &sequence, &result)){
+        results++;
+        result_counts[result]++;
+        if(!__quiet){
+          printf("message %u: %s\n", sequence, (result == WiLP_RETURN_SUCCESS) ? "queued" : validationName(result, NOT_THIS_DEST_NAME));
+        }
+      } else if(WiLPLink::readStats(inPacket, inLength, &stats)){
+        have_stats = true;
+      } else {
+        unknown_packets++;
+      }
+    }
+
+    void __handleFrame(const WiLPSerialRecord& inRecord){
+      frames++;
+      if(!__started){
+        __first_micros = inRecord.micros;
+        __started = true;
+      } else if((int32_t)(inRecord.micros - __last_micros) < 0){
+        out_of_order++;
+      }
+      __last_micros = inRecord.micros;
+      for(uint8_t idx = 0; idx < inRecord.count; idx++){
+        validation_counts[inRecord.validations[idx]]++;
+      }
+      if(__quiet){
+        return;
+      }
+      // One line per message, split up the same way as processFrame() does
+      uint32_t micros = inRecord.micros - __first_micros;
+      uint8_t offset = 0;
+      for(uint8_t idx = 0; idx < inRecord.count; idx++){
+        WiLPMessageView message = WiLEDProto::parseMessage(&inRecord.frame[offset], inRecord.length - offset);
+        printf("%6u.%06u %4d dBm  ", (unsigned)(micros / 1000000), (unsigned)(micros % 1000000), inRecord.rssi);
+        if(message.hasHeader()){
+          printf("%04X -> %04X  type %02X  rst %5u  ctr %5u  %s\n", message.getSource(), message.getDestination(),
+            message.getType(), message.getResetCounter(), message.getMessageCounter(), validationName(inRecord.validations[idx], NOT_THIS_DEST_NAME));
+        } else {
+          printf("%u bytes  %s\n", (unsigned)(inRecord.length - offset), validationName(inRecord.validations[idx], NOT_THIS_DEST_NAME));
+        }
+        uint8_t frame_length = (inRecord.length - offset >= WiLPMessageView::HEADER_LENGTH)
+          ? WiLEDProto::getFrameLength(inRecord.frame[offset + WiLPMessageView::OFFSET_TYPE]) : 0;
+        if(frame_length == 0 || offset + frame_length >= inRecord.length){
+          break;
+        }
+        offset += frame_length;
+      }
+    }
+};
+
+
+// The self test coordinator, sending random Beacons from its nodes as fast
+// as the link takes them
+class CoordinatorEmulator : public NativeCoordinator {
+  public:
+    CoordinatorEmulator(int inDescriptor, uint32_t inFrames, uint16_t inNodes)
+      : NativeCoordinator(inDescriptor, 0x1000, inNodes), __frames(inFrames) {}
+
+    // Receive frames while the ring has room, leaving space for results
+    void produce(){
+      while(__made < __frames && __ring.getFree() >= 2048){
+        __random = __random * 1103515245 + 12345;
+        WiLPSender* sender = __senders[(__random >> 8) % __senders.size()];
+        sender->sendMessageBeacon(__micros / 1000);
+        uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+        uint8_t length = sender->copyToBuffer(frame);
+        // About as fast as a saturated 250 kbps channel delivers Beacons
+        __micros += 800 + (__random >> 4) % 400;
+        __receiveFrame(frame, length, __micros, -40 - (int8_t)((__random >> 3) % 60));
+        __made++;
+      }
+      if(__made == __frames && !__finished && __ring.getFree() >= 2048){
+        // The last batch, then the totals so the host can check them
+        __flush();
+        uint8_t packet[WiLP_LINK_MAXIMUM_PACKET];
+        __sendPacket(packet, WiLPLink::writeStats(packet, __stats));
+        __finished = true;
+      }
+    }
+
+    bool isFinished(){
+      return __finished;
+    }
+
+  protected:
+    uint32_t __frames;
+    uint32_t __made = 0;
+    bool __finished = false;
+    uint32_t __random = 12345;
+    uint32_t __micros = 0;
+};
+
+
+// Pass the self test frames and messages across a pseudo-terminal pair,
+// and check that everything arrives
+int selfTest(uint32_t inFrames, uint32_t inMessages){
+  Serial.muted = true;
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0){
+    perror("posix_openpt");
+    return 1;
+  }
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  if(slave < 0){
+    perror("ptsname");
+    return 1;
+  }
+  if(!setupPort(slave, 921600, true) || !setupPort(master, 921600, true)){
+    return 1;
+  }
+
+  LinkHost host(master, true);
+  CoordinatorEmulator coordinator(slave, inFrames, 100);
+  for(uint32_t idx = 0; idx < inMessages; idx++){
+    uint8_t payload[3] = {(uint8_t)idx, (uint8_t)(0x10 + idx / 256), (uint8_t)idx};
+    host.sendMessage(0xFFFF, WiLP_Set_Individual, payload, sizeof(payload));
+  }
+
+  int epoll = epoll_create1(0);
+  watch(epoll, master, true, true, true);
+  watch(epoll, slave, true, true, true);
+  auto start = std::chrono::steady_clock::now();
+  bool link_up = true;
+  while(link_up && !stopping){
+    coordinator.produce();
+    watch(epoll, master, true, host.wantsWrite(), false);
+    watch(epoll, slave, true, coordinator.wantsWrite(), false);
+    if(host.have_stats && host.results == inMessages){
+      break;
+    }
+    if(std::chrono::steady_clock::now() - start > std::chrono::seconds(30)){
+      printf("timed out\n");
+      break;
+    }
+    struct epoll_event events[4];
+    int count = epoll_wait(epoll, events, 4, 100);
+    for(int idx = 0; idx < count; idx++){
+      bool master_side = (events[idx].data.fd == master);
+      if(events[idx].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+        link_up &= master_side ? host.onReadable() : coordinator.onReadable();
+      }
+      if(events[idx].events & EPOLLOUT){
+        link_up &= master_side ? host.onWritable() : coordinator.onWritable();
+      }
+    }
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  close(epoll);
+  close(slave);
+  close(master);
+
+  bool passed = host.have_stats && host.frames == inFrames && host.stats.received == inFrames
+    && host.stats.dropped == 0 && host.stats.sent == inMessages && host.results == inMessages
+    && host.result_counts[WiLP_RETURN_SUCCESS] == inMessages && host.getErrorCount() == 0
+    && host.unknown_packets == 0 && host.out_of_order == 0;
+  printf("self test over a pseudo-terminal: %u/%u frames in %u batches (%.1f per batch), %u/%u messages sent\n",
+    (unsigned)host.frames, (unsigned)inFrames, (unsigned)host.batches, host.batches ? (double)host.frames / host.batches : 0.0,
+    (unsigned)host.result_counts[WiLP_RETURN_SUCCESS], (unsigned)inMessages);
+  printf("%.3f s, %.0f frames/s, %.0f KB/s, %u serial errors, %u out of order, %u dropped\n", seconds, host.frames / seconds,
+    host.bytes / seconds / 1024, (unsigned)host.getErrorCount(), (unsigned)host.out_of_order, (unsigned)host.stats.dropped);
+  printf("%s\n", passed ? "PASSED" : "FAILED");
+  return passed ? 0 : 1;
+}
+
+
+// Turn a line typed on standard input into a message for the coordinator
+void runCommand(LinkHost& ioHost, const std::string& inLine){
+  unsigned values[8];
+  // Big enough for the %64s below, longer payloads are then turned away
+  char hex[65];
+  if(sscanf(inLine.c_str(), "set %x %u", &values[0], &values[1]) == 2){
+    uint8_t payload[3] = {(uint8_t)values[1], (uint8_t)(values[0] >> 8), (uint8_t)values[0]};
+    ioHost.sendMessage(0xFFFF, WiLP_Set_Individual, payload, sizeof(payload));
+  } else if(sscanf(inLine.c_str(), "groups %u %u %u %u", &values[0], &values[1], &values[2], &values[3]) >= 2){
+    int count = sscanf(inLine.c_str(), "groups %u %u %u %u", &values[0], &values[1], &values[2], &values[3]);
+    uint8_t payload[4] = {(uint8_t)values[0], (uint8_t)values[1], (uint8_t)(count > 2 ? values[2] : 0), (uint8_t)(count > 3 ? values[3] : 0)};
+    ioHost.sendMessage(0xFFFF, WiLP_Set_Groups, payload, sizeof(payload));
+  } else if(sscanf(inLine.c_str(), "send %x %x %64s", &values[0], &values[1], hex) == 3){
+    size_t digits = strlen(hex);
+    if(digits % 2 != 0 || digits > 2 * MAXIMUM_PAYLOAD_LENGTH || strspn(hex, "0123456789abcdefABCDEF") != digits){
+      printf("payload must be up to %u bytes, as pairs of hex digits\n", MAXIMUM_PAYLOAD_LENGTH);
+      return;
+    }
+    uint8_t payload[MAXIMUM_PAYLOAD_LENGTH];
+    uint8_t length = 0;
+    for(size_t idx = 0; idx < digits; idx += 2){
+      unsigned value;
+      sscanf(&hex[idx], "%2x", &value);
+      payload[length] = value;
+      length++;
+    }
+    ioHost.sendMessage(values[0], values[1], payload, length);
+  } else if(!inLine.empty()){
+    printf("commands: set ADDRESS LEVEL | groups LEVEL GROUP [GROUP [GROUP]] | send DESTINATION TYPE PAYLOAD_HEX\n");
+  }
+}
+
+
+void usage(const char* inName){
+  printf("Usage: %s [options] /dev/ttyUSB0\n", inName);
+  printf("  -b BAUD     serial speed (default 921600)\n");
+  printf("  -q          don't print each message, only the totals\n");
+  printf("Commands are read from standard input, one per line:\n");
+  printf("  set ADDRESS LEVEL\n  groups LEVEL GROUP [GROUP [GROUP]]\n  send DESTINATION TYPE PAYLOAD_HEX\n");
+  printf("Or: %s --selftest [FRAMES [MESSAGES]]\n", inName);
+}
+
+
+int main(int argc, char** argv){
+  if(argc >= 2 && strcmp(argv[1], "--selftest") == 0){
+    uint32_t frames = (argc >= 3) ? strtoul(argv[2], 0, 10) : 100000;
+    uint32_t messages = (argc >= 4) ? strtoul(argv[3], 0, 10) : 200;
+    return selfTest(frames, messages);
+  }
+
+  uint32_t baud = 921600;
+  bool quiet = false;
+  const char* path = 0;
+  for(int arg = 1; arg < argc; arg++){
+    if(strcmp(argv[arg], "-b") == 0 && arg + 1 < argc){
+      baud = strtoul(argv[++arg], 0, 10);
+    } else if(strcmp(argv[arg], "-q") == 0){
+      quiet = true;
+    } else if(argv[arg][0] != '-' && path == 0){
+      path = argv[arg];
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if(path == 0){
+    usage(argv[0]);
+    return 2;
+  }
+  int port = open(path, O_RDWR | O_NOCTTY);
+  if(port < 0){
+    perror(path);
+    return 1;
+  }
+  if(!setupPort(port, baud, true)){
+    return 1;
+  }
+  signal(SIGINT, &stopSignal);
+  signal(SIGTERM, &stopSignal);
+
+  LinkHost host(port, quiet);
+  int epoll = epoll_create1(0);
+  watch(epoll, port, true, false, true);
+  // Standard input can't be watched if it is a plain file, then there are
+  // just no commands
+  if(fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK) == 0){
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = 0;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, 0, &event);
+  }
+  std::string line;
+  bool link_up = true;
+  while(link_up && !stopping){
+    watch(epoll, port, true, host.wantsWrite(), false);
+    struct epoll_event events[2];
+    int count = epoll_wait(epoll, events, 2, -1);
+    for(int idx = 0; idx < count; idx++){
+      if(events[idx].data.fd == 0){
+        char chunk[256];
+        ssize_t length = read(0, chunk, sizeof(chunk));
+        if(length <= 0 && !(length < 0 && errno == EAGAIN)){
+          epoll_ctl(epoll, EPOLL_CTL_DEL, 0, 0);
+          continue;
+        }
+        for(ssize_t pos = 0; pos < length; pos++){
+          if(chunk[pos] == '\n'){
+            runCommand(host, line);
+            line.clear();
+          } else {
+            line += chunk[pos];
+          }
+        }
+        continue;
+      }
+      if(events[idx].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+        link_up &= host.onReadable();
+      }
+      if(events[idx].events & EPOLLOUT){
+        link_up &= host.onWritable();
+      }
+    }
+    fflush(stdout);
+  }
+
+  printf("%llu bytes, %u batches, %u frames, %u serial errors, %u results\n", (unsigned long long)host.bytes,
+    (unsigned)host.batches, (unsigned)host.frames, (unsigned)host.getErrorCount(), (unsigned)host.results);
+  if(host.have_stats){
+    printf("coordinator: %u frames received, %u dropped by the link, %u sent\n", (unsigned)host.stats.received,
+      (unsigned)host.stats.dropped, (unsigned)host.stats.sent);
+  }
+  close(epoll);
+  close(port);
+  return 0;
+}
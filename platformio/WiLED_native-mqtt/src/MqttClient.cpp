@@ -0,0 +1,368 @@
+/*
+* MqttClient class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* Just enough of MQTT 3.1.1 for WiLED_native-mqtt: QoS 0 publishing and
+* subscribing over one non-blocking TCP connection.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "MqttClient.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+MqttClient::MqttClient(MessageCallback inCallback){
+  __callback = inCallback;
+  // Enough for a few thousand publishes between two writes, without
+  // growing the buffer
+  __outgoing.reserve(1 << 16);
+  __incoming.reserve(1 << 12);
+}
+
+MqttClient::~MqttClient(){
+  if(__descriptor >= 0){
+    close(__descriptor);
+  }
+}
+
+
+bool MqttClient::connect(const char* inHost, uint16_t inPort, const char* inClientID, uint16_t inKeepAliveSeconds,
+  const char* inWillTopic, const char* inWillMessage){
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  char port[8];
+  snprintf(port, sizeof(port), "%u", (unsigned)inPort);
+  struct addrinfo* addresses;
+  int error = getaddrinfo(inHost, port, &hints, &addresses);
+  if(error != 0){
+    fprintf(stderr, "%s: %s\n", inHost, gai_strerror(error));
+    return false;
+  }
+  for(struct addrinfo* address = addresses; address != 0; address = address->ai_next){
+    __descriptor = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+    if(__descriptor < 0){
+      continue;
+    }
+    if(::connect(__descriptor, address->ai_addr, address->ai_addrlen) == 0){
+      break;
+    }
+    close(__descriptor);
+    __descriptor = -1;
+  }
+  freeaddrinfo(addresses);
+  if(__descriptor < 0){
+    fprintf(stderr, "can't connect to %s:%u: %s\n", inHost, (unsigned)inPort, strerror(errno));
+    return false;
+  }
+
+  // Variable header: protocol name and level 4, connect flags, keep alive.
+  // Then the client identifier and the will.
+  uint8_t flags = 0x02;
+  size_t remaining = 10 + 2 + strlen(inClientID);
+  if(inWillTopic != 0){
+    flags |= 0x04 | 0x20;
+    remaining += 2 + strlen(inWillTopic) + 2 + strlen(inWillMessage);
+  }
+  uint8_t header[MQTT_MAXIMUM_FIXED_HEADER];
+  __outgoing.insert(__outgoing.end(), header, header + writeFixedHeader(header, MQTT_CONNECT, remaining));
+  const uint8_t variable[10] = {0, 4, 'M', 'Q', 'T', 'T', 4, flags, (uint8_t)(inKeepAliveSeconds >> 8), (uint8_t)inKeepAliveSeconds};
+  __outgoing.insert(__outgoing.end(), variable, variable + sizeof(variable));
+  __appendString(inClientID, strlen(inClientID));
+  if(inWillTopic != 0){
+    __appendString(inWillTopic, strlen(inWillTopic));
+    __appendString(inWillMessage, strlen(inWillMessage));
+  }
+  if(!onWritable()){
+    fprintf(stderr, "can't send CONNECT: %s\n", strerror(errno));
+    return false;
+  }
+
+  // Wait up to 5 seconds for the CONNACK
+  while(true){
+    struct pollfd wait = {__descriptor, POLLIN, 0};
+    if(poll(&wait, 1, 5000) <= 0){
+      fprintf(stderr, "no CONNACK from %s:%u\n", inHost, (unsigned)inPort);
+      return false;
+    }
+    uint8_t chunk[64];
+    ssize_t length = read(__descriptor, chunk, sizeof(chunk));
+    if(length <= 0){
+      fprintf(stderr, "%s:%u closed the connection\n", inHost, (unsigned)inPort);
+      return false;
+    }
+    __incoming.insert(__incoming.end(), chunk, chunk + length);
+    uint8_t header_length;
+    size_t packet_length = findPacket(&__incoming[0], __incoming.size(), &header_length);
+    if(packet_length == 0){
+      continue;
+    }
+    if((__incoming[0] & 0xF0) != MQTT_CONNACK || packet_length != 4 || __incoming[3] != 0){
+      fprintf(stderr, "%s:%u refused the connection (%u)\n", inHost, (unsigned)inPort,
+        (unsigned)((packet_length == 4) ? __incoming[3] : 0xFF));
+      return false;
+    }
+    __incoming.erase(__incoming.begin(), __incoming.begin() + packet_length);
+    break;
+  }
+
+  fcntl(__descriptor, F_SETFL, fcntl(__descriptor, F_GETFL) | O_NONBLOCK);
+  // Each write is a batch of publishes already, don't hold it back waiting
+  // for an ACK
+  int nodelay = 1;
+  setsockopt(__descriptor, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  __keep_alive_millis = (uint32_t)inKeepAliveSeconds * 1000;
+  return true;
+}
+
+int MqttClient::getDescriptor(){
+  return __descriptor;
+}
+
+
+void MqttClient::subscribe(const char* inTopicFilter){
+  uint16_t length = strlen(inTopicFilter);
+  if(!__room(MQTT_MAXIMUM_FIXED_HEADER + 5 + length)){
+    return;
+  }
+  __packet_id++;
+  if(__packet_id == 0){
+    __packet_id = 1;
+  }
+  uint8_t header[MQTT_MAXIMUM_FIXED_HEADER];
+  __outgoing.insert(__outgoing.end(), header, header + writeFixedHeader(header, MQTT_SUBSCRIBE | 0x02, 2 + 2 + length + 1));
+  __outgoing.push_back(__packet_id >> 8);
+  __outgoing.push_back(__packet_id);
+  __appendString(inTopicFilter, length);
+  // Requested QoS
+  __outgoing.push_back(0);
+}
+
+void MqttClient::publish(const char* inTopic, const uint8_t* inPayload, uint16_t inPayloadLength, bool inRetain){
+  uint8_t rendered[2 + 256];
+  uint16_t length = strlen(inTopic);
+  if(length > 256){
+    return;
+  }
+  publishRendered(rendered, renderTopic(rendered, inTopic, length), inPayload, inPayloadLength, inRetain);
+}
+
+void MqttClient::publishRendered(const uint8_t* inRendered, uint16_t inRenderedLength, const uint8_t* inPayload,
+  uint16_t inPayloadLength, bool inRetain){
+  if(!__room(MQTT_MAXIMUM_FIXED_HEADER + inRenderedLength + inPayloadLength)){
+    publishes_dropped++;
+    return;
+  }
+  uint8_t header[MQTT_MAXIMUM_FIXED_HEADER];
+  uint8_t header_length = writeFixedHeader(header, MQTT_PUBLISH | (inRetain ? MQTT_PUBLISH_RETAIN : 0), inRenderedLength + inPayloadLength);
+  __outgoing.insert(__outgoing.end(), header, header + header_length);
+  __outgoing.insert(__outgoing.end(), inRendered, inRendered + inRenderedLength);
+  __outgoing.insert(__outgoing.end(), inPayload, inPayload + inPayloadLength);
+  publishes_queued++;
+}
+
+void MqttClient::disconnect(){
+  if(__room(2)){
+    __outgoing.push_back(MQTT_DISCONNECT);
+    __outgoing.push_back(0);
+  }
+  onWritable();
+}
+
+
+bool MqttClient::wantsWrite(){
+  return __outgoing_offset < __outgoing.size();
+}
+
+size_t MqttClient::getOutgoingLength(){
+  return __outgoing.size() - __outgoing_offset;
+}
+
+bool MqttClient::onReadable(){
+  uint8_t chunk[4096];
+  while(true){
+    ssize_t length = read(__descriptor, chunk, sizeof(chunk));
+    if(length < 0 && errno == EINTR){
+      continue;
+    }
+    if(length <= 0){
+      return (length < 0 && errno == EAGAIN);
+    }
+    __incoming.insert(__incoming.end(), chunk, chunk + length);
+    size_t offset = 0;
+    while(true){
+      uint8_t header_length;
+      size_t packet_length = findPacket(__incoming.data() + offset, __incoming.size() - offset, &header_length);
+      if(packet_length == 0){
+        break;
+      }
+      if(header_length == 0){
+        return false;
+      }
+      __handlePacket(&__incoming[offset], header_length, packet_length);
+      offset += packet_length;
+    }
+    __incoming.erase(__incoming.begin(), __incoming.begin() + offset);
+  }
+}
+
+bool MqttClient::onWritable(){
+  while(wantsWrite()){
+    ssize_t length = write(__descriptor, &__outgoing[__outgoing_offset], __outgoing.size() - __outgoing_offset);
+    if(length > 0){
+      __outgoing_offset += length;
+      bytes_sent += length;
+      writes++;
+    } else if(length < 0 && errno == EINTR){
+      continue;
+    } else {
+      return (length < 0 && errno == EAGAIN);
+    }
+  }
+  __outgoing.clear();
+  __outgoing_offset = 0;
+  return true;
+}
+
+void MqttClient::service(uint32_t inMillis){
+  if(__keep_alive_millis == 0 || inMillis - __last_ping_millis < __keep_alive_millis / 2){
+    return;
+  }
+  __last_ping_millis = inMillis;
+  if(__room(2)){
+    __outgoing.push_back(MQTT_PINGREQ);
+    __outgoing.push_back(0);
+  }
+}
+
+
+uint16_t MqttClient::renderTopic(uint8_t* outRendered, const char* inTopic, uint16_t inTopicLength){
+  outRendered[0] = inTopicLength >> 8;
+  outRendered[1] = inTopicLength;
+  memcpy(&outRendered[2], inTopic, inTopicLength);
+  return 2 + inTopicLength;
+}
+
+uint8_t MqttClient::writeFixedHeader(uint8_t* outBuffer, uint8_t inFirstByte, uint32_t inRemainingLength){
+  outBuffer[0] = inFirstByte;
+  uint8_t length = 1;
+  do {
+    uint8_t digit = inRemainingLength & 0x7F;
+    inRemainingLength >>= 7;
+    outBuffer[length] = digit | ((inRemainingLength != 0) ? 0x80 : 0);
+    length++;
+  } while(inRemainingLength != 0 && length < MQTT_MAXIMUM_FIXED_HEADER);
+  return length;
+}
+
+size_t MqttClient::findPacket(const uint8_t* inBuffer, size_t inLength, uint8_t* outHeaderLength){
+  uint32_t remaining = 0;
+  for(uint8_t idx = 1; idx < MQTT_MAXIMUM_FIXED_HEADER; idx++){
+    if(idx >= inLength){
+      return 0;
+    }
+    remaining |= (uint32_t)(inBuffer[idx] & 0x7F) << (7 * (idx - 1));
+    if((inBuffer[idx] & 0x80) == 0){
+      *outHeaderLength = idx + 1;
+      return (inLength >= idx + 1 + remaining) ? idx + 1 + remaining : 0;
+    }
+  }
+  *outHeaderLength = 0;
+  return inLength;
+}
+
+bool MqttClient::topicMatches(const char* inFilter, const char* inTopic, uint16_t inTopicLength){
+  uint16_t pos = 0;
+  while(*inFilter != 0){
+    if(*inFilter == '#'){
+      return true;
+    }
+    if(*inFilter == '+'){
+      while(pos < inTopicLength && inTopic[pos] != '/'){
+        pos++;
+      }
+      inFilter++;
+    } else if(pos < inTopicLength && inTopic[pos] == *inFilter){
+      pos++;
+      inFilter++;
+    } else {
+      // "a/#" also matches "a" itself
+      return (pos == inTopicLength && strcmp(inFilter, "/#") == 0);
+    }
+  }
+  return pos == inTopicLength;
+}
+
+
+bool MqttClient::__room(size_t inLength){
+  if(__outgoing.size() - __outgoing_offset + inLength > MQTT_MAXIMUM_OUTGOING){
+    return false;
+  }
+  // Move the unwritten part to the front rather than growing the buffer
+  if(__outgoing_offset != 0 && __outgoing.size() + inLength > __outgoing.capacity()){
+    __outgoing.erase(__outgoing.begin(), __outgoing.begin() + __outgoing_offset);
+    __outgoing_offset = 0;
+  }
+  return true;
+}
+
+void MqttClient::__appendString(const char* inText, uint16_t inLength){
+  __outgoing.push_back(inLength >> 8);
+  __outgoing.push_back(inLength);
+  __outgoing.insert(__outgoing.end(), inText, inText + inLength);
+}
+
+void MqttClient::__handlePacket(const uint8_t* inPacket, uint8_t inHeaderLength, size_t inLength){
+  if((inPacket[0] & 0xF0) == MQTT_SUBACK){
+    subscriptions_acknowledged++;
+  }
+  if((inPacket[0] & 0xF0) != MQTT_PUBLISH || inLength < inHeaderLength + 2u){
+    // CONNACK and PINGRESP need nothing done
+    return;
+  }
+  uint8_t qos = (inPacket[0] >> 1) & 0x03;
+  size_t pos = inHeaderLength;
+  uint16_t topic_length = ((uint16_t)inPacket[pos] << 8) | inPacket[pos + 1];
+  pos += 2;
+  const char* topic = (const char*)&inPacket[pos];
+  pos += topic_length;
+  if(qos != 0){
+    // Only QoS 0 is subscribed to, but a broker may still send QoS 1
+    if(pos + 2 > inLength){
+      return;
+    }
+    if(qos == 1 && __room(4)){
+      const uint8_t ack[4] = {MQTT_PUBACK, 2, inPacket[pos], inPacket[pos + 1]};
+      __outgoing.insert(__outgoing.end(), ack, ack + sizeof(ack));
+    }
+    pos += 2;
+  }
+  if(pos > inLength){
+    return;
+  }
+  publishes_received++;
+  __callback(topic, topic_length, &inPacket[pos], inLength - pos);
+}
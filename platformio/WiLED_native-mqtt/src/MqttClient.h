@@ -0,0 +1,120 @@
+/*
+* MqttClient class
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* Just enough of MQTT 3.1.1 for WiLED_native-mqtt: QoS 0 publishing and
+* subscribing over one non-blocking TCP connection.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef MQTTCLIENT_H
+#define MQTTCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Control packet types, in the top four bits of the first byte
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PUBLISH 0x30
+#define MQTT_PUBACK 0x40
+#define MQTT_SUBSCRIBE 0x80
+#define MQTT_SUBACK 0x90
+#define MQTT_PINGREQ 0xC0
+#define MQTT_PINGRESP 0xD0
+#define MQTT_DISCONNECT 0xE0
+
+#define MQTT_PUBLISH_RETAIN 0x01
+// The first byte and up to four bytes of Remaining Length
+#define MQTT_MAXIMUM_FIXED_HEADER 5
+// Publishes waiting to be written are dropped past this, rather than
+// letting a stalled broker use up all the memory
+#define MQTT_MAXIMUM_OUTGOING (1 << 20)
+
+class MqttClient {
+  public:
+    // Called for each PUBLISH received. The topic is not null terminated.
+    typedef void (*MessageCallback)(const char* inTopic, uint16_t inTopicLength, const uint8_t* inPayload, uint32_t inPayloadLength);
+
+    MqttClient(MessageCallback inCallback);
+    ~MqttClient();
+
+    // Open the connection and wait for the broker's CONNACK, this is the only
+    // call that blocks. The will message is published (retained) by the
+    // broker if the connection is lost, inWillTopic can be 0 for none.
+    // Returns false after printing why to stderr.
+    bool connect(const char* inHost, uint16_t inPort, const char* inClientID, uint16_t inKeepAliveSeconds,
+      const char* inWillTopic, const char* inWillMessage);
+    int getDescriptor();
+
+    // These add packets to the outgoing buffer, which is written by
+    // onWritable(). Everything added between two writes goes out together.
+    void subscribe(const char* inTopicFilter);
+    void publish(const char* inTopic, const uint8_t* inPayload, uint16_t inPayloadLength, bool inRetain);
+    // Publish to a topic from renderTopic(), which saves measuring and
+    // copying the topic name each time
+    void publishRendered(const uint8_t* inRendered, uint16_t inRenderedLength, const uint8_t* inPayload,
+      uint16_t inPayloadLength, bool inRetain);
+    void disconnect();
+
+    bool wantsWrite();
+    // Bytes waiting to be written
+    size_t getOutgoingLength();
+    // Both return false once the connection has gone
+    bool onReadable();
+    bool onWritable();
+    // Send a PINGREQ when one is due, call at least once a second
+    void service(uint32_t inMillis);
+
+    // Write the two byte length and the topic name into outRendered, returns
+    // the number of bytes written
+    static uint16_t renderTopic(uint8_t* outRendered, const char* inTopic, uint16_t inTopicLength);
+    // Returns the length of the fixed header written
+    static uint8_t writeFixedHeader(uint8_t* outBuffer, uint8_t inFirstByte, uint32_t inRemainingLength);
+    // Find the first whole packet in a buffer. Returns its total length, or
+    // 0 if more bytes are needed. *outHeaderLength is the length of the
+    // fixed header. A malformed Remaining Length gives *outHeaderLength 0.
+    static size_t findPacket(const uint8_t* inBuffer, size_t inLength, uint8_t* outHeaderLength);
+    // Whether a topic name matches a subscription filter with + and #
+    static bool topicMatches(const char* inFilter, const char* inTopic, uint16_t inTopicLength);
+
+    // Publishes added to the outgoing buffer, and those dropped because it
+    // was full
+    uint32_t publishes_queued = 0;
+    uint32_t publishes_dropped = 0;
+    uint32_t publishes_received = 0;
+    uint32_t subscriptions_acknowledged = 0;
+    uint32_t writes = 0;
+    uint64_t bytes_sent = 0;
+
+  protected:
+    MessageCallback __callback;
+    int __descriptor = -1;
+    uint32_t __keep_alive_millis = 0;
+    uint32_t __last_ping_millis = 0;
+    uint16_t __packet_id = 0;
+    std::vector<uint8_t> __outgoing;
+    size_t __outgoing_offset = 0;
+    std::vector<uint8_t> __incoming;
+
+    bool __room(size_t inLength);
+    void __appendString(const char* inText, uint16_t inLength);
+    void __handlePacket(const uint8_t* inPacket, uint8_t inHeaderLength, size_t inLength);
+};
+
+
+#endif
@@ -0,0 +1,975 @@
+/* WiLED_native-mqtt.cpp
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* Bridges WiLED_m0-server to an MQTT broker. Device Status messages received
+* over the WiLPLink serial protocol are published, and levels published to
+* the command topics are sent as Set Individual and Set Groups messages.
+* With --selftest it measures the whole path against an emulated
+* coordinator and a local broker.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <Arduino.h>
+
+#include <arpa/inet.h>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include <WiLEDProto.h>
+#include <WiLPLink.h>
+
+#include <WiLEDNative.h>
+
+#include "MqttClient.h"
+
+// Topics are PREFIX/ADDRESS/status, PREFIX/ADDRESS/set and
+// PREFIX/group/GROUP/set, with the address as four hex digits
+#define BRIDGE_DEFAULT_PREFIX "wiled"
+#define BRIDGE_MAXIMUM_PREFIX 64
+#define BRIDGE_KEEP_ALIVE_SECONDS 60
+
+
+volatile sig_atomic_t stopping = 0;
+
+void stopSignal(int){
+  stopping = 1;
+}
+
+
+uint64_t nowNanos(){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// Latencies in 1 microsecond steps up to 10 ms, anything longer goes in
+// the last bucket
+class LatencyHistogram {
+  public:
+    void add(uint64_t inNanos){
+      uint64_t micros = inNanos / 1000;
+      __buckets[(micros < BUCKETS - 1) ? micros : BUCKETS - 1]++;
+      count++;
+      if(inNanos > max_nanos){
+        max_nanos = inNanos;
+      }
+    }
+
+    // The latency that inFraction of the samples were within, in microseconds
+    uint32_t percentile(double inFraction){
+      uint64_t wanted = (uint64_t)(count * inFraction);
+      uint64_t seen = 0;
+      for(uint32_t micros = 0; micros < BUCKETS; micros++){
+        seen += __buckets[micros];
+        if(seen > wanted){
+          return micros + 1;
+        }
+      }
+      return BUCKETS;
+    }
+
+    uint64_t count = 0;
+    uint64_t max_nanos = 0;
+
+  protected:
+    static const uint32_t BUCKETS = 10000;
+    uint32_t __buckets[BUCKETS] = {0};
+};
+
+
+// Append to a payload without going through printf
+uint8_t appendText(uint8_t* outBuffer, uint8_t inOffset, const char* inText){
+  while(*inText != 0){
+    outBuffer[inOffset] = *inText;
+    inOffset++;
+    inText++;
+  }
+  return inOffset;
+}
+
+uint8_t appendNumber(uint8_t* outBuffer, uint8_t inOffset, uint8_t inValue){
+  if(inValue >= 100){
+    outBuffer[inOffset++] = '0' + inValue / 100;
+  }
+  if(inValue >= 10){
+    outBuffer[inOffset++] = '0' + (inValue / 10) % 10;
+  }
+  outBuffer[inOffset++] = '0' + inValue % 10;
+  return inOffset;
+}
+
+// Read a whole string as a number, false if it isn't one or is too big
+bool parseNumber(const char* inText, uint16_t inLength, uint8_t inBase, uint32_t inMaximum, uint32_t* outValue){
+  if(inLength == 0 || inLength > 8){
+    return false;
+  }
+  uint32_t value = 0;
+  for(uint16_t idx = 0; idx < inLength; idx++){
+    char digit = inText[idx];
+    uint8_t number;
+    if(digit >= '0' && digit <= '9'){
+      number = digit - '0';
+    } else if(digit >= 'a' && digit <= 'f'){
+      number = digit - 'a' + 10;
+    } else if(digit >= 'A' && digit <= 'F'){
+      number = digit - 'A' + 10;
+    } else {
+      return false;
+    }
+    if(number >= inBase){
+      return false;
+    }
+    value = value * inBase + number;
+  }
+  *outValue = value;
+  return value <= inMaximum;
+}
+
+
+// The topic for one device's status, ready to go into a PUBLISH
+struct DeviceTopic {
+  uint16_t length;
+  uint8_t rendered[2 + BRIDGE_MAXIMUM_PREFIX + 12];
+};
+
+// Reads the link from the coordinator and publishes each valid Device
+// Status, and turns command publishes into messages for the coordinator to
+// send. All the publishes from one read of the link are written to the
+// broker together.
+class MqttBridge {
+  public:
+    MqttBridge(int inDescriptor, MqttClient& ioClient, const char* inPrefix)
+      : __descriptor(inDescriptor), __client(ioClient), __prefix(inPrefix), __topics(65536, (DeviceTopic*)0) {
+      __prefix_length = strlen(inPrefix);
+    }
+    ~MqttBridge(){
+      for(size_t idx = 0; idx < __topics.size(); idx++){
+        delete __topics[idx];
+      }
+    }
+
+    void subscribe(){
+      std::string filter = __prefix + "/+/set";
+      __client.subscribe(filter.c_str());
+      filter = __prefix + "/group/+/set";
+      __client.subscribe(filter.c_str());
+      std::string state = __prefix + "/bridge/state";
+      __client.publish(state.c_str(), (const uint8_t*)"online", 6, true);
+    }
+
+    // Stop reading the link while the broker is this far behind, so the
+    // coordinator counts what is lost instead of it piling up here
+    bool wantsLinkRead(){
+      return __client.getOutgoingLength() < MQTT_MAXIMUM_OUTGOING / 2;
+    }
+    bool wantsLinkWrite(){
+      return __outgoing_offset < __outgoing.size();
+    }
+
+    // Both return false once the link has gone
+    bool onLinkReadable(){
+      uint8_t chunk[4096];
+      while(wantsLinkRead()){
+        ssize_t length = read(__descriptor, chunk, sizeof(chunk));
+        if(length < 0 && errno == EINTR){
+          continue;
+        }
+        if(length <= 0){
+          return (length < 0 && errno == EAGAIN);
+        }
+        uint64_t read_nanos = nowNanos();
+        uint32_t queued = __client.publishes_queued;
+        link_bytes += length;
+        for(ssize_t idx = 0; idx < length; idx++){
+          if(__decoder.push(chunk[idx])){
+            __handlePacket(__decoder.getPacket(), __decoder.getLength());
+          }
+        }
+        if(__pending_nanos == 0 && __client.publishes_queued != queued){
+          __pending_nanos = read_nanos;
+        }
+      }
+      return true;
+    }
+
+    bool onLinkWritable(){
+      while(wantsLinkWrite()){
+        ssize_t length = write(__descriptor, &__outgoing[__outgoing_offset], __outgoing.size() - __outgoing_offset);
+        if(length > 0){
+          __outgoing_offset += length;
+        } else if(length < 0 && errno == EINTR){
+          continue;
+        } else {
+          return (length < 0 && errno == EAGAIN);
+        }
+      }
+      __outgoing.clear();
+      __outgoing_offset = 0;
+      return true;
+    }
+
+    // Call once the MQTT client has written what it can, to time how long
+    // the publishes took to get through the bridge
+    void afterWrite(){
+      if(__pending_nanos != 0 && !__client.wantsWrite()){
+        latency.add(nowNanos() - __pending_nanos);
+        __pending_nanos = 0;
+      }
+    }
+
+    // A PUBLISH to one of the command topics
+    void handleCommand(const char* inTopic, uint16_t inTopicLength, const uint8_t* inPayload, uint32_t inPayloadLength){
+      uint32_t level;
+      uint32_t target;
+      const char* middle = inTopic + __prefix_length + 1;
+      int middle_length = (int)inTopicLength - (int)__prefix_length - 1 - 4;
+      if(middle_length <= 0 || memcmp(inTopic, __prefix.c_str(), __prefix_length) != 0 || inTopic[__prefix_length] != '/'
+        || memcmp(middle + middle_length, "/set", 4) != 0){
+        __badCommand(inTopic, inTopicLength, "not a command topic");
+        return;
+      }
+      if(!parseNumber((const char*)inPayload, inPayloadLength, 10, 255, &level)){
+        __badCommand(inTopic, inTopicLength, "the level must be 0 to 255");
+        return;
+      }
+      if(middle_length > 6 && memcmp(middle, "group/", 6) == 0){
+        if(!parseNumber(middle + 6, middle_length - 6, 10, 255, &target) || target == 0){
+          __badCommand(inTopic, inTopicLength, "the group must be 1 to 255");
+          return;
+        }
+        uint8_t payload[4] = {(uint8_t)level, (uint8_t)target, 0, 0};
+        __sendMessage(0xFFFF, WiLP_Set_Groups, payload, sizeof(payload));
+      } else {
+        if(!parseNumber(middle, middle_length, 16, 0xFFFF, &target)){
+          __badCommand(inTopic, inTopicLength, "the address must be 4 hex digits");
+          return;
+        }
+        uint8_t payload[3] = {(uint8_t)level, (uint8_t)(target >> 8), (uint8_t)target};
+        __sendMessage(0xFFFF, WiLP_Set_Individual, payload, sizeof(payload));
+      }
+    }
+
+    uint32_t getErrorCount(){
+      return __decoder.getErrorCount();
+    }
+
+    uint64_t link_bytes = 0;
+    uint32_t frames = 0;
+    uint32_t statuses = 0;
+    uint32_t commands = 0;
+    uint32_t bad_commands = 0;
+    uint32_t results = 0;
+    uint32_t failed_results = 0;
+    bool have_stats = false;
+    WiLPLinkStats stats = {0, 0, 0};
+    // From reading a status off the link to writing it to the broker
+    LatencyHistogram latency;
+
+  protected:
+    int __descriptor;
+    MqttClient& __client;
+    std::string __prefix;
+    size_t __prefix_length;
+    // Made the first time each address is heard from
+    std::vector<DeviceTopic*> __topics;
+    WiLPSerialDecoder __decoder;
+    std::vector<uint8_t> __outgoing;
+    size_t __outgoing_offset = 0;
+    uint8_t __sequence = 0;
+    uint64_t __pending_nanos = 0;
+
+    void __handlePacket(const uint8_t* inPacket, uint8_t inLength){
+      uint8_t sequence;
+      uint8_t result;
+      if(inPacket[0] == WiLP_LINK_FRAMES){
+        uint8_t offset = 0;
+        WiLPSerialRecord record;
+        while(WiLPLink::nextFrame(inPacket, inLength, &offset, &record)){
+          __handleFrame(record);
+        }
+      } else if(WiLPLink::readResult(inPacket, inLength, &sequence, &result)){
+        results++;
+        if(result != WiLP_RETURN_SUCCESS){
+          failed_results++;
+          fprintf(stderr, "command %u was not sent (%u)\n", sequence, result);
+        }
+      } else if(WiLPLink::readStats(inPacket, inLength, &stats)){
+        have_stats = true;
+      }
+    }
+
+    // Split the frame up the same way as processFrame() does, and publish
+    // each Device Status whose counters were valid
+    void __handleFrame(const WiLPSerialRecord& inRecord){
+      frames++;
+      uint8_t offset = 0;
+      for(uint8_t idx = 0; idx < inRecord.count; idx++){
+        WiLPMessageView message = WiLEDProto::parseMessage(&inRecord.frame[offset], inRecord.length - offset);
+        if(!message.isValid()){
+          break;
+        }
+        uint8_t validation = inRecord.validations[idx];
+        if(message.getType() == WiLP_Device_Status
+          && (validation == WiLP_RETURN_SUCCESS || validation == WiLP_RETURN_ADDED_ADDRESS)){
+          __publishStatus(message);
+        }
+        offset += message.getFrameLength();
+        if(offset >= inRecord.length){
+          break;
+        }
+      }
+    }
+
+    void __publishStatus(const WiLPMessageView& inMessage){
+      uint16_t source = inMessage.getSource();
+      DeviceTopic* topic = __topics[source];
+      if(topic == 0){
+        // Room for "/XXXX/status" after the longest prefix, and the NUL
+        char name[BRIDGE_MAXIMUM_PREFIX + 13];
+        int length = snprintf(name, sizeof(name), "%s/%04X/status", __prefix.c_str(), source);
+        topic = new DeviceTopic;
+        topic->length = MqttClient::renderTopic(topic->rendered, name, length);
+        __topics[source] = topic;
+      }
+      // {"level":200,"groups":[1,2,0,0]}
+      uint8_t payload[48];
+      uint8_t length = appendText(payload, 0, "{\"level\":");
+      length = appendNumber(payload, length, inMessage.getPayloadByte(0));
+      length = appendText(payload, length, ",\"groups\":[");
+      for(uint8_t group = 1; group <= 4; group++){
+        length = appendNumber(payload, length, inMessage.getPayloadByte(group));
+        payload[length++] = (group < 4) ? ',' : ']';
+      }
+      payload[length++] = '}';
+      __client.publishRendered(topic->rendered, topic->length, payload, length, true);
+      statuses++;
+    }
+
+    void __sendMessage(uint16_t inDestination, uint8_t inType, const uint8_t* inPayload, uint8_t inPayloadLength){
+      uint8_t packet[WiLP_LINK_MAXIMUM_PACKET];
+      uint8_t encoded[WiLP_LINK_MAXIMUM_ENCODED];
+      uint8_t length = WiLPLink::writeMessage(packet, __sequence, inDestination, inType, inPayload, inPayloadLength);
+      __sequence++;
+      length = WiLPSerialFrame::encode(packet, length, encoded);
+      __outgoing.insert(__outgoing.end(), encoded, encoded + length);
+      commands++;
+    }
+
+    void __badCommand(const char* inTopic, uint16_t inTopicLength, const char* inReason){
+      bad_commands++;
+      fprintf(stderr, "ignored a command on %.*s, %s\n", (int)inTopicLength, inTopic, inReason);
+    }
+};
+
+
+// Command publishes go to the bridge, the callback has no context so it is
+// found through this
+MqttBridge* bridge = 0;
+
+void commandReceived(const char* inTopic, uint16_t inTopicLength, const uint8_t* inPayload, uint32_t inPayloadLength){
+  if(bridge != 0){
+    bridge->handleCommand(inTopic, inTopicLength, inPayload, inPayloadLength);
+  }
+}
+
+
+#define SELFTEST_FIRST_ADDRESS 0x1000
+
+// The level in the Nth Device Status of the self test
+uint8_t selfTestLevel(uint32_t inIndex){
+  return (inIndex * 7) & 0xFF;
+}
+
+
+// The self test coordinator, receiving Device Status messages from
+// simulated lamps and batching them the same way as WiLED_m0-server
+class CoordinatorEmulator : public NativeCoordinator {
+  public:
+    CoordinatorEmulator(int inDescriptor, uint16_t inNodes)
+      : NativeCoordinator(inDescriptor, SELFTEST_FIRST_ADDRESS, inNodes) {}
+
+    bool hasRoom(){
+      return __ring.getFree() >= 2048;
+    }
+
+    // One Device Status from the next lamp in turn
+    void receive(){
+      WiLPSender* sender = __senders[made % __senders.size()];
+      uint16_t node = made % __senders.size();
+      sender->sendMessageDeviceStatus(selfTestLevel(made), 1 + node % 8, 0, 0, 0);
+      uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+      uint8_t length = sender->copyToBuffer(frame);
+      __receiveFrame(frame, length, nowNanos() / 1000, -50);
+      sources.push_back(SELFTEST_FIRST_ADDRESS + node);
+      made++;
+    }
+
+    // Send the batch if the link is idle or it has waited long enough, as
+    // WiLED_m0-server does
+    void service(){
+      if(__batch.getFrameCount() != 0 && (__ring.getUsed() == 0
+        || nowNanos() - __batch_nanos >= WiLP_LINK_BATCH_MILLIS * 1000000ull)){
+        __flush();
+      }
+    }
+
+    void flush(){
+      __flush();
+    }
+
+    uint32_t made = 0;
+    uint32_t commands_correct = 0;
+    // The source and send time of each Device Status, in order
+    std::vector<uint16_t> sources;
+    std::vector<uint64_t> sent_nanos;
+
+  protected:
+    uint64_t __batch_nanos = 0;
+
+    // Each self test command sets a lamp to the low byte of its address
+    void __onMessage(const WiLPLinkMessage& inMessage){
+      if(inMessage.type == WiLP_Set_Individual && inMessage.payload_length == 3
+        && inMessage.payload[0] == inMessage.payload[2] && inMessage.payload[1] == (SELFTEST_FIRST_ADDRESS >> 8)){
+        commands_correct++;
+      }
+    }
+
+    uint8_t __flush(){
+      uint8_t frames = NativeCoordinator::__flush();
+      if(frames == 0){
+        return 0;
+      }
+      // Latency is counted from when the batch leaves, the time it spent
+      // being filled is the coordinator's choice
+      uint64_t now = nowNanos();
+      while(sent_nanos.size() < made){
+        sent_nanos.push_back(now);
+      }
+      __batch_nanos = now;
+      return frames;
+    }
+};
+
+
+// Enough of an MQTT broker for the self test when there is no real one to
+// use: QoS 0 only, nothing retained, no will messages
+class TestBroker {
+  public:
+    ~TestBroker(){
+      for(size_t idx = 0; idx < __clients.size(); idx++){
+        close(__clients[idx]->descriptor);
+        delete __clients[idx];
+      }
+      if(__descriptor >= 0){
+        close(__descriptor);
+      }
+    }
+
+    // Listen on a free port on the loopback interface
+    bool listenLocal(){
+      __descriptor = socket(AF_INET, SOCK_STREAM, 0);
+      struct sockaddr_in address;
+      memset(&address, 0, sizeof(address));
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      socklen_t length = sizeof(address);
+      if(__descriptor < 0 || bind(__descriptor, (struct sockaddr*)&address, sizeof(address)) != 0
+        || listen(__descriptor, 8) != 0 || getsockname(__descriptor, (struct sockaddr*)&address, &length) != 0){
+        perror("broker");
+        return false;
+      }
+      __port = ntohs(address.sin_port);
+      return true;
+    }
+
+    uint16_t getPort(){
+      return __port;
+    }
+
+    // Serve clients until SIGTERM, run in a process of its own
+    void run(){
+      signal(SIGTERM, &stopSignal);
+      int epoll = epoll_create1(0);
+      struct epoll_event event;
+      event.events = EPOLLIN;
+      event.data.ptr = 0;
+      epoll_ctl(epoll, EPOLL_CTL_ADD, __descriptor, &event);
+      while(!stopping){
+        struct epoll_event events[16];
+        int count = epoll_wait(epoll, events, 16, 100);
+        for(int idx = 0; idx < count; idx++){
+          Client* client = (Client*)events[idx].data.ptr;
+          if(client == 0){
+            __accept(epoll);
+          } else if(!__read(client)){
+            __close(client);
+          }
+        }
+        for(size_t idx = 0; idx < __clients.size(); idx++){
+          __write(__clients[idx]);
+          event.events = EPOLLIN | (__clients[idx]->outgoing.empty() ? 0 : (uint32_t)EPOLLOUT);
+          event.data.ptr = __clients[idx];
+          epoll_ctl(epoll, EPOLL_CTL_MOD, __clients[idx]->descriptor, &event);
+        }
+      }
+      close(epoll);
+    }
+
+  protected:
+    struct Client {
+      int descriptor;
+      std::vector<uint8_t> incoming;
+      std::vector<uint8_t> outgoing;
+      std::vector<std::string> filters;
+    };
+
+    int __descriptor = -1;
+    uint16_t __port = 0;
+    std::vector<Client*> __clients;
+
+    void __accept(int inEpoll){
+      int descriptor = accept(__descriptor, 0, 0);
+      if(descriptor < 0){
+        return;
+      }
+      fcntl(descriptor, F_SETFL, fcntl(descriptor, F_GETFL) | O_NONBLOCK);
+      int nodelay = 1;
+      setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+      Client* client = new Client;
+      client->descriptor = descriptor;
+      __clients.push_back(client);
+      struct epoll_event event;
+      event.events = EPOLLIN;
+      event.data.ptr = client;
+      epoll_ctl(inEpoll, EPOLL_CTL_ADD, descriptor, &event);
+    }
+
+    void __close(Client* inClient){
+      for(size_t idx = 0; idx < __clients.size(); idx++){
+        if(__clients[idx] == inClient){
+          __clients.erase(__clients.begin() + idx);
+          break;
+        }
+      }
+      close(inClient->descriptor);
+      delete inClient;
+    }
+
+    bool __read(Client* ioClient){
+      uint8_t chunk[4096];
+      while(true){
+        ssize_t length = read(ioClient->descriptor, chunk, sizeof(chunk));
+        if(length < 0 && errno == EINTR){
+          continue;
+        }
+        if(length <= 0){
+          return (length < 0 && errno == EAGAIN);
+        }
+        ioClient->incoming.insert(ioClient->incoming.end(), chunk, chunk + length);
+        size_t offset = 0;
+        while(true){
+          uint8_t header_length;
+          size_t packet_length = MqttClient::findPacket(ioClient->incoming.data() + offset, ioClient->incoming.size() - offset, &header_length);
+          if(packet_length == 0){
+            break;
+          }
+          if(header_length == 0 || !__handlePacket(ioClient, &ioClient->incoming[offset], header_length, packet_length)){
+            return false;
+          }
+          offset += packet_length;
+        }
+        ioClient->incoming.erase(ioClient->incoming.begin(), ioClient->incoming.begin() + offset);
+      }
+    }
+
+    void __write(Client* ioClient){
+      size_t offset = 0;
+      while(offset < ioClient->outgoing.size()){
+        ssize_t length = write(ioClient->descriptor, &ioClient->outgoing[offset], ioClient->outgoing.size() - offset);
+        if(length <= 0){
+          break;
+        }
+        offset += length;
+      }
+      ioClient->outgoing.erase(ioClient->outgoing.begin(), ioClient->outgoing.begin() + offset);
+    }
+
+    // Returns false when the client disconnects
+    bool __handlePacket(Client* ioClient, const uint8_t* inPacket, uint8_t inHeaderLength, size_t inLength){
+      const uint8_t* body = inPacket + inHeaderLength;
+      size_t body_length = inLength - inHeaderLength;
+      switch(inPacket[0] & 0xF0){
+        case MQTT_CONNECT: {
+          const uint8_t connack[4] = {MQTT_CONNACK, 2, 0, 0};
+          ioClient->outgoing.insert(ioClient->outgoing.end(), connack, connack + sizeof(connack));
+          break;
+        }
+        case MQTT_SUBSCRIBE: {
+          // Packet identifier, then filters each followed by a QoS
+          size_t pos = 2;
+          uint8_t granted = 0;
+          while(pos + 2 < body_length){
+            uint16_t length = ((uint16_t)body[pos] << 8) | body[pos + 1];
+            ioClient->filters.push_back(std::string((const char*)&body[pos + 2], length));
+            pos += 2 + length + 1;
+            granted++;
+          }
+          uint8_t header[MQTT_MAXIMUM_FIXED_HEADER];
+          uint8_t header_length = MqttClient::writeFixedHeader(header, MQTT_SUBACK, 2 + granted);
+          ioClient->outgoing.insert(ioClient->outgoing.end(), header, header + header_length);
+          ioClient->outgoing.insert(ioClient->outgoing.end(), body, body + 2);
+          ioClient->outgoing.insert(ioClient->outgoing.end(), granted, 0);
+          break;
+        }
+        case MQTT_PUBLISH: {
+          const char* topic = (const char*)&body[2];
+          uint16_t topic_length = ((uint16_t)body[0] << 8) | body[1];
+          for(size_t idx = 0; idx < __clients.size(); idx++){
+            Client* client = __clients[idx];
+            for(size_t filter = 0; filter < client->filters.size(); filter++){
+              if(MqttClient::topicMatches(client->filters[filter].c_str(), topic, topic_length)){
+                // Sent on with the retain flag cleared, it is a live message
+                client->outgoing.push_back(inPacket[0] & ~MQTT_PUBLISH_RETAIN);
+                client->outgoing.insert(client->outgoing.end(), inPacket + 1, inPacket + inLength);
+                break;
+              }
+            }
+          }
+          break;
+        }
+        case MQTT_PINGREQ: {
+          const uint8_t pingresp[2] = {MQTT_PINGRESP, 0};
+          ioClient->outgoing.insert(ioClient->outgoing.end(), pingresp, pingresp + sizeof(pingresp));
+          break;
+        }
+        case MQTT_DISCONNECT:
+          return false;
+      }
+      return true;
+    }
+};
+
+
+// What the self test subscriber has seen
+struct SelfTestResults {
+  CoordinatorEmulator* coordinator = 0;
+  bool listening = false;
+  uint32_t received = 0;
+  uint32_t wrong = 0;
+  LatencyHistogram latency;
+};
+SelfTestResults selftest;
+
+// Each status must arrive in the order it was sent, with the right level
+void statusReceived(const char* inTopic, uint16_t inTopicLength, const uint8_t* inPayload, uint32_t inPayloadLength){
+  if(!selftest.listening){
+    // Left over from an earlier run on a real broker
+    return;
+  }
+  uint64_t now = nowNanos();
+  uint32_t index = selftest.received;
+  selftest.received++;
+  CoordinatorEmulator& coordinator = *selftest.coordinator;
+  if(index >= coordinator.sent_nanos.size()){
+    selftest.wrong++;
+    return;
+  }
+  selftest.latency.add(now - coordinator.sent_nanos[index]);
+  char expected_topic[64];
+  int topic_length = snprintf(expected_topic, sizeof(expected_topic), "wiled-selftest/%04X/status", coordinator.sources[index]);
+  char expected_payload[16];
+  int payload_length = snprintf(expected_payload, sizeof(expected_payload), "{\"level\":%u,", selfTestLevel(index));
+  if(inTopicLength != topic_length || memcmp(inTopic, expected_topic, topic_length) != 0
+    || inPayloadLength < (uint32_t)payload_length || memcmp(inPayload, expected_payload, payload_length) != 0){
+    selftest.wrong++;
+  }
+}
+
+
+// Wait for both clients to have their subscriptions in place
+bool waitForSubscriptions(MqttClient& ioFirst, uint32_t inFirst, MqttClient& ioSecond, uint32_t inSecond){
+  uint64_t deadline = nowNanos() + 5000000000ull;
+  while(ioFirst.subscriptions_acknowledged < inFirst || ioSecond.subscriptions_acknowledged < inSecond){
+    if(nowNanos() > deadline || !ioFirst.onWritable() || !ioSecond.onWritable()
+      || !ioFirst.onReadable() || !ioSecond.onReadable()){
+      return false;
+    }
+    usleep(1000);
+  }
+  return true;
+}
+
+
+// Send Device Status messages at inRate a second (or as fast as they can go
+// if 0) through an emulated coordinator, the bridge and the broker to a
+// subscriber, with commands going the other way
+int selfTest(const char* inHost, uint16_t inPort, uint32_t inStatuses, uint32_t inRate, uint32_t inCommands){
+  Serial.muted = true;
+  pid_t broker_process = 0;
+  if(inHost == 0){
+    TestBroker broker;
+    if(!broker.listenLocal()){
+      return 1;
+    }
+    inHost = "127.0.0.1";
+    inPort = broker.getPort();
+    broker_process = fork();
+    if(broker_process == 0){
+      broker.run();
+      _exit(0);
+    }
+  }
+
+  MqttClient subscriber(&statusReceived);
+  MqttClient client(&commandReceived);
+  if(!subscriber.connect(inHost, inPort, "wiled-selftest", BRIDGE_KEEP_ALIVE_SECONDS, 0, 0)
+    || !client.connect(inHost, inPort, "wiled-selftest-bridge", BRIDGE_KEEP_ALIVE_SECONDS, 0, 0)){
+    return 1;
+  }
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if(master < 0 || grantpt(master) != 0 || unlockpt(master) != 0){
+    perror("posix_openpt");
+    return 1;
+  }
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  if(slave < 0 || !setupPort(slave, 921600, true) || !setupPort(master, 921600, true)){
+    perror("ptsname");
+    return 1;
+  }
+  MqttBridge link_bridge(master, client, "wiled-selftest");
+  bridge = &link_bridge;
+  CoordinatorEmulator coordinator(slave, 100);
+  coordinator.sources.reserve(inStatuses);
+  coordinator.sent_nanos.reserve(inStatuses);
+  selftest.coordinator = &coordinator;
+
+  subscriber.subscribe("wiled-selftest/+/status");
+  link_bridge.subscribe();
+  if(!waitForSubscriptions(subscriber, 1, client, 2)){
+    printf("the broker didn't acknowledge the subscriptions\n");
+    return 1;
+  }
+  selftest.listening = true;
+
+  int epoll = epoll_create1(0);
+  watch(epoll, master, true, false, true);
+  watch(epoll, slave, true, false, true);
+  watch(epoll, client.getDescriptor(), true, false, true);
+  watch(epoll, subscriber.getDescriptor(), true, false, true);
+  uint64_t start = nowNanos();
+  uint64_t deadline = start + ((inRate != 0) ? (uint64_t)inStatuses * 1000000000ull / inRate : 0) + 30000000000ull;
+  uint32_t commands_sent = 0;
+  bool connected = true;
+  while(connected && !stopping){
+    uint64_t now = nowNanos();
+    // Statuses that are due, and a command for every so many of them
+    uint32_t due = (inRate != 0) ? (uint32_t)std::min<uint64_t>(inStatuses, (now - start) * inRate / 1000000000ull) : inStatuses;
+    while(coordinator.made < due && coordinator.hasRoom()){
+      coordinator.receive();
+      if(inCommands != 0 && commands_sent < inCommands && coordinator.made >= (uint64_t)(commands_sent + 1) * inStatuses / inCommands){
+        uint16_t address = SELFTEST_FIRST_ADDRESS + commands_sent % 100;
+        char topic[64];
+        char level[4];
+        snprintf(topic, sizeof(topic), "wiled-selftest/%04X/set", address);
+        int length = snprintf(level, sizeof(level), "%u", address & 0xFF);
+        subscriber.publish(topic, (const uint8_t*)level, length, false);
+        commands_sent++;
+      }
+    }
+    coordinator.service();
+    if(coordinator.made == inStatuses && coordinator.sent_nanos.size() < inStatuses){
+      coordinator.flush();
+    }
+    // Write whatever is waiting straight away, rather than on the next loop
+    connected &= coordinator.onWritable() && link_bridge.onLinkWritable() && subscriber.onWritable() && client.onWritable();
+    link_bridge.afterWrite();
+    if(selftest.received >= inStatuses && link_bridge.results >= inCommands){
+      break;
+    }
+    if(now > deadline){
+      printf("timed out\n");
+      break;
+    }
+    watch(epoll, master, link_bridge.wantsLinkRead(), link_bridge.wantsLinkWrite(), false);
+    watch(epoll, slave, true, coordinator.wantsWrite(), false);
+    watch(epoll, client.getDescriptor(), true, client.wantsWrite(), false);
+    watch(epoll, subscriber.getDescriptor(), true, subscriber.wantsWrite(), false);
+    struct epoll_event events[4];
+    int count = epoll_wait(epoll, events, 4, 1);
+    for(int idx = 0; idx < count; idx++){
+      int descriptor = events[idx].data.fd;
+      if(events[idx].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+        if(descriptor == master){
+          connected &= link_bridge.onLinkReadable();
+        } else if(descriptor == slave){
+          connected &= coordinator.onReadable();
+        } else if(descriptor == client.getDescriptor()){
+          connected &= client.onReadable();
+        } else {
+          connected &= subscriber.onReadable();
+        }
+      }
+    }
+  }
+  double seconds = (nowNanos() - start) / 1e9;
+  close(epoll);
+  subscriber.disconnect();
+  client.disconnect();
+  if(broker_process != 0){
+    kill(broker_process, SIGTERM);
+    waitpid(broker_process, 0, 0);
+  }
+  close(slave);
+  close(master);
+  bridge = 0;
+
+  bool passed = selftest.received == inStatuses && selftest.wrong == 0 && link_bridge.statuses == inStatuses
+    && coordinator.getStats().dropped == 0 && client.publishes_dropped == 0 && link_bridge.getErrorCount() == 0
+    && commands_sent == inCommands && coordinator.commands_correct == inCommands
+    && link_bridge.results == inCommands && link_bridge.failed_results == 0;
+  printf("self test against %s:%u: %u/%u statuses received (%u wrong), %u/%u commands sent\n", inHost, (unsigned)inPort,
+    (unsigned)selftest.received, (unsigned)inStatuses, (unsigned)selftest.wrong, (unsigned)coordinator.commands_correct, (unsigned)inCommands);
+  printf("%.3f s, %.0f statuses/s, %u broker writes (%.1f publishes each)\n", seconds, selftest.received / seconds,
+    (unsigned)client.writes, client.writes ? (double)client.publishes_queued / client.writes : 0.0);
+  printf("through the bridge: median %u us, 99%% %u us, max %.0f us\n", link_bridge.latency.percentile(0.5),
+    link_bridge.latency.percentile(0.99), link_bridge.latency.max_nanos / 1e3);
+  printf("link to subscriber: median %u us, 99%% %u us, max %.0f us\n", selftest.latency.percentile(0.5),
+    selftest.latency.percentile(0.99), selftest.latency.max_nanos / 1e3);
+  printf("%s\n", passed ? "PASSED" : "FAILED");
+  return passed ? 0 : 1;
+}
+
+
+void usage(const char* inName){
+  printf("Usage: %s [options] /dev/ttyUSB0\n", inName);
+  printf("  -b BAUD     serial speed (default 921600)\n");
+  printf("  -h HOST     MQTT broker (default localhost)\n");
+  printf("  -p PORT     MQTT port (default 1883)\n");
+  printf("  -t PREFIX   topic prefix (default %s)\n", BRIDGE_DEFAULT_PREFIX);
+  printf("  -i ID       MQTT client identifier (default wiled-bridge)\n");
+  printf("Publishes PREFIX/ADDRESS/status, levels published to PREFIX/ADDRESS/set\n");
+  printf("and PREFIX/group/GROUP/set are sent to the lamps.\n");
+  printf("Or: %s --selftest [-h HOST] [-p PORT] [STATUSES [RATE [COMMANDS]]]\n", inName);
+  printf("  with a local test broker unless -h is given, RATE 0 is as fast as possible\n");
+}
+
+
+int main(int argc, char** argv){
+  bool self_test = (argc >= 2 && strcmp(argv[1], "--selftest") == 0);
+  uint32_t baud = 921600;
+  const char* host = 0;
+  uint16_t port = 1883;
+  const char* prefix = BRIDGE_DEFAULT_PREFIX;
+  const char* client_id = "wiled-bridge";
+  std::vector<const char*> positional;
+  for(int arg = self_test ? 2 : 1; arg < argc; arg++){
+    if(strcmp(argv[arg], "-b") == 0 && arg + 1 < argc){
+      baud = strtoul(argv[++arg], 0, 10);
+    } else if(strcmp(argv[arg], "-h") == 0 && arg + 1 < argc){
+      host = argv[++arg];
+    } else if(strcmp(argv[arg], "-p") == 0 && arg + 1 < argc){
+      port = strtoul(argv[++arg], 0, 10);
+    } else if(strcmp(argv[arg], "-t") == 0 && arg + 1 < argc){
+      prefix = argv[++arg];
+    } else if(strcmp(argv[arg], "-i") == 0 && arg + 1 < argc){
+      client_id = argv[++arg];
+    } else if(argv[arg][0] != '-'){
+      positional.push_back(argv[arg]);
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if(self_test){
+    uint32_t statuses = (positional.size() >= 1) ? strtoul(positional[0], 0, 10) : 20000;
+    uint32_t rate = (positional.size() >= 2) ? strtoul(positional[1], 0, 10) : 5000;
+    uint32_t commands = (positional.size() >= 3) ? strtoul(positional[2], 0, 10) : 200;
+    return selfTest(host, port, statuses, rate, commands);
+  }
+  if(positional.size() != 1 || strlen(prefix) > BRIDGE_MAXIMUM_PREFIX){
+    usage(argv[0]);
+    return 2;
+  }
+
+  int link = open(positional[0], O_RDWR | O_NOCTTY);
+  if(link < 0){
+    perror(positional[0]);
+    return 1;
+  }
+  if(!setupPort(link, baud, true)){
+    return 1;
+  }
+  std::string state_topic = std::string(prefix) + "/bridge/state";
+  MqttClient client(&commandReceived);
+  if(!client.connect(host ? host : "localhost", port, client_id, BRIDGE_KEEP_ALIVE_SECONDS, state_topic.c_str(), "offline")){
+    return 1;
+  }
+  signal(SIGINT, &stopSignal);
+  signal(SIGTERM, &stopSignal);
+  signal(SIGPIPE, SIG_IGN);
+
+  MqttBridge link_bridge(link, client, prefix);
+  bridge = &link_bridge;
+  link_bridge.subscribe();
+  int epoll = epoll_create1(0);
+  watch(epoll, link, true, false, true);
+  watch(epoll, client.getDescriptor(), true, false, true);
+  bool connected = true;
+  while(connected && !stopping){
+    client.service(millis());
+    // Everything from the last round of reads goes out in one write
+    connected &= client.onWritable() && link_bridge.onLinkWritable();
+    link_bridge.afterWrite();
+    watch(epoll, link, link_bridge.wantsLinkRead(), link_bridge.wantsLinkWrite(), false);
+    watch(epoll, client.getDescriptor(), true, client.wantsWrite(), false);
+    struct epoll_event events[2];
+    int count = epoll_wait(epoll, events, 2, 1000);
+    for(int idx = 0; idx < count; idx++){
+      if(events[idx].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+        connected &= (events[idx].data.fd == link) ? link_bridge.onLinkReadable() : client.onReadable();
+      }
+    }
+  }
+  if(!connected){
+    fprintf(stderr, "lost the connection to the coordinator or the broker\n");
+  }
+  client.disconnect();
+  close(epoll);
+  close(link);
+  bridge = 0;
+
+  printf("%u frames, %u statuses published, %u dropped, %u broker writes\n", (unsigned)link_bridge.frames,
+    (unsigned)link_bridge.statuses, (unsigned)client.publishes_dropped, (unsigned)client.writes);
+  printf("%u commands, %u not understood, %u not sent by the coordinator\n", (unsigned)link_bridge.commands,
+    (unsigned)link_bridge.bad_commands, (unsigned)link_bridge.failed_results);
+  printf("through the bridge: median %u us, 99%% %u us, max %.0f us\n", link_bridge.latency.percentile(0.5),
+    link_bridge.latency.percentile(0.99), link_bridge.latency.max_nanos / 1e3);
+  if(link_bridge.have_stats){
+    printf("coordinator: %u frames received, %u dropped by the link, %u sent\n", (unsigned)link_bridge.stats.received,
+      (unsigned)link_bridge.stats.dropped, (unsigned)link_bridge.stats.sent);
+  }
+  return 0;
+}
@@ -0,0 +1,745 @@
+/* WiLED_native-radiosim.cpp
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* A discrete-event simulation of many WiLED lamps and a coordinator sharing
+* one RFM69 channel. Each virtual node runs the real WiLEDProto (and, for
+* lamps, LEDOutput) code; only the radio is simulated. Reports switching
+* latency and channel use as the number of lamps and the beacon rate grow.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <Arduino.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <math.h>
+#include <queue>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <LEDOutput.h>
+#include <WiLEDProto.h>
+#ifdef WiLP_TRACE
+#include <WiLPTrace.h>
+#endif
+
+// GFSK_Rb250Fd250 sends 250 kbps, so a byte takes 32 us
+#define SIM_BYTE_MICROS 32
+// Sent with every frame: 4 bytes of preamble, 2 sync words, the length byte,
+// RadioHead's 4 byte header and the CRC
+#define SIM_FRAME_OVERHEAD 13
+// From send() finding the channel clear to the first bit on air, filling the
+// FIFO over SPI and switching the radio to transmit. Another node that checks
+// the channel during this time finds it clear, so both transmit.
+#define SIM_TX_TURNAROUND_MICROS 150
+// RH_RF69_MAX_MESSAGE_LEN
+#define SIM_MAXIMUM_FRAME 60
+// How often each node goes round its loop(), running LEDOutput::process()
+// and WiLEDProto::process()
+#define SIM_LOOP_MICROS 10000
+// WiLED_m0-server's TX ring, shared by acks and protocol frames
+#define SIM_COORDINATOR_TX_SLOTS 8
+#define SIM_COORDINATOR_ADDRESS 0x0001
+#define SIM_FIRST_LAMP 0x1000
+// Commands and status changes this close to the end aren't counted, they
+// might still have arrived
+#define SIM_SETTLE_MICROS 3000000ull
+
+// WiLED_m0-server acks every frame with a valid message in it
+const uint8_t ACK_FRAME[] = "Received";
+
+// The coordinator hears every lamp, so it gets room for all of them. Lamps
+// use the default WiLEDProto.
+typedef WiLEDProtoCapacity<1024> SimCoordinatorProto;
+
+
+uint32_t airtimeMicros(uint8_t inLength){
+  return (SIM_FRAME_OVERHEAD + inLength) * SIM_BYTE_MICROS;
+}
+
+
+// xorshift64*, so that a run can be repeated exactly from its seed
+class SimRandom {
+  public:
+    SimRandom(uint64_t inSeed) : __state(inSeed * 0x9E3779B97F4A7C15ull + 1) {}
+
+    uint64_t next(){
+      __state ^= __state >> 12;
+      __state ^= __state << 25;
+      __state ^= __state >> 27;
+      return __state * 0x2545F4914F6CDD1Dull;
+    }
+    // inLow to inHigh - 1, like Arduino's random()
+    uint32_t range(uint32_t inLow, uint32_t inHigh){
+      return inLow + next() % (inHigh - inLow);
+    }
+    double uniform(){
+      return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+  protected:
+    uint64_t __state;
+};
+
+
+struct SimConfig {
+  uint16_t lamps = 50;
+  uint32_t beacon_millis = 5000;
+  uint32_t seconds = 30;
+  // Set Individual commands a second from the host, at random times
+  double command_rate = 2;
+  // The chance of each receiver missing a frame that didn't collide
+  double loss = 0.01;
+  // The lamps' setCADTimeout(), 0 sends without checking the channel
+  uint32_t cad_timeout_millis = 2;
+  bool acks = true;
+  uint64_t seed = 1;
+  // Fail if the traced p99 from command to output is longer, 0 for none
+  uint32_t budget_millis = 0;
+};
+
+struct SimResults {
+  uint64_t busy_micros = 0;
+  uint32_t frames = 0;
+  uint32_t collided = 0;
+  uint32_t cad_waits = 0;
+  uint32_t cad_drops = 0;
+  uint32_t coordinator_backoffs = 0;
+  uint32_t acks_dropped = 0;
+  uint32_t queue_full = 0;
+  uint32_t beacons_sent = 0;
+  uint32_t beacons_heard = 0;
+  uint32_t commands = 0;
+  uint32_t commands_lost = 0;
+  // Refused by a lamp whose table of known addresses was full
+  uint32_t commands_refused = 0;
+  uint32_t statuses = 0;
+  uint32_t statuses_lost = 0;
+  // From the host's command to the lamp changing its output
+  std::vector<uint32_t> command_latency;
+  // From the lamp's output changing to the coordinator hearing its status
+  std::vector<uint32_t> status_latency;
+};
+
+
+struct SimNode {
+  uint16_t address;
+  bool coordinator;
+  WiLEDProtoBase* proto = 0;
+  LEDOutput* output = 0;
+  std::vector<uint8_t> storage;
+
+  // From the channel being found clear until the frame has been sent, the
+  // node can't receive while tx_from <= t < tx_until
+  bool transmitting = false;
+  uint64_t tx_from = 0;
+  uint64_t tx_until = 0;
+  uint64_t on_air_from = 0;
+  bool collided = false;
+  uint8_t frame[SIM_MAXIMUM_FRAME];
+  uint8_t frame_length = 0;
+
+  // A lamp inside waitCAD()'s delay. The radio keeps the first frame it
+  // hears until the lamp gets back to its loop.
+  bool waiting = false;
+  uint64_t cad_from = 0;
+  bool rx_held = false;
+  uint8_t rx_frame[SIM_MAXIMUM_FRAME];
+  uint8_t rx_length = 0;
+
+  // The coordinator's TX state
+  uint8_t acks_waiting = 0;
+  bool backoff = false;
+
+  // The lamp's last command and status change that haven't arrived yet
+  bool command_pending = false;
+  uint64_t command_micros = 0;
+  uint8_t command_level = 0;
+  bool status_pending = false;
+  uint64_t status_micros = 0;
+  uint8_t status_level = 0;
+};
+
+
+enum SimEventType : uint8_t {
+  SIM_LOOP,
+  SIM_BEACON,
+  SIM_CAD_RETRY,
+  SIM_TX_START,
+  SIM_TX_END,
+  SIM_BACKOFF_END,
+  SIM_COMMAND
+};
+
+struct SimEvent {
+  uint64_t micros;
+  uint32_t order;
+  SimEventType type;
+  uint16_t node;
+
+  bool operator>(const SimEvent& inOther) const {
+    return (micros != inOther.micros) ? micros > inOther.micros : order > inOther.order;
+  }
+};
+
+
+class RadioSim;
+
+// The WiLEDProto and LEDOutput callbacks have no context argument, so the
+// node whose code is running is found through these
+RadioSim* sim = 0;
+SimNode* current_node = 0;
+
+uint8_t simReader(uint16_t inAddress){
+  return current_node->storage[inAddress];
+}
+void simWriter(uint16_t inAddress, uint8_t inValue){
+  current_node->storage[inAddress] = inValue;
+}
+void simCommitter(){
+}
+
+void lampSetIndividual(const WiLPMessageView& inMessage);
+void lampStatusChanged();
+void coordinatorBeacon(const WiLPMessageView& inMessage);
+void coordinatorDeviceStatus(const WiLPMessageView& inMessage);
+
+
+class RadioSim {
+  public:
+    RadioSim(const SimConfig& inConfig) : __config(inConfig), __random(inConfig.seed) {
+      sim = this;
+      #ifdef WiLP_TRACE
+      WiLPTrace::clear();
+      #endif
+      __nodes.resize(1 + inConfig.lamps);
+      for(uint16_t idx = 0; idx < __nodes.size(); idx++){
+        SimNode& node = __nodes[idx];
+        node.coordinator = (idx == 0);
+        node.address = node.coordinator ? SIM_COORDINATOR_ADDRESS : SIM_FIRST_LAMP + idx - 1;
+        __enter(node);
+        if(node.coordinator){
+          node.storage.resize(SimCoordinatorProto::STORAGE_LENGTH);
+          node.proto = new SimCoordinatorProto(node.address, &simReader, &simWriter, &simCommitter);
+          node.proto->setMessageHandler(WiLP_Beacon, &coordinatorBeacon);
+          node.proto->setMessageHandler(WiLP_Device_Status, &coordinatorDeviceStatus);
+        } else {
+          node.storage.resize(WiLEDProto::STORAGE_LENGTH);
+          node.proto = new WiLEDProto(node.address, &simReader, &simWriter, &simCommitter);
+          node.proto->setMessageHandler(WiLP_Set_Individual, &lampSetIndividual);
+          node.output = new LEDOutput(0);
+          node.output->setStatusCallback(&lampStatusChanged);
+          __schedule(__random.range(0, inConfig.beacon_millis * 1000), SIM_BEACON, idx);
+        }
+        node.proto->initStorage();
+        __schedule(__random.range(0, SIM_LOOP_MICROS), SIM_LOOP, idx);
+      }
+      if(inConfig.command_rate > 0){
+        __schedule(__nextCommandDelay(), SIM_COMMAND, 0);
+      }
+    }
+
+    ~RadioSim(){
+      for(size_t idx = 0; idx < __nodes.size(); idx++){
+        delete __nodes[idx].proto;
+        delete __nodes[idx].output;
+      }
+      sim = 0;
+    }
+
+    SimResults run(){
+      uint64_t end = (uint64_t)__config.seconds * 1000000;
+      while(!__events.empty() && __events.top().micros < end){
+        SimEvent event = __events.top();
+        __events.pop();
+        __now = event.micros;
+        __handle(event);
+      }
+      __now = end;
+      if(!__on_air.empty()){
+        __results.busy_micros += __now - __busy_from;
+      }
+      for(size_t idx = 1; idx < __nodes.size(); idx++){
+        __results.commands_lost += __nodes[idx].command_pending;
+        __results.statuses_lost += __nodes[idx].status_pending;
+      }
+      return __results;
+    }
+
+    // The lamp that is running has been told to change its output
+    void lampCommand(SimNode& ioLamp, uint8_t inLevel){
+      if(ioLamp.command_pending && inLevel == ioLamp.command_level){
+        __results.command_latency.push_back(__now - ioLamp.command_micros);
+        ioLamp.command_pending = false;
+      }
+      ioLamp.output->setDimPWMExact(inLevel);
+    }
+
+    void lampOutputChanged(SimNode& ioLamp){
+      uint8_t level = ioLamp.output->getDimPWM();
+      ioLamp.proto->updateDeviceStatus(level);
+      if(__now + SIM_SETTLE_MICROS < (uint64_t)__config.seconds * 1000000){
+        __results.statuses += !ioLamp.status_pending;
+        ioLamp.status_pending = true;
+        ioLamp.status_micros = __now;
+        ioLamp.status_level = level;
+      }
+    }
+
+    void statusHeard(uint16_t inSource, uint8_t inLevel){
+      if(inSource < SIM_FIRST_LAMP || inSource - SIM_FIRST_LAMP >= __config.lamps){
+        return;
+      }
+      SimNode& lamp = __nodes[1 + inSource - SIM_FIRST_LAMP];
+      if(lamp.status_pending && inLevel == lamp.status_level){
+        __results.status_latency.push_back(__now - lamp.status_micros);
+        lamp.status_pending = false;
+      }
+    }
+
+    void beaconHeard(){
+      __results.beacons_heard++;
+    }
+
+  protected:
+    SimConfig __config;
+    SimRandom __random;
+    std::vector<SimNode> __nodes;
+    std::priority_queue<SimEvent, std::vector<SimEvent>, std::greater<SimEvent> > __events;
+    uint32_t __order = 0;
+    uint64_t __now = 0;
+    // Nodes whose frames are on air
+    std::vector<uint16_t> __on_air;
+    uint64_t __busy_from = 0;
+    SimResults __results;
+
+    void __schedule(uint64_t inMicros, SimEventType inType, uint16_t inNode){
+      SimEvent event = {inMicros, __order++, inType, inNode};
+      __events.push(event);
+    }
+
+    // Run a node's code, at the current time
+    void __enter(SimNode& inNode){
+      current_node = &inNode;
+      nativeSetMicros(__now);
+    }
+
+    uint64_t __nextCommandDelay(){
+      return (uint64_t)(-log(1.0 - __random.uniform()) / __config.command_rate * 1e6);
+    }
+
+    void __handle(const SimEvent& inEvent){
+      SimNode& node = __nodes[inEvent.node];
+      switch(inEvent.type){
+        case SIM_LOOP:
+          // A lamp stuck in waitCAD() or waitPacketSent() isn't running its loop
+          if(!node.waiting && !(node.transmitting && !node.coordinator)){
+            __enter(node);
+            if(node.output != 0){
+              node.output->process();
+            }
+            node.proto->process();
+            __send(node);
+          }
+          __schedule(__now + SIM_LOOP_MICROS, SIM_LOOP, inEvent.node);
+          break;
+        case SIM_BEACON:
+          __enter(node);
+          node.proto->sendMessageBeacon(millis());
+          if(node.proto->queueMessage(WiLP_PRIORITY_NORMAL) != WiLP_RETURN_SUCCESS){
+            __results.queue_full++;
+          }
+          __results.beacons_sent++;
+          __send(node);
+          // 10% jitter, so that lamps started together drift apart
+          __schedule(__now + __config.beacon_millis * (900 + __random.range(0, 201)), SIM_BEACON, inEvent.node);
+          break;
+        case SIM_CAD_RETRY:
+          __lampCAD(node);
+          break;
+        case SIM_TX_START:
+          __startOnAir(node);
+          break;
+        case SIM_TX_END:
+          __endOnAir(node);
+          break;
+        case SIM_BACKOFF_END:
+          node.backoff = false;
+          __send(node);
+          break;
+        case SIM_COMMAND:
+          __command();
+          __schedule(__now + __nextCommandDelay(), SIM_COMMAND, 0);
+          break;
+      }
+    }
+
+    // The host asks the coordinator to set a random lamp to a new level
+    void __command(){
+      if(__now + SIM_SETTLE_MICROS >= (uint64_t)__config.seconds * 1000000){
+        return;
+      }
+      SimNode& lamp = __nodes[1 + __random.range(0, __config.lamps)];
+      if(lamp.command_pending){
+        return;
+      }
+      uint8_t level = __random.range(1, 256);
+      if(level == lamp.output->getDimPWM()){
+        level ^= 0x80;
+      }
+      SimNode& coordinator = __nodes[0];
+      __enter(coordinator);
+      uint8_t result = coordinator.proto->sendMessageSetIndividual(level, lamp.address);
+      if(result == WiLP_RETURN_SUCCESS){
+        result = coordinator.proto->queueMessage(WiLP_PRIORITY_NORMAL);
+      }
+      if(result != WiLP_RETURN_SUCCESS){
+        __results.queue_full++;
+        return;
+      }
+      __results.commands++;
+      lamp.command_pending = true;
+      lamp.command_micros = __now;
+      lamp.command_level = level;
+      __send(coordinator);
+    }
+
+    // Whether another node's frame is on air, as isChannelActive() sees it
+    bool __channelActive(const SimNode& inNode){
+      for(size_t idx = 0; idx < __on_air.size(); idx++){
+        if(&__nodes[__on_air[idx]] != &inNode){
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Start sending whatever the node has, if it is free to
+    void __send(SimNode& ioNode){
+      if(ioNode.transmitting || ioNode.waiting || ioNode.backoff){
+        return;
+      }
+      if(ioNode.coordinator){
+        __coordinatorSend(ioNode);
+        return;
+      }
+      if(ioNode.proto->getQueuedCount() == 0){
+        return;
+      }
+      __enter(ioNode);
+      ioNode.frame_length = ioNode.proto->appendQueuedToFrame(ioNode.frame, 0, WiLP_MAXIMUM_AGGREGATE_LENGTH);
+      if(ioNode.frame_length == 0){
+        return;
+      }
+      // RH_RF69::send() calls waitCAD() before anything else
+      ioNode.cad_from = __now;
+      __lampCAD(ioNode);
+    }
+
+    // RHGenericDriver::waitCAD(): while the channel is busy, give up once
+    // the CAD timeout has passed, otherwise delay(random(1, 10) * 100). With a
+    // 2 ms timeout that is one long delay and then a last look.
+    void __lampCAD(SimNode& ioLamp){
+      if(__config.cad_timeout_millis == 0 || !__channelActive(ioLamp)){
+        ioLamp.waiting = false;
+        __transmit(ioLamp);
+        return;
+      }
+      if(__now - ioLamp.cad_from > __config.cad_timeout_millis * 1000ull){
+        // send() returns false, and the frame is gone
+        __results.cad_drops++;
+        ioLamp.waiting = false;
+        __releaseHeld(ioLamp);
+        return;
+      }
+      __results.cad_waits++;
+      ioLamp.waiting = true;
+      __schedule(__now + __random.range(1, 10) * 100000ull, SIM_CAD_RETRY, &ioLamp - &__nodes[0]);
+    }
+
+    // WiLED_m0-server's serviceTx(): acks first, then queued messages packed
+    // into one frame, with a short random backoff while the channel is busy
+    void __coordinatorSend(SimNode& ioCoordinator){
+      if(ioCoordinator.acks_waiting == 0 && ioCoordinator.proto->getQueuedCount() == 0){
+        return;
+      }
+      if(__channelActive(ioCoordinator)){
+        __results.coordinator_backoffs++;
+        ioCoordinator.backoff = true;
+        __schedule(__now + __random.range(1, 10) * 1000ull, SIM_BACKOFF_END, 0);
+        return;
+      }
+      if(ioCoordinator.acks_waiting != 0){
+        memcpy(ioCoordinator.frame, ACK_FRAME, sizeof(ACK_FRAME));
+        ioCoordinator.frame_length = sizeof(ACK_FRAME);
+        ioCoordinator.acks_waiting--;
+      } else {
+        __enter(ioCoordinator);
+        ioCoordinator.frame_length = ioCoordinator.proto->appendQueuedToFrame(ioCoordinator.frame, 0, WiLP_MAXIMUM_AGGREGATE_LENGTH);
+      }
+      __transmit(ioCoordinator);
+    }
+
+    void __transmit(SimNode& ioNode){
+      #ifdef WiLP_TRACE
+      nativeSetMicros(__now);
+      WiLPTrace::frame(WiLP_TRACE_SEND, ioNode.frame, ioNode.frame_length);
+      #endif
+      ioNode.transmitting = true;
+      ioNode.tx_from = __now;
+      ioNode.tx_until = __now + SIM_TX_TURNAROUND_MICROS + airtimeMicros(ioNode.frame_length);
+      __schedule(__now + SIM_TX_TURNAROUND_MICROS, SIM_TX_START, &ioNode - &__nodes[0]);
+    }
+
+    void __startOnAir(SimNode& ioNode){
+      ioNode.on_air_from = __now;
+      ioNode.collided = false;
+      // Anything already on air is ruined, and so is this
+      for(size_t idx = 0; idx < __on_air.size(); idx++){
+        __nodes[__on_air[idx]].collided = true;
+        ioNode.collided = true;
+      }
+      if(__on_air.empty()){
+        __busy_from = __now;
+      }
+      __on_air.push_back(&ioNode - &__nodes[0]);
+      __results.frames++;
+      __schedule(ioNode.tx_until, SIM_TX_END, &ioNode - &__nodes[0]);
+    }
+
+    void __endOnAir(SimNode& ioNode){
+      uint16_t sender = &ioNode - &__nodes[0];
+      __on_air.erase(std::find(__on_air.begin(), __on_air.end(), sender));
+      if(__on_air.empty()){
+        __results.busy_micros += __now - __busy_from;
+      }
+      if(ioNode.collided){
+        __results.collided++;
+      } else {
+        for(uint16_t idx = 0; idx < __nodes.size(); idx++){
+          if(idx != sender){
+            __deliver(__nodes[idx], ioNode);
+          }
+        }
+      }
+      ioNode.transmitting = false;
+      if(!ioNode.coordinator){
+        __releaseHeld(ioNode);
+      }
+      __send(ioNode);
+    }
+
+    void __deliver(SimNode& ioReceiver, const SimNode& inSender){
+      // Half duplex, a node that was sending for any of the frame missed it
+      if(ioReceiver.tx_from < __now && ioReceiver.tx_until > inSender.on_air_from){
+        return;
+      }
+      if(__random.uniform() < __config.loss){
+        return;
+      }
+      if(ioReceiver.waiting){
+        if(!ioReceiver.rx_held){
+          memcpy(ioReceiver.rx_frame, inSender.frame, inSender.frame_length);
+          ioReceiver.rx_length = inSender.frame_length;
+          ioReceiver.rx_held = true;
+        }
+        return;
+      }
+      __receive(ioReceiver, inSender.frame, inSender.frame_length);
+    }
+
+    // The lamp is back in its loop, and reads what the radio kept for it
+    void __releaseHeld(SimNode& ioLamp){
+      if(ioLamp.rx_held){
+        ioLamp.rx_held = false;
+        __receive(ioLamp, ioLamp.rx_frame, ioLamp.rx_length);
+      }
+    }
+
+    void __receive(SimNode& ioNode, const uint8_t* inFrame, uint8_t inLength){
+      __enter(ioNode);
+      #ifdef WiLP_TRACE
+      WiLPTrace::frame(WiLP_TRACE_RECEIVE, inFrame, inLength);
+      #endif
+      WiLPBatchResult results[WiLP_MAXIMUM_AGGREGATE_MESSAGES];
+      uint8_t count = ioNode.proto->processFrame(inFrame, inLength, results, WiLP_MAXIMUM_AGGREGATE_MESSAGES);
+      if(ioNode.coordinator){
+        bool valid = false;
+        for(uint8_t idx = 0; idx < count; idx++){
+          valid |= (results[idx].validation == WiLP_RETURN_SUCCESS || results[idx].validation == WiLP_RETURN_ADDED_ADDRESS);
+        }
+        if(valid && __config.acks){
+          if(ioNode.acks_waiting < SIM_COORDINATOR_TX_SLOTS){
+            ioNode.acks_waiting++;
+          } else {
+            __results.acks_dropped++;
+          }
+        }
+        __send(ioNode);
+        return;
+      }
+      for(uint8_t idx = 0; idx < count; idx++){
+        if(results[idx].source == SIM_COORDINATOR_ADDRESS && results[idx].validation == WiLP_RETURN_AT_MAX_ADDRESSES){
+          __results.commands_refused++;
+        }
+      }
+      ioNode.output->process();
+    }
+};
+
+
+void lampSetIndividual(const WiLPMessageView& inMessage){
+  sim->lampCommand(*current_node, inMessage.getPayloadByte(0));
+}
+
+void lampStatusChanged(){
+  sim->lampOutputChanged(*current_node);
+}
+
+void coordinatorBeacon(const WiLPMessageView&){
+  sim->beaconHeard();
+}
+
+void coordinatorDeviceStatus(const WiLPMessageView& inMessage){
+  sim->statusHeard(inMessage.getSource(), inMessage.getPayloadByte(0));
+}
+
+
+// In milliseconds
+double percentile(std::vector<uint32_t>& ioValues, double inFraction){
+  if(ioValues.empty()){
+    return 0;
+  }
+  size_t index = std::min(ioValues.size() - 1, (size_t)(ioValues.size() * inFraction));
+  std::nth_element(ioValues.begin(), ioValues.begin() + index, ioValues.end());
+  return ioValues[index] / 1000.0;
+}
+
+double percent(uint32_t inPart, uint32_t inWhole){
+  return inWhole ? 100.0 * inPart / inWhole : 0.0;
+}
+
+
+std::vector<uint32_t> parseList(const char* inText){
+  std::vector<uint32_t> values;
+  while(*inText != 0){
+    char* end;
+    values.push_back(strtoul(inText, &end, 10));
+    inText = (*end == ',') ? end + 1 : end;
+    if(end == inText && *end != 0){
+      break;
+    }
+  }
+  return values;
+}
+
+
+void usage(const char* inName){
+  printf("Usage: %s [options]\n", inName);
+  printf("  -n LIST     numbers of lamps to simulate (default 25,50,100,200)\n");
+  printf("  -b LIST     lamp beacon intervals in ms (default 5000,2000,1000)\n");
+  printf("  -t SECONDS  simulated time for each run (default 30)\n");
+  printf("  -c RATE     Set Individual commands a second from the host (default 2)\n");
+  printf("  -l LOSS     chance of a receiver missing a frame, besides collisions (default 0.01)\n");
+  printf("  -C MS       the lamps' CAD timeout, 0 sends without checking (default 2)\n");
+  printf("  -A          the coordinator doesn't ack each frame\n");
+  printf("  -s SEED     random seed (default 1)\n");
+  #ifdef WiLP_TRACE
+  printf("  -B MS       fail if the traced command p99 is over MS in any run\n");
+  #endif
+  printf("Every combination of lamps and beacon interval is run.\n");
+}
+
+
+int main(int argc, char** argv){
+  SimConfig config;
+  std::vector<uint32_t> lamp_counts = {25, 50, 100, 200};
+  std::vector<uint32_t> beacon_intervals = {5000, 2000, 1000};
+  for(int arg = 1; arg < argc; arg++){
+    if(strcmp(argv[arg], "-n") == 0 && arg + 1 < argc){
+      lamp_counts = parseList(argv[++arg]);
+    } else if(strcmp(argv[arg], "-b") == 0 && arg + 1 < argc){
+      beacon_intervals = parseList(argv[++arg]);
+    } else if(strcmp(argv[arg], "-t") == 0 && arg + 1 < argc){
+      config.seconds = strtoul(argv[++arg], 0, 10);
+    } else if(strcmp(argv[arg], "-c") == 0 && arg + 1 < argc){
+      config.command_rate = atof(argv[++arg]);
+    } else if(strcmp(argv[arg], "-l") == 0 && arg + 1 < argc){
+      config.loss = atof(argv[++arg]);
+    } else if(strcmp(argv[arg], "-C") == 0 && arg + 1 < argc){
+      config.cad_timeout_millis = strtoul(argv[++arg], 0, 10);
+    } else if(strcmp(argv[arg], "-A") == 0){
+      config.acks = false;
+    } else if(strcmp(argv[arg], "-s") == 0 && arg + 1 < argc){
+      config.seed = strtoull(argv[++arg], 0, 10);
+    #ifdef WiLP_TRACE
+    } else if(strcmp(argv[arg], "-B") == 0 && arg + 1 < argc){
+      config.budget_millis = strtoul(argv[++arg], 0, 10);
+    #endif
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if(config.seconds * 1000000ull <= SIM_SETTLE_MICROS){
+    printf("runs must be longer than %u s\n", (unsigned)(SIM_SETTLE_MICROS / 1000000));
+    return 2;
+  }
+  Serial.muted = true;
+
+  printf("%u s per run, %.1f commands/s, %.1f%% loss, CAD timeout %u ms, %s\n", (unsigned)config.seconds,
+    config.command_rate, config.loss * 100, (unsigned)config.cad_timeout_millis, config.acks ? "acks" : "no acks");
+  printf("                channel          lamp CAD     beacons  commands (ms)                      status (ms)\n");
+  printf("lamps beacon_ms busy%%  collided%%  waits drops heard%%   sent   p50    p90    p99   lost%% refused  p50    p99   lost%%\n");
+  bool over_budget = false;
+  auto start = std::chrono::steady_clock::now();
+  for(size_t lamps = 0; lamps < lamp_counts.size(); lamps++){
+    for(size_t beacon = 0; beacon < beacon_intervals.size(); beacon++){
+      config.lamps = lamp_counts[lamps];
+      config.beacon_millis = beacon_intervals[beacon];
+      if(config.lamps == 0 || config.beacon_millis == 0){
+        continue;
+      }
+      RadioSim simulation(config);
+      SimResults results = simulation.run();
+      printf("%5u %9u %5.1f %8.1f %7u %5u %6.1f %6u %6.1f %6.1f %6.1f %6.1f %7u %6.1f %6.1f %6.1f\n",
+        (unsigned)config.lamps, (unsigned)config.beacon_millis,
+        percent(results.busy_micros / 1000, config.seconds * 1000), percent(results.collided, results.frames),
+        (unsigned)results.cad_waits, (unsigned)results.cad_drops, percent(results.beacons_heard, results.beacons_sent),
+        (unsigned)results.commands, percentile(results.command_latency, 0.5), percentile(results.command_latency, 0.9),
+        percentile(results.command_latency, 0.99), percent(results.commands_lost, results.commands),
+        (unsigned)results.commands_refused, percentile(results.status_latency, 0.5),
+        percentile(results.status_latency, 0.99), percent(results.statuses_lost, results.statuses));
+      #ifdef WiLP_TRACE
+      // The trace only sees the Set Individual commands, from the
+      // coordinator encoding them to the lamp's analogWrite()
+      Serial.muted = false;
+      WiLPTrace::dump();
+      Serial.muted = true;
+      uint32_t p99 = WiLPTrace::getStage(WiLP_TRACE_INPUT).getPercentile(0.99f);
+      if(config.budget_millis != 0 && p99 > config.budget_millis * 1000){
+        printf("over budget: p99 %.1f ms > %u ms\n", p99 / 1000.0, (unsigned)config.budget_millis);
+        over_budget = true;
+      }
+      #endif
+      fflush(stdout);
+    }
+  }
+  printf("simulated in %.1f s\n", std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  return over_budget ? 1 : 0;
+}
@@ -0,0 +1,327 @@
+/* WiLED_native-replay.cpp
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* Replays a WiLPCapture file of received radio frames through WiLEDProto on
+* a workstation, and reports the throughput, the outcome of each message
+* and how much was written to storage.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <Arduino.h>
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+#include <WiLEDProto.h>
+#include <WiLPCapture.h>
+#include <WiLEDNative.h>
+
+
+// Emulated EEPROM, large enough for the storage image at any capacity
+uint8_t storage[65536];
+uint32_t storage_writes = 0;
+uint32_t storage_commits = 0;
+
+uint8_t storageReader(uint16_t inAddress){
+  return storage[inAddress];
+}
+void storageWriter(uint16_t inAddress, uint8_t inValue){
+  storage[inAddress] = inValue;
+  storage_writes++;
+}
+void storageCommitter(){
+  storage_commits++;
+}
+
+
+// Simulated NOR flash for the journal, as in WiLED_native-bench
+#define FLASH_SECTOR_SIZE 4096
+#define FLASH_SECTOR_COUNT 8
+uint8_t flash[FLASH_SECTOR_SIZE * FLASH_SECTOR_COUNT];
+uint32_t flash_writes = 0;
+
+void flashReader(uint32_t inAddress, uint8_t* outData, uint16_t inLength){
+  memcpy(outData, &flash[inAddress], inLength);
+}
+void flashWriter(uint32_t inAddress, const uint8_t* inData, uint16_t inLength){
+  for(uint16_t idx = 0; idx < inLength; idx++){
+    flash[inAddress + idx] &= inData[idx];
+  }
+  flash_writes += inLength;
+}
+void flashEraser(uint16_t inSector){
+  memset(&flash[(uint32_t)inSector * FLASH_SECTOR_SIZE], 0xFF, FLASH_SECTOR_SIZE);
+}
+
+
+// Names for the codes that processMessage() returns, which are also used
+// for the counter validation
+const char* returnName(uint8_t inCode){
+  switch(inCode){
+    case WiLP_RETURN_SUCCESS: return "SUCCESS";
+    case WiLP_RETURN_NOT_THIS_DEST: return "NOT_THIS_DEST";
+    case WiLP_RETURN_UNKNOWN_TYPE: return "UNKNOWN_TYPE";
+    case WiLP_RETURN_NOT_INIT: return "NOT_INIT";
+    case WiLP_RETURN_QUEUE_FULL: return "QUEUE_FULL";
+    case WiLP_RETURN_INVALID_MSG_CTR: return "INVALID_MSG_CTR";
+    case WiLP_RETURN_INVALID_RST_CTR: return "INVALID_RST_CTR";
+    case WiLP_RETURN_ADDED_ADDRESS: return "ADDED_ADDRESS";
+    case WiLP_RETURN_AT_MAX_ADDRESSES: return "AT_MAX_ADDRESSES";
+    case WiLP_RETURN_INVALID_CHECKSUM: return "INVALID_CHECKSUM";
+    case WiLP_RETURN_INVALID_BUFFER: return "INVALID_BUFFER";
+    case WiLP_RETURN_OTHER_ERROR: return "OTHER_ERROR";
+  }
+  return "?";
+}
+
+
+void printHistogram(const char* inTitle, const uint32_t* inCounts, uint32_t inTotal){
+  printf("%s\n", inTitle);
+  for(uint16_t code = 0; code < 256; code++){
+    if(inCounts[code] != 0){
+      printf("  %-18s %3u  %9u  %5.1f%%\n", returnName(code), code, (unsigned)inCounts[code],
+        100.0 * inCounts[code] / inTotal);
+    }
+  }
+}
+
+
+// Write a capture of inNodes devices sending Beacons and Device Status
+// messages, with the duplicates, reordering, corruption and restarts seen
+// on a busy network, so the tool can be tried without a radio
+bool generateCapture(const char* inPath, uint16_t inNodes, uint32_t inFrames){
+  FILE* file = fopen(inPath, "wb");
+  if(file == 0){
+    perror(inPath);
+    return false;
+  }
+  uint8_t record[WiLP_CAPTURE_MAXIMUM_RECORD];
+  fwrite(record, 1, WiLPCapture::writeHeader(record), file);
+
+  // The senders share one small storage image. Each restart takes the next
+  // Reset Counter from it, so every sender's Reset Counter still goes up.
+  Serial.muted = true;
+  memset(senderStorage(), 0, WiLPSender::STORAGE_LENGTH);
+  std::vector<WiLPSender*> senders(inNodes);
+  std::vector<std::vector<uint8_t> > held(inNodes);
+  for(uint16_t node = 0; node < inNodes; node++){
+    senders[node] = new WiLPSender(0x1000 + node, &senderReader, &senderWriter, &senderCommitter);
+    senders[node]->initStorage();
+  }
+
+  uint32_t random = 12345;
+  uint32_t micros = 0;
+  uint8_t frame[MAXIMUM_MESSAGE_LENGTH];
+  for(uint32_t idx = 0; idx < inFrames; idx++){
+    random = random * 1103515245 + 12345;
+    uint16_t node = (random >> 8) % inNodes;
+    uint8_t pattern = (random >> 24) % 64;
+    // Around 200 frames a second
+    micros += 1000 + (random >> 4) % 8000;
+
+    if(pattern == 0){
+      // The device restarts, and comes back with a higher Reset Counter
+      delete senders[node];
+      senders[node] = new WiLPSender(0x1000 + node, &senderReader, &senderWriter, &senderCommitter);
+      senders[node]->initStorage();
+      held[node].clear();
+    }
+    if(pattern < 8){
+      senders[node]->sendMessageDeviceStatus(random >> 16, 1, 0, 0, 0);
+    } else {
+      senders[node]->sendMessageBeacon(micros / 1000);
+    }
+    uint8_t length = senders[node]->copyToBuffer(frame);
+
+    if(pattern == 1 && held[node].empty()){
+      // Hold this one back, it arrives after the next one
+      held[node].assign(frame, frame + length);
+      continue;
+    }
+    if(pattern == 2){
+      // A bit is flipped on the air
+      frame[(random >> 10) % length] ^= (1 << ((random >> 20) % 8));
+    }
+    int8_t rssi = -40 - (int8_t)((random >> 3) % 60);
+    fwrite(record, 1, WiLPCapture::writeRecord(record, micros, rssi, frame, length), file);
+    if(pattern == 3){
+      // Relayed, or sent again without an acknowledgement
+      micros += 300;
+      fwrite(record, 1, WiLPCapture::writeRecord(record, micros, rssi - 6, frame, length), file);
+    }
+    if(!held[node].empty() && pattern != 1){
+      micros += 200;
+      fwrite(record, 1, WiLPCapture::writeRecord(record, micros, rssi, &held[node][0], held[node].size()), file);
+      held[node].clear();
+    }
+  }
+  for(uint16_t node = 0; node < inNodes; node++){
+    delete senders[node];
+  }
+  fclose(file);
+  return true;
+}
+
+
+void usage(const char* inName){
+  printf("Usage: %s [options] capture.wlpc\n", inName);
+  printf("  -a ADDRESS  address of the receiving device, in hex (default 0001)\n");
+  printf("  -r          replay at the recorded timing, instead of as fast as possible\n");
+  printf("  -j          keep the known addresses in a flash journal, not EEPROM\n");
+  printf("  -g NODES FRAMES  write a synthetic capture to the file instead\n");
+}
+
+
+int main(int argc, char** argv){
+  uint16_t own_address = 0x0001;
+  bool realtime = false;
+  bool journal = false;
+  uint32_t generate_nodes = 0;
+  uint32_t generate_frames = 0;
+  const char* path = 0;
+  for(int arg = 1; arg < argc; arg++){
+    if(strcmp(argv[arg], "-a") == 0 && arg + 1 < argc){
+      own_address = strtoul(argv[++arg], 0, 16);
+    } else if(strcmp(argv[arg], "-r") == 0){
+      realtime = true;
+    } else if(strcmp(argv[arg], "-j") == 0){
+      journal = true;
+    } else if(strcmp(argv[arg], "-g") == 0 && arg + 2 < argc){
+      generate_nodes = strtoul(argv[++arg], 0, 10);
+      generate_frames = strtoul(argv[++arg], 0, 10);
+    } else if(argv[arg][0] != '-' && path == 0){
+      path = argv[arg];
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if(path == 0){
+    usage(argv[0]);
+    return 2;
+  }
+  if(generate_nodes != 0){
+    if(!generateCapture(path, generate_nodes, generate_frames)){
+      return 1;
+    }
+    printf("wrote %u frames from %u nodes to %s\n", (unsigned)generate_frames, (unsigned)generate_nodes, path);
+    return 0;
+  }
+
+  FILE* file = fopen(path, "rb");
+  if(file == 0){
+    perror(path);
+    return 1;
+  }
+  std::vector<uint8_t> capture;
+  uint8_t chunk[4096];
+  size_t read_length;
+  while((read_length = fread(chunk, 1, sizeof(chunk), file)) > 0){
+    capture.insert(capture.end(), chunk, chunk + read_length);
+  }
+  fclose(file);
+  WiLPCaptureReader reader(capture.empty() ? 0 : &capture[0], capture.size());
+  if(!reader.isValid()){
+    printf("%s is not a WiLPCapture file\n", path);
+    return 1;
+  }
+
+  Serial.muted = true;
+  memset(storage, 0, sizeof(storage));
+  memset(flash, 0xFF, sizeof(flash));
+  WiLEDJournal flash_journal(&flashReader, &flashWriter, &flashEraser, FLASH_SECTOR_SIZE, FLASH_SECTOR_COUNT);
+  WiLEDProto* handler = new WiLEDProto(own_address, &storageReader, &storageWriter, &storageCommitter);
+  if(journal){
+    handler->setJournal(&flash_journal);
+  }
+  handler->initStorage();
+  // Only count what the traffic causes, not setting up the storage
+  storage_writes = 0;
+  storage_commits = 0;
+  flash_writes = 0;
+  uint32_t erases_before = flash_journal.getEraseCount();
+
+  // The protocol's clock follows the capture in both modes, so write-behind
+  // commits and peer eviction happen as they would have on the device
+  nativeSetMillis(0);
+  uint32_t frames = 0;
+  uint32_t unreadable = 0;
+  uint32_t messages = 0;
+  uint32_t status_counts[256] = {0};
+  uint32_t validation_counts[256] = {0};
+  int32_t rssi_sum = 0;
+  int8_t rssi_min = 127;
+  int8_t rssi_max = -128;
+  uint64_t last_micros = 0;
+  WiLPCaptureRecord record;
+  WiLPBatchResult results[WiLP_MAXIMUM_AGGREGATE_MESSAGES];
+  auto start = std::chrono::steady_clock::now();
+  while(reader.next(&record)){
+    if(realtime){
+      std::this_thread::sleep_until(start + std::chrono::microseconds(record.micros));
+    }
+    nativeSetMillis(record.micros / 1000);
+    last_micros = record.micros;
+    frames++;
+    rssi_sum += record.rssi;
+    if(record.rssi < rssi_min) rssi_min = record.rssi;
+    if(record.rssi > rssi_max) rssi_max = record.rssi;
+
+    uint8_t count = handler->processFrame(record.frame, record.length, results, WiLP_MAXIMUM_AGGREGATE_MESSAGES);
+    if(count == 0){
+      unreadable++;
+    }
+    for(uint8_t idx = 0; idx < count; idx++){
+      status_counts[results[idx].status]++;
+      validation_counts[results[idx].validation]++;
+    }
+    messages += count;
+    handler->process();
+  }
+  auto end = std::chrono::steady_clock::now();
+  // Let the last write-behind commit happen, as it would once the air
+  // went quiet
+  nativeAdvanceMillis(WiLP_STORAGE_COMMIT_DEADLINE_MILLIS);
+  handler->process();
+  double seconds = std::chrono::duration<double>(end - start).count();
+
+  printf("%s: %u frames, %u messages, %.1f s of traffic%s\n", path, (unsigned)frames, (unsigned)messages,
+    last_micros / 1e6, reader.isTruncated() ? " (last record cut short)" : "");
+  printf("replayed in %.3f s, %.0f frames/s, %.0f messages/s%s\n", seconds, frames / seconds, messages / seconds,
+    realtime ? " (recorded timing)" : "");
+  if(frames != 0){
+    printf("rssi min %d avg %.1f max %d dBm\n", rssi_min, (double)rssi_sum / frames, rssi_max);
+  }
+  printf("frames with no readable message: %u\n", (unsigned)unreadable);
+  if(messages != 0){
+    printHistogram("message status", status_counts, messages);
+    printHistogram("counter validation", validation_counts, messages);
+  }
+  WiLPCounterStats stats = handler->getCounterStats();
+  printf("counters: accepted %u late %u duplicates %u too old %u lost %u\n", (unsigned)stats.accepted,
+    (unsigned)stats.late, (unsigned)stats.duplicates, (unsigned)stats.too_old, (unsigned)stats.lost);
+  printf("peers evicted: %u of capacity %u\n", (unsigned)handler->getPeerEvictionCount(), handler->getCapacity());
+  if(journal){
+    printf("storage: %u bytes to flash, %u sector erases\n", (unsigned)flash_writes,
+      (unsigned)(flash_journal.getEraseCount() - erases_before));
+  } else {
+    printf("storage: %u byte writes, %u commits\n", (unsigned)storage_writes, (unsigned)storage_commits);
+  }
+  delete handler;
+  return 0;
+}
@@ -0,0 +1,208 @@
+/* WiLED_native-sniffer.cpp
+* Part of the "WiLED" project, https://github.com/seanlano/WiLED
+* Decodes the binary serial output of WiLED_esp8266-client-eavesdropper on
+* Linux, printing each message and optionally saving a WiLPCapture file.
+* Copyright (C) 2017 Sean Lanigan.
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <Arduino.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <WiLEDProto.h>
+#include <WiLPCapture.h>
+#include <WiLPSerialFrame.h>
+#include <WiLEDNative.h>
+
+
+volatile sig_atomic_t stopping = 0;
+
+void stopSignal(int){
+  stopping = 1;
+}
+
+
+// Messages that were not meant for the eavesdropper
+#define NOT_THIS_DEST_NAME "NOT FOR EAVESDROPPER"
+
+
+// Print one line per message in a received frame, split up the same way as
+// WiLEDProto::processFrame() does
+void printFrame(const WiLPSerialRecord& inRecord, uint32_t inMicros){
+  uint8_t offset = 0;
+  for(uint8_t idx = 0; idx < inRecord.count; idx++){
+    WiLPMessageView message = WiLEDProto::parseMessage(&inRecord.frame[offset], inRecord.length - offset);
+    printf("%6u.%06u %4d dBm  ", (unsigned)(inMicros / 1000000), (unsigned)(inMicros % 1000000), inRecord.rssi);
+    if(message.hasHeader()){
+      printf("%04X -> %04X  type %02X  rst %5u  ctr %5u  %s\n", message.getSource(), message.getDestination(),
+        message.getType(), message.getResetCounter(), message.getMessageCounter(), validationName(inRecord.validations[idx], NOT_THIS_DEST_NAME));
+    } else {
+      printf("%u bytes  %s\n", (unsigned)(inRecord.length - offset), validationName(inRecord.validations[idx], NOT_THIS_DEST_NAME));
+    }
+    uint8_t frame_length = (inRecord.length - offset >= WiLPMessageView::HEADER_LENGTH)
+      ? WiLEDProto::getFrameLength(inRecord.frame[offset + WiLPMessageView::OFFSET_TYPE]) : 0;
+    if(frame_length == 0 || offset + frame_length >= inRecord.length){
+      break;
+    }
+    offset += frame_length;
+  }
+  if(inRecord.count == 0){
+    printf("%6u.%06u %4d dBm  %u bytes with no message\n", (unsigned)(inMicros / 1000000), (unsigned)(inMicros % 1000000),
+      inRecord.rssi, inRecord.length);
+  }
+}
+
+
+void usage(const char* inName){
+  printf("Usage: %s [options] /dev/ttyUSB0\n", inName);
+  printf("  -b BAUD     serial speed (default 921600), ignored for files and pipes\n");
+  printf("  -w FILE     also save every frame to a WiLPCapture file\n");
+  printf("  -q          don't print each message, only the totals\n");
+  printf("Reads from a file or standard input (\"-\") as well as a serial port.\n");
+}
+
+
+int main(int argc, char** argv){
+  uint32_t baud = 921600;
+  const char* capture_path = 0;
+  bool quiet = false;
+  const char* path = 0;
+  for(int arg = 1; arg < argc; arg++){
+    if(strcmp(argv[arg], "-b") == 0 && arg + 1 < argc){
+      baud = strtoul(argv[++arg], 0, 10);
+    } else if(strcmp(argv[arg], "-w") == 0 && arg + 1 < argc){
+      capture_path = argv[++arg];
+    } else if(strcmp(argv[arg], "-q") == 0){
+      quiet = true;
+    } else if((argv[arg][0] != '-' || strcmp(argv[arg], "-") == 0) && path == 0){
+      path = argv[arg];
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if(path == 0){
+    usage(argv[0]);
+    return 2;
+  }
+
+  int input = 0;
+  if(strcmp(path, "-") != 0){
+    input = open(path, O_RDONLY | O_NOCTTY);
+    if(input < 0){
+      perror(path);
+      return 1;
+    }
+  }
+  if(isatty(input) && !setupPort(input, baud, false)){
+    return 1;
+  }
+  FILE* capture = 0;
+  if(capture_path != 0){
+    capture = fopen(capture_path, "wb");
+    if(capture == 0){
+      perror(capture_path);
+      return 1;
+    }
+    uint8_t header[WiLP_CAPTURE_HEADER_LENGTH];
+    fwrite(header, 1, WiLPCapture::writeHeader(header), capture);
+  }
+  // Lines are only flushed when a read comes back, so a burst of frames
+  // costs one write to the terminal
+  static char output_buffer[1 << 16];
+  setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+  signal(SIGINT, &stopSignal);
+  signal(SIGTERM, &stopSignal);
+
+  WiLPSerialDecoder decoder;
+  uint64_t bytes = 0;
+  uint32_t records = 0;
+  uint32_t messages = 0;
+  uint32_t dropped = 0;
+  uint32_t unknown_records = 0;
+  uint32_t validation_counts[256] = {0};
+  bool started = false;
+  uint32_t first_micros = 0;
+  uint32_t last_micros = 0;
+  uint8_t chunk[4096];
+  while(!stopping){
+    ssize_t length = read(input, chunk, sizeof(chunk));
+    if(length < 0 && errno == EINTR){
+      continue;
+    }
+    if(length <= 0){
+      break;
+    }
+    bytes += length;
+    for(ssize_t idx = 0; idx < length; idx++){
+      if(!decoder.push(chunk[idx])){
+        continue;
+      }
+      WiLPSerialRecord record;
+      if(!WiLPSerialFrame::readRecord(decoder.getPacket(), decoder.getLength(), &record)){
+        unknown_records++;
+        continue;
+      }
+      // Times are shown from the first record, the device's clock is
+      // only 32 bits of microseconds
+      if(!started){
+        first_micros = record.micros;
+        started = true;
+      }
+      last_micros = record.micros - first_micros;
+      if(record.type == WiLP_SERIAL_RECORD_DROPPED){
+        dropped += record.dropped;
+        if(!quiet){
+          printf("%6u.%06u  %u frames dropped by the eavesdropper\n", (unsigned)(last_micros / 1000000),
+            (unsigned)(last_micros % 1000000), (unsigned)record.dropped);
+        }
+        continue;
+      }
+      records++;
+      messages += record.count;
+      for(uint8_t message = 0; message < record.count; message++){
+        validation_counts[record.validations[message]]++;
+      }
+      if(!quiet){
+        printFrame(record, last_micros);
+      }
+      if(capture != 0){
+        uint8_t capture_record[WiLP_CAPTURE_MAXIMUM_RECORD];
+        fwrite(capture_record, 1, WiLPCapture::writeRecord(capture_record, last_micros, record.rssi, record.frame, record.length), capture);
+      }
+    }
+    fflush(stdout);
+  }
+
+  if(capture != 0){
+    fclose(capture);
+  }
+  printf("%llu bytes, %u frames, %u messages over %.1f s, %u serial errors, %u unknown records, %u frames dropped by the eavesdropper\n",
+    (unsigned long long)bytes, (unsigned)records, (unsigned)messages, last_micros / 1e6, (unsigned)decoder.getErrorCount(),
+    (unsigned)unknown_records, (unsigned)dropped);
+  for(uint16_t code = 0; code < 256; code++){
+    if(validation_counts[code] != 0){
+      printf("  %-20s %3u  %9u\n", validationName(code, NOT_THIS_DEST_NAME), code, (unsigned)validation_counts[code]);
+    }
+  }
+  fflush(stdout);
+  return 0;
+}